@@ -0,0 +1,138 @@
+/**
+ * @file bench.c
+ * benchmarks timing and reporting helpers
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "bench.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+FILE *bench_out = NULL;
+
+/**
+ * read the monotonic clock
+ * @return current time in nanoseconds
+ */
+unsigned long long bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * print a benchmark result
+ * @param[in] name benchmark name
+ * @param[in] ops number of operations
+ * @param[in] ns elapsed time in nanoseconds
+ * @param[in] bytes number of bytes processed (0 if not relevant)
+ * @note the output format is stable so that results can be compared
+ *       between commits
+ */
+void bench_report(
+			const char *name,
+			unsigned long long ops,
+			unsigned long long ns,
+			unsigned long long bytes)
+{
+	FILE *fp;
+
+	fp = (bench_out ? bench_out : stdout);
+
+	if (!ns)
+		ns = 1;
+
+	fprintf(fp, "%-36s %10llu ops %12.1f ns/op", name, ops,
+				(double)ns / (ops ? ops : 1));
+	if (bytes)
+		fprintf(fp, " %10.2f MB/s", (double)bytes * 1000.0 / ns);
+	fputc('\n', fp);
+	fflush(fp);
+}
+
+/**
+ * read a CPU time clock
+ * @param[in] thread 1 for the calling thread, 0 for the whole process
+ * @return CPU time in nanoseconds
+ */
+unsigned long long bench_cpu(int thread)
+{
+	struct timespec ts;
+
+	clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID,
+					&ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * deterministic pseudo-random generator (same sequence for every run)
+ */
+unsigned int bench_rand(void)
+{
+	static unsigned int seed = 0x2545f491;
+
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/**
+ * qsort comparison of unsigned long long values (latency samples)
+ */
+int bench_cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * find a free local TCP port
+ * @return port number or 0 on error
+ */
+unsigned short bench_free_port(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	len = sizeof(addr);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+			|| getsockname(fd, (struct sockaddr *)&addr, &len)) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	return ntohs(addr.sin_port);
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+
+/** benchmarks results stream */
+extern FILE *bench_out;
+
+unsigned long long bench_clock(void);
+unsigned long long bench_cpu(int);
+void bench_report(const char *, unsigned long long, unsigned long long,
+						unsigned long long);
+unsigned int bench_rand(void);
+int bench_cmp_ull(const void *, const void *);
+unsigned short bench_free_port(void);
+
+// client.c
+struct _netsock;
+int bench_client_init(void);
+int bench_channel_pipe(unsigned int);
+struct _netsock *bench_tunnel(int *);
+int bench_feed_start(const int *, unsigned int, unsigned int, unsigned int);
+unsigned long long bench_feed_stop(void);
+int bench_drain_start(void);
+unsigned long long bench_drained(void);
+unsigned long long bench_drain_cpu(void);
+
+// mock_server.c
+#define MOCK_ECHO_PORT    7  /**< data are sent back */
+#define MOCK_DISCARD_PORT 9  /**< data are counted and dropped */
+#define MOCK_CHARGEN_PORT 19 /**< data are generated as fast as possible */
+
+/** mock server counters */
+typedef struct _mockstats {
+	unsigned long long generated; /**< bytes sent by chargen tunnels */
+	unsigned long long echoed;    /**< bytes sent by echo tunnels */
+	unsigned long long discarded; /**< bytes received by discard tunnels */
+	unsigned int conns;           /**< tunnels connected */
+	unsigned int opened;          /**< tunnels currently open */
+	unsigned int queued;          /**< channel data not written yet */
+	unsigned char connected;      /**< 1 once the client answered a ping */
+} mockstats_t;
+
+int  mock_start(int, unsigned char);
+void mock_stop(void);
+void mock_stat(mockstats_t *);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+/** number of accepted and closed connections */
+#define CONNS  100000
+/** number of connections opened at once */
+#define BATCH  100
+
+static netsock_t *srv = NULL;
+static struct sockaddr_in srv_addr;
+
+/*
+ * allocator calls of the client code, counted by wrapping the libc
+ * functions (-Wl,--wrap)
+ */
+static unsigned long long allocs = 0, frees = 0;
+
+void *__real_malloc(size_t);
+void *__wrap_malloc(size_t size)
+{
+	++allocs;
+	return __real_malloc(size);
+}
+
+void *__real_calloc(size_t, size_t);
+void *__wrap_calloc(size_t n, size_t size)
+{
+	++allocs;
+	return __real_calloc(n, size);
+}
+
+void *__real_realloc(void *, size_t);
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	++allocs;
+	return __real_realloc(ptr, size);
+}
+
+void __real_free(void *);
+void __wrap_free(void *ptr)
+{
+	if (ptr)
+		++frees;
+	__real_free(ptr);
+}
+
+/* number of accepted connections not closed yet */
+static unsigned int clients(void)
+{
+	mempool_stats_t stats;
+
+	netsock_pool_stat(&stats);
+	return stats.used;
+}
+
+/* dispatch the events until count connections are open */
+static int wait_clients(unsigned int count)
+{
+	unsigned int i, evts, chan_evts;
+	netsock_t *ns;
+	int n;
+
+	while (clients() != count) {
+		n = events_wait(0, 1000, &chan_evts);
+		if (n < 0)
+			return -1;
+
+		for (i=0; i<(unsigned int)n; ++i) {
+			ns = event_get(i, &evts);
+			if (!(evts & NETEVT_READ))
+				continue;
+			if (ns == srv) {
+				controller_accept_event(ns);
+			} else if (controller_read_event(ns) < 0) {
+				netsock_close(ns);
+				continue;
+			}
+			netsock_update_watch(ns);
+		}
+	}
+
+	return 0;
+}
+
+/* accept and close CONNS connections, BATCH at a time */
+static int run(void)
+{
+	int peers[BATCH];
+	unsigned int i, done;
+	unsigned long long start, now, a, f;
+	mempool_stats_t stats[IOBUF_POOLS+1];
+	struct linger lg;
+	char name[64];
+
+	lg.l_onoff  = 1;
+	lg.l_linger = 0;
+
+	a = allocs;
+	f = frees;
+	start = bench_clock();
+
+	for (done=0; done<CONNS; done+=BATCH) {
+
+		for (i=0; i<BATCH; ++i) {
+			peers[i] = socket(AF_INET, SOCK_STREAM, 0);
+			if ((peers[i] == -1) || connect(peers[i],
+						(struct sockaddr *)&srv_addr, sizeof(srv_addr)))
+				return -1;
+		}
+
+		if (wait_clients(BATCH))
+			return -1;
+
+		// reset, the closed connections do not linger in TIME_WAIT
+		for (i=0; i<BATCH; ++i) {
+			setsockopt(peers[i], SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+			close(peers[i]);
+		}
+
+		if (wait_clients(0))
+			return -1;
+	}
+
+	now = bench_clock();
+
+	snprintf(name, sizeof(name), "churn/accept+close n=%u", done);
+	bench_report(name, done, now - start, 0);
+	fprintf(bench_out, "%-36s %10.2f allocs/conn %6.2f frees/conn\n", name,
+				(double)(allocs - a) / done, (double)(frees - f) / done);
+
+	netsock_pool_stat(&stats[0]);
+	i = 1 + iobuf_pools_stat(&stats[1], IOBUF_POOLS);
+	while (i-- > 0) {
+		if (!stats[i].hits && !stats[i].misses)
+			continue;
+		snprintf(name, sizeof(name), "churn/pool %s size=%u",
+					stats[i].name, stats[i].size);
+		fprintf(bench_out, "%-36s %10llu hits %6llu misses %6u peak\n", name,
+					stats[i].hits, stats[i].misses, stats[i].peak);
+	}
+	fflush(bench_out);
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned short port;
+	int fd;
+
+	if (bench_client_init())
+		return 1;
+
+	// the client reports each reset connection as an error
+	fd = open("/dev/null", O_WRONLY);
+	if (fd != -1) {
+		dup2(fd, 2);
+		close(fd);
+	}
+
+	port = bench_free_port();
+	if (!port)
+		return 1;
+
+	srv = netsock_bind(NULL, "127.0.0.1", port, 0);
+	if (!srv)
+		return 1;
+	srv->type = NETSOCK_CTRLSRV;
+
+	memset(&srv_addr, 0, sizeof(srv_addr));
+	srv_addr.sin_family      = AF_INET;
+	srv_addr.sin_port        = htons(port);
+	srv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	return (run() ? 1 : 0);
+}
@@ -0,0 +1,277 @@
+/**
+ * @file bench_frame.c
+ * framing overhead and parsing cost on an interactive SSH trace
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "msgparser.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/** number of keystrokes of the trace */
+#define KEYS      20000
+/** size of SSH packets carrying a keystroke or its echo */
+#define KEY_SIZE  36
+/** a command output is received every CMD_KEYS keystrokes */
+#define CMD_KEYS  8
+/** number of times the server frames are parsed */
+#define PARSE_RUNS 50
+
+/** packet of the trace */
+typedef struct _pkt {
+	unsigned short size; /**< size of SSH packet */
+	unsigned char up;    /**< 1 for client to server */
+} pkt_t;
+
+static pkt_t trace[KEYS * 6];
+static unsigned int trace_len = 0;
+static unsigned char down[16*1024*1024];
+
+/**
+ * build an interactive session trace: each keystroke is echoed by the
+ * server, commands output a few packets of up to 1452 bytes
+ */
+static void make_trace(void)
+{
+	unsigned int i, n;
+
+	for (i=0; i<KEYS; ++i) {
+		trace[trace_len].size = KEY_SIZE;
+		trace[trace_len++].up = 1;
+		trace[trace_len].size = KEY_SIZE;
+		trace[trace_len++].up = 0;
+		if (!(bench_rand() % CMD_KEYS)) {
+			n = 1 + bench_rand() % 4;
+			while (n-- > 0) {
+				trace[trace_len].size = 52 + bench_rand() % 1400;
+				trace[trace_len++].up = 0;
+			}
+		}
+	}
+}
+
+/**
+ * send the client packets of the trace through the client channel
+ * @param[in] name benchmark name
+ * @param[in] caps server capabilities
+ * @param[in] chan_fd channel output pipe
+ */
+static void bench_upload(const char *name, unsigned char caps, int chan_fd)
+{
+	static char drain[64*1024], pkt[1500];
+	int sv[2], n, i, loops;
+	unsigned int evts, chan_evts, k;
+	unsigned long long payload, wire;
+	netaddr_t addr;
+	netsock_t *ns;
+	ssize_t r;
+
+	// the capabilities ping answer is not accounted
+	channel_pong(caps);
+	if (channel_want_write())
+		channel_write_event();
+	while (read(chan_fd, drain, sizeof(drain)) > 0)
+		;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return;
+	ns->type    = NETSOCK_TUNCLI;
+	ns->state   = NETSTATE_CONNECTED;
+	ns->nodelay = 1;
+	iobuf_init2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+	netsock_update_watch(ns);
+
+	memset(pkt, 'k', sizeof(pkt));
+	payload = wire = 0;
+	for (k=0; k<trace_len; ++k) {
+
+		if (!trace[k].up)
+			continue;
+		if (write(sv[1], pkt, trace[k].size) != trace[k].size)
+			break;
+		payload += trace[k].size;
+
+		// interactive packets are sent on their own
+		for (loops=0; loops<4; ++loops) {
+			n = events_wait(channel_want_write(), 0, &chan_evts);
+			if (n < 0)
+				break;
+			if (chan_evts & NETEVT_WRITE)
+				channel_write_event();
+			for (i=0; i<n; ++i) {
+				ns = event_get(i, &evts);
+				if (evts & NETEVT_READ)
+					channel_forward_recv(ns);
+				netsock_update_watch(ns);
+			}
+		}
+
+		while ((r = read(chan_fd, drain, sizeof(drain))) > 0)
+			wire += r;
+	}
+
+	fprintf(bench_out, "%-36s %10llu bytes %10llu wire %8.3f overhead/byte\n",
+				name, payload, wire, (double)(wire - payload) / payload);
+
+	tunnel_close(ns, 0);
+	netsocks_close_cancelled();
+	close(sv[1]);
+}
+
+/**
+ * encode the server packets of the trace
+ * @param[in] tid tunnel ID
+ * @param[in] compact 1 for compact DATA frames
+ * @param[out] out_payload size of tunnel data
+ * @return size of frames
+ */
+static unsigned int encode_download(
+					unsigned short tid,
+					int compact,
+					unsigned long long *out_payload)
+{
+	unsigned int k, off, size;
+
+	off = 0;
+	*out_payload = 0;
+	for (k=0; k<trace_len; ++k) {
+
+		if (trace[k].up)
+			continue;
+		size = trace[k].size;
+		if (off + 6 + size > sizeof(down))
+			break;
+
+		if (compact) {
+			off += compact_header(down + off, tid, size);
+		} else {
+			*(unsigned int *)(down + off) = htonl(size + 2);
+			down[off+4] = R2TCMD_DATA;
+			down[off+5] = (unsigned char) tid;
+			off += 6;
+		}
+		memset(down + off, 'o', size);
+		off += size;
+		*out_payload += size;
+	}
+
+	return off;
+}
+
+/**
+ * parse the server packets of the trace
+ * @param[in] name benchmark name
+ * @param[in] compact 1 for compact DATA frames
+ * @note tunnel data are buffered by the tunnel, the socket is not written
+ */
+static void bench_download(const char *name, int compact)
+{
+	int sv[2];
+	unsigned int len, run, frames, k;
+	unsigned long long t, payload;
+	netaddr_t addr;
+	netsock_t *ns;
+	iobuf_t ibuf;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return;
+	ns->type  = NETSOCK_TUNCLI;
+	ns->state = NETSTATE_CONNECTED;
+	iobuf_init2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+
+	// pending byte: tunnel data are appended to the output buffer
+	iobuf_append(&ns->u.tuncli.obuf, "", 1);
+
+	len = encode_download(ns->tid, compact, &payload);
+	for (k=0, frames=0; k<trace_len; ++k)
+		frames += !trace[k].up;
+
+	iobuf_init(&ibuf, 'r', "bench");
+	t = 0;
+	for (run=0; run<PARSE_RUNS; ++run) {
+		// compact headers are modified in place
+		iobuf_append(&ibuf, down, len);
+		t -= bench_clock();
+		if (commands_parse(&ibuf))
+			break;
+		t += bench_clock();
+		iobuf_consume(&ns->u.tuncli.obuf, iobuf_datalen(&ns->u.tuncli.obuf) - 1);
+	}
+	bench_report(name, (unsigned long long)frames * PARSE_RUNS, t,
+					payload * PARSE_RUNS);
+	fprintf(bench_out, "%-36s %10llu bytes %10u wire %8.3f overhead/byte\n",
+				name, payload, len, (double)(len - payload) / payload);
+
+	iobuf_kill(&ibuf);
+	iobuf_consume(&ns->u.tuncli.obuf, 1);
+	tunnel_close(ns, 0);
+	netsocks_close_cancelled();
+	close(sv[1]);
+}
+
+int main(void)
+{
+	int pfd[2], chan_fd;
+
+	if (bench_client_init())
+		return 1;
+
+	// channel output is drained by the benchmark
+	if (pipe(pfd))
+		return 1;
+	dup2(pfd[1], RDP_FD_OUT);
+	close(pfd[1]);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+	chan_fd = pfd[0];
+	fcntl(chan_fd, F_SETFL, fcntl(chan_fd, F_GETFL)|O_NONBLOCK);
+	events_kill();
+	if (events_init())
+		return 1;
+
+	make_trace();
+
+	bench_upload("frame/ssh-up-v1", 0, chan_fd);
+	bench_upload("frame/ssh-up-compact", R2TCAP_COMPACT, chan_fd);
+	bench_download("frame/ssh-down-v1", 0);
+	bench_download("frame/ssh-down-compact", 1);
+
+	return 0;
+}
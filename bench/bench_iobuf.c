@@ -0,0 +1,145 @@
+/**
+ * @file bench_iobuf.c
+ * I/O buffers benchmark (bytes moved per byte delivered)
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define IOBUF_STATS
+#include "bench.h"
+#include "iobuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** bytes delivered by each benchmark */
+#define DELIVERED (256*1024*1024ULL)
+
+/** legacy buffer, data are moved to the head on every consume */
+typedef struct {
+	unsigned int size, total;
+	char *data;
+} flatbuf_t;
+
+static unsigned long long flat_moved = 0;
+
+static void *flat_append(flatbuf_t *b, const void *data, unsigned int size)
+{
+	char *ptr;
+
+	if (b->total - b->size < size) {
+		ptr = realloc(b->data, b->size + size);
+		if (!ptr)
+			return NULL;
+		b->data = ptr;
+		b->total = b->size + size;
+	}
+	ptr = b->data + b->size;
+	memcpy(ptr, data, size);
+	b->size += size;
+	return ptr;
+}
+
+static void flat_consume(flatbuf_t *b, unsigned int consumed)
+{
+	b->size -= consumed;
+	if (b->size) {
+		memmove(b->data, b->data + consumed, b->size);
+		flat_moved += b->size;
+	}
+}
+
+/*
+ * the producer appends chunks of in_max bytes at most and the consumer
+ * drains out_max bytes at most per step. this mimics the channel input
+ * buffer (large reads, one frame parsed at a time) and the sockets
+ * output buffers (many frames, partial writes).
+ */
+static void run(const char *name, unsigned int in_max, unsigned int out_max,
+					unsigned int backlog)
+{
+	static char chunk[65536];
+	char label[64];
+	iobuf_t buf;
+	flatbuf_t flat;
+	unsigned long long t, delivered, ops;
+	unsigned int seed_state, n, len;
+
+	// same random sequence for both buffers
+	seed_state = bench_rand();
+
+	iobuf_init(&buf, 'w', "bench");
+	iobuf_moved = 0;
+	t = bench_clock();
+	srand(seed_state);
+	for (delivered=0, ops=0; delivered<DELIVERED; ++ops) {
+		while (iobuf_datalen(&buf) < backlog) {
+			len = 1 + rand() % in_max;
+			if (!iobuf_append(&buf, chunk, len))
+				return;
+		}
+		n = 1 + rand() % out_max;
+		if (n > iobuf_datalen(&buf))
+			n = iobuf_datalen(&buf);
+		iobuf_consume(&buf, n);
+		delivered += n;
+	}
+	t = bench_clock() - t;
+	snprintf(label, sizeof(label), "iobuf_%s", name);
+	bench_report(label, ops, t, delivered);
+	fprintf(bench_out, "%-36s %10.3f moved/delivered\n", label,
+					(double)iobuf_moved / delivered);
+	iobuf_kill(&buf);
+
+	memset(&flat, 0, sizeof(flat));
+	flat_moved = 0;
+	t = bench_clock();
+	srand(seed_state);
+	for (delivered=0, ops=0; delivered<DELIVERED; ++ops) {
+		while (flat.size < backlog) {
+			len = 1 + rand() % in_max;
+			if (!flat_append(&flat, chunk, len))
+				return;
+		}
+		n = 1 + rand() % out_max;
+		if (n > flat.size)
+			n = flat.size;
+		flat_consume(&flat, n);
+		delivered += n;
+	}
+	t = bench_clock() - t;
+	snprintf(label, sizeof(label), "legacy_%s", name);
+	bench_report(label, ops, t, delivered);
+	fprintf(bench_out, "%-36s %10.3f moved/delivered\n", label,
+					(double)flat_moved / delivered);
+	free(flat.data);
+}
+
+int main(void)
+{
+	bench_out = stdout;
+
+	// channel input: 1600 bytes RDP chunks, small frames parsed
+	run("chan_in", 1600, 64, 16*1024);
+	// tunnel output: large frames, partial writes
+	run("tun_out", 8192, 4096, 64*1024);
+	// bulk: backlog of 512kB, socket writes of 64kB
+	run("bulk", 65536, 65536, 512*1024);
+
+	return 0;
+}
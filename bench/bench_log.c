@@ -0,0 +1,191 @@
+/**
+ * @file bench_log.c
+ * cost of the transfers logging on the data path
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/** number of transfers accounted by the logging benchmarks */
+#define XFERS       1000000
+/** size of the tunnel writes (small writes mean one transfer per event) */
+#define WRITE_SIZE  1024
+/** data sent through the channel per run */
+#define TUNNEL_DATA (64*1024*1024ULL)
+
+extern int info_level;
+
+/* print_xfer() before the logging ring: one stderr line per transfer */
+static void legacy_xfer(const char *name, char rw, unsigned int size)
+{
+	fprintf(stderr, (rw=='r'?"%-6s          < %-8u\n":"%-6s %8u >\n"), name, size);
+}
+
+static unsigned long long log_size(void)
+{
+	struct stat st;
+
+	fflush(stderr);
+	return (fstat(2, &st) ? 0 : (unsigned long long) st.st_size);
+}
+
+/**
+ * account transfers with the legacy and the current logging
+ */
+static void bench_xfer(void)
+{
+	unsigned long long t, size;
+	unsigned int i;
+
+	size = log_size();
+	t = bench_clock();
+	for (i=0; i<XFERS; ++i)
+		legacy_xfer("chan", (i & 1 ? 'w' : 'r'), i & 0xffff);
+	t = bench_clock() - t;
+	bench_report("log/xfer-legacy", XFERS, t, 0);
+	fprintf(bench_out, "%-36s %10llu bytes logged\n", "log/xfer-legacy",
+				log_size() - size);
+
+	size = log_size();
+	t = bench_clock();
+	for (i=0; i<XFERS; ++i) {
+		print_xfer("chan", (i & 1 ? 'w' : 'r'), i & 0xffff);
+		if (!(i & 1023))
+			print_flush();
+	}
+	print_flush();
+	t = bench_clock() - t;
+	bench_report("log/xfer", XFERS, t, 0);
+	fprintf(bench_out, "%-36s %10llu bytes logged\n", "log/xfer",
+				log_size() - size);
+}
+
+/**
+ * send tunnel data through the client channel with small writes
+ * @param[in] name benchmark name
+ * @param[in] chan_fd channel output pipe
+ */
+static void bench_channel(const char *name, int chan_fd)
+{
+	static char drain[256*1024], blob[WRITE_SIZE];
+	int sv[2], n, i;
+	unsigned int evts, chan_evts;
+	unsigned long long t, sent, size;
+	netaddr_t addr;
+	netsock_t *ns;
+	ssize_t r;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return;
+	ns->type  = NETSOCK_TUNCLI;
+	ns->state = NETSTATE_CONNECTED;
+	ns->nodelay = 1;
+	iobuf_init2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+	netsock_update_watch(ns);
+
+	memset(blob, 'L', sizeof(blob));
+	size = log_size();
+	sent = 0;
+	t = bench_clock();
+	while (sent < TUNNEL_DATA) {
+
+		r = write(sv[1], blob, sizeof(blob));
+		if (r > 0)
+			sent += r;
+
+		print_flush();
+		n = events_wait(channel_want_write(), 1000, &chan_evts);
+		if (n < 0)
+			break;
+		if (chan_evts & NETEVT_WRITE)
+			channel_write_event();
+		for (i=0; i<n; ++i) {
+			ns = event_get(i, &evts);
+			if (evts & NETEVT_READ)
+				channel_forward_recv(ns);
+			netsock_update_watch(ns);
+		}
+
+		while (read(chan_fd, drain, sizeof(drain)) > 0)
+			;
+	}
+	print_flush();
+	t = bench_clock() - t;
+
+	bench_report(name, 1, t, sent);
+	fprintf(bench_out, "%-36s %10llu bytes logged\n", name, log_size() - size);
+
+	tunnel_close(ns, 0);
+	netsocks_close_cancelled();
+	close(sv[1]);
+}
+
+int main(void)
+{
+	int pfd[2], chan_fd;
+	FILE *log;
+
+	if (bench_client_init())
+		return 1;
+
+	// messages are logged to a file like a redirected console
+	log = tmpfile();
+	if (!log)
+		return 1;
+	dup2(fileno(log), 2);
+
+	// channel output is drained by the benchmark
+	if (pipe(pfd))
+		return 1;
+	dup2(pfd[1], RDP_FD_OUT);
+	close(pfd[1]);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+	chan_fd = pfd[0];
+	fcntl(chan_fd, F_SETFL, fcntl(chan_fd, F_GETFL)|O_NONBLOCK);
+	events_kill();
+	if (events_init())
+		return 1;
+	channel_pong(R2TCAP_WINDOW);
+
+	// default verbosity
+	info_level = 3;
+	bench_xfer();
+	bench_channel("log/chan-info3", chan_fd);
+
+	info_level = 0;
+	bench_channel("log/chan-info0", chan_fd);
+
+	return 0;
+}
@@ -0,0 +1,696 @@
+/**
+ * @file bench_loopback.c
+ * end-to-end benchmark of the rdp2tcp client against a mock server
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "print.h"
+#include "rdp2tcp.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef CLIENT_PATH
+/** rdp2tcp client executable */
+#define CLIENT_PATH "../client/rdp2tcp"
+#endif
+#ifndef CHANEMU_PATH
+/** channel emulator executable */
+#define CHANEMU_PATH "./chanemu"
+#endif
+
+/** capabilities advertised by the mock server */
+#define MOCK_CAPS (R2TCAP_WINDOW|R2TCAP_TID16|R2TCAP_COMPACT|R2TCAP_PROBE)
+
+/** maximal number of connections of a benchmark */
+#define MAX_CONNS 256
+/** bytes transferred per connection by bulk benchmarks */
+#define BULK_SIZE (8*1024*1024)
+/** size of latency benchmarks messages */
+#define MSG_SIZE  64
+/** messages exchanged by latency benchmarks */
+#define MSG_COUNT 4096
+/** connections opened by setup benchmarks */
+#define SETUP_COUNT 2048
+/** delay (ms) after which a benchmark is aborted */
+#define BENCH_TIMEOUT 30000
+
+extern int info_level;
+
+static pid_t client_pid = -1;
+static int ctrl_fd = -1;
+static char *emu_args = NULL;
+static unsigned long long bulk_size = BULK_SIZE;
+static unsigned int msg_count = MSG_COUNT;
+static unsigned int setup_count = SETUP_COUNT;
+static FILE *report = NULL;
+static unsigned short ports[4];
+#define PORT_ECHO     0
+#define PORT_NODELAY  1
+#define PORT_DISCARD  2
+#define PORT_CHARGEN  3
+
+/* connect to a local TCP port */
+static int connect_port(unsigned short port, int nonblock)
+{
+	struct sockaddr_in sin;
+	int fd, one;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (nonblock)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin))
+			&& (errno != EINPROGRESS)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* send a controller command and read its answer */
+static int controller(const char *fmt, ...)
+{
+	char buf[256];
+	va_list va;
+	ssize_t r;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+
+	if (write(ctrl_fd, buf, len) != len)
+		return -1;
+
+	r = read(ctrl_fd, buf, sizeof(buf)-1);
+	if (r <= 0)
+		return -1;
+	buf[r] = 0;
+
+	return (strncmp(buf, "error", 5) ? 0 : -1);
+}
+
+/* run the client through the channel emulator */
+static void exec_emulator(char *port)
+{
+	char *argv[64], *arg;
+	unsigned int argc;
+
+	argc = 0;
+	argv[argc++] = "chanemu";
+	for (arg = strtok(emu_args, " "); arg && (argc < 59);
+			arg = strtok(NULL, " "))
+		argv[argc++] = arg;
+	argv[argc++] = CLIENT_PATH;
+	argv[argc++] = "127.0.0.1";
+	argv[argc++] = port;
+	argv[argc] = NULL;
+
+	execv(CHANEMU_PATH, argv);
+}
+
+/* start the client with its channel connected to the mock server */
+static int start_client(void)
+{
+	unsigned short port;
+	unsigned long long start;
+	mockstats_t stats;
+	char arg[8];
+	int sv[2], fd, i;
+
+	port = bench_free_port();
+	if (!port || socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	snprintf(arg, sizeof(arg), "%hu", port);
+
+	client_pid = fork();
+	if (client_pid == -1)
+		return -1;
+
+	if (!client_pid) {
+		dup2(sv[1], STDIN_FILENO);
+		dup2(sv[1], STDOUT_FILENO);
+		fd = open("/dev/null", O_WRONLY);
+		if (fd != -1)
+			dup2(fd, 2);
+		for (fd=3; fd<256; ++fd)
+			close(fd);
+		if (emu_args)
+			exec_emulator(arg);
+		else
+			execl(CLIENT_PATH, "rdp2tcp", "127.0.0.1", arg, NULL);
+		_exit(1);
+	}
+	close(sv[1]);
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	if (mock_start(sv[0], MOCK_CAPS))
+		return -1;
+
+	// wait for the client to answer the server ping
+	start = bench_clock();
+	do {
+		usleep(10000);
+		mock_stat(&stats);
+	} while (!stats.connected && (bench_clock() - start < 5000000000ULL));
+	if (!stats.connected)
+		return error("client is not connected");
+
+	for (i=0; (i<100) && (ctrl_fd == -1); ++i) {
+		ctrl_fd = connect_port(port, 0);
+		if (ctrl_fd == -1)
+			usleep(10000);
+	}
+	if (ctrl_fd == -1)
+		return error("failed to connect to the controller");
+
+	for (i=0; i<4; ++i) {
+		ports[i] = bench_free_port();
+		if (!ports[i])
+			return -1;
+	}
+
+	if (controller("t 127.0.0.1 %hu 127.0.0.1 %u\n", ports[PORT_ECHO],
+						MOCK_ECHO_PORT)
+			|| controller("t 127.0.0.1 %hu 127.0.0.1 %u\n", ports[PORT_NODELAY],
+							MOCK_ECHO_PORT)
+			|| controller("n 127.0.0.1 %hu 1\n", ports[PORT_NODELAY])
+			|| controller("t 127.0.0.1 %hu 127.0.0.1 %u\n", ports[PORT_DISCARD],
+							MOCK_DISCARD_PORT)
+			|| controller("t 127.0.0.1 %hu 127.0.0.1 %u\n", ports[PORT_CHARGEN],
+							MOCK_CHARGEN_PORT))
+		return error("failed to register tunnels");
+
+	return 0;
+}
+
+static void stop_client(void)
+{
+	if (ctrl_fd != -1)
+		close(ctrl_fd);
+	if (client_pid > 0) {
+		kill(client_pid, SIGINT);
+		waitpid(client_pid, NULL, 0);
+	}
+	mock_stop();
+}
+
+/* wait until the tunnels of the previous benchmark are closed */
+static void wait_idle(void)
+{
+	mockstats_t stats;
+	unsigned long long start;
+
+	start = bench_clock();
+	do {
+		mock_stat(&stats);
+		if (!stats.opened && !stats.queued)
+			break;
+		usleep(1000);
+	} while (bench_clock() - start < BENCH_TIMEOUT * 1000000ULL);
+	// let the client drop the data of the closed tunnels
+	usleep(50000);
+}
+
+/* open connections to a tunnel */
+static int open_conns(struct pollfd *pfd, unsigned int count,
+						unsigned short port)
+{
+	unsigned int i;
+
+	for (i=0; i<count; ++i) {
+		pfd[i].fd = connect_port(port, 1);
+		if (pfd[i].fd == -1) {
+			while (i-- > 0)
+				close(pfd[i].fd);
+			return error("failed to connect tunnel (%s)", strerror(errno));
+		}
+	}
+
+	return 0;
+}
+
+static void close_conns(struct pollfd *pfd, unsigned int count)
+{
+	unsigned int i;
+
+	for (i=0; i<count; ++i) {
+		if (pfd[i].fd >= 0)
+			close(pfd[i].fd);
+	}
+}
+
+/**
+ * write a benchmark throughput result
+ * @param[in] name benchmark name
+ * @param[in] conns number of concurrent connections
+ * @param[in] ns elapsed time in nanoseconds
+ * @param[in] bytes number of bytes transferred
+ */
+static void report_bulk(const char *name, unsigned int conns,
+							unsigned long long ns, unsigned long long bytes)
+{
+	char label[64];
+
+	snprintf(label, sizeof(label), "loopback/%s n=%u", name, conns);
+	bench_report(label, bytes / bulk_size, ns, bytes);
+
+	fprintf(report, "{\"bench\":\"%s\",\"channel\":\"%s\",\"conns\":%u,"
+					"\"ns\":%llu,\"bytes\":%llu,\"mb_s\":%.2f}\n", name,
+					emu_args ? emu_args : "pipe", conns, ns, bytes,
+					(double)bytes * 1000.0 / (ns ? ns : 1));
+}
+
+/**
+ * write a benchmark latency result
+ * @param[in] name benchmark name
+ * @param[in] conns number of concurrent connections
+ * @param[in] ns elapsed time in nanoseconds
+ * @param[in] samples latencies in nanoseconds (sorted)
+ * @param[in] count number of samples
+ */
+static void report_latency(const char *name, unsigned int conns,
+							unsigned long long ns,
+							unsigned long long *samples, unsigned int count)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	unsigned long long p[4];
+	unsigned int i, idx;
+	char label[64];
+
+	if (!count)
+		return;
+
+	qsort(samples, count, sizeof(*samples), bench_cmp_ull);
+	for (i=0; i<4; ++i) {
+		idx = (unsigned int)(count * pcts[i] / 100.0);
+		p[i] = samples[idx < count ? idx : count - 1];
+	}
+
+	snprintf(label, sizeof(label), "loopback/%s n=%u", name, conns);
+	bench_report(label, count, ns, 0);
+	fprintf(bench_out, "%-36s p50=%.1fus p90=%.1fus p99=%.1fus "
+			"p99.9=%.1fus max=%.1fus\n", label, p[0] / 1000.0, p[1] / 1000.0,
+			p[2] / 1000.0, p[3] / 1000.0, samples[count-1] / 1000.0);
+
+	fprintf(report, "{\"bench\":\"%s\",\"channel\":\"%s\",\"conns\":%u,"
+					"\"ns\":%llu,\"ops\":%u,\"ops_s\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,"
+					"\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+					name, emu_args ? emu_args : "pipe", conns, ns, count,
+					count * 1e9 / (ns ? ns : 1),
+					p[0] / 1000.0, p[1] / 1000.0, p[2] / 1000.0, p[3] / 1000.0,
+					samples[count-1] / 1000.0);
+}
+
+/**
+ * receive chargen tunnels data
+ * @param[in] conns number of concurrent connections
+ */
+static int bench_download(unsigned int conns)
+{
+	static char buf[256*1024];
+	struct pollfd pfd[MAX_CONNS];
+	unsigned long long got[MAX_CONNS], total, start, ns;
+	unsigned int i, done;
+	ssize_t r;
+
+	if (open_conns(pfd, conns, ports[PORT_CHARGEN]))
+		return -1;
+
+	memset(got, 0, sizeof(got));
+	for (i=0; i<conns; ++i)
+		pfd[i].events = POLLIN;
+
+	total = 0;
+	done = 0;
+	start = bench_clock();
+	while (done < conns) {
+		if (poll(pfd, conns, BENCH_TIMEOUT) <= 0)
+			break;
+		for (i=0; i<conns; ++i) {
+			if (!(pfd[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			r = read(pfd[i].fd, buf, sizeof(buf));
+			if (r <= 0) {
+				if ((r < 0) && (errno == EAGAIN))
+					continue;
+				break;
+			}
+			got[i] += r;
+			total += r;
+			if (got[i] >= bulk_size) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				++done;
+			}
+		}
+	}
+	ns = bench_clock() - start;
+	close_conns(pfd, conns);
+
+	if (done < conns)
+		return error("download aborted (%u/%u)", done, conns);
+
+	report_bulk("download", conns, ns, total);
+	return 0;
+}
+
+/**
+ * send data to discard tunnels
+ * @param[in] conns number of concurrent connections
+ */
+static int bench_upload(unsigned int conns)
+{
+	static char blob[64*1024];
+	struct pollfd pfd[MAX_CONNS];
+	unsigned long long sent[MAX_CONNS], base, start, ns, last, seen;
+	unsigned int i, done;
+	mockstats_t stats;
+	ssize_t w;
+
+	memset(blob, 'U', sizeof(blob));
+	if (open_conns(pfd, conns, ports[PORT_DISCARD]))
+		return -1;
+
+	memset(sent, 0, sizeof(sent));
+	for (i=0; i<conns; ++i)
+		pfd[i].events = POLLOUT;
+
+	mock_stat(&stats);
+	base = stats.discarded;
+	done = 0;
+	start = bench_clock();
+	while (done < conns) {
+		if (poll(pfd, conns, BENCH_TIMEOUT) <= 0)
+			break;
+		for (i=0; i<conns; ++i) {
+			if (!(pfd[i].revents & POLLOUT))
+				continue;
+			w = bulk_size - sent[i];
+			if (w > (ssize_t) sizeof(blob))
+				w = sizeof(blob);
+			w = write(pfd[i].fd, blob, w);
+			if (w <= 0) {
+				if ((w < 0) && (errno == EAGAIN))
+					continue;
+				break;
+			}
+			sent[i] += w;
+			if (sent[i] >= bulk_size) {
+				pfd[i].events = 0;
+				++done;
+			}
+		}
+	}
+
+	// the data are accounted once received by the server
+	seen = bench_clock();
+	last = 0;
+	do {
+		mock_stat(&stats);
+		if (stats.discarded - base >= (unsigned long long) conns * bulk_size)
+			break;
+		if (stats.discarded != last) {
+			last = stats.discarded;
+			seen = bench_clock();
+		}
+		usleep(100);
+	} while (bench_clock() - seen < BENCH_TIMEOUT * 1000000ULL);
+	ns = bench_clock() - start;
+	close_conns(pfd, conns);
+
+	if (stats.discarded - base < (unsigned long long) conns * bulk_size)
+		return error("upload aborted");
+
+	report_bulk("upload", conns, ns, stats.discarded - base);
+	return 0;
+}
+
+/**
+ * exchange small messages with echo tunnels
+ * @param[in] name benchmark name
+ * @param[in] port tunnel port
+ * @param[in] conns number of concurrent connections
+ * @note each connection sends a message once the previous one is echoed,
+ *       the first exchange of each connection is not measured
+ */
+static int bench_latency(const char *name, unsigned short port,
+							unsigned int conns)
+{
+	static unsigned long long samples[MSG_COUNT];
+	static char msg[MSG_SIZE];
+	char buf[MSG_SIZE];
+	struct pollfd pfd[MAX_CONNS];
+	unsigned long long sent_at[MAX_CONNS], start, now;
+	unsigned int got[MAX_CONNS], rounds[MAX_CONNS];
+	unsigned int i, count, issued, done, total;
+	ssize_t r;
+
+	if (open_conns(pfd, conns, port))
+		return -1;
+
+	memset(msg, 'L', sizeof(msg));
+	memset(got, 0, sizeof(got));
+	memset(rounds, 0, sizeof(rounds));
+	for (i=0; i<conns; ++i)
+		pfd[i].events = POLLOUT;
+
+	total = msg_count + conns;
+	issued = done = count = 0;
+	start = bench_clock();
+
+	while (done < total) {
+		if (poll(pfd, conns, BENCH_TIMEOUT) <= 0)
+			break;
+		for (i=0; i<conns; ++i) {
+			if (pfd[i].revents & POLLOUT) {
+				// connection is established
+				sent_at[i] = bench_clock();
+				if (write(pfd[i].fd, msg, sizeof(msg)) != sizeof(msg))
+					goto abort;
+				pfd[i].events = POLLIN;
+				++issued;
+				continue;
+			}
+			if (!(pfd[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+
+			r = read(pfd[i].fd, buf, sizeof(buf) - got[i]);
+			if (r <= 0) {
+				if ((r < 0) && (errno == EAGAIN))
+					continue;
+				goto abort;
+			}
+			got[i] += r;
+			if (got[i] < sizeof(msg))
+				continue;
+
+			now = bench_clock();
+			got[i] = 0;
+			++done;
+			if (rounds[i]++ && (count < msg_count))
+				samples[count++] = now - sent_at[i];
+
+			if (issued < total) {
+				sent_at[i] = now;
+				if (write(pfd[i].fd, msg, sizeof(msg)) != sizeof(msg))
+					goto abort;
+				++issued;
+			}
+		}
+	}
+	now = bench_clock();
+	close_conns(pfd, conns);
+
+	if (count < msg_count)
+		return error("%s aborted (%u/%u)", name, count, msg_count);
+
+	report_latency(name, conns, now - start, samples, count);
+	return 0;
+
+abort:
+	close_conns(pfd, conns);
+	return error("%s aborted (%u/%u)", name, count, msg_count);
+}
+
+/**
+ * open and close echo tunnels
+ * @param[in] conns number of concurrent connections
+ * @note a connection is established once a byte is echoed
+ */
+static int bench_setup(unsigned int conns)
+{
+	static unsigned long long samples[SETUP_COUNT];
+	struct pollfd pfd[MAX_CONNS];
+	unsigned long long opened_at[MAX_CONNS], start;
+	unsigned int i, started, count;
+	char c;
+
+	start = bench_clock();
+	for (i=0; i<conns; ++i) {
+		opened_at[i] = bench_clock();
+		pfd[i].fd = connect_port(ports[PORT_NODELAY], 1);
+		if (pfd[i].fd == -1)
+			return error("failed to connect tunnel (%s)", strerror(errno));
+		pfd[i].events = POLLOUT;
+	}
+	started = conns;
+	count = 0;
+
+	while (count < setup_count) {
+		if (poll(pfd, conns, BENCH_TIMEOUT) <= 0)
+			break;
+		for (i=0; i<conns; ++i) {
+			if (pfd[i].fd == -1)
+				continue;
+
+			if (pfd[i].revents & POLLOUT) {
+				c = 'S';
+				if (write(pfd[i].fd, &c, 1) == 1)
+					pfd[i].events = POLLIN;
+				continue;
+			}
+			if (!(pfd[i].revents & (POLLIN|POLLHUP|POLLERR)))
+				continue;
+			if (read(pfd[i].fd, &c, 1) != 1) {
+				if (errno == EAGAIN)
+					continue;
+				close_conns(pfd, conns);
+				return error("setup aborted (%u/%u)", count, setup_count);
+			}
+
+			samples[count++] = bench_clock() - opened_at[i];
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+
+			if (started < setup_count) {
+				opened_at[i] = bench_clock();
+				pfd[i].fd = connect_port(ports[PORT_NODELAY], 1);
+				pfd[i].events = POLLOUT;
+				++started;
+			}
+		}
+	}
+	close_conns(pfd, conns);
+
+	if (count < setup_count)
+		return error("setup aborted (%u/%u)", count, setup_count);
+
+	report_latency("setup", conns, bench_clock() - start, samples, count);
+	return 0;
+}
+
+/**
+ * usage: bench_loopback [-e "chanemu options"] [-s KB] [-m count] [report]
+ * @note results are appended to the report file (JSON lines,
+ *       bench_loopback.json by default). With -e, the channel goes through
+ *       the emulator (chanemu.c), -s and -m reduce the bulk transfers size
+ *       and the number of messages to keep slow channels runs short.
+ */
+int main(int argc, char **argv)
+{
+	static const unsigned int bulk[] = { 1, 16, 64 };
+	static const unsigned int lat[] = { 1, 16, 64 };
+	static const unsigned int setup[] = { 1, 16, 64 };
+	const char *path;
+	unsigned int i;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "e:s:m:")) != -1) {
+		switch (c) {
+			case 'e': emu_args = optarg; break;
+			case 's': bulk_size = strtoull(optarg, NULL, 10) * 1024; break;
+			case 'm':
+				msg_count = strtoul(optarg, NULL, 10);
+				if (msg_count > MSG_COUNT)
+					msg_count = MSG_COUNT;
+				setup_count = (msg_count < SETUP_COUNT ? msg_count : SETUP_COUNT);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-e \"chanemu options\"] [-s KB] "
+						"[-m count] [report]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (!bulk_size || !msg_count) {
+		fprintf(stderr, "invalid bulk size or message count\n");
+		return 1;
+	}
+
+	bench_out = stdout;
+	path = (optind < argc ? argv[optind] : "bench_loopback.json");
+	report = fopen(path, "a");
+	if (!report) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return 1;
+	}
+
+	print_init();
+	info_level = 0;
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = start_client();
+	for (i=0; !ret && (i<sizeof(bulk)/sizeof(bulk[0])); ++i) {
+		ret = bench_download(bulk[i]);
+		wait_idle();
+		if (!ret)
+			ret = bench_upload(bulk[i]);
+		wait_idle();
+	}
+	for (i=0; !ret && (i<sizeof(lat)/sizeof(lat[0])); ++i) {
+		ret = bench_latency("latency", ports[PORT_ECHO], lat[i]);
+		wait_idle();
+		if (!ret)
+			ret = bench_latency("latency-nodelay", ports[PORT_NODELAY], lat[i]);
+		wait_idle();
+	}
+	for (i=0; !ret && (i<sizeof(setup)/sizeof(setup[0])); ++i) {
+		ret = bench_setup(setup[i]);
+		wait_idle();
+	}
+
+	stop_client();
+	fclose(report);
+	print_flush();
+
+	return (ret ? 1 : 0);
+}
@@ -0,0 +1,409 @@
+/**
+ * @file bench_micro.c
+ * microbenchmarks of the data path primitives
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "msgparser.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/** each benchmark is run RUNS times, the fastest run is reported */
+#define RUNS 5
+/** iobuf operations per run */
+#define IOBUF_OPS (1024*1024)
+/** frames of the synthetic channel stream */
+#define FRAMES 4096
+/** maximal size of the synthetic channel stream */
+#define STREAM_SIZE (16*1024*1024)
+/** parses of the synthetic stream per run */
+#define PARSES 64
+/** bytes transferred per net_read/net_write run */
+#define NET_BYTES (64*1024*1024)
+/** SOCKS5 requests per run */
+#define SOCKS_REQS 4096
+
+extern int info_level;
+
+static int chan_fd = -1;
+
+/* drop the messages written by the client on the channel */
+static void drain_channel(void)
+{
+	char buf[65536];
+
+	channel_write_event();
+	while (read(chan_fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/**
+ * print the fastest of the benchmark runs
+ * @param[in] name benchmark name
+ * @param[in] ops number of operations per run
+ * @param[in] ns elapsed time of each run
+ * @param[in] bytes number of bytes processed per run
+ */
+static void report(const char *name, unsigned long long ops,
+						const unsigned long long *ns, unsigned long long bytes)
+{
+	unsigned long long best;
+	unsigned int r;
+
+	best = ns[0];
+	for (r=1; r<RUNS; ++r) {
+		if (ns[r] < best)
+			best = ns[r];
+	}
+	bench_report(name, ops, best, bytes);
+}
+
+/**
+ * reserve, commit and consume buffer space
+ * @param[in] name benchmark name
+ * @param[in] reserve size reserved by each operation
+ * @param[in] commit size committed by each operation
+ * @param[in] consume maximal size consumed at once (0 empties the buffer)
+ * @note each operation consumes a random size between 1 and consume
+ *       as long as enough data are buffered, like frames parsing
+ */
+static void bench_iobuf(const char *name, unsigned int reserve,
+							unsigned int commit, unsigned int consume)
+{
+	unsigned long long ns[RUNS], bytes, t;
+	unsigned int r, i, n, avail;
+	iobuf_t buf;
+	char *ptr;
+
+	for (r=0; r<RUNS; ++r) {
+		iobuf_init(&buf, 'r', "bench");
+		bytes = 0;
+		t = bench_clock();
+		for (i=0; i<IOBUF_OPS; ++i) {
+			ptr = iobuf_reserve(&buf, reserve, &avail);
+			if (!ptr)
+				return;
+			n = (commit < avail ? commit : avail);
+			ptr[0] = ptr[n-1] = (char) i;
+			iobuf_commit(&buf, n);
+			bytes += n;
+
+			if (!consume) {
+				iobuf_consume(&buf, iobuf_datalen(&buf));
+				continue;
+			}
+			n = 1 + bench_rand() % consume;
+			while (iobuf_datalen(&buf) >= n)
+				iobuf_consume(&buf, n);
+		}
+		ns[r] = bench_clock() - t;
+		iobuf_kill(&buf);
+	}
+
+	report(name, IOBUF_OPS, ns, bytes);
+}
+
+/**
+ * build a synthetic server stream
+ * @param[out] out frames (STREAM_SIZE bytes)
+ * @param[in] tid tunnel ID
+ * @param[in] framing 0 for v1, 1 for v2, 2 for compact DATA frames
+ * @param[out] out_frames number of frames
+ * @return size of frames
+ * @note 80% of frames are DATA (8 bytes to 16KB), 15% WINDOW, 5% PING
+ */
+static unsigned int make_stream(unsigned char *out, unsigned short tid,
+									int framing, unsigned int *out_frames)
+{
+	static const unsigned int sizes[] = { 8, 64, 256, 1400, 4096, 16384 };
+	unsigned int i, off, kind, len, hlen;
+
+	off = 0;
+	for (i=0; (i<FRAMES) && (off + 16384 + 8 <= STREAM_SIZE); ++i) {
+		kind = bench_rand() % 100;
+		if (kind < 80) {
+			len = sizes[bench_rand() % (sizeof(sizes)/sizeof(sizes[0]))];
+			if (framing == 2) {
+				hlen = compact_header(out + off, tid, len);
+				memset(out + off + hlen, 'd', len);
+				off += hlen + len;
+				continue;
+			}
+		} else {
+			len = (kind < 95 ? 4 : 1);
+		}
+
+		if (kind < 80) {
+			out[off+4] = R2TCMD_DATA;
+			memset(out + off + 6 + !!framing, 'd', len);
+		} else if (kind < 95) {
+			out[off+4] = R2TCMD_WINDOW;
+			*(unsigned int *)(out + off + 6 + !!framing) = htonl(1);
+		} else {
+			out[off+4] = R2TCMD_PING;
+			out[off+6+!!framing] = R2TCAP_WINDOW;
+		}
+
+		if (framing) {
+			*(unsigned int *)(out + off) = htonl(len + 3);
+			out[off+4] |= R2TCMD_V2;
+			out[off+5] = (unsigned char)(tid >> 8);
+			out[off+6] = (unsigned char) tid;
+			hlen = 7;
+		} else {
+			*(unsigned int *)(out + off) = htonl(len + 2);
+			out[off+5] = (unsigned char) tid;
+			hlen = 6;
+		}
+		off += hlen + len;
+	}
+
+	*out_frames = i;
+	return off;
+}
+
+/**
+ * parse a synthetic stream of mixed commands and sizes
+ * @param[in] name benchmark name
+ * @param[in] framing 0 for v1, 1 for v2, 2 for compact DATA frames
+ * @note tunnel data are buffered by the tunnel, the socket is not written
+ */
+static void bench_parse(const char *name, int framing)
+{
+	static unsigned char stream[STREAM_SIZE];
+	unsigned long long ns[RUNS];
+	unsigned int r, p, len, frames;
+	int sv[2];
+	netaddr_t addr;
+	netsock_t *ns_tun;
+	iobuf_t ibuf;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+	ns_tun = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns_tun)
+		return;
+	ns_tun->type  = NETSOCK_TUNCLI;
+	ns_tun->state = NETSTATE_CONNECTED;
+	iobuf_init2(&ns_tun->u.tuncli.ibuf, &ns_tun->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns_tun, tunnel_generate_id());
+
+	// pending byte: tunnel data are appended to the output buffer
+	iobuf_append(&ns_tun->u.tuncli.obuf, "", 1);
+
+	len = make_stream(stream, ns_tun->tid, framing, &frames);
+	iobuf_init(&ibuf, 'r', "bench");
+	for (r=0; r<RUNS; ++r) {
+		ns[r] = 0;
+		for (p=0; p<PARSES; ++p) {
+			// compact headers are modified in place
+			iobuf_append(&ibuf, stream, len);
+			ns[r] -= bench_clock();
+			if (commands_parse(&ibuf))
+				return;
+			ns[r] += bench_clock();
+			iobuf_consume(&ns_tun->u.tuncli.obuf,
+							iobuf_datalen(&ns_tun->u.tuncli.obuf) - 1);
+		}
+	}
+	report(name, (unsigned long long)frames * PARSES, ns,
+				(unsigned long long)len * PARSES);
+
+	iobuf_kill(&ibuf);
+	iobuf_consume(&ns_tun->u.tuncli.obuf, 1);
+	tunnel_close(ns_tun, 0);
+	netsocks_close_cancelled();
+	close(sv[1]);
+	drain_channel();
+}
+
+/**
+ * write and read messages over a socketpair
+ * @param[in] name benchmark name
+ * @param[in] size size of messages
+ */
+static void bench_net(const char *name, unsigned int size)
+{
+	static char msg[65536];
+	unsigned long long ns[RUNS], t, bytes;
+	unsigned int r, i, count, out, got, flushed, min_size;
+	iobuf_t ibuf, obuf;
+	int sv[2], ret;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+	memset(msg, 'n', sizeof(msg));
+
+	count = NET_BYTES / size;
+	for (r=0; r<RUNS; ++r) {
+		iobuf_init(&ibuf, 'r', "bench");
+		iobuf_init(&obuf, 'w', "bench");
+		min_size = 0;
+		bytes = 0;
+		t = bench_clock();
+		for (i=0; i<count; ++i) {
+			ret = net_write(&sv[0], &obuf, msg, size, &out);
+			for (got=0; got<size; got+=out) {
+				if (ret < 0)
+					goto end;
+				if (net_read(&sv[1], &ibuf, 0, &min_size, &out) < 0)
+					goto end;
+				iobuf_consume(&ibuf, out);
+				if (iobuf_datalen(&obuf))
+					ret = net_write(&sv[0], &obuf, NULL, 0, &flushed);
+			}
+			bytes += size;
+		}
+		ns[r] = bench_clock() - t;
+		iobuf_kill(&ibuf);
+		iobuf_kill(&obuf);
+	}
+	report(name, count, ns, bytes);
+
+end:
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/**
+ * parse SOCKS5 connection requests
+ * @param[in] name benchmark name
+ * @param[in] req method selection and CONNECT request
+ * @param[in] len size of request
+ * @note the socket setup and teardown are not measured, the reads of
+ *       the request are
+ */
+static void bench_socks5(const char *name, const unsigned char *req,
+							unsigned int len)
+{
+	unsigned long long ns[RUNS];
+	unsigned int r, i;
+	int sv[2];
+	netaddr_t addr;
+	netsock_t *cli;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+
+	for (r=0; r<RUNS; ++r) {
+		ns[r] = 0;
+		for (i=0; i<SOCKS_REQS; ++i) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+				return;
+			fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+
+			cli = netsock_alloc(NULL, sv[0], &addr, 0);
+			if (!cli)
+				return;
+			cli->type  = NETSOCK_S5CLI;
+			cli->tid   = R2TID_NONE;
+			cli->state = NETSTATE_AUTHENTICATING;
+			iobuf_init2(&cli->u.sockscli.ibuf, &cli->u.sockscli.obuf, "socks5");
+
+			// the client sends its request without waiting for the answer
+			if (write(sv[1], req, len) != len)
+				return;
+
+			ns[r] -= bench_clock();
+			if (socks5_read_event(cli) || socks5_read_event(cli)
+					|| (cli->state != NETSTATE_CONNECTING))
+				return;
+			ns[r] += bench_clock();
+
+			tunnel_close(cli, 0);
+			netsocks_close_cancelled();
+			close(sv[1]);
+			if (!(i % 64))
+				drain_channel();
+		}
+		drain_channel();
+	}
+
+	report(name, SOCKS_REQS, ns, 0);
+}
+
+int main(void)
+{
+	static const unsigned char s5_ipv4[] = {
+		5, 1, 0,
+		5, 1, 0, 1, 10, 0, 0, 1, 0, 22
+	};
+	static const unsigned char s5_fqdn[] = {
+		5, 2, 2, 0,
+		5, 1, 0, 3, 16, 'i','n','t','r','a','n','e','t','.','l','o','c','a',
+		'l','.','x', 1, 187
+	};
+	static const unsigned char s5_ipv6[] = {
+		5, 1, 0,
+		5, 1, 0, 4, 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+		0x0d, 0x3d
+	};
+	int pfd[2];
+
+	if (bench_client_init())
+		return 1;
+	info_level = -1;
+
+	// channel output is drained by the benchmark
+	if (pipe(pfd))
+		return 1;
+	dup2(pfd[1], RDP_FD_OUT);
+	close(pfd[1]);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+	chan_fd = pfd[0];
+	fcntl(chan_fd, F_SETFL, fcntl(chan_fd, F_GETFL)|O_NONBLOCK);
+	events_kill();
+	if (events_init())
+		return 1;
+
+	// socket reads, one message at a time
+	bench_iobuf("iobuf/read-64", IOBUF_MIN_SIZE, 64, 0);
+	bench_iobuf("iobuf/read-1460", IOBUF_MIN_SIZE, 1460, 0);
+	bench_iobuf("iobuf/read-16k", 16384, 16384, 0);
+	// channel input: rdesktop chunks, frames parsed as they complete
+	bench_iobuf("iobuf/chunks-frames", 4096, 1600, 300);
+	// tunnel output: data frames, partial socket writes
+	bench_iobuf("iobuf/stream", 8192, 8000, 6000);
+
+	bench_parse("parse/mixed-v1", 0);
+	bench_parse("parse/mixed-v2", 1);
+	bench_parse("parse/mixed-compact", 2);
+
+	bench_net("net/socketpair-64", 64);
+	bench_net("net/socketpair-1460", 1460);
+	bench_net("net/socketpair-16k", 16384);
+	bench_net("net/socketpair-64k", 65536);
+
+	bench_socks5("socks5/ipv4", s5_ipv4, sizeof(s5_ipv4));
+	bench_socks5("socks5/fqdn", s5_fqdn, sizeof(s5_fqdn));
+	bench_socks5("socks5/ipv6", s5_ipv6, sizeof(s5_ipv6));
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file bench_sched.c
+ * latency of an interactive tunnel while a bulk tunnel saturates the channel
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/** simulated virtual channel bandwidth (bytes per second) */
+#define RATE      (16*1024*1024)
+/** size of interactive requests */
+#define REQ_SIZE  64
+/** delay between interactive requests (ns) */
+#define THINK_NS  1000000ULL
+/** number of interactive requests measured */
+#define SAMPLES   300
+
+static int chan_fd = -1;
+static unsigned char frames[256*1024];
+static unsigned int frames_len = 0;
+
+/* the simulated server grants its window back as soon as data arrive */
+static void grant_window(netsock_t *ns)
+{
+	ns->u.tuncli.win.tx = 1;
+	ns->u.tuncli.win.credit = RDP2TCP_WINDOW_SIZE;
+	netsock_update_watch(ns);
+}
+
+int main(void)
+{
+	int bulk_peer, inter_peer, n, i;
+	unsigned int evts, chan_evts, len, off, got, samples;
+	unsigned long long start, now, drained, sent_at, next_req, bulk_bytes;
+	unsigned long long lat[SAMPLES];
+	netsock_t *bulk, *inter, *ns;
+	ssize_t r;
+	static char blob[65536], req[REQ_SIZE];
+
+	if (bench_client_init())
+		return 1;
+
+	// channel output is drained by the simulated rdesktop
+	chan_fd = bench_channel_pipe(0);
+	if (chan_fd < 0)
+		return 1;
+	fcntl(chan_fd, F_SETFL, fcntl(chan_fd, F_GETFL)|O_NONBLOCK);
+
+	bulk  = bench_tunnel(&bulk_peer);
+	inter = bench_tunnel(&inter_peer);
+	if (!bulk || !inter)
+		return 1;
+	grant_window(bulk);
+	grant_window(inter);
+
+	memset(blob, 'B', sizeof(blob));
+	memset(req, 'R', sizeof(req));
+
+	samples = 0;
+	drained = 0;
+	bulk_bytes = 0;
+	sent_at = 0;
+	start = bench_clock();
+	next_req = start + 100 * THINK_NS; // let the bulk tunnel fill the queues
+
+	while (samples < SAMPLES) {
+
+		n = events_wait(channel_want_write(), 1000, &chan_evts);
+		if (n < 0)
+			return 1;
+
+		if (chan_evts & NETEVT_WRITE)
+			channel_write_event();
+
+		for (i=0; i<n; ++i) {
+			ns = event_get(i, &evts);
+			if (evts & NETEVT_READ)
+				channel_forward_recv(ns);
+			netsock_update_watch(ns);
+		}
+
+		// bulk application always has data to send
+		while (write(bulk_peer, blob, sizeof(blob)) > 0)
+			;
+
+		now = bench_clock();
+		if (!sent_at && (now >= next_req)) {
+			if (write(inter_peer, req, sizeof(req)) == sizeof(req))
+				sent_at = now;
+		}
+
+		// simulated channel bandwidth
+		len = (unsigned int)((now - start) * RATE / 1000000000ULL - drained);
+		if (len > sizeof(frames) - frames_len)
+			len = sizeof(frames) - frames_len;
+		if (!len)
+			continue;
+
+		r = read(chan_fd, frames + frames_len, len);
+		if (r <= 0)
+			continue;
+		drained += r;
+		frames_len += r;
+
+		// parse the complete frames
+		off = 0;
+		while (frames_len - off >= 6) {
+			len = ntohl(*(unsigned int *)(frames + off));
+			if (frames_len - off < len + 4)
+				break;
+
+			if (frames[off+4] == R2TCMD_DATA) {
+				got = len - 2;
+				ns = tunnel_lookup(frames[off+5]);
+				if (ns == bulk) {
+					bulk_bytes += got;
+				} else if ((ns == inter) && sent_at) {
+					lat[samples++] = bench_clock() - sent_at;
+					sent_at = 0;
+					next_req = bench_clock() + THINK_NS;
+				}
+				if (ns) {
+					ns->u.tuncli.win.credit += got;
+					netsock_update_watch(ns);
+				}
+			}
+			off += len + 4;
+		}
+		memmove(frames, frames + off, frames_len - off);
+		frames_len -= off;
+	}
+
+	now = bench_clock() - start;
+	bench_report("sched/bulk-throughput", 1, now, bulk_bytes);
+
+	qsort(lat, SAMPLES, sizeof(lat[0]), bench_cmp_ull);
+	fprintf(bench_out, "%-36s %10u req %9.2f ms p50 %9.2f ms p99\n",
+				"sched/interactive-latency", SAMPLES,
+				lat[SAMPLES/2] / 1e6, lat[SAMPLES*99/100] / 1e6);
+	fflush(bench_out);
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/** number of tunnels sending data */
+#define TUNNELS   64
+/** number of threads writing the tunnels peers */
+#define FEEDERS   2
+/** size of data written to a tunnel peer at once */
+#define CHUNK     4096
+/** duration of a measure (ns) */
+#define DURATION  1000000000ULL
+
+static int peers[TUNNELS];
+static netsock_t *tunnels[TUNNELS];
+
+/* forward the tunnels data to the channel for DURATION */
+static int run(unsigned int threads)
+{
+	unsigned int i, evts, chan_evts;
+	unsigned long long start, now, bytes;
+	unsigned long long cpu, loop, feed, drain, work;
+	netsock_t *ns;
+	char name[64];
+	int n;
+
+	if (threads && shards_init(threads))
+		return -1;
+	events_kill();
+	if (events_init())
+		return -1;
+
+	for (i=0; i<TUNNELS; ++i) {
+		tunnels[i] = bench_tunnel(&peers[i]);
+		if (!tunnels[i])
+			return -1;
+	}
+
+	if (bench_feed_start(peers, TUNNELS, FEEDERS, CHUNK))
+		return -1;
+
+	bytes = bench_drained();
+	drain = bench_drain_cpu();
+	loop  = bench_cpu(1);
+	cpu   = bench_cpu(0);
+	start = bench_clock();
+
+	do {
+		n = events_wait(channel_want_write(), 1000, &chan_evts);
+		if (n < 0)
+			return -1;
+
+		if (chan_evts & NETEVT_WRITE)
+			channel_write_event();
+#ifdef USE_SHARDS
+		if (chan_evts & NETEVT_SHARDS)
+			shards_recv();
+#endif
+
+		for (i=0; i<(unsigned int)n; ++i) {
+			ns = event_get(i, &evts);
+			if (evts & NETEVT_READ)
+				channel_forward_recv(ns);
+			netsock_update_watch(ns);
+		}
+		netsocks_close_cancelled();
+
+		now = bench_clock();
+	} while (now - start < DURATION);
+
+	bytes = bench_drained() - bytes;
+	loop  = bench_cpu(1) - loop;
+
+	// the feeders CPU time is accounted from their start
+	feed  = bench_feed_stop();
+	drain = bench_drain_cpu() - drain;
+	cpu   = bench_cpu(0) - cpu;
+	// what is left is the shards workers
+	work  = cpu > loop + feed + drain ? cpu - loop - feed - drain : 0;
+
+	for (i=0; i<TUNNELS; ++i) {
+		netsock_close(tunnels[i]);
+		close(peers[i]);
+	}
+	// flush the data of the closed tunnels
+	while (channel_want_write())
+		channel_write_event();
+#ifdef USE_SHARDS
+	shards_kill();
+#endif
+
+	snprintf(name, sizeof(name), "threads/forward n=%u threads=%u",
+				TUNNELS, threads);
+	bench_report(name, bytes / CHUNK, now - start, bytes);
+	fprintf(bench_out, "%-36s %6.1f MB/cpu-s loop %3.0f%% workers %3.0f%% "
+		"feeders %3.0f%% drainer %3.0f%%\n", name,
+		(double) bytes * 1000.0 / (loop + work ? loop + work : 1),
+		100.0 * loop / (now - start), 100.0 * work / (now - start),
+		100.0 * feed / (now - start), 100.0 * drain / (now - start));
+	return 0;
+}
+
+int main(void)
+{
+	static const unsigned int threads[] = { 0, 1, 2, 4 };
+	unsigned int i;
+	long cpus;
+
+	if (bench_client_init())
+		return 1;
+
+	// channel output is drained by the simulated rdesktop
+	if ((bench_channel_pipe(1024*1024) < 0) || bench_drain_start())
+		return 1;
+
+	// workers only scale with free CPUs, the loop, feeders and drainer
+	// are already 4 busy threads
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fprintf(bench_out, "threads/forward: %ld online CPUs\n", cpus);
+
+	for (i=0; i<sizeof(threads)/sizeof(threads[0]); ++i) {
+#ifndef USE_SHARDS
+		if (threads[i])
+			break;
+#endif
+		if (run(threads[i]))
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file bench_tunnels.c
+ * tunnel ID lookup/allocation benchmark
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "msgparser.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define MAX_TUNNELS 254
+#define FRAMES      1024
+#define PAYLOAD     32
+#define ROUNDS      200
+#define LOOKUPS     1000000
+
+extern struct list_head all_sockets;
+
+static netsock_t *tunnels[MAX_TUNNELS];
+static int peers[MAX_TUNNELS];
+static unsigned int count = 0;
+
+/* tunnel_lookup() algorithm before the tunnel ID table */
+static netsock_t *list_lookup(unsigned char tid)
+{
+	netsock_t *ns;
+
+	list_for_each(ns, &all_sockets) {
+		if (ns->tid == tid)
+			return ns;
+	}
+	return NULL;
+}
+
+/* tunnel_generate_id() algorithm before the tunnel ID table */
+static unsigned char list_generate_id(void)
+{
+	unsigned char tid;
+	static unsigned char last_tid = 0xff;
+
+	for (tid=last_tid+1; tid!=last_tid; ++tid) {
+		if (!list_lookup(tid)) {
+			last_tid = tid;
+			return tid;
+		}
+	}
+	return 0xff;
+}
+
+static int add_tunnel(void)
+{
+	int sv[2];
+	netaddr_t addr;
+	netsock_t *ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return -1;
+	ns->type  = NETSOCK_TUNCLI;
+	ns->state = NETSTATE_CONNECTED;
+	iobuf_init(&ns->u.tuncli.obuf, 'w', "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+
+	tunnels[count] = ns;
+	peers[count] = sv[1];
+	++count;
+	return 0;
+}
+
+static void drain_peers(void)
+{
+	unsigned int i;
+	char buf[65536];
+
+	for (i=0; i<count; ++i) {
+		while (read(peers[i], buf, sizeof(buf)) > 0)
+			;
+	}
+}
+
+static void bench_parse(void)
+{
+	unsigned int i, r, len;
+	unsigned char *frames, *msg;
+	unsigned long long t0, ns;
+	iobuf_t ibuf;
+	char name[64];
+
+	len = FRAMES * (6 + PAYLOAD);
+	frames = malloc(len);
+	if (!frames)
+		return;
+
+	for (i=0, msg=frames; i<FRAMES; ++i, msg+=6+PAYLOAD) {
+		*(unsigned int *)msg = htonl(2 + PAYLOAD);
+		msg[4] = R2TCMD_DATA;
+		msg[5] = tunnels[bench_rand() % count]->tid;
+		memset(msg+6, 'A' + (i % 26), PAYLOAD);
+	}
+
+	iobuf_init(&ibuf, 'r', "bench");
+	ns = 0;
+	for (r=0; r<ROUNDS; ++r) {
+		iobuf_append(&ibuf, frames, len);
+		t0 = bench_clock();
+		commands_parse(&ibuf);
+		ns += bench_clock() - t0;
+		drain_peers();
+	}
+	iobuf_kill(&ibuf);
+	free(frames);
+
+	snprintf(name, sizeof(name), "parse/data-mixed-tid n=%u", count);
+	bench_report(name, (unsigned long long)ROUNDS*FRAMES, ns,
+						(unsigned long long)ROUNDS*FRAMES*PAYLOAD);
+}
+
+static void bench_lookup(void)
+{
+	unsigned int i;
+	unsigned long long t0, ns;
+	unsigned char tids[256];
+	volatile netsock_t *found;
+	char name[64];
+
+	for (i=0; i<256; ++i)
+		tids[i] = tunnels[bench_rand() % count]->tid;
+
+	t0 = bench_clock();
+	for (i=0; i<LOOKUPS; ++i)
+		found = tunnel_lookup(tids[i & 0xff]);
+	ns = bench_clock() - t0;
+	snprintf(name, sizeof(name), "lookup/table n=%u", count);
+	bench_report(name, LOOKUPS, ns, 0);
+
+	t0 = bench_clock();
+	for (i=0; i<LOOKUPS; ++i)
+		found = list_lookup(tids[i & 0xff]);
+	ns = bench_clock() - t0;
+	snprintf(name, sizeof(name), "lookup/list n=%u", count);
+	bench_report(name, LOOKUPS, ns, 0);
+	(void)found;
+}
+
+static void bench_generate(void)
+{
+	unsigned int i;
+	unsigned char tid;
+	unsigned long long t0, ns;
+	netsock_t *tmp;
+	char name[64];
+
+	tmp = calloc(1, sizeof(*tmp));
+	if (!tmp)
+		return;
+	tmp->tid = 0xff;
+	list_add_tail(&tmp->list, &all_sockets);
+
+	t0 = bench_clock();
+	for (i=0; i<LOOKUPS; ++i) {
+		tunnel_set_id(tmp, tunnel_generate_id());
+		tunnel_set_id(tmp, 0xff);
+	}
+	ns = bench_clock() - t0;
+	snprintf(name, sizeof(name), "genid/table n=%u", count);
+	bench_report(name, LOOKUPS, ns, 0);
+
+	t0 = bench_clock();
+	for (i=0; i<LOOKUPS/10; ++i) {
+		tid = list_generate_id();
+		tmp->tid = tid;
+		tmp->tid = 0xff;
+	}
+	ns = bench_clock() - t0;
+	snprintf(name, sizeof(name), "genid/list n=%u", count);
+	bench_report(name, LOOKUPS/10, ns, 0);
+
+	list_del(&tmp->list);
+	free(tmp);
+}
+
+int main(void)
+{
+	static const unsigned int steps[] = { 1, 16, 64, 128, MAX_TUNNELS };
+	unsigned int i;
+
+	if (bench_client_init())
+		return 1;
+
+	for (i=0; i<sizeof(steps)/sizeof(steps[0]); ++i) {
+		while (count < steps[i]) {
+			if (add_tunnel())
+				return 1;
+		}
+		bench_parse();
+		bench_lookup();
+		bench_generate();
+	}
+
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/** number of tunnels sending data */
+#define TUNNELS   64
+/** number of threads writing the tunnels peers */
+#define FEEDERS   2
+/** size of data written to a tunnel peer at once */
+#define CHUNK     4096
+/** duration of a measure (ns) */
+#define DURATION  1000000000ULL
+
+static int peers[TUNNELS];
+static netsock_t *tunnels[TUNNELS];
+
+/*
+ * system calls of the events loop thread, counted by wrapping the libc
+ * functions used by the client (-Wl,--wrap)
+ */
+static __thread int counted = 0;
+static unsigned long long syscalls = 0;
+
+#define COUNT() do { if (counted) ++syscalls; } while (0)
+
+ssize_t __real_read(int, void *, size_t);
+ssize_t __wrap_read(int fd, void *buf, size_t len)
+{
+	COUNT();
+	return __real_read(fd, buf, len);
+}
+
+ssize_t __real_write(int, const void *, size_t);
+ssize_t __wrap_write(int fd, const void *buf, size_t len)
+{
+	COUNT();
+	return __real_write(fd, buf, len);
+}
+
+ssize_t __real_writev(int, const struct iovec *, int);
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int n)
+{
+	COUNT();
+	return __real_writev(fd, iov, n);
+}
+
+ssize_t __real_recv(int, void *, size_t, int);
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags)
+{
+	COUNT();
+	return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __real_send(int, const void *, size_t, int);
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+	COUNT();
+	return __real_send(fd, buf, len, flags);
+}
+
+int __real_ioctl(int, unsigned long, void *);
+int __wrap_ioctl(int fd, unsigned long req, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	COUNT();
+	return __real_ioctl(fd, req, arg);
+}
+
+int __real_epoll_ctl(int, int, int, struct epoll_event *);
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev)
+{
+	COUNT();
+	return __real_epoll_ctl(epfd, op, fd, ev);
+}
+
+int __real_epoll_wait(int, struct epoll_event *, int, int);
+int __wrap_epoll_wait(int epfd, struct epoll_event *evs, int max, int timeout)
+{
+	COUNT();
+	return __real_epoll_wait(epfd, evs, max, timeout);
+}
+
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 35))
+int __real_epoll_pwait2(int, struct epoll_event *, int,
+						const struct timespec *, const sigset_t *);
+int __wrap_epoll_pwait2(int epfd, struct epoll_event *evs, int max,
+						const struct timespec *ts, const sigset_t *set)
+{
+	COUNT();
+	return __real_epoll_pwait2(epfd, evs, max, ts, set);
+}
+#endif
+
+long __real_syscall(long, ...);
+long __wrap_syscall(long nr, ...)
+{
+	va_list ap;
+	long a[6];
+	int i;
+
+	va_start(ap, nr);
+	for (i=0; i<6; ++i)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+
+	COUNT();
+	return __real_syscall(nr, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+/* forward the tunnels data to the channel for DURATION */
+static int run(const char *engine)
+{
+	unsigned int i, evts, chan_evts;
+	unsigned long long start, now, bytes, calls;
+	netsock_t *ns;
+	char name[64];
+	int n;
+
+	events_kill();
+	if (events_init())
+		return -1;
+
+	for (i=0; i<TUNNELS; ++i) {
+		tunnels[i] = bench_tunnel(&peers[i]);
+		if (!tunnels[i])
+			return -1;
+	}
+
+	if (bench_feed_start(peers, TUNNELS, FEEDERS, CHUNK))
+		return -1;
+
+	bytes = bench_drained();
+	syscalls = 0;
+	counted = 1;
+	start = bench_clock();
+
+	do {
+		n = events_wait(channel_want_write(), 1000, &chan_evts);
+		if (n < 0)
+			return -1;
+
+		if (chan_evts & NETEVT_WRITE)
+			channel_write_event();
+
+		for (i=0; i<(unsigned int)n; ++i) {
+			ns = event_get(i, &evts);
+			if (evts & NETEVT_READ)
+				channel_forward_recv(ns);
+			netsock_update_watch(ns);
+		}
+		netsocks_close_cancelled();
+
+		now = bench_clock();
+	} while (now - start < DURATION);
+
+	counted = 0;
+	calls = syscalls;
+	bytes = bench_drained() - bytes;
+	bench_feed_stop();
+
+	for (i=0; i<TUNNELS; ++i) {
+		netsock_close(tunnels[i]);
+		close(peers[i]);
+	}
+	// flush the data of the closed tunnels
+	while (channel_want_write())
+		channel_write_event();
+
+	snprintf(name, sizeof(name), "uring/forward n=%u %s", TUNNELS, engine);
+	bench_report(name, bytes / CHUNK, now - start, bytes);
+	fprintf(bench_out, "%-36s %10.1f syscalls/MB\n", name,
+				(double)calls * 1048576.0 / (bytes ? bytes : 1));
+	fflush(bench_out);
+	return 0;
+}
+
+int main(void)
+{
+	if (bench_client_init())
+		return 1;
+
+	// channel output is drained by the simulated rdesktop
+	if ((bench_channel_pipe(1024*1024) < 0) || bench_drain_start())
+		return 1;
+
+	if (run("epoll"))
+		return 1;
+
+#ifdef USE_URING
+	if (uring_init()) {
+		fprintf(bench_out, "uring/forward: io_uring not available\n");
+		return 0;
+	}
+	if (run("io_uring"))
+		return 1;
+	uring_kill();
+#endif
+
+	return 0;
+}
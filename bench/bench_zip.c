@@ -0,0 +1,248 @@
+/**
+ * @file bench_zip.c
+ * compression of tunnel data on text and random corpora
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "lzblock.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** size of each corpus */
+#define CORPUS_SIZE (8*1024*1024)
+/** size of compressed blocks in codec benchmarks */
+#define BLOCK_SIZE  (64*1024)
+/** data sent through the channel per corpus */
+#define TUNNEL_DATA (64*1024*1024ULL)
+
+static unsigned char text[CORPUS_SIZE];
+static unsigned char rnd[CORPUS_SIZE];
+
+/**
+ * build a web server log corpus
+ */
+static void make_text(void)
+{
+	static const char *dirs[] = { "static", "images", "api/v1", "docs", "css" };
+	static const char *files[] = { "index", "login", "logo", "users",
+								"style", "search", "help", "about" };
+	static const char *agents[] = {
+		"Mozilla/5.0 (Windows NT 6.1; rv:2.0) Gecko/20100101 Firefox/4.0",
+		"Mozilla/4.0 (compatible; MSIE 8.0; Windows NT 5.1)",
+		"curl/7.21.0 (x86_64-pc-linux-gnu)" };
+	unsigned int off, r;
+	int n;
+
+	off = 0;
+	while (off < sizeof(text)) {
+		r = bench_rand();
+		n = snprintf((char *)text + off, sizeof(text) - off,
+				"10.%u.%u.%u - - [16/Oct/2010:13:%02u:%02u +0200] "
+				"\"GET /%s/%s.html HTTP/1.1\" %u %u \"%s\"\n",
+				r & 0xff, (r >> 8) & 0xff, bench_rand() & 0xff,
+				(r >> 16) % 60, bench_rand() % 60,
+				dirs[bench_rand() % 5], files[bench_rand() % 8],
+				(bench_rand() % 8 ? 200 : 404), bench_rand() % 50000,
+				agents[bench_rand() % 3]);
+		if ((n <= 0) || (off + n >= sizeof(text)))
+			break;
+		off += n;
+	}
+	memset(text + off, '\n', sizeof(text) - off);
+}
+
+static unsigned long long cpu_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * compress and decompress a corpus by blocks
+ */
+static void bench_codec(const char *name, const unsigned char *corpus)
+{
+	static unsigned char z[lzblock_bound(BLOCK_SIZE)], out[BLOCK_SIZE];
+	static unsigned int zlen[CORPUS_SIZE / BLOCK_SIZE];
+	unsigned long long t, zbytes;
+	unsigned int i, n, pass;
+	char label[64];
+
+	n = CORPUS_SIZE / BLOCK_SIZE;
+
+	zbytes = 0;
+	t = bench_clock();
+	for (pass=0; pass<4; ++pass) {
+		for (i=0; i<n; ++i)
+			zlen[i] = lzblock_compress(corpus + i*BLOCK_SIZE, BLOCK_SIZE,
+											z, sizeof(z));
+	}
+	t = bench_clock() - t;
+	for (i=0; i<n; ++i)
+		zbytes += zlen[i];
+	snprintf(label, sizeof(label), "lz4/compress-%s", name);
+	bench_report(label, 4*n, t, 4ULL*CORPUS_SIZE);
+	fprintf(bench_out, "%-36s %10.3f ratio\n", label, (double)zbytes / CORPUS_SIZE);
+
+	// failing early on incompressible data is what the bypass relies on
+	t = bench_clock();
+	for (pass=0; pass<4; ++pass) {
+		for (i=0; i<n; ++i)
+			lzblock_compress(corpus + i*BLOCK_SIZE, BLOCK_SIZE,
+								z, BLOCK_SIZE - BLOCK_SIZE/8);
+	}
+	t = bench_clock() - t;
+	snprintf(label, sizeof(label), "lz4/compress-7/8-%s", name);
+	bench_report(label, 4*n, t, 4ULL*CORPUS_SIZE);
+
+	t = bench_clock();
+	for (pass=0; pass<4; ++pass) {
+		for (i=0; i<n; ++i) {
+			zlen[i] = lzblock_compress(corpus + i*BLOCK_SIZE, BLOCK_SIZE,
+											z, sizeof(z));
+			if (lzblock_decompress(z, zlen[i], out, BLOCK_SIZE) != BLOCK_SIZE) {
+				fprintf(bench_out, "%s: bad block %u\n", name, i);
+				return;
+			}
+		}
+	}
+	t = bench_clock() - t;
+	snprintf(label, sizeof(label), "lz4/roundtrip-%s", name);
+	bench_report(label, 4*n, t, 4ULL*CORPUS_SIZE);
+}
+
+/**
+ * send a corpus through a tunnel and the client channel
+ * @param[in] name benchmark name
+ * @param[in] corpus tunnel data
+ * @param[in] caps channel capabilities
+ * @param[in] chan_fd channel output pipe
+ */
+static void bench_channel(const char *name, const unsigned char *corpus,
+								unsigned char caps, int chan_fd)
+{
+	static char drain[256*1024];
+	int sv[2], n, i;
+	unsigned int evts, chan_evts, off;
+	unsigned long long t, cpu, sent, wire;
+	netaddr_t addr;
+	netsock_t *ns;
+	ssize_t r;
+
+	channel_pong(caps);
+	while (read(chan_fd, drain, sizeof(drain)) > 0)
+		;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return;
+	ns->type  = NETSOCK_TUNCLI;
+	ns->state = NETSTATE_CONNECTED;
+	iobuf_init2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+	netsock_update_watch(ns);
+
+	sent = wire = 0;
+	off = 0;
+	t = bench_clock();
+	cpu = cpu_clock();
+	while (sent < TUNNEL_DATA) {
+
+		r = write(sv[1], corpus + off, CORPUS_SIZE - off);
+		if (r > 0) {
+			sent += r;
+			off = (off + r) % CORPUS_SIZE;
+		}
+
+		n = events_wait(channel_want_write(), 1000, &chan_evts);
+		if (n < 0)
+			break;
+		if (chan_evts & NETEVT_WRITE)
+			channel_write_event();
+		for (i=0; i<n; ++i) {
+			ns = event_get(i, &evts);
+			if (evts & NETEVT_READ)
+				channel_forward_recv(ns);
+			netsock_update_watch(ns);
+		}
+
+		while ((r = read(chan_fd, drain, sizeof(drain))) > 0)
+			wire += r;
+	}
+	t = bench_clock() - t;
+	cpu = cpu_clock() - cpu;
+
+	bench_report(name, 1, t, sent);
+	fprintf(bench_out, "%-36s %10.3f wire/raw %8.2f ms cpu/MB\n", name,
+				(double)wire / sent, cpu / 1e6 / (sent / 1048576.0));
+
+	tunnel_close(ns, 0);
+	netsocks_close_cancelled();
+	close(sv[1]);
+}
+
+int main(void)
+{
+	int pfd[2], chan_fd;
+	unsigned int i;
+
+	if (bench_client_init())
+		return 1;
+
+	// channel output is drained by the benchmark
+	if (pipe(pfd))
+		return 1;
+	dup2(pfd[1], RDP_FD_OUT);
+	close(pfd[1]);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+	chan_fd = pfd[0];
+	fcntl(chan_fd, F_SETFL, fcntl(chan_fd, F_GETFL)|O_NONBLOCK);
+	events_kill();
+	if (events_init())
+		return 1;
+
+	make_text();
+	for (i=0; i<sizeof(rnd); ++i)
+		rnd[i] = (unsigned char) bench_rand();
+
+	bench_codec("text", text);
+	bench_codec("random", rnd);
+
+	bench_channel("chan/text-raw", text, R2TCAP_WINDOW, chan_fd);
+	bench_channel("chan/text-lz4", text, R2TCAP_WINDOW|R2TCAP_ZDATA, chan_fd);
+	bench_channel("chan/random-raw", rnd, R2TCAP_WINDOW, chan_fd);
+	bench_channel("chan/random-lz4", rnd, R2TCAP_WINDOW|R2TCAP_ZDATA, chan_fd);
+
+	return 0;
+}
@@ -0,0 +1,433 @@
+/**
+ * @file chanemu.c
+ * RDP virtual channel emulator (bandwidth, delay, jitter and chunking)
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * chanemu runs the client (or any command) with its stdin/stdout connected
+ * to pipes and relays them to its own stdin/stdout, which face the peer
+ * (the rdesktop side). Both directions are cut into chunks which leave a
+ * link of limited bandwidth and are delivered after a one-way delay, in
+ * order, like the chunks of a RDP virtual channel.
+ *
+ * The data written to the client are prefixed by the 4-byte size header
+ * of rdesktop chunks. The data read from the peer must carry such headers
+ * (as the mock server writes them), they are removed before re-chunking.
+ */
+#define _GNU_SOURCE
+#include "iobuf.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/** default chunk size (CHANNEL_CHUNK_LENGTH) */
+#define EMU_CHUNK      1600
+/** default bytes queued by a direction above which its source is not read */
+#define EMU_QUEUE      (256*1024)
+/** maximal number of chunks queued by a direction */
+#define EMU_MAX_CHUNKS 4096
+/** size of reads */
+#define EMU_RSIZE      (64*1024)
+
+/** queued chunk */
+typedef struct _emuchunk {
+	unsigned int len;         /**< payload size */
+	unsigned long long read;  /**< time the data were read */
+	unsigned long long sent;  /**< time the chunk left the link */
+	unsigned long long due;   /**< time the chunk is delivered */
+} emuchunk_t;
+
+/** one direction of the channel */
+typedef struct _emudir {
+	const char *name;           /**< "down" (to client) or "up" */
+	int in;                     /**< source fd (-1 once closed) */
+	int out;                    /**< destination fd */
+	int strip;                  /**< 1 if source data have chunk headers */
+	int hdr;                    /**< 1 if chunk headers are written */
+	unsigned long long bps;     /**< bandwidth (bits/s, 0 for unlimited) */
+	iobuf_t ibuf;               /**< data read and not chunked yet */
+	iobuf_t qbuf;               /**< payload of queued chunks */
+	iobuf_t obuf;               /**< delivered data not written yet */
+	emuchunk_t chunks[EMU_MAX_CHUNKS]; /**< queued chunks (ring) */
+	unsigned int head;          /**< first queued chunk */
+	unsigned int count;         /**< number of queued chunks */
+	unsigned int chunk_left;    /**< payload left in current source chunk */
+	unsigned char chunk_hdr[4]; /**< size header of next source chunk */
+	unsigned int chunk_hdr_len; /**< received size of chunk header */
+	unsigned long long link;    /**< time the link is free */
+	unsigned long long last;    /**< delivery time of the last chunk */
+	unsigned long long seq;     /**< chunks delivered */
+	unsigned long long bytes;   /**< payload delivered */
+	unsigned long long delay;   /**< sum of chunks delay (read to delivery) */
+	unsigned long long max;     /**< maximal chunk delay */
+} emudir_t;
+
+/** emulator settings */
+static struct {
+	unsigned int chunk;       /**< chunk size */
+	unsigned int queue;       /**< queue limit of a direction */
+	unsigned long long delay; /**< one-way delay (ns) */
+	unsigned long long jitter;/**< delay variation (ns) */
+	FILE *trace;              /**< per-chunk timing records */
+	unsigned long long start; /**< start time */
+} emu;
+
+static emudir_t down, up;
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+/* random delay variation in [-jitter, +jitter] */
+static long long jitter(void)
+{
+	unsigned long long r;
+
+	if (!emu.jitter)
+		return 0;
+	// bench_rand() returns 24 bits
+	r = ((unsigned long long) bench_rand() << 24) | bench_rand();
+	return (long long)(r % (2 * emu.jitter + 1)) - (long long) emu.jitter;
+}
+
+/**
+ * schedule a chunk
+ * @param[in] d channel direction
+ * @param[in] len chunk size
+ * @param[in] now current time
+ * @note the chunk is sent once the previous ones left the link and it is
+ *       never delivered before them, whatever the jitter
+ */
+static void chunk_queue(emudir_t *d, unsigned int len, unsigned long long now)
+{
+	emuchunk_t *c;
+	long long due;
+
+	c = &d->chunks[(d->head + d->count++) % EMU_MAX_CHUNKS];
+	c->len = len;
+	c->read = now;
+	c->sent = (d->link > now ? d->link : now);
+	if (d->bps)
+		c->sent += (unsigned long long) len * 8 * 1000000000ULL / d->bps;
+	d->link = c->sent;
+
+	due = (long long)(c->sent + emu.delay) + jitter();
+	if (due < (long long) c->sent)
+		due = c->sent;
+	c->due = ((unsigned long long) due > d->last
+				? (unsigned long long) due : d->last);
+	d->last = c->due;
+}
+
+/* cut the data read on a direction into chunks */
+static int chunk_input(emudir_t *d, unsigned long long now)
+{
+	unsigned int len, n;
+
+	len = iobuf_datalen(&d->ibuf);
+	while ((len > 0) && (d->count < EMU_MAX_CHUNKS)) {
+		n = (len > emu.chunk ? emu.chunk : len);
+		if (!iobuf_append(&d->qbuf, iobuf_dataptr(&d->ibuf), n))
+			return -1;
+		iobuf_consume(&d->ibuf, n);
+		chunk_queue(d, n, now);
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * read the source of a direction
+ * @param[in] d channel direction
+ * @return 0 on success, 1 on end of stream, -1 on error
+ */
+static int dir_read(emudir_t *d)
+{
+	unsigned char buf[EMU_RSIZE], *ptr;
+	unsigned int in, n;
+	ssize_t r;
+
+	r = read(d->in, buf, sizeof(buf));
+	if (r <= 0) {
+		if ((r < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+			return 0;
+		return (r ? -1 : 1);
+	}
+
+	if (!d->strip)
+		return (iobuf_append(&d->ibuf, buf, (unsigned int) r) ? 0 : -1);
+
+	// remove the size headers of source chunks
+	for (in = 0; in < (unsigned int) r; in += n) {
+		if (!d->chunk_left) {
+			n = 1;
+			d->chunk_hdr[d->chunk_hdr_len++] = buf[in];
+			if (d->chunk_hdr_len == sizeof(d->chunk_hdr)) {
+				memcpy(&d->chunk_left, d->chunk_hdr, sizeof(d->chunk_left));
+				d->chunk_hdr_len = 0;
+			}
+			continue;
+		}
+		n = (unsigned int) r - in;
+		if (n > d->chunk_left)
+			n = d->chunk_left;
+		ptr = iobuf_append(&d->ibuf, buf + in, n);
+		if (!ptr)
+			return -1;
+		d->chunk_left -= n;
+	}
+
+	return 0;
+}
+
+/* move the due chunks of a direction to its output buffer */
+static int dir_deliver(emudir_t *d, unsigned long long now)
+{
+	emuchunk_t *c;
+
+	while (d->count > 0) {
+		c = &d->chunks[d->head];
+		if (c->due > now)
+			break;
+
+		if ((d->hdr && !iobuf_append(&d->obuf, &c->len, 4))
+				|| !iobuf_append(&d->obuf, iobuf_dataptr(&d->qbuf), c->len))
+			return -1;
+		iobuf_consume(&d->qbuf, c->len);
+
+		if (emu.trace)
+			fprintf(emu.trace, "%s %llu %u %.1f %.1f %.1f %.1f\n", d->name,
+					d->seq, c->len, (c->read - emu.start) / 1000.0,
+					(c->sent - emu.start) / 1000.0, (c->due - emu.start) / 1000.0,
+					(now - emu.start) / 1000.0);
+
+		++d->seq;
+		d->bytes += c->len;
+		d->delay += now - c->read;
+		if (now - c->read > d->max)
+			d->max = now - c->read;
+
+		d->head = (d->head + 1) % EMU_MAX_CHUNKS;
+		--d->count;
+	}
+
+	return 0;
+}
+
+/* bytes held by a direction */
+static unsigned int dir_queued(emudir_t *d)
+{
+	return iobuf_datalen(&d->ibuf) + iobuf_datalen(&d->qbuf)
+			+ iobuf_datalen(&d->obuf);
+}
+
+static void dir_summary(emudir_t *d, unsigned long long ns)
+{
+	fprintf(stderr, "chanemu %-4s %8llu chunks %12llu bytes %9.2f MB/s "
+			"avg delay %.1fus max %.1fus\n", d->name, d->seq, d->bytes,
+			(double) d->bytes * 1000.0 / (ns ? ns : 1),
+			d->seq ? d->delay / 1000.0 / d->seq : 0.0, d->max / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b kbit/s] [-u kbit/s] [-d ms] [-j ms] "
+			"[-c chunk] [-q bytes] [-t trace] command [args...]\n"
+			"  -b  bandwidth to the command (default unlimited)\n"
+			"  -u  bandwidth from the command (default -b)\n"
+			"  -d  one-way delay\n"
+			"  -j  delay variation (uniform in [-j,+j])\n"
+			"  -c  chunk size (default %u)\n"
+			"  -q  data queued per direction before reads stop (default %u)\n"
+			"  -t  write per-chunk timing records to file\n"
+			"      (dir seq len read_us sent_us due_us delivered_us)\n",
+			prog, EMU_CHUNK, EMU_QUEUE);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int c, to_cmd[2], from_cmd[2], status;
+	long long upbw;
+	struct pollfd pfd[4];
+	struct timespec ts;
+	unsigned long long now, next, ns;
+	emudir_t *dirs[2], *d;
+	unsigned int i, n;
+	pid_t pid;
+	ssize_t w;
+
+	memset(&emu, 0, sizeof(emu));
+	emu.chunk = EMU_CHUNK;
+	emu.queue = EMU_QUEUE;
+	upbw = -1;
+
+	while ((c = getopt(argc, argv, "+b:u:d:j:c:q:t:")) != -1) {
+		switch (c) {
+			case 'b': down.bps = strtoull(optarg, NULL, 10) * 1000; break;
+			case 'u': upbw = strtoll(optarg, NULL, 10) * 1000; break;
+			case 'd': emu.delay = strtod(optarg, NULL) * 1000000.0; break;
+			case 'j': emu.jitter = strtod(optarg, NULL) * 1000000.0; break;
+			case 'c': emu.chunk = strtoul(optarg, NULL, 10); break;
+			case 'q': emu.queue = strtoul(optarg, NULL, 10); break;
+			case 't':
+				emu.trace = fopen(optarg, "w");
+				if (!emu.trace) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((optind >= argc) || !emu.chunk)
+		usage(argv[0]);
+	up.bps = (upbw >= 0 ? (unsigned long long) upbw : down.bps);
+
+	if (pipe(to_cmd) || pipe(from_cmd)) {
+		perror("pipe");
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid) {
+		dup2(to_cmd[0], 0);
+		dup2(from_cmd[1], 1);
+		close(to_cmd[0]);
+		close(to_cmd[1]);
+		close(from_cmd[0]);
+		close(from_cmd[1]);
+		execvp(argv[optind], argv + optind);
+		_exit(1);
+	}
+	close(to_cmd[0]);
+	close(from_cmd[1]);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	down.name = "down";
+	down.in = 0;
+	down.out = to_cmd[1];
+	down.strip = 1;
+	down.hdr = 1;
+	up.name = "up";
+	up.in = from_cmd[0];
+	up.out = 1;
+	dirs[0] = &down;
+	dirs[1] = &up;
+	for (i=0; i<2; ++i) {
+		d = dirs[i];
+		fcntl(d->in, F_SETFL, fcntl(d->in, F_GETFL)|O_NONBLOCK);
+		fcntl(d->out, F_SETFL, fcntl(d->out, F_GETFL)|O_NONBLOCK);
+		iobuf_init(&d->ibuf, 'r', d->name);
+		iobuf_init(&d->qbuf, 'r', d->name);
+		iobuf_init(&d->obuf, 'w', d->name);
+	}
+
+	emu.start = bench_clock();
+	while (!stop) {
+
+		// deliver the due chunks and compute the next deadline
+		now = bench_clock();
+		next = 0;
+		for (i=0; i<2; ++i) {
+			d = dirs[i];
+			if (chunk_input(d, now) || dir_deliver(d, now))
+				goto end;
+			if (d->count && (!next || (d->chunks[d->head].due < next)))
+				next = d->chunks[d->head].due;
+		}
+
+		for (i=0; i<2; ++i) {
+			d = dirs[i];
+			pfd[i].fd = ((d->in >= 0) && (dir_queued(d) < emu.queue)
+							&& (d->count < EMU_MAX_CHUNKS) ? d->in : -1);
+			pfd[i].events = POLLIN;
+			pfd[i+2].fd = (iobuf_datalen(&d->obuf) ? d->out : -1);
+			pfd[i+2].events = POLLOUT;
+		}
+
+		if (next) {
+			ns = (next > now ? next - now : 0);
+			ts.tv_sec = ns / 1000000000ULL;
+			ts.tv_nsec = ns % 1000000000ULL;
+		}
+		if ((ppoll(pfd, 4, next ? &ts : NULL, NULL) < 0) && (errno != EINTR))
+			break;
+
+		for (i=0; i<2; ++i) {
+			d = dirs[i];
+
+			if (pfd[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+				c = dir_read(d);
+				if (c < 0)
+					goto end;
+				if (c > 0)
+					d->in = -1;
+			}
+
+			if (pfd[i+2].revents & (POLLOUT|POLLERR|POLLHUP)) {
+				n = iobuf_datalen(&d->obuf);
+				w = write(d->out, iobuf_dataptr(&d->obuf), n);
+				if (w > 0)
+					iobuf_consume(&d->obuf, (unsigned int) w);
+				else if ((errno != EAGAIN) && (errno != EINTR))
+					goto end;
+			}
+		}
+
+		// the command or the peer is gone and its data are delivered
+		if (((down.in < 0) && !dir_queued(&down))
+				|| ((up.in < 0) && !dir_queued(&up)))
+			break;
+	}
+
+end:
+	ns = bench_clock() - emu.start;
+	kill(pid, SIGINT);
+	close(to_cmd[1]);
+	close(from_cmd[0]);
+	waitpid(pid, &status, 0);
+
+	dir_summary(&down, ns);
+	dir_summary(&up, ns);
+	if (emu.trace)
+		fclose(emu.trace);
+
+	return 0;
+}
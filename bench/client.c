@@ -0,0 +1,288 @@
+/**
+ * @file client.c
+ * rdp2tcp client environment for benchmarks
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "r2tcli.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+/** maximal number of tunnels written by feeder threads */
+#define FEED_MAX 256
+/** maximal number of feeder threads */
+#define FEEDERS_MAX 16
+
+extern int info_level;
+
+/** simulated local applications and rdesktop */
+static struct {
+	int chan_fd;                     /**< read end of the channel pipe */
+	pthread_t drainer;               /**< thread reading the channel */
+	unsigned long long drained;      /**< bytes read from the channel */
+	const int *peers;                /**< peers of the fed tunnels */
+	unsigned int count;              /**< number of fed tunnels */
+	unsigned int chunk;              /**< size written to a peer at once */
+	unsigned int threads;            /**< number of feeder threads */
+	pthread_t feeders[FEEDERS_MAX];  /**< feeder threads */
+	volatile int stop;               /**< 1 if feeders must exit */
+	unsigned long long feed_cpu;     /**< CPU time of stopped feeders */
+} sim = { -1 };
+
+/**
+ * replace rdp2tcp client main.c exit handler
+ */
+void bye(void)
+{
+	exit(0);
+}
+
+/**
+ * setup the client events loop and rdesktop pipes
+ * @return 0 on success
+ * @note fd 0 and fd 1 are replaced by a pipe, results are printed
+ *       on the original stdout
+ */
+int bench_client_init(void)
+{
+	int fd, pfd[2];
+
+	fd = dup(1);
+	if (fd == -1)
+		return -1;
+	bench_out = fdopen(fd, "w");
+	if (!bench_out)
+		return -1;
+
+	if (pipe(pfd))
+		return -1;
+	dup2(pfd[0], RDP_FD_IN);
+	dup2(pfd[1], RDP_FD_OUT);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+
+	print_init();
+	info_level = 0;
+
+	if (events_init())
+		return -1;
+
+	return channel_init();
+}
+
+/**
+ * replace the channel output by a pipe read by the benchmark
+ * @param[in] size pipe size (0 for the system default)
+ * @return read end of the pipe (blocking) or -1 on error
+ * @note the events loop is restarted to watch the new pipe
+ */
+int bench_channel_pipe(unsigned int size)
+{
+	int pfd[2];
+
+	if (pipe(pfd))
+		return -1;
+	dup2(pfd[1], RDP_FD_OUT);
+	close(pfd[1]);
+	fcntl(RDP_FD_OUT, F_SETFL, fcntl(RDP_FD_OUT, F_GETFL)|O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+	if (size)
+		fcntl(RDP_FD_OUT, F_SETPIPE_SZ, size);
+#endif
+	sim.chan_fd = pfd[0];
+
+	events_kill();
+	if (events_init())
+		return -1;
+
+	return pfd[0];
+}
+
+/**
+ * create a connected tunnel whose local peer is a socketpair end
+ * @param[out] peer socket of the simulated local application
+ * @return tunnel socket or NULL on error
+ */
+netsock_t *bench_tunnel(int *peer)
+{
+	int sv[2];
+	netaddr_t addr;
+	netsock_t *ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return NULL;
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL)|O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL)|O_NONBLOCK);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.ip4.sin_family = AF_INET;
+
+	ns = netsock_alloc(NULL, sv[0], &addr, 0);
+	if (!ns)
+		return NULL;
+	ns->type  = NETSOCK_TUNCLI;
+	ns->state = NETSTATE_CONNECTED;
+	iobuf_init2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf, "tun");
+	tunnel_set_id(ns, tunnel_generate_id());
+	netsock_update_watch(ns);
+
+	*peer = sv[1];
+	return ns;
+}
+
+/* simulated local applications, each thread writes a share of the peers */
+static void *feeder(void *arg)
+{
+	struct pollfd pfd[FEED_MAX];
+	unsigned int i, n, first;
+	unsigned long long cpu;
+	char *blob;
+
+	blob = malloc(sim.chunk);
+	if (!blob)
+		return NULL;
+	memset(blob, 'F', sim.chunk);
+	first = (unsigned int)(size_t) arg;
+
+	for (n=0, i=first; i<sim.count; i+=sim.threads, ++n) {
+		pfd[n].fd = sim.peers[i];
+		pfd[n].events = POLLOUT;
+	}
+
+	while (!sim.stop) {
+		if (poll(pfd, n, 100) <= 0)
+			continue;
+		for (i=0; i<n; ++i) {
+			if (pfd[i].revents & POLLOUT) {
+				if (write(pfd[i].fd, blob, sim.chunk) < 0)
+					continue;
+			}
+		}
+	}
+
+	free(blob);
+	cpu = bench_cpu(1);
+	__atomic_add_fetch(&sim.feed_cpu, cpu, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/**
+ * start threads writing data to tunnels peers as fast as possible
+ * @param[in] peers peers sockets
+ * @param[in] count number of peers
+ * @param[in] threads number of feeder threads
+ * @param[in] chunk size of data written at once
+ * @return 0 on success
+ */
+int bench_feed_start(const int *peers, unsigned int count,
+						unsigned int threads, unsigned int chunk)
+{
+	unsigned int i;
+
+	if (!threads || (threads > FEEDERS_MAX) || (count > FEED_MAX * threads))
+		return -1;
+
+	sim.peers   = peers;
+	sim.count   = count;
+	sim.chunk   = chunk;
+	sim.threads = threads;
+	sim.stop    = 0;
+	sim.feed_cpu = 0;
+
+	for (i=0; i<threads; ++i) {
+		if (pthread_create(&sim.feeders[i], NULL, feeder, (void *)(size_t) i))
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * stop the feeder threads
+ * @return CPU time used by the feeders (ns)
+ */
+unsigned long long bench_feed_stop(void)
+{
+	unsigned int i;
+
+	sim.stop = 1;
+	for (i=0; i<sim.threads; ++i)
+		pthread_join(sim.feeders[i], NULL);
+	sim.threads = 0;
+
+	return sim.feed_cpu;
+}
+
+/* simulated rdesktop reading the channel */
+static void *drainer(void *arg)
+{
+	static char buf[256*1024];
+	ssize_t r;
+
+	while ((r = read(sim.chan_fd, buf, sizeof(buf))) > 0)
+		__atomic_add_fetch(&sim.drained, (unsigned long long) r,
+								__ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/**
+ * start a thread reading the channel pipe (see bench_channel_pipe)
+ * @return 0 on success
+ */
+int bench_drain_start(void)
+{
+	if (sim.chan_fd == -1)
+		return -1;
+
+	return pthread_create(&sim.drainer, NULL, drainer, NULL);
+}
+
+/**
+ * get the amount of channel data read by the drainer thread
+ * @return number of bytes
+ */
+unsigned long long bench_drained(void)
+{
+	return __atomic_load_n(&sim.drained, __ATOMIC_RELAXED);
+}
+
+/**
+ * get the CPU time used by the drainer thread
+ * @return CPU time (ns)
+ */
+unsigned long long bench_drain_cpu(void)
+{
+	struct timespec ts;
+	clockid_t id;
+
+	if (pthread_getcpuclockid(sim.drainer, &id) || clock_gettime(id, &ts))
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,451 @@
+/**
+ * @file mock_server.c
+ * POSIX rdp2tcp server speaking the channel protocol for benchmarks
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "print.h"
+#include "iobuf.h"
+#include "msgparser.h"
+#include "lzblock.h"
+#include "bench.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+/** size of rdesktop chunks written to the client */
+#define MOCK_CHUNK     1600
+/** channel data queued above which chargen tunnels are not read */
+#define MOCK_WMAX      (256*1024)
+/** size of data sent by a chargen tunnel at once */
+#define MOCK_READ_SIZE (16*1024)
+/** size of channel reads */
+#define MOCK_RSIZE     (64*1024)
+
+/** mock tunnel */
+typedef struct _mocktun {
+	unsigned short port; /**< service port (0 if closed) */
+	int credit;          /**< data accepted by the client */
+	unsigned char tx;    /**< 1 if the client limits data sent to it */
+} mocktun_t;
+
+/** mock server singleton */
+static struct {
+	int fd;              /**< channel socket */
+	unsigned char caps;  /**< capabilities advertised to the client */
+	unsigned char ccaps; /**< capabilities supported by both peers */
+	volatile int stop;   /**< 1 if the thread must exit */
+	pthread_t th;        /**< server thread */
+	iobuf_t ibuf;        /**< channel input buffer */
+	iobuf_t fbuf;        /**< frames not cut into chunks yet */
+	iobuf_t wbuf;        /**< chunks not written yet */
+	time_t ping_at;      /**< time of next ping */
+	mocktun_t tuns[R2TID_MAX_V2];     /**< tunnels by identifier */
+	unsigned short gens[R2TID_MAX_V2];/**< identifiers of chargen tunnels */
+	unsigned int gens_count;          /**< number of chargen tunnels */
+	unsigned int gens_next;           /**< next chargen tunnel to read */
+	unsigned int opened;              /**< tunnels currently open */
+	mockstats_t stats;   /**< counters (atomic) */
+} mock;
+
+/**
+ * queue a frame to the client
+ * @param[in] cmd command (R2TCMD_xxx)
+ * @param[in] tid tunnel identifier
+ * @param[in] data message payload
+ * @param[in] len size of payload
+ * @note frames are encoded as the server does, according to the
+ *       capabilities shared with the client
+ */
+static void mock_write(
+				unsigned char cmd,
+				unsigned short tid,
+				const void *data,
+				unsigned int len)
+{
+	unsigned char *ptr;
+	unsigned int hlen;
+
+	ptr = iobuf_reserve(&mock.fbuf, len + 7, NULL);
+	if (!ptr) {
+		mock.stop = 1;
+		return;
+	}
+
+	if ((cmd == R2TCMD_DATA) && (mock.ccaps & R2TCAP_COMPACT)
+			&& (tid < R2TID_MAX_COMPACT)) {
+		hlen = compact_header(ptr, tid, len);
+	} else if ((mock.ccaps & R2TCAP_TID16) || (tid >= R2TID_MAX_V1)) {
+		*(unsigned int *)ptr = htonl(len + 3);
+		ptr[4] = cmd | R2TCMD_V2;
+		ptr[5] = (unsigned char)(tid >> 8);
+		ptr[6] = (unsigned char) tid;
+		hlen = 7;
+	} else {
+		*(unsigned int *)ptr = htonl(len + 2);
+		ptr[4] = cmd;
+		ptr[5] = (unsigned char) tid;
+		hlen = 6;
+	}
+
+	memcpy(ptr + hlen, data, len);
+	iobuf_commit(&mock.fbuf, hlen + len);
+}
+
+/* cut the queued frames into rdesktop chunks */
+static void mock_chunk(void)
+{
+	unsigned char *ptr;
+	unsigned int len, n;
+
+	len = iobuf_datalen(&mock.fbuf);
+	while (len > 0) {
+		n = (len > MOCK_CHUNK ? MOCK_CHUNK : len);
+		ptr = iobuf_reserve(&mock.wbuf, n + 4, NULL);
+		if (!ptr) {
+			mock.stop = 1;
+			return;
+		}
+		memcpy(ptr, &n, 4);
+		memcpy(ptr + 4, iobuf_dataptr(&mock.fbuf), n);
+		iobuf_commit(&mock.wbuf, n + 4);
+		iobuf_consume(&mock.fbuf, n);
+		len -= n;
+	}
+}
+
+/* send a ping advertising the server capabilities */
+static void mock_ping(void)
+{
+	mock_write(R2TCMD_PING, 0, &mock.caps, 1);
+	mock.ping_at = time(NULL) + RDP2TCP_PING_DELAY;
+}
+
+/* forget a chargen tunnel */
+static void gens_del(unsigned short tid)
+{
+	unsigned int i;
+
+	for (i=0; i<mock.gens_count; ++i) {
+		if (mock.gens[i] == tid) {
+			mock.gens[i] = mock.gens[--mock.gens_count];
+			return;
+		}
+	}
+}
+
+/* generate data on chargen tunnels while the channel is not full */
+static void mock_generate(void)
+{
+	static char blob[MOCK_READ_SIZE];
+	mocktun_t *tun;
+	unsigned int i, sent, len;
+	unsigned short tid;
+
+	if (!blob[0])
+		memset(blob, 'G', sizeof(blob));
+
+	do {
+		sent = 0;
+		for (i=0; i<mock.gens_count; ++i) {
+			if (iobuf_datalen(&mock.fbuf) + iobuf_datalen(&mock.wbuf) >= MOCK_WMAX)
+				return;
+
+			if (mock.gens_next >= mock.gens_count)
+				mock.gens_next = 0;
+			tid = mock.gens[mock.gens_next++];
+			tun = &mock.tuns[tid];
+
+			len = sizeof(blob);
+			if (tun->tx) {
+				if (tun->credit <= 0)
+					continue;
+				if ((unsigned int)tun->credit < len)
+					len = (unsigned int) tun->credit;
+				tun->credit -= (int) len;
+			}
+			mock_write(R2TCMD_DATA, tid, blob, len);
+			__atomic_add_fetch(&mock.stats.generated, len, __ATOMIC_RELAXED);
+			sent += len;
+		}
+	} while (sent > 0);
+}
+
+static void mock_close(unsigned short tid)
+{
+	mocktun_t *tun;
+
+	tun = &mock.tuns[tid];
+	if (!tun->port)
+		return;
+
+	if (tun->port == MOCK_CHARGEN_PORT)
+		gens_del(tid);
+	tun->port = 0;
+	--mock.opened;
+}
+
+static int cmd_conn(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	const r2tmsg_connreq_t *req;
+	mocktun_t *tun;
+	unsigned char ans[8];
+	unsigned short port;
+
+	req = (const r2tmsg_connreq_t *) msg;
+	if ((len < 5) || (hdr->id >= R2TID_MAX_V2))
+		return error("invalid connection request");
+
+	port = ntohs(req->port);
+	if ((port != MOCK_ECHO_PORT) && (port != MOCK_DISCARD_PORT)
+			&& (port != MOCK_CHARGEN_PORT)) {
+		ans[0] = R2TERR_CONNREFUSED;
+		mock_write(R2TCMD_CONN, hdr->id, ans, 1);
+		return 0;
+	}
+
+	mock_close(hdr->id);
+	tun = &mock.tuns[hdr->id];
+	tun->port   = port;
+	tun->credit = 0;
+	tun->tx     = 0;
+	++mock.opened;
+	if (port == MOCK_CHARGEN_PORT)
+		mock.gens[mock.gens_count++] = hdr->id;
+	__atomic_add_fetch(&mock.stats.conns, 1, __ATOMIC_RELAXED);
+
+	ans[0] = R2TERR_SUCCESS;
+	ans[1] = TUNAF_IPV4;
+	*(unsigned short *)(ans + 2) = htons(port);
+	ans[4] = 127; ans[5] = 0; ans[6] = 0; ans[7] = 1;
+	mock_write(R2TCMD_CONN, hdr->id, ans, sizeof(ans));
+
+	return 0;
+}
+
+static int cmd_close(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	if (hdr->id < R2TID_MAX_V2)
+		mock_close(hdr->id);
+	return 0;
+}
+
+static void tunnel_data(unsigned short tid, const void *data, unsigned int len)
+{
+	if ((tid >= R2TID_MAX_V2) || !mock.tuns[tid].port)
+		return;
+
+	if (mock.tuns[tid].port == MOCK_ECHO_PORT) {
+		mock_write(R2TCMD_DATA, tid, data, len);
+		__atomic_add_fetch(&mock.stats.echoed, len, __ATOMIC_RELAXED);
+	} else if (mock.tuns[tid].port == MOCK_DISCARD_PORT) {
+		__atomic_add_fetch(&mock.stats.discarded, len, __ATOMIC_RELAXED);
+	}
+}
+
+static int cmd_data(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	tunnel_data(hdr->id, ((const char *)msg) + 2, len - 2);
+	return 0;
+}
+
+static int cmd_zdata(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	static char data[RDP2TCP_MAX_MSGLEN];
+	const r2tmsg_zdata_t *zmsg;
+	unsigned int size;
+
+	zmsg = (const r2tmsg_zdata_t *) msg;
+	size = ntohl(zmsg->len);
+	if (!size || (size > sizeof(data))
+			|| (lzblock_decompress(zmsg->data, len-6, data, size) != (int)size))
+		return error("invalid compressed data for tunnel 0x%02x", hdr->id);
+
+	tunnel_data(hdr->id, data, size);
+	return 0;
+}
+
+static int cmd_ping(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	const r2tmsg_ping_t *ping;
+	r2tmsg_ping_t echo;
+
+	if (len > 2)
+		mock.ccaps = mock.caps & ((const unsigned char *)msg)[2];
+	__atomic_store_n(&mock.stats.connected, 1, __ATOMIC_RELEASE);
+
+	ping = (const r2tmsg_ping_t *) msg;
+	if ((len >= sizeof(*ping)) && (ping->flags & R2TPING_PROBE)
+			&& (mock.caps & R2TCAP_PROBE)) {
+		echo.caps  = mock.caps;
+		echo.flags = R2TPING_ECHO;
+		echo.seq   = ping->seq;
+		memcpy(echo.ts, ping->ts, sizeof(echo.ts));
+		mock_write(R2TCMD_PING, 0, &echo.caps, sizeof(echo) - 2);
+	}
+
+	return 0;
+}
+
+static int cmd_bind(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	unsigned char err;
+
+	err = R2TERR_FORBIDDEN;
+	mock_write(R2TCMD_BIND, hdr->id, &err, 1);
+	return 0;
+}
+
+static int cmd_window(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	mocktun_t *tun;
+
+	if ((hdr->id >= R2TID_MAX_V2) || !mock.tuns[hdr->id].port)
+		return 0;
+
+	tun = &mock.tuns[hdr->id];
+	tun->tx = 1;
+	tun->credit += (int) ntohl(((const r2tmsg_window_t *)msg)->inc);
+	return 0;
+}
+
+/**
+ * handlers for each command
+ */
+const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
+	cmd_conn,  // R2TCMD_CONN
+	cmd_close, // R2TCMD_CLOSE
+	cmd_data,  // R2TCMD_DATA
+	cmd_ping,  // R2TCMD_PING
+	cmd_bind,  // R2TCMD_BIND
+	NULL,      // R2TCMD_RCONN
+	cmd_window,// R2TCMD_WINDOW
+	cmd_zdata  // R2TCMD_ZDATA
+};
+
+/* handle the channel until the client exits or the server is stopped */
+static void *mock_thread(void *arg)
+{
+	struct pollfd pfd;
+	void *ptr;
+	unsigned int avail;
+	ssize_t r;
+
+	while (!mock.stop) {
+
+		if (time(NULL) >= mock.ping_at)
+			mock_ping();
+		mock_generate();
+		mock_chunk();
+
+		pfd.fd = mock.fd;
+		pfd.events = POLLIN | (iobuf_datalen(&mock.wbuf) ? POLLOUT : 0);
+		pfd.revents = 0;
+		if ((poll(&pfd, 1, 100) < 0) && (errno != EINTR))
+			break;
+
+		if (pfd.revents & POLLOUT) {
+			r = write(mock.fd, iobuf_dataptr(&mock.wbuf),
+						iobuf_datalen(&mock.wbuf));
+			if (r > 0)
+				iobuf_consume(&mock.wbuf, (unsigned int) r);
+			else if ((r < 0) && (errno != EAGAIN) && (errno != EINTR))
+				break;
+		}
+
+		__atomic_store_n(&mock.stats.opened, mock.opened, __ATOMIC_RELAXED);
+		__atomic_store_n(&mock.stats.queued, iobuf_datalen(&mock.fbuf)
+							+ iobuf_datalen(&mock.wbuf), __ATOMIC_RELAXED);
+
+		if (pfd.revents & (POLLIN|POLLHUP|POLLERR)) {
+			ptr = iobuf_reserve(&mock.ibuf, MOCK_RSIZE, &avail);
+			if (!ptr)
+				break;
+			r = read(mock.fd, ptr, avail);
+			if (!r)
+				break; // client exited
+			if (r < 0) {
+				if ((errno == EAGAIN) || (errno == EINTR))
+					continue;
+				break;
+			}
+			iobuf_commit(&mock.ibuf, (unsigned int) r);
+			if (commands_parse(&mock.ibuf))
+				break;
+		}
+	}
+
+	__atomic_store_n(&mock.stats.connected, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * start the mock server thread
+ * @param[in] fd channel socket (client stdin and stdout)
+ * @param[in] caps capabilities advertised to the client (R2TCAP_xxx)
+ * @return 0 on success
+ * @note tunnels can be connected to the echo, discard and chargen
+ *       services (MOCK_xxx_PORT), the host is ignored
+ */
+int mock_start(int fd, unsigned char caps)
+{
+	memset(&mock, 0, sizeof(mock));
+	mock.fd   = fd;
+	mock.caps = caps;
+	iobuf_init(&mock.ibuf, 'r', "mock");
+	iobuf_init(&mock.fbuf, 'w', "mock");
+	iobuf_init(&mock.wbuf, 'w', "mock");
+
+	if (pthread_create(&mock.th, NULL, mock_thread, NULL))
+		return error("failed to start mock server");
+
+	return 0;
+}
+
+/**
+ * stop the mock server thread
+ */
+void mock_stop(void)
+{
+	mock.stop = 1;
+	pthread_join(mock.th, NULL);
+	iobuf_kill(&mock.ibuf);
+	iobuf_kill(&mock.fbuf);
+	iobuf_kill(&mock.wbuf);
+}
+
+/**
+ * get the mock server counters
+ * @param[out] stats counters
+ */
+void mock_stat(mockstats_t *stats)
+{
+	stats->generated = __atomic_load_n(&mock.stats.generated, __ATOMIC_RELAXED);
+	stats->echoed    = __atomic_load_n(&mock.stats.echoed, __ATOMIC_RELAXED);
+	stats->discarded = __atomic_load_n(&mock.stats.discarded, __ATOMIC_RELAXED);
+	stats->conns     = __atomic_load_n(&mock.stats.conns, __ATOMIC_RELAXED);
+	stats->opened    = __atomic_load_n(&mock.stats.opened, __ATOMIC_RELAXED);
+	stats->queued    = __atomic_load_n(&mock.stats.queued, __ATOMIC_RELAXED);
+	stats->connected = __atomic_load_n(&mock.stats.connected, __ATOMIC_ACQUIRE);
+}
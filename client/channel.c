@@ -20,27 +20,135 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include "r2tcli.h"
 #include "msgparser.h"
+#include "lzblock.h"
 
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#ifdef USE_SPLICE
+#include <sys/stat.h>
+#endif
 
 extern int debug_level;
 
+/** maximum number of buffers written by a single writev */
+#define CHANNEL_IOV_MAX 64
+/** size of channel reads */
+#define CHANNEL_READ_SIZE (64*1024)
+/** data queued for a channel write if the pipe free space is unknown */
+#define CHANNEL_WRITE_SIZE (64*1024)
+/** data sent per scheduling round by a tunnel of weight 1 */
+#define CHANNEL_QUANTUM 4096
+/** minimal data queued by the scheduler for a single write */
+#define CHANNEL_SCHED_MIN 1024
+/** tunnel data smaller than this are never compressed */
+#define CHANNEL_ZIP_MIN 256
+/** maximal number of messages sent uncompressed after a poor ratio */
+#define CHANNEL_ZIP_BACKOFF 64
+
+#ifndef CHANNEL_COALESCE_DELAY
+/** delay (in microseconds) of tunnel data received while the channel pipe
+ *  holds data (0: none) */
+#define CHANNEL_COALESCE_DELAY 200
+#endif
+#ifndef CHANNEL_COALESCE_SIZE
+/** coalesced tunnel data which are sent without delay */
+#define CHANNEL_COALESCE_SIZE 4096
+#endif
+
+#ifndef NO_COMPRESSION
+/** capabilities advertised to the server */
+#define CLIENT_CAPS (R2TCAP_ZDATA|R2TCAP_TID16|R2TCAP_COMPACT|R2TCAP_PROBE)
+#else
+#define CLIENT_CAPS (R2TCAP_TID16|R2TCAP_COMPACT|R2TCAP_PROBE)
+#endif
+
+/**
+ * message queued for the TS virtual channel
+ * @note DATA messages reference the data in the tunnel input buffer,
+ *       other messages are stored in the channel output buffer. ZDATA
+ *       messages are stored in the channel output buffer, the tunnel data
+ *       they replace are consumed once written.
+ */
+typedef struct _chanmsg {
+	iobuf_t *buf;         /**< buffer holding the message data */
+	iobuf_t *src;         /**< tunnel input buffer of ZDATA message */
+	netsock_t *ns;        /**< tunnel of (Z)DATA message (NULL if detached) */
+	unsigned int len;     /**< size of data not yet written */
+	unsigned int raw;     /**< size of tunnel data of ZDATA message */
+	unsigned char hdr[7]; /**< DATA message header (aligned on the end) */
+	unsigned char hoff;   /**< offset of header not yet written */
+	unsigned char owned;  /**< 1 if tunnel buffer must be freed once written */
+} chanmsg_t;
+
 /** TS virtual channel singleton  */
 typedef struct _vchannel {
 	time_t ts;      /**< timestamp of last channel activity */
 	int last_state; /**< virtual channel previous state */
 	iobuf_t ibuf;   /**< input buffer */
 	iobuf_t obuf;   /**< output buffer */
+	chanmsg_t *msgs;        /**< output messages queue */
+	unsigned int msgs_head; /**< index of the first queued message */
+	unsigned int msgs_count;/**< number of queued messages */
+	unsigned int msgs_max;  /**< size of the messages queue */
+	unsigned int chunk_left;      /**< data left in current rdesktop chunk */
+	unsigned char chunk_hdr[4];   /**< size header of next rdesktop chunk */
+	unsigned char chunk_hdr_len;  /**< received size of chunk header */
+	unsigned char caps;           /**< capabilities of the server */
+	unsigned char wv2;            /**< 1 if the reserved message is a v2 frame */
+	unsigned char wcmd;           /**< command of the reserved message */
+	unsigned int pipe_size;       /**< rdesktop output pipe size (or 0) */
+	netsock_t *sched_head;        /**< first tunnel waiting for the channel */
+	netsock_t *sched_tail;        /**< last tunnel waiting for the channel */
+	unsigned long long flush_at;  /**< deadline of coalesced data (or 0) */
+	chanstats_t stats;            /**< counters */
+	chanrtt_t rtt;                /**< measurements */
+	unsigned int probe_seq;       /**< sequence number of the last probe */
+	unsigned long long probe_at;  /**< time of the next probe */
+	unsigned long long probe_sent;/**< time of the unanswered probe (or 0) */
+	unsigned long long probe_mark;/**< channel data sent before the probe */
+	unsigned long long echo_at;   /**< time of the previous echo (or 0) */
+	unsigned long long echo_mark; /**< channel data delivered at the echo */
+#ifdef USE_SPLICE
+	int spipe[2];   /**< splice pipe (if rdesktop input is not a pipe) */
+	netsock_t *fwd; /**< tunnel receiving the forwarded DATA payload */
+	unsigned int fwd_left; /**< size of DATA payload left to forward */
+#endif
 } vchannel_t;
 
 static vchannel_t vc;
 
+#define chanmsg_at(i) (&vc.msgs[(vc.msgs_head + (i)) % vc.msgs_max])
+
+/**
+ * free the detached tunnel buffer owned by a message
+ * @param[in] msg written message
+ */
+static void free_tunnel_buf(chanmsg_t *msg)
+{
+	iobuf_t *buf;
+
+	buf = (msg->src ? msg->src : msg->buf);
+	iobuf_kill(buf);
+	free(buf);
+}
+
+#ifdef USE_SPLICE
+/** minimal size of DATA payload forwarded with splice */
+#define SPLICE_MIN_SIZE 4096
+#endif
+
 /**
  * initialize TS virtual channel
  */
@@ -51,17 +159,90 @@ int channel_init(void)
 	vc.ts = 0;
 	vc.last_state = -1;
 	iobuf_init2(&vc.ibuf, &vc.obuf, "chan");
+	vc.msgs = NULL;
+	vc.msgs_head = 0;
+	vc.msgs_count = 0;
+	vc.msgs_max = 0;
+	vc.chunk_left = 0;
+	vc.chunk_hdr_len = 0;
+	vc.caps = 0;
+	vc.sched_head = vc.sched_tail = NULL;
+	vc.flush_at = 0;
+	memset(&vc.stats, 0, sizeof(vc.stats));
+	memset(&vc.rtt, 0, sizeof(vc.rtt));
+	vc.probe_seq = 0;
+	vc.probe_at = vc.probe_sent = vc.echo_at = 0;
+
+	vc.pipe_size = 0;
+#ifdef F_GETPIPE_SZ
+	{
+		int size;
+
+		// output pipe size bounds the data queued per write
+		size = fcntl(RDP_FD_OUT, F_GETPIPE_SZ);
+		if (size > 0)
+			vc.pipe_size = (unsigned int) size;
+	}
+#endif
+
+	if (fcntl(RDP_FD_IN, F_SETFL, fcntl(RDP_FD_IN, F_GETFL)|O_NONBLOCK))
+		return error("failed to setup rdesktop pipe (%s)", strerror(errno));
+
+#ifdef USE_SPLICE
+	vc.fwd = NULL;
+	vc.fwd_left = 0;
+	{
+		struct stat st;
+
+		// splice needs a pipe on one side
+		vc.spipe[0] = vc.spipe[1] = -1;
+		if (!fstat(RDP_FD_IN, &st) && !S_ISFIFO(st.st_mode)) {
+			if (pipe2(vc.spipe, O_CLOEXEC))
+				warn("failed to create splice pipe (%s)", strerror(errno));
+		}
+	}
+#endif
 
 	return 0;
 }
 
+/**
+ * release the storage of the empty TS virtual channel I/O buffers
+ */
+void channel_trim(void)
+{
+	iobuf_trim(&vc.ibuf);
+	iobuf_trim(&vc.obuf);
+}
+
 /**
  * destroy TS virtual channel I/O buffers
  */
 void channel_kill(void)
 {
+	chanmsg_t *msg;
+
 	trace_chan("");
 
+	while (vc.msgs_count > 0) {
+		msg = chanmsg_at(0);
+		if (msg->owned)
+			free_tunnel_buf(msg);
+		vc.msgs_head = (vc.msgs_head + 1) % vc.msgs_max;
+		--vc.msgs_count;
+	}
+	free(vc.msgs);
+	vc.msgs = NULL;
+	vc.msgs_max = 0;
+
+#ifdef USE_SPLICE
+	if (vc.spipe[0] != -1) {
+		close(vc.spipe[0]);
+		close(vc.spipe[1]);
+		vc.spipe[0] = vc.spipe[1] = -1;
+	}
+#endif
+
 	iobuf_kill2(&vc.ibuf, &vc.obuf);
 }
 
@@ -87,168 +268,1074 @@ int channel_is_connected(void)
 	return connected;
 }
 
+/**
+ * remove rdesktop chunks size headers from data read on the channel
+ * @param[in,out] data data read from rdesktop
+ * @param[in] len size of data
+ * @return size of channel data left in buffer
+ */
+static unsigned int strip_chunk_headers(char *data, unsigned int len)
+{
+	unsigned int in, out, n;
+
+	in = out = 0;
+	while (in < len) {
+
+		if (!vc.chunk_left) {
+			// size header may be splitted between reads
+			vc.chunk_hdr[vc.chunk_hdr_len++] = data[in++];
+			if (vc.chunk_hdr_len == sizeof(vc.chunk_hdr)) {
+				memcpy(&vc.chunk_left, vc.chunk_hdr, sizeof(vc.chunk_left));
+				vc.chunk_hdr_len = 0;
+			}
+			continue;
+		}
+
+		n = len - in;
+		if (n > vc.chunk_left)
+			n = vc.chunk_left;
+		if (in != out)
+			memmove(data + out, data + in, n);
+		in  += n;
+		out += n;
+		vc.chunk_left -= n;
+	}
+
+	return out;
+}
+
+#ifdef USE_SPLICE
+/**
+ * read exactly len bytes
+ * @param[in] fd file descriptor
+ * @param[out] buf destination buffer
+ * @param[in] len number of bytes to read
+ * @return 0 on success
+ */
+static int read_all(int fd, void *buf, unsigned int len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = read(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return error("failed to read from channel pipe (%s)",
+								strerror(errno));
+		}
+		if (!r)
+			return error("channel closed");
+		buf = ((char *)buf) + r;
+		len -= (unsigned int) r;
+	}
+
+	return 0;
+}
+
+/**
+ * move available DATA payload from the rdesktop pipe to a tunnel socket
+ * @param[in] ns connected tunnel socket with an empty output buffer
+ * @param[in] len size of payload available in the rdesktop pipe
+ * @return number of bytes moved or -1 on error
+ * @note the payload not accepted by the socket is stored in the tunnel
+ *       output buffer
+ */
+static int splice_payload(netsock_t *ns, unsigned int len)
+{
+	ssize_t r;
+	int in_fd;
+	unsigned int left;
+	char *ptr;
+
+	in_fd = RDP_FD_IN;
+
+	if (vc.spipe[0] != -1) {
+		// rdesktop input is not a pipe, use the intermediate one
+		r = splice(RDP_FD_IN, NULL, vc.spipe[1], NULL, len,
+						SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (r <= 0) {
+			if ((r < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+				return 0;
+			return error("failed to splice channel data (%s)",
+								r ? strerror(errno) : "closed");
+		}
+		len = (unsigned int) r;
+		in_fd = vc.spipe[0];
+	}
+
+	left = len;
+	while (left > 0) {
+		r = splice(in_fd, NULL, ns->fd, NULL, left,
+						SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			// socket is full or broken, the write-event will handle it
+			break;
+		}
+		print_xfer("tcp", 'w', (unsigned int) r);
+		ns->tx += (unsigned long long) r;
+		channel_ack_data(ns, (unsigned int) r);
+		left -= (unsigned int) r;
+	}
+
+	if (left > 0) {
+		if ((in_fd == RDP_FD_IN) && (left == len))
+			return 0; // nothing moved, let the caller read the payload
+		ptr = iobuf_reserve(&ns->u.tuncli.obuf, left, NULL);
+		if (!ptr)
+			return error("failed to allocate tunnel memory");
+		if (read_all(in_fd, ptr, left))
+			return -1;
+		iobuf_commit(&ns->u.tuncli.obuf, left);
+		netsock_update_watch(ns);
+	}
+
+	return (int) len;
+}
+
+/**
+ * forward the current DATA payload to its tunnel
+ * @return 0 on success
+ * @note only the data available in the rdesktop pipe are forwarded, the
+ *       payload of a closed tunnel is discarded
+ */
+static int forward_data(void)
+{
+	netsock_t *ns;
+	ssize_t r;
+	int avail;
+	unsigned int len;
+	char *ptr;
+
+	while (vc.fwd_left > 0) {
+
+		if (ioctl(RDP_FD_IN, FIONREAD, &avail))
+			return error("failed to query rdesktop pipe (%s)", strerror(errno));
+		if (avail <= 0)
+			return 0;
+
+		len = vc.fwd_left;
+		if ((unsigned int)avail < len)
+			len = (unsigned int) avail;
+
+		ns = vc.fwd;
+		r = 0;
+		if (ns && (ns->state == NETSTATE_CONNECTED)
+				&& !iobuf_datalen(&ns->u.tuncli.obuf)) {
+			r = splice_payload(ns, len);
+			if (r < 0)
+				return -1;
+		}
+
+		if (!r) {
+			// append to tunnel output buffer or discard
+			ptr = iobuf_reserve(ns ? &ns->u.tuncli.obuf : &vc.ibuf, len, NULL);
+			if (!ptr)
+				return error("failed to allocate tunnel memory");
+			r = read(RDP_FD_IN, ptr, len);
+			if (r <= 0) {
+				if ((r < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+					return 0;
+				return error("failed to read from channel pipe (%s)",
+									r ? strerror(errno) : "closed");
+			}
+			if (ns && (ns->state != NETSTATE_CANCELLED)) {
+				iobuf_commit(&ns->u.tuncli.obuf, (unsigned int) r);
+				netsock_update_watch(ns);
+			}
+		}
+
+		print_xfer("chan", 'r', (unsigned int) r);
+		++vc.stats.reads;
+		vc.stats.rbytes += (unsigned long long) r;
+		vc.fwd_left   -= (unsigned int) r;
+		vc.chunk_left -= (unsigned int) r;
+	}
+
+	vc.fwd = NULL;
+	return 0;
+}
+
+/**
+ * forward the DATA message partially received with splice
+ * @return 0 on success
+ * @note only large DATA messages which end in the current rdesktop chunk
+ *       and target a connected tunnel with an empty output buffer are
+ *       forwarded
+ */
+static int splice_data(void)
+{
+	unsigned char *msg;
+	unsigned int len, avail, hlen;
+	unsigned short tid;
+	netsock_t *ns;
+	int n;
+
+	avail = iobuf_datalen(&vc.ibuf);
+	if (avail < 7)
+		return 0;
+
+	msg = iobuf_dataptr(&vc.ibuf);
+	if (msg[0] & R2TFRAME_COMPACT) {
+		// compact frame: payload size follows the first byte
+		n = varint_get(msg+1, avail-1, &len);
+		if (n <= 0)
+			return 0;
+		hlen = 1 + (unsigned int) n;
+		tid = msg[0] & ~R2TFRAME_COMPACT;
+	} else {
+		if (msg[4] == (R2TCMD_DATA|R2TCMD_V2)) {
+			hlen = 7;
+			tid = (msg[5] << 8) | msg[6];
+		} else if (msg[4] == R2TCMD_DATA) {
+			hlen = 6;
+			tid = (msg[5] != R2TID_MAX_V1 ? msg[5] : R2TID_NONE);
+		} else {
+			return 0;
+		}
+
+		// size header covers the command, the ID and the payload
+		len = ntohl(*(unsigned int *)msg);
+		if (len < hlen - 4)
+			return 0;
+		len -= hlen - 4;
+	}
+
+	if ((len < SPLICE_MIN_SIZE) || (avail - hlen >= len)
+			|| (len - (avail - hlen) > vc.chunk_left))
+		return 0;
+
+	ns = tunnel_lookup(tid);
+	if (!ns || (ns->state != NETSTATE_CONNECTED)
+			|| ((ns->type != NETSOCK_TUNCLI) && (ns->type != NETSOCK_RTUNCLI)
+				&& (ns->type != NETSOCK_S5CLI))
+			|| (iobuf_datalen(&ns->u.tuncli.obuf) > 0))
+		return 0;
+
+	trace_chan("id=0x%02x, len=%u", tid, len);
+
+	if ((avail > hlen) && (tunnel_write(ns, msg + hlen, avail - hlen) < 0)) {
+		tunnel_close(ns, 1);
+		ns = NULL;
+	}
+
+	vc.fwd = ns;
+	vc.fwd_left = len - (avail - hlen);
+	iobuf_consume(&vc.ibuf, avail);
+
+	return forward_data();
+}
+#endif
+
 /**
  * handle virtual channel read-event
  * @return 0 on success
+ * @note all the complete messages available are processed, the remaining
+ *       data are kept for the next event
  */
 int channel_read_event(void)
 {
 	ssize_t r;
 	char *ptr;
-	unsigned int msglen, avail;
-	
+	unsigned int len, avail;
+
 	//trace_chan("");
 
-	ptr = (char *)&msglen;
-	avail = 4;
-	do {
-		r = read(RDP_FD_IN, ptr, avail);
-		if (r <= 0)
-			goto chan_read_err;
-		ptr += r;
-		avail -= r;
-	} while (avail > 0);
-
-	ptr = iobuf_reserve(&vc.ibuf, msglen, &avail);
+#ifdef USE_SPLICE
+	if (vc.fwd_left > 0) {
+		if (forward_data())
+			return -1;
+		if (vc.fwd_left > 0)
+			return 0;
+	}
+#endif
+
+	ptr = iobuf_reserve(&vc.ibuf, CHANNEL_READ_SIZE, &avail);
 	if (!ptr)
 		return error("failed to reserve channel memory");
 
-  avail = msglen;
-	do {
-		r = read(RDP_FD_IN, ptr, avail);
-		//trace_chan("r=%u/%u", r, avail);
-		if (r < 0)
-			goto chan_read_err;
+	r = read(RDP_FD_IN, ptr, avail);
+	if (r <= 0) {
+		if (r < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				return 0;
+			error("failed to read from channel pipe (%s)", strerror(errno));
+		} else {
+			error("channel closed");
+		}
+		return -1;
+	}
 
 #ifdef DEBUG
-		if (debug_level > 2) {
-			fputs("[in] ", stderr);
-			fprint_hex(ptr, r, stderr);
-			fputc('\n', stderr);
-		}
+	if (debug_level > 2) {
+		fputs("[in] ", stderr);
+		fprint_hex(ptr, r, stderr);
+		fputc('\n', stderr);
+	}
 #endif
-		
-		print_xfer("chan", 'r', (unsigned int)r);
-
-		ptr += r;
-		avail -= r;
-	} while (avail > 0);
-
-	iobuf_commit(&vc.ibuf, msglen);
-	commands_parse(&vc.ibuf);
+	print_xfer("chan", 'r', (unsigned int)r);
+	++vc.stats.reads;
+	vc.stats.rbytes += (unsigned long long) r;
+
+	len = strip_chunk_headers(ptr, (unsigned int) r);
+	if (len > 0) {
+		iobuf_commit(&vc.ibuf, len);
+		// a failed handler only drops its message, the following ones
+		// are parsed. An invalid frame leaves the channel out of sync.
+		do {
+			avail = iobuf_datalen(&vc.ibuf);
+			if (!commands_parse(&vc.ibuf))
+				break;
+			if (iobuf_datalen(&vc.ibuf) == avail)
+				return error("invalid channel stream");
+		} while (iobuf_datalen(&vc.ibuf) > 0);
+	}
 	time(&vc.ts);
 
+#ifdef USE_SPLICE
+	return splice_data();
+#else
 	return 0;
+#endif
+}
 
-chan_read_err:
-	if (r < 0)
-		error("failed to read from channel pipe (%s)", strerror(errno));
-	else if (r == 0)
-		error("channel closed");
-	return -1;	
+/**
+ * monotonic clock
+ * @return current time in microseconds
+ */
+static unsigned long long now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * check whether tunnels data waiting on an idle channel must be written
+ * @return 0 if the coalescing delay is running
+ */
+static int flush_due(void)
+{
+	netsock_t *ns;
+	unsigned int pending;
+
+	if (!vc.flush_at || (now_usec() >= vc.flush_at))
+		return 1;
+
+	pending = 0;
+	for (ns=vc.sched_head; ns; ns=ns->u.tuncli.sched.next) {
+		pending += iobuf_datalen(&ns->u.tuncli.ibuf) - ns->u.tuncli.sched.queued;
+		if (pending >= CHANNEL_COALESCE_SIZE)
+			return 1;
+	}
+
+	return 0;
 }
 
 /**
  * check whether data must be written to the TS virtual channel
- * @return 0 if virtual channel output buffer is empty
+ * @return 0 if virtual channel output queue is empty or if tunnels data
+ *         are coalesced
  */
 int channel_want_write(void)
 {
-	//trace_chan(iobuf_datalen(&vc.obuf) > 0 ? "yes" : "no");
-	return iobuf_datalen(&vc.obuf) > 0;
+	//trace_chan(vc.msgs_count > 0 ? "yes" : "no");
+	return (vc.msgs_count > 0) || (vc.sched_head && flush_due());
 }
 
 /**
- * handle virtual channel write-event
- * @return 0 on success
+ * compute the time left before coalesced tunnels data are written
+ * @return delay in microseconds or -1 if no data are coalesced
  */
-void channel_write_event(void)
+long channel_write_delay(void)
 {
-	int ret, fd;
-	unsigned int w;
+	unsigned long long now;
 
-	trace_chan("");
-#ifdef DEBUG
-	if (debug_level > 2) iobuf_dump(&vc.obuf);
-#endif
+	if (vc.msgs_count || !vc.sched_head || !vc.flush_at)
+		return -1;
 
-	fd = RDP_FD_OUT;
-	ret = net_write(&fd, &vc.obuf, NULL, 0, &w);
-	if (ret >= 0) {
-		if (w > 0)
-			print_xfer("chan", 'w', (unsigned int) w);
-
-	} else { 
-		if (ret == NETERR_CLOSED) 
-			error("rdesktop pipe closed");
-		else
-			error("failed to write to rdesktop pipe (%s)", strerror(errno));
-		bye();
+	now = now_usec();
+	return (now < vc.flush_at ? (long)(vc.flush_at - now) : 0);
+}
+
+/**
+ * compute the size of the queued messages
+ * @return size of data not written yet
+ */
+static unsigned int queued_size(void)
+{
+	chanmsg_t *msg;
+	unsigned int i, size;
+
+	size = 0;
+	for (i=0; i<vc.msgs_count; ++i) {
+		msg = chanmsg_at(i);
+		size += msg->len + sizeof(msg->hdr) - msg->hoff;
+	}
+
+	return size;
+}
+
+/**
+ * get the virtual channel counters
+ * @note the buffers and queue depths are sampled by this call
+ */
+const chanstats_t *channel_stats(void)
+{
+	netsock_t *ns;
+
+	vc.stats.ibuf = iobuf_datalen(&vc.ibuf);
+	vc.stats.obuf = iobuf_datalen(&vc.obuf);
+	vc.stats.queued = vc.msgs_count;
+	vc.stats.pending = queued_size();
+
+	vc.stats.waiting = 0;
+	for (ns=vc.sched_head; ns; ns=ns->u.tuncli.sched.next)
+		++vc.stats.waiting;
+
+	return &vc.stats;
+}
+
+/**
+ * get the virtual channel measurements
+ */
+const chanrtt_t *channel_rtt(void)
+{
+	return &vc.rtt;
+}
+
+/**
+ * append a message to the virtual channel output queue
+ * @param[in] buf buffer holding the message data
+ * @param[in] len message data size
+ * @return NULL on memory allocation error
+ */
+static chanmsg_t *queue_msg(iobuf_t *buf, unsigned int len)
+{
+	chanmsg_t *msg, *msgs;
+	unsigned int i, max;
+
+	if (vc.msgs_count > 0) {
+		// merge with previous message if both are in the output buffer
+		msg = chanmsg_at(vc.msgs_count - 1);
+		if ((buf == &vc.obuf) && (msg->buf == buf) && !msg->src) {
+			msg->len += len;
+			return msg;
+		}
+	}
+
+	if (vc.msgs_count == vc.msgs_max) {
+		max = (vc.msgs_max ? vc.msgs_max * 2 : 64);
+		msgs = malloc(max * sizeof(chanmsg_t));
+		if (!msgs) {
+			error("failed to allocate channel memory");
+			return NULL;
+		}
+		for (i=0; i<vc.msgs_count; ++i)
+			msgs[i] = *chanmsg_at(i);
+		free(vc.msgs);
+		vc.msgs = msgs;
+		vc.msgs_head = 0;
+		vc.msgs_max = max;
 	}
+
+	msg = chanmsg_at(vc.msgs_count);
+	++vc.msgs_count;
+
+	msg->buf   = buf;
+	msg->src   = NULL;
+	msg->ns    = NULL;
+	msg->len   = len;
+	msg->raw   = 0;
+	msg->hoff  = sizeof(msg->hdr);
+	msg->owned = 0;
+
+	return msg;
 }
 
 /**
- * reserve memory into virtual channel ouput buffer
- * @param[in] size requested minimal buffer size
+ * check whether a tunnel message must be sent as a v2 frame
+ * @param[in] tid tunnel ID
+ * @note identifiers which do not fit in 8 bits are always sent in v2
+ *       frames, the server only allocates them if it supports them
+ */
+static inline int tid_is_v2(unsigned short tid)
+{
+	return ((vc.caps & R2TCAP_TID16) || (tid >= R2TID_MAX_V1));
+}
+
+/**
+ * write a message header
+ * @param[out] hdr header buffer (7 bytes for v2 or 6 bytes for v1)
+ * @param[in] cmd command (R2TCMD_xxx)
+ * @param[in] tid tunnel ID
+ * @param[in] size size of message in v1 format (command, ID and payload)
+ * @return size of written header
+ */
+static unsigned int write_header(
+						unsigned char *hdr,
+						unsigned char cmd,
+						unsigned short tid,
+						unsigned int size)
+{
+	if (tid_is_v2(tid)) {
+		*(unsigned int *)hdr = htonl(size + 1);
+		hdr[4] = cmd | R2TCMD_V2;
+		hdr[5] = (unsigned char)(tid >> 8);
+		hdr[6] = (unsigned char) tid;
+		return 7;
+	}
+
+	*(unsigned int *)hdr = htonl(size);
+	hdr[4] = cmd;
+	hdr[5] = (unsigned char) tid;
+	return 6;
+}
+
+/**
+ * reserve memory for a message into virtual channel ouput buffer
+ * @param[in] cmd command (R2TCMD_xxx)
+ * @param[in] tid tunnel ID
+ * @param[in] size requested minimal message size in v1 format
  * @param[out] out_avail allocated size
  * @return NULL on memory allocation error
+ * @note the returned message has the v1 layout, its command and ID are
+ *       already written and must not be modified
  */
-static void *write_reserve(unsigned int size, unsigned int *out_avail)
+static void *write_reserve(
+					unsigned char cmd,
+					unsigned short tid,
+					unsigned int size,
+					unsigned int *out_avail)
 {
 	char *ptr;
 	unsigned int avail;
 
-	assert(size || out_avail);
+	assert(size >= 2);
 	//trace_chan("");
 
+	vc.wv2 = (unsigned char) tid_is_v2(tid);
+	vc.wcmd = cmd;
+
 	// need extra space for size header
-	ptr = iobuf_reserve(&vc.obuf, size+4, &avail);
+	ptr = iobuf_reserve(&vc.obuf, size+4+vc.wv2, &avail);
 	if (!ptr) {
 		error("failed to allocate channel memory");
 		return NULL;
 	}
 
 	if (out_avail)
-		*out_avail = avail - 4;
+		*out_avail = avail - 4 - vc.wv2;
 
-	return ptr + 4;
+	write_header((unsigned char *)ptr, cmd, tid, 0);
+	return ptr + 4 + vc.wv2;
 }
 
 /**
  * commit memory into virtual channel output buffer
- * @param[in] size commited buffer size
+ * @param[in] size commited message size in v1 format
+ * @return the queued message
  */
-static void write_commit(unsigned int size)
+static chanmsg_t *write_commit(unsigned int size)
 {
+	chanmsg_t *msg;
+
 	assert(size);
 	//trace_chan("size=%u", size);
 
+	size += vc.wv2;
 	*(unsigned int *)(iobuf_allocptr(&vc.obuf)) = htonl(size);
 	iobuf_commit(&vc.obuf, size+4);
+	msg = queue_msg(&vc.obuf, size+4);
+	if (!msg)
+		bye();
+	++vc.stats.frames;
+	++vc.stats.frames_out[vc.wcmd];
+
+	return msg;
+}
+
+/**
+ * queue tunnel data in the virtual channel output queue
+ * @param[in] ns tunnel socket
+ * @param[in] len size of input data not queued yet to send
+ * @return 0 on success
+ */
+static int queue_data(netsock_t *ns, unsigned int len)
+{
+	chanmsg_t *msg;
+	unsigned char hdr[R2TFRAME_COMPACT_HDRLEN];
+	unsigned int hlen;
+
+	msg = queue_msg(&ns->u.tuncli.ibuf, len);
+	if (!msg)
+		return -1;
+
+	if ((vc.caps & R2TCAP_COMPACT) && (ns->tid < R2TID_MAX_COMPACT)) {
+		hlen = compact_header(hdr, ns->tid, len);
+		msg->hoff = sizeof(msg->hdr) - hlen;
+		memcpy(msg->hdr + msg->hoff, hdr, hlen);
+	} else {
+		msg->hoff = sizeof(msg->hdr) - (tid_is_v2(ns->tid) ? 7 : 6);
+		write_header(msg->hdr + msg->hoff, R2TCMD_DATA, ns->tid, len + 2);
+	}
+	msg->ns   = ns;
+	ns->u.tuncli.sched.queued += len;
+	++vc.stats.frames;
+	++vc.stats.frames_out[R2TCMD_DATA];
+
+	return 0;
+}
+
+/**
+ * queue compressed tunnel data in the virtual channel output queue
+ * @param[in] ns tunnel socket
+ * @param[in] len size of input data not queued yet to compress
+ * @return 0 on success, 1 if data do not compress well or -1 on error
+ * @note after a poor ratio the next messages of the tunnel are sent
+ *       uncompressed, the number of skipped messages doubles as long as
+ *       the tunnel data (TLS, archives...) do not compress
+ */
+static int queue_zdata(netsock_t *ns, unsigned int len)
+{
+	tunsched_t *sched;
+	r2tmsg_zdata_t *zmsg;
+	chanmsg_t *msg;
+	unsigned int max, zlen;
+
+	sched = &ns->u.tuncli.sched;
+	if (sched->zskip > 0) {
+		--sched->zskip;
+		return 1;
+	}
+
+	// compression must save at least 1/8 of the data
+	max = len - len/8;
+	zmsg = write_reserve(R2TCMD_ZDATA, ns->tid, 6 + max, NULL);
+	if (!zmsg)
+		return -1;
+
+	zlen = lzblock_compress((char *)iobuf_dataptr(&ns->u.tuncli.ibuf)
+								+ sched->queued, len, zmsg->data, max);
+	if (!zlen) {
+		sched->zbackoff = (sched->zbackoff ? sched->zbackoff * 2 : 1);
+		if (sched->zbackoff > CHANNEL_ZIP_BACKOFF)
+			sched->zbackoff = CHANNEL_ZIP_BACKOFF;
+		sched->zskip = sched->zbackoff;
+		return 1;
+	}
+	sched->zbackoff = 0;
+
+	zmsg->len = htonl(len);
+
+	msg = write_commit(6 + zlen);
+	msg->src = &ns->u.tuncli.ibuf;
+	msg->raw = len;
+	msg->ns  = ns;
+	sched->queued += len;
+
+	return 0;
+}
+
+/**
+ * get the size of data written to the channel pipe and not read yet
+ * @return size of data or -1 if unknown
+ */
+static int pipe_used(void)
+{
+	int used;
+
+	if (ioctl(RDP_FD_OUT, FIONREAD, &used) || (used < 0))
+		return -1;
+
+	return used;
+}
+
+/**
+ * append a tunnel with input data to the scheduler list
+ * @param[in] ns tunnel socket
+ * @note like Nagle, data are only delayed while previous data are in
+ *       flight: data received while the channel pipe still holds data are
+ *       delayed for up to CHANNEL_COALESCE_DELAY so that small messages of
+ *       several tunnels share a single write, unless the tunnel is in
+ *       nodelay mode. Data received on an idle channel are sent at once.
+ */
+static void sched_add(netsock_t *ns)
+{
+	tunsched_t *sched;
+
+	if (ns->nodelay || !CHANNEL_COALESCE_DELAY)
+		vc.flush_at = 0;
+	else if (!vc.sched_head && !vc.msgs_count)
+		vc.flush_at = (pipe_used() > 0 ? now_usec() + CHANNEL_COALESCE_DELAY
+						: 0);
+
+	sched = &ns->u.tuncli.sched;
+	if (sched->active)
+		return;
+
+	sched->active = 1;
+	sched->next = NULL;
+	if (vc.sched_tail)
+		vc.sched_tail->u.tuncli.sched.next = ns;
+	else
+		vc.sched_head = ns;
+	vc.sched_tail = ns;
+}
+
+/**
+ * remove a tunnel from the scheduler list
+ * @param[in] ns tunnel socket
+ */
+static void sched_del(netsock_t *ns)
+{
+	netsock_t **pos, *prev;
+	tunsched_t *sched;
+
+	sched = &ns->u.tuncli.sched;
+	if (!sched->active)
+		return;
+
+	prev = NULL;
+	for (pos=&vc.sched_head; *pos!=ns; pos=&(*pos)->u.tuncli.sched.next)
+		prev = *pos;
+
+	*pos = sched->next;
+	if (vc.sched_tail == ns)
+		vc.sched_tail = prev;
+	sched->active  = 0;
+	sched->deficit = 0;
+}
+
+/**
+ * queue tunnels input data with deficit round robin
+ * @param[in] budget maximal size of data to queue
+ * @return 0 on success
+ * @note each tunnel sends up to CHANNEL_QUANTUM*weight bytes per round
+ *       so that bulk transfers do not delay interactive tunnels, the
+ *       budget is accounted before compression
+ */
+static int sched_run(unsigned int budget)
+{
+	netsock_t *ns;
+	tunsched_t *sched;
+	unsigned int pending, len;
+	int ret;
+
+	while (vc.sched_head && (budget > 0)) {
+
+		ns = vc.sched_head;
+		sched = &ns->u.tuncli.sched;
+
+		if (!sched->deficit) // new round
+			sched->deficit = CHANNEL_QUANTUM * ns->weight;
+
+		pending = iobuf_datalen(&ns->u.tuncli.ibuf) - sched->queued;
+		len = pending;
+		// a lone tunnel is not split into quantums
+		if ((len > sched->deficit) && (vc.sched_head != vc.sched_tail))
+			len = sched->deficit;
+		if (len > budget)
+			len = budget;
+		if (len > RDP2TCP_MAX_MSGLEN - 2)
+			len = RDP2TCP_MAX_MSGLEN - 2;
+
+		if (len > 0) {
+			ret = 1;
+			if ((vc.caps & R2TCAP_ZDATA) && (len >= CHANNEL_ZIP_MIN))
+				ret = queue_zdata(ns, len);
+			if ((ret < 0) || ((ret > 0) && queue_data(ns, len)))
+				return -1;
+		}
+		sched->deficit -= (len < sched->deficit ? len : sched->deficit);
+		budget -= len;
+
+		if (len == pending) {
+			// no more data, the tunnel leaves the list
+			sched_del(ns);
+		} else if (!sched->deficit) {
+			// end of round, move tunnel to the end of the list
+			sched_del(ns);
+			sched_add(ns);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * compute the amount of tunnel data to queue for the next write
+ * @param[in] queued size of messages already queued
+ * @return the scheduling budget
+ */
+static unsigned int sched_budget(unsigned int queued)
+{
+	unsigned int size;
+	int used;
+
+	size = CHANNEL_WRITE_SIZE;
+	if (vc.pipe_size && ((used = pipe_used()) >= 0)
+			&& ((unsigned int)used <= vc.pipe_size))
+		size = vc.pipe_size - (unsigned int) used;
+
+	size = (size > queued ? size - queued : 0);
+
+	// avoid tiny messages unless the queue is empty
+	if (size < CHANNEL_SCHED_MIN)
+		size = (queued ? 0 : CHANNEL_SCHED_MIN);
+
+	return size;
+}
+
+/**
+ * describe the messages to write to the TS virtual channel
+ * @param[out] iov buffers of the queued messages
+ * @param[in] max maximal number of buffers
+ * @return number of buffers (0 if nothing can be written)
+ * @note tunnels data are queued by the scheduler according to the pipe
+ *       free space, buffers stay valid until channel_write_done
+ */
+unsigned int channel_write_iov(struct iovec *iov, unsigned int max)
+{
+	chanmsg_t *msg, *prev;
+	unsigned int i, j, n, off;
+
+	assert(iov && (max >= 2));
+	trace_chan("max=%u", max);
+#ifdef DEBUG
+	if (debug_level > 2) iobuf_dump(&vc.obuf);
+#endif
+
+	if (vc.sched_head && sched_run(sched_budget(queued_size())))
+		bye();
+
+	n = 0;
+	for (i=0; (i<vc.msgs_count) && (n+2 <= max); ++i) {
+		msg = chanmsg_at(i);
+
+		if (msg->hoff < sizeof(msg->hdr)) {
+			iov[n].iov_base = msg->hdr + msg->hoff;
+			iov[n].iov_len  = sizeof(msg->hdr) - msg->hoff;
+			++n;
+		}
+
+		if (msg->len > 0) {
+			// skip the data of previous messages from the same buffer
+			off = 0;
+			for (j=0; j<i; ++j) {
+				prev = chanmsg_at(j);
+				if (prev->buf == msg->buf)
+					off += prev->len;
+				else if (prev->src == msg->buf)
+					off += prev->raw;
+			}
+			iov[n].iov_base = (char *)iobuf_dataptr(msg->buf) + off;
+			iov[n].iov_len  = msg->len;
+			++n;
+		}
+	}
+
+	if (n)
+		vc.flush_at = 0;
+
+	return n;
+}
+
+/**
+ * handle virtual channel write-event
+ * @note the queued messages are written with a single writev
+ */
+void channel_write_event(void)
+{
+	struct iovec iov[CHANNEL_IOV_MAX];
+	unsigned int n;
+	ssize_t w;
+
+	trace_chan("");
+
+	n = channel_write_iov(iov, CHANNEL_IOV_MAX);
+	if (!n)
+		return;
+
+	do {
+		w = writev(RDP_FD_OUT, iov, n);
+	} while ((w < 0) && (errno == EINTR));
+
+	channel_write_done(w < 0 ? -errno : w);
+}
+
+/**
+ * release the messages written to the TS virtual channel
+ * @param[in] w size of data written or -errno
+ */
+void channel_write_done(ssize_t w)
+{
+	chanmsg_t *msg;
+	unsigned int n;
+
+	trace_chan("w=%li", (long) w);
+
+	if (w < 0) {
+		if ((w == -EAGAIN) || (w == -EWOULDBLOCK))
+			return;
+		error("failed to write to rdesktop pipe (%s)", strerror((int) -w));
+		bye();
+	}
+	if (!w) {
+		error("rdesktop pipe closed");
+		bye();
+	}
+
+	print_xfer("chan", 'w', (unsigned int) w);
+	++vc.stats.writes;
+	vc.stats.bytes += (unsigned long long) w;
+
+	// release written messages
+	while (w > 0) {
+		msg = chanmsg_at(0);
+
+		if (msg->hoff < sizeof(msg->hdr)) {
+			n = sizeof(msg->hdr) - msg->hoff;
+			if ((size_t)w < n)
+				n = (unsigned int) w;
+			msg->hoff += n;
+			w -= n;
+		}
+
+		n = msg->len;
+		if ((size_t)w < n)
+			n = (unsigned int) w;
+		if (n > 0) {
+			iobuf_consume(msg->buf, n);
+			msg->len -= n;
+			w -= n;
+			if (msg->ns && !msg->src) {
+				// tunnel may be read again
+				msg->ns->u.tuncli.sched.queued -= n;
+				netsock_update_watch(msg->ns);
+			}
+		}
+
+		if (msg->len || (msg->hoff < sizeof(msg->hdr)))
+			break;
+
+		if (msg->src) {
+			// compressed tunnel data have been sent
+			iobuf_consume(msg->src, msg->raw);
+			if (msg->ns) {
+				msg->ns->u.tuncli.sched.queued -= msg->raw;
+				netsock_update_watch(msg->ns);
+			}
+		}
+
+		if (msg->owned)
+			free_tunnel_buf(msg);
+		vc.msgs_head = (vc.msgs_head + 1) % vc.msgs_max;
+		--vc.msgs_count;
+	}
+}
+
+/**
+ * detach a tunnel from the virtual channel
+ * @param[in] ns tunnel socket about to be destroyed
+ * @note data already queued are still sent, the channel takes ownership
+ *       of the tunnel input buffer memory
+ */
+void channel_detach_tunnel(netsock_t *ns)
+{
+	iobuf_t *buf, *copy;
+	chanmsg_t *msg, *last;
+	unsigned int i;
+
+	assert(ns && ((ns->type == NETSOCK_TUNCLI)
+			|| (ns->type == NETSOCK_RTUNCLI) || (ns->type == NETSOCK_S5CLI)));
+
+#ifdef USE_SPLICE
+	// forwarded DATA payload will be discarded
+	if (vc.fwd == ns)
+		vc.fwd = NULL;
+#endif
+
+	// data not queued yet are discarded
+	sched_del(ns);
+
+	buf = &ns->u.tuncli.ibuf;
+
+	last = NULL;
+	for (i=0; i<vc.msgs_count; ++i) {
+		msg = chanmsg_at(i);
+		if ((msg->buf == buf) || (msg->src == buf)) {
+			msg->ns = NULL;
+			last = msg;
+		}
+	}
+
+	if (!last)
+		return;
+
+	trace_chan("buf=%p", buf);
+
+	copy = malloc(sizeof(*copy));
+	if (!copy) {
+		error("failed to allocate channel memory");
+		bye();
+	}
+	*copy = *buf;
+	iobuf_init(buf, 'r', "detached");
+
+	for (i=0; i<vc.msgs_count; ++i) {
+		msg = chanmsg_at(i);
+		if (msg->buf == buf)
+			msg->buf = copy;
+		else if (msg->src == buf)
+			msg->src = copy;
+	}
+	last->owned = 1;
 }
 
 /**
  * send a ping message to rdp2tcp server
  * @return 0 if message cannot be queued
+ * @note the message advertises the client capabilities, it must only be
+ *       sent to servers which support it
  */
 int channel_ping(void)
 {
-	r2tmsg_t msg;
+	unsigned char *msg;
 
 	trace_chan("");
-	msg.cmd = R2TCMD_PING;
-	msg.id  = 0;
+	msg = write_reserve(R2TCMD_PING, 0, 3, NULL);
+	if (!msg)
+		return 0;
 
-	return !iobuf_append(&vc.obuf, &msg, 2);
+	msg[2] = CLIENT_CAPS;
+	write_commit(3);
+
+	return 1;
 }
 
 /**
  * function called whenever a ping message is sent by rdp2tcp server
+ * @param[in] caps server capabilities (R2TCAP_xxx)
  */
-void channel_pong(void)
+void channel_pong(unsigned char caps)
 {
 	//trace_chan("");
 
+	// servers handling ZDATA, TID16, COMPACT or PROBE also handle client pings
+	if (caps & (R2TCAP_ZDATA|R2TCAP_TID16|R2TCAP_COMPACT|R2TCAP_PROBE))
+		channel_ping();
+
+	// only the features supported by both peers are used
+	caps &= R2TCAP_WINDOW|CLIENT_CAPS;
+	if (vc.caps != caps) {
+		debug(0, "channel capabilities 0x%02x", caps);
+		vc.caps = caps;
+	}
+
 	if (vc.last_state != 1) {
 		vc.last_state = 1;
 		info(0, "virtual channel connected");
@@ -256,6 +1343,117 @@ void channel_pong(void)
 	time(&vc.ts);
 }
 
+/**
+ * send a timestamped ping measuring the channel if it is due
+ * @note probes are only sent to servers which advertised R2TCAP_PROBE,
+ *       a single probe is waiting for its echo at any time
+ */
+void channel_probe(void)
+{
+	r2tmsg_ping_t *msg;
+	unsigned long long now;
+
+	if (!(vc.caps & R2TCAP_PROBE))
+		return;
+
+	now = now_usec();
+	if ((now < vc.probe_at) || (vc.probe_sent
+			&& (now - vc.probe_sent < RDP2TCP_PING_DELAY * 1000000ULL)))
+		return;
+
+	msg = write_reserve(R2TCMD_PING, 0, sizeof(*msg), NULL);
+	if (!msg)
+		return;
+
+	msg->caps  = CLIENT_CAPS;
+	msg->flags = R2TPING_PROBE;
+	msg->seq   = htonl(++vc.probe_seq);
+	memcpy(msg->ts, &now, sizeof(msg->ts));
+
+	// the data queued before the probe are delivered once it is echoed
+	vc.probe_mark = vc.stats.bytes + queued_size();
+	write_commit(sizeof(*msg));
+
+	vc.probe_sent = now;
+	vc.probe_at = now + RDP2TCP_PROBE_DELAY * 1000ULL;
+}
+
+/**
+ * update the channel measurements with an echoed probe
+ * @param[in] now current time in microseconds
+ * @param[in] sent time of the probe
+ */
+static void probe_echoed(unsigned long long now, unsigned long long sent)
+{
+	chanrtt_t *rtt;
+	unsigned int r, delta;
+	unsigned long long rate;
+
+	rtt = &vc.rtt;
+	r = (now > sent ? (unsigned int)(now - sent) : 0);
+	rtt->last = r;
+
+	// RFC 6298 estimators
+	if (!rtt->samples++) {
+		rtt->srtt   = r;
+		rtt->rttvar = r / 2;
+		rtt->min = rtt->max = r;
+	} else {
+		delta = (rtt->srtt > r ? rtt->srtt - r : r - rtt->srtt);
+		rtt->rttvar = rtt->rttvar - rtt->rttvar / 4 + delta / 4;
+		rtt->srtt   = rtt->srtt - rtt->srtt / 8 + r / 8;
+		if (r < rtt->min)
+			rtt->min = r;
+		if (r > rtt->max)
+			rtt->max = r;
+	}
+
+	// data delivered between 2 echoes (low if tunnels are idle)
+	if (vc.echo_at && (now > vc.echo_at)) {
+		rate = (vc.probe_mark - vc.echo_mark) * 1000000ULL / (now - vc.echo_at);
+		rtt->rate = (rtt->rate ? rtt->rate - rtt->rate / 4 + rate / 4 : rate);
+		if (rate > rtt->max_rate)
+			rtt->max_rate = rate;
+	}
+	vc.echo_at   = now;
+	vc.echo_mark = vc.probe_mark;
+
+	debug(1, "channel rtt=%uus srtt=%uus rate=%lluB/s", r, rtt->srtt,
+				rtt->rate);
+}
+
+/**
+ * function called whenever a timestamped ping is sent by rdp2tcp server
+ * @param[in] ping received message
+ * @note probes are echoed at once, echoes of stale probes are ignored
+ */
+void channel_echo(const r2tmsg_ping_t *ping)
+{
+	r2tmsg_ping_t *msg;
+	unsigned long long sent;
+
+	assert(ping);
+
+	if (ping->flags & R2TPING_PROBE) {
+		msg = write_reserve(R2TCMD_PING, 0, sizeof(*msg), NULL);
+		if (msg) {
+			msg->caps  = CLIENT_CAPS;
+			msg->flags = R2TPING_ECHO;
+			msg->seq   = ping->seq;
+			memcpy(msg->ts, ping->ts, sizeof(msg->ts));
+			write_commit(sizeof(*msg));
+		}
+
+	} else if ((ping->flags & R2TPING_ECHO) && vc.probe_sent
+			&& (ntohl(ping->seq) == vc.probe_seq)) {
+		memcpy(&sent, ping->ts, sizeof(sent));
+		vc.probe_sent = 0;
+		probe_echoed(now_usec(), sent);
+	}
+
+	time(&vc.ts);
+}
+
 #if 0
 // purify/valgrind/amd64
 static unsigned int purify_strlen(const char *x)
@@ -267,21 +1465,30 @@ static unsigned int purify_strlen(const char *x)
 }
 #endif
 
+/**
+ * get the tunnel ID allocation limit
+ * @return R2TID_MAX_V2 if the server supports 16-bit IDs
+ */
+unsigned short channel_max_tid(void)
+{
+	return (vc.caps & R2TCAP_TID16 ? R2TID_MAX_V2 : R2TID_MAX_V1);
+}
+
 /**
  * send a rdp2tcp tunnel request command to the rdp2tcp server
  * @param[in] tunaf preferred address family (TUNAF_IPV4/IPV6/ANY)
  * @param[in] rhost remote tunnel hostname
  * @param[in] rport remote tunnel port
  * @param[in] reverse_connect 0 for tcp-connect or 1 for tcp-bind
- * @return the tunnel ID or 0xff on error
+ * @return the tunnel ID or R2TID_NONE on error
  */
-unsigned char channel_request_tunnel(
+unsigned short channel_request_tunnel(
 							unsigned char tunaf,
 							const char *rhost,
 							unsigned short rport,
 							int reverse_connect)
 {
-	unsigned char tid;
+	unsigned short tid;
 	unsigned int hlen;
 	r2tmsg_connreq_t *msg;
 
@@ -289,16 +1496,15 @@ unsigned char channel_request_tunnel(
 	trace_chan("tunaf=0x%02x, rhost=%s, rport=%hu", tunaf, rhost, rport);
 
 	tid = tunnel_generate_id();
-	if (tid == 0xff)
-		return 0xff;
+	if (tid == R2TID_NONE)
+		return R2TID_NONE;
 
 	hlen = 1 + strlen(rhost);
-	msg = write_reserve(5 + hlen, NULL);
+	msg = write_reserve((!reverse_connect ? R2TCMD_CONN : R2TCMD_BIND), tid,
+								5 + hlen, NULL);
 	if (!msg)
-		return 0xff;
+		return R2TID_NONE;
 
-	msg->cmd  = (!reverse_connect ? R2TCMD_CONN : R2TCMD_BIND);
-	msg->id   = tid;
 	msg->port = htons(rport);
 	msg->af   = tunaf;
 	memcpy(msg->hostname, rhost, hlen);
@@ -312,18 +1518,89 @@ unsigned char channel_request_tunnel(
  * notify the server a tunnel has been closed
  * @param[in] tid the tunnel ID
  */
-void channel_close_tunnel(unsigned char tid)
+void channel_close_tunnel(unsigned short tid)
 {
 	r2tmsg_t *msg;
+	netsock_t *ns;
+	unsigned int len;
 
-	assert(tid != 0xff);
+	assert(tid != R2TID_NONE);
 	trace_chan("tid=0x%02x", tid);
 
-	msg = write_reserve(2, NULL);
-	if (msg) {
-		msg->cmd = R2TCMD_CLOSE;
-		msg->id  = tid;
+	// tunnel data must be sent before the close message
+	ns = tunnel_lookup(tid);
+	if (ns && ns->u.tuncli.sched.active
+			&& ((ns->type == NETSOCK_TUNCLI) || (ns->type == NETSOCK_RTUNCLI)
+				|| (ns->type == NETSOCK_S5CLI))) {
+		sched_del(ns);
+		len = iobuf_datalen(&ns->u.tuncli.ibuf) - ns->u.tuncli.sched.queued;
+		while (len > 0) {
+			if (queue_data(ns, (len < RDP2TCP_MAX_MSGLEN - 2
+										? len : RDP2TCP_MAX_MSGLEN - 2)))
+				bye();
+			len = iobuf_datalen(&ns->u.tuncli.ibuf) - ns->u.tuncli.sched.queued;
+		}
+	}
+
+	msg = write_reserve(R2TCMD_CLOSE, tid, 2, NULL);
+	if (msg)
 		write_commit(2);
+}
+
+/**
+ * send a window update to the server
+ * @param[in] tid the tunnel ID
+ * @param[in] inc receive window increment
+ */
+static void write_window(unsigned short tid, unsigned int inc)
+{
+	r2tmsg_window_t *msg;
+
+	msg = write_reserve(R2TCMD_WINDOW, tid, 6, NULL);
+	if (msg) {
+		msg->inc = htonl(inc);
+		write_commit(6);
+	}
+}
+
+/**
+ * advertise the tunnel receive window to the server
+ * @param[in] ns tunnel socket with a reserved tunnel ID
+ * @note nothing is sent if the server does not support flow control
+ */
+void channel_open_window(netsock_t *ns)
+{
+	assert(valid_netsock(ns) && (ns->tid != R2TID_NONE));
+
+	if (!(vc.caps & R2TCAP_WINDOW))
+		return;
+
+	trace_chan("tid=0x%02x, size=%u", ns->tid, RDP2TCP_WINDOW_SIZE);
+	write_window(ns->tid, RDP2TCP_WINDOW_SIZE);
+	ns->u.tuncli.win.rx = 1;
+}
+
+/**
+ * acknowledge tunnel data written to the tunnel socket
+ * @param[in] ns tunnel socket
+ * @param[in] len size of data written
+ * @note window updates are sent once half of the window is available
+ */
+void channel_ack_data(netsock_t *ns, unsigned int len)
+{
+	tunwin_t *win;
+
+	assert(valid_netsock(ns));
+
+	if (ns->state != NETSTATE_CONNECTED)
+		return;
+
+	win = &ns->u.tuncli.win;
+	win->unacked += len;
+
+	if (win->rx && (win->unacked >= RDP2TCP_WINDOW_SIZE / 2)) {
+		write_window(ns->tid, win->unacked);
+		win->unacked = 0;
 	}
 }
 
@@ -335,20 +1612,16 @@ void channel_close_tunnel(unsigned char tid)
 int channel_forward_recv(netsock_t *ns)
 {
 	int ret;
-	unsigned int r, off;
-	unsigned char *msg;
+	unsigned int r;
 
 	assert(valid_netsock(ns) && ((ns->type == NETSOCK_TUNCLI)
 			|| (ns->type == NETSOCK_RTUNCLI) || (ns->type == NETSOCK_S5CLI)));
 	trace_chan("id=0x%02x", ns->tid);
 
-	off = iobuf_datalen(&vc.obuf);
-	ret = netsock_read(ns, &vc.obuf, 6, &r);
-	if (!ret) {
-		msg = iobuf_dataptr(&vc.obuf) + off;
-		*(unsigned int*)msg = htonl(r + 2);
-		msg[4] = R2TCMD_DATA;
-		msg[5] = ns->tid;
+	ret = netsock_read(ns, &ns->u.tuncli.ibuf, 0, &r);
+	if (!ret && (r > 0)) {
+		ns->u.tuncli.win.credit -= (int) r;
+		sched_add(ns);
 	}
 
 	if (ret < 0)
@@ -357,34 +1630,85 @@ int channel_forward_recv(netsock_t *ns)
 	return 0;
 }
 
+/**
+ * forward data received by a worker thread to the RDP channel
+ * @param[in] ns tunnel socket
+ * @param[in] buf received data (destroyed)
+ * @return 0 on success
+ * @note the buffer memory becomes the tunnel input buffer if it is empty
+ */
+int channel_forward_buf(netsock_t *ns, iobuf_t *buf)
+{
+	unsigned int len;
+
+	assert(valid_netsock(ns) && ((ns->type == NETSOCK_TUNCLI)
+			|| (ns->type == NETSOCK_RTUNCLI) || (ns->type == NETSOCK_S5CLI))
+			&& valid_iobuf(buf));
+	trace_chan("id=0x%02x", ns->tid);
+
+	len = iobuf_datalen(buf);
+	if (!iobuf_xfer(&ns->u.tuncli.ibuf, buf)) {
+		iobuf_kill(buf);
+		return error("failed to allocate tunnel memory");
+	}
+	print_xfer("tcp", 'r', len);
+	ns->rx += len;
+
+	ns->u.tuncli.win.credit -= (int) len;
+	sched_add(ns);
+
+	return 0;
+}
+
+/**
+ * forward data received by the io_uring engine to the RDP channel
+ * @param[in] ns tunnel socket
+ * @param[in] data received data
+ * @param[in] len size of data
+ * @return 0 on success
+ */
+int channel_forward_data(netsock_t *ns, const void *data, unsigned int len)
+{
+	assert(valid_netsock(ns) && ((ns->type == NETSOCK_TUNCLI)
+			|| (ns->type == NETSOCK_RTUNCLI) || (ns->type == NETSOCK_S5CLI))
+			&& data && len);
+	trace_chan("id=0x%02x, len=%u", ns->tid, len);
+
+	if (!iobuf_append(&ns->u.tuncli.ibuf, data, len))
+		return error("failed to allocate tunnel memory");
+	print_xfer("tcp", 'r', len);
+	ns->rx += len;
+
+	ns->u.tuncli.win.credit -= (int) len;
+	sched_add(ns);
+
+	return 0;
+}
+
 /**
  * forward data from I/O buffer to the RDP channel
- * @param[in] ibuf input buffer
+ * @param[in] ibuf tunnel input buffer
  * @param[in] tid tunnel identifier
  * @return 0 or 1 on success
+ * @note data are not copied, they are consumed once written
  */
-int channel_forward_iobuf(iobuf_t *ibuf, unsigned char tid)
+int channel_forward_iobuf(iobuf_t *ibuf, unsigned short tid)
 {
-	r2tmsg_t *msg;
 	unsigned int len;
+	netsock_t *ns;
 
-	assert(valid_iobuf(ibuf) && (tid != 0xff));
+	assert(valid_iobuf(ibuf) && (tid != R2TID_NONE));
 	trace_chan("tid=0x%02x", tid);
 
 	len = iobuf_datalen(ibuf);
 	assert(len > 0);
 
-	msg = write_reserve(len+2, NULL);
-	if (!msg)
+	ns = tunnel_lookup(tid);
+	if (!ns)
 		return -1;
 
-	msg->cmd = R2TCMD_DATA;
-	msg->id  = tid;
-	memcpy(((char *)msg)+2, iobuf_dataptr(ibuf), len);
-	write_commit(len + 2);
-
-	iobuf_consume(ibuf, len);
+	ns->u.tuncli.win.credit -= (int) len;
+	sched_add(ns);
 
 	return 0;
 }
-
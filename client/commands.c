@@ -22,6 +22,7 @@
  */
 #include "r2tcli.h"
 #include "msgparser.h"
+#include "lzblock.h"
 
 #include <arpa/inet.h>
 
@@ -35,32 +36,44 @@ static int badproto(netsock_t *cli)
 	return error("bad server protocol");
 }
 
-static netsock_t *check_tunnel_id(const r2tmsg_t *msg)
+static netsock_t *check_tunnel_id(unsigned short tid)
 {
 	netsock_t *ns;
 
-	ns = tunnel_lookup(msg->id);
+	ns = tunnel_lookup(tid);
 	if (!ns) {
-		warn("unknown tunnel 0x%02x", msg->id);
-		channel_close_tunnel(msg->id);
+		warn("unknown tunnel 0x%02x", tid);
+		if (tid != R2TID_NONE)
+			channel_close_tunnel(tid);
 	}
 
 	return ns;
 }
 
+/**
+ * process the answer to a tunnel request
+ * @param[in] mode 0 for connect, 1 for bind or 2 for reverse-connect
+ * @param[in] msg answer message
+ * @param[in] len size of answer message
+ * @param[in] tid tunnel identifier
+ * @param[in] rid tunnel identifier allocated by the server (reverse-connect)
+ * @return 0 on success
+ */
 static int check_binding_answer(
 					int mode,
 					const r2tmsg_connans_t *msg,
-					unsigned int len)
+					unsigned int len,
+					unsigned short tid,
+					unsigned short rid)
 {
 	netsock_t *cli;
 	int af;
 	unsigned short port;
 
 	assert(msg && (len >= 3));
-	trace_chan("len=%u, tid=%u, err=%u", len, msg->id, msg->err);
+	trace_chan("len=%u, tid=%u, err=%u", len, tid, msg->err);
 
-	cli = check_tunnel_id((const r2tmsg_t*)msg);
+	cli = check_tunnel_id(tid);
 	if (!cli)
 		return 0;
 
@@ -106,11 +119,13 @@ static int check_binding_answer(
 
 		} else {
 
-			if (!tunnel_lookup(msg->err)) {
-				tunnel_revconnect_event(cli, msg->err, af, &msg->addr[0], port);
+			if (rid == R2TID_NONE) {
+				return badproto(cli);
+			} else if (!tunnel_lookup(rid)) {
+				tunnel_revconnect_event(cli, rid, af, &msg->addr[0], port);
 			} else {
 				// server allocated an already used tunnel ID
-				channel_close_tunnel(msg->err);
+				channel_close_tunnel(rid);
 			}
 		}
 
@@ -125,56 +140,137 @@ static int check_binding_answer(
 	return 0;
 }
 
-static int cmd_conn(const r2tmsg_t *msg, unsigned int len)
+static int cmd_conn(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
-	return check_binding_answer(0, (const r2tmsg_connans_t *)msg, len);
+	return check_binding_answer(0, (const r2tmsg_connans_t *)msg, len,
+										hdr->id, R2TID_NONE);
 }
 
-static int cmd_bind(const r2tmsg_t *msg, unsigned int len)
+static int cmd_bind(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
-	return check_binding_answer(1, (const r2tmsg_connans_t *)msg, len);
+	return check_binding_answer(1, (const r2tmsg_connans_t *)msg, len,
+										hdr->id, R2TID_NONE);
 }
 
-static int cmd_close(const r2tmsg_t *msg, unsigned int len)
+static int cmd_close(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
 	netsock_t *tun;
 
 	assert(msg && (len >= 2));
 	trace_chan("len=%u", len);
 
-	tun = check_tunnel_id(msg);
+	tun = check_tunnel_id(hdr->id);
 	if (tun)
 		netsock_cancel(tun);
 
 	return 0;
 }
 
-static int cmd_data(const r2tmsg_t *msg, unsigned int len)
+static int cmd_data(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
 	netsock_t *clitun;
 
 	assert(msg && (len >= 3));
 	trace_chan("len=%u", len);
 
-	clitun = check_tunnel_id(msg);
+	clitun = check_tunnel_id(hdr->id);
 	if (!clitun)
 		return 0;
 
-	return tunnel_write(clitun, ((const char *)msg)+2, len-2);
+	// data not written yet are buffered, the message is consumed
+	if (tunnel_write(clitun, ((const char *)msg)+2, len-2) < 0)
+		tunnel_close(clitun, 1);
+
+	return 0;
+}
+
+static int cmd_zdata(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	static char data[RDP2TCP_MAX_MSGLEN];
+	const r2tmsg_zdata_t *zmsg;
+	netsock_t *clitun;
+	unsigned int size;
+
+	assert(msg && (len >= 7));
+	trace_chan("len=%u", len);
+
+	clitun = check_tunnel_id(hdr->id);
+	if (!clitun)
+		return 0;
+
+	zmsg = (const r2tmsg_zdata_t *) msg;
+	size = ntohl(zmsg->len);
+	if (!size || (size > sizeof(data))
+			|| (lzblock_decompress(zmsg->data, len-6, data, size) != (int)size)) {
+		error("invalid compressed data for tunnel 0x%02x", hdr->id);
+		tunnel_close(clitun, 1);
+		return 0;
+	}
+
+	if (tunnel_write(clitun, data, size) < 0)
+		tunnel_close(clitun, 1);
+
+	return 0;
 }
 
-static int cmd_ping(const r2tmsg_t *msg, unsigned int len)
+static int cmd_ping(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
 	assert(msg && (len >= 2));
 	//trace_chan("len=%u", len);
 
-	channel_pong();
+	if ((len >= sizeof(r2tmsg_ping_t)) && ((const r2tmsg_ping_t *)msg)->flags) {
+		channel_echo((const r2tmsg_ping_t *) msg);
+		return 0;
+	}
+
+	channel_pong(len > 2 ? ((const unsigned char *)msg)[2] : 0);
 	return 0;
 }
 
-static int cmd_rconn(const r2tmsg_t *msg, unsigned int len)
+static int cmd_rconn(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
-	return check_binding_answer(2, (const r2tmsg_connans_t *)msg, len);
+	const r2tmsg_rconnreq2_t *msg2;
+	netsock_t *cli;
+
+	if (!hdr->v2)
+		return check_binding_answer(2, (const r2tmsg_connans_t *)msg, len,
+							hdr->id, ((const r2tmsg_connans_t *)msg)->err);
+
+	// 16-bit remote ID: the answer fields follow 1 byte further
+	if (len < 4) {
+		cli = check_tunnel_id(hdr->id);
+		return (cli ? badproto(cli) : 0);
+	}
+	msg2 = (const r2tmsg_rconnreq2_t *) msg;
+	return check_binding_answer(2,
+				(const r2tmsg_connans_t *)((const char *)msg + 1), len - 1,
+				hdr->id, ntohs(msg2->rid));
+}
+
+static int cmd_window(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	netsock_t *ns;
+	tunwin_t *win;
+	unsigned int inc;
+
+	assert(msg && (len >= 6));
+	trace_chan("len=%u", len);
+
+	// window updates may be received after the tunnel has been closed
+	ns = tunnel_lookup(hdr->id);
+	if (!ns || (ns->type == NETSOCK_RTUNSRV))
+		return 0;
+
+	inc = ntohl(((const r2tmsg_window_t *)msg)->inc);
+	win = &ns->u.tuncli.win;
+	win->tx = 1;
+	if ((long long)win->credit + inc > 0x7fffffff)
+		win->credit = 0x7fffffff;
+	else
+		win->credit += (int) inc;
+
+	netsock_update_watch(ns);
+	return 0;
 }
 
 /**
@@ -186,6 +282,8 @@ const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	cmd_data,  // R2TCMD_DATA
 	cmd_ping,  // R2TCMD_PING
 	cmd_bind,  // R2TCMD_BIND
-	cmd_rconn  // R2TCMD_RCONN
+	cmd_rconn, // R2TCMD_RCONN
+	cmd_window,// R2TCMD_WINDOW
+	cmd_zdata  // R2TCMD_ZDATA
 };
 
@@ -22,12 +22,22 @@
  */
 #include "r2tcli.h"
 #include "nethelper.h"
+#include "msgparser.h"
 
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 
+#ifndef CONTROLLER_LINE_MAX
+/** maximum size of a command line */
+#define CONTROLLER_LINE_MAX 1024
+#endif
+
 #ifndef PTR_DIFF
 #define PTR_DIFF(e,s) \
 	        ((unsigned int)(((unsigned long)(e))-((unsigned long)(s))))
@@ -100,7 +110,7 @@ void controller_accept_event(netsock_t *ns)
 	cli = netsock_accept(ns);
 	if (cli) {
 		cli->type = NETSOCK_CTRLCLI;
-		cli->tid  = 0xff;
+		cli->tid  = R2TID_NONE;
 		iobuf_init2(&cli->u.ctrlcli.ibuf, &cli->u.ctrlcli.obuf, "ctrl");
 		info(1, "accepted controller %s", netaddr_print(&cli->addr, buf));
 	}
@@ -112,6 +122,8 @@ static int dump_sockets(netsock_t *cli)
 {
 	int ret;
 	netsock_t *ns;
+	const chanstats_t *stats;
+	const chanrtt_t *rtt;
 	char host1[NETADDRSTR_MAXSIZE], host2[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(cli));
@@ -194,6 +206,291 @@ static int dump_sockets(netsock_t *cli)
 			break;
 	}
 
+	if (!ret) {
+		stats = channel_stats();
+		ret = controller_answer(cli, "channel writes=%llu frames/write=%.2f "
+									"bytes/write=%.0f", stats->writes,
+									(stats->writes ? (double)stats->frames
+										/ stats->writes : 0.0),
+									(stats->writes ? (double)stats->bytes
+										/ stats->writes : 0.0));
+	}
+
+	rtt = channel_rtt();
+	if (!ret && rtt->samples)
+		ret = controller_answer(cli, "channel rtt=%.1fms min=%.1fms max=%.1fms "
+									"rate=%.1fKB/s max=%.1fKB/s",
+									rtt->srtt / 1000.0, rtt->min / 1000.0,
+									rtt->max / 1000.0, rtt->rate / 1024.0,
+									rtt->max_rate / 1024.0);
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
+
+static int dump_dns_cache(netsock_t *cli)
+{
+	int ret;
+	unsigned int count;
+	time_t now;
+	const netcache_t *nc;
+	const struct addrinfo *ai;
+	netcache_stats_t stats;
+	char host[NI_MAXHOST];
+
+	assert(valid_netsock(cli));
+
+	ret = 0;
+	now = time(NULL);
+
+	for (nc=netcache_entries(&stats); nc && !ret; nc=nc->next) {
+
+		if (nc->pending) {
+			ret = controller_answer(cli, "dns     %s resolving", nc->host);
+			continue;
+		}
+
+		if (nc->ret || !nc->res) {
+			ret = controller_answer(cli, "dns     %s failed ttl=%ld",
+										nc->host, (long)(nc->expire - now));
+			continue;
+		}
+
+		for (ai=nc->res, count=0; ai; ai=ai->ai_next)
+			++count;
+		if (getnameinfo(nc->res->ai_addr, nc->res->ai_addrlen, host,
+							sizeof(host), NULL, 0, NI_NUMERICHOST))
+			strcpy(host, "???");
+
+		ret = controller_answer(cli, "dns     %s %s (%u addresses) ttl=%ld",
+									nc->host, host, count,
+									(long)(nc->expire - now));
+	}
+
+	if (!ret)
+		ret = controller_answer(cli, "dns cache hits=%u misses=%u entries=%u",
+									stats.hits, stats.misses, stats.entries);
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
+
+/* resident memory of the process (KB) */
+static unsigned long resident_size(void)
+{
+	FILE *fp;
+	unsigned long size, rss;
+	struct rusage ru;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu %lu", &size, &rss) == 2) {
+			fclose(fp);
+			return rss * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+		fclose(fp);
+	}
+
+	// peak resident size on systems without procfs
+	if (!getrusage(RUSAGE_SELF, &ru))
+		return (unsigned long) ru.ru_maxrss;
+
+	return 0;
+}
+
+static int dump_mem_pools(netsock_t *cli)
+{
+	int ret;
+	unsigned int i, count, conns, exceeded;
+	unsigned long rss;
+	netsock_t *ns;
+	mempool_stats_t stats[IOBUF_POOLS+1];
+
+	assert(valid_netsock(cli));
+
+	netsock_pool_stat(&stats[0]);
+	count = 1 + iobuf_pools_stat(&stats[1], IOBUF_POOLS);
+
+	for (i=0, ret=0; (i<count) && !ret; ++i)
+		ret = controller_answer(cli, "mem     %s size=%u used=%u cached=%u "
+									"peak=%u hits=%llu misses=%llu",
+									stats[i].name, stats[i].size, stats[i].used,
+									stats[i].cached, stats[i].peak,
+									stats[i].hits, stats[i].misses);
+
+	if (!ret) {
+		conns = 0;
+		list_for_each(ns, &all_sockets) {
+			if (!netsock_is_server(ns) && (ns->type != NETSOCK_RTUNSRV))
+				++conns;
+		}
+		rss = resident_size();
+		ret = controller_answer(cli, "mem     rss=%luKB buffers=%luKB "
+									"budget=%luKB throttled=%i exceeded=%u "
+									"connections=%u rss/connection=%luKB",
+									rss, iobuf_memory() / 1024,
+									RDP2TCP_MEM_BUDGET / 1024,
+									netsocks_throttled(&exceeded), exceeded,
+									conns, (conns ? rss / conns : 0));
+	}
+
+	if (ret >= 0)
+		ret = controller_answer(cli, "\n");
+
+	return ret;
+}
+
+/* metrics names of commands (R2TCMD_xxx) */
+static const char *metric_cmds[R2TCMD_MAX] = {
+	"conn", "close", "data", "ping", "bind", "rconn", "window", "zdata"
+};
+
+/* metrics names of sockets types (NETSOCK_xxx) */
+static const char *metric_socks[NETSOCK_RTUNCLI+1] = {
+	"ctrlsrv", "tunsrv", "s5srv", "ctrlcli", "tuncli", "s5cli",
+	"rtunsrv", "rtuncli"
+};
+
+/* answer a metric type line followed by a metric without labels */
+static int metric(
+			netsock_t *cli,
+			const char *name,
+			const char *type,
+			unsigned long long val)
+{
+	int ret;
+
+	ret = controller_answer(cli, "# TYPE rdp2tcp_%s %s", name, type);
+	if (!ret)
+		ret = controller_answer(cli, "rdp2tcp_%s %llu", name, val);
+
+	return ret;
+}
+
+/* answer a metric of all the connected sockets */
+static int sockets_metric(netsock_t *cli, const char *name, const char *type)
+{
+	int ret;
+	netsock_t *ns;
+	unsigned long long val;
+	char host[NETADDRSTR_MAXSIZE];
+
+	ret = controller_answer(cli, "# TYPE rdp2tcp_socket_%s %s", name, type);
+
+	list_for_each(ns, &all_sockets) {
+
+		if (ret)
+			break;
+		if ((ns == cli) || netsock_is_server(ns)
+				|| (ns->type > NETSOCK_RTUNCLI) || (ns->fd == -1))
+			continue;
+
+		switch (*name) {
+			case 'r': val = ns->rx; break;
+			case 't': val = ns->tx; break;
+			case 'i': val = iobuf_datalen(&ns->u.tuncli.ibuf); break;
+			case 'o': val = iobuf_datalen(&ns->u.tuncli.obuf); break;
+			default:  val = (unsigned long long)(time(NULL) - ns->since);
+		}
+
+		ret = controller_answer(cli, "rdp2tcp_socket_%s{type=\"%s\",tid=\"%hu\","
+									"addr=\"%s\"} %llu", name,
+									metric_socks[ns->type], ns->tid,
+									netaddr_print(&ns->addr, host), val);
+	}
+
+	return ret;
+}
+
+/**
+ * answer the channel and sockets counters (Prometheus text format)
+ * @param[in] cli controller client socket
+ * @return -1 on error
+ * @note counters are plain integers updated by the events loop, they are
+ *       only read when the command is handled
+ */
+static int dump_metrics(netsock_t *cli)
+{
+	int ret;
+	unsigned int i;
+	const chanstats_t *stats;
+	const chanrtt_t *rtt;
+
+	assert(valid_netsock(cli));
+
+	stats = channel_stats();
+	rtt = channel_rtt();
+
+	ret = metric(cli, "channel_connected", "gauge",
+					(unsigned long long) channel_is_connected());
+	if (!ret)
+		ret = metric(cli, "channel_reads_total", "counter", stats->reads);
+	if (!ret)
+		ret = metric(cli, "channel_read_bytes_total", "counter", stats->rbytes);
+	if (!ret)
+		ret = metric(cli, "channel_writes_total", "counter", stats->writes);
+	if (!ret)
+		ret = metric(cli, "channel_written_bytes_total", "counter",
+							stats->bytes);
+	if (!ret)
+		ret = metric(cli, "channel_ibuf_bytes", "gauge", stats->ibuf);
+	if (!ret)
+		ret = metric(cli, "channel_obuf_bytes", "gauge", stats->obuf);
+	if (!ret)
+		ret = metric(cli, "channel_pending_bytes", "gauge", stats->pending);
+	if (!ret)
+		ret = metric(cli, "channel_queued_frames", "gauge", stats->queued);
+	if (!ret)
+		ret = metric(cli, "channel_waiting_tunnels", "gauge", stats->waiting);
+	if (!ret)
+		ret = metric(cli, "channel_probes_total", "counter", rtt->samples);
+	if (!ret)
+		ret = metric(cli, "channel_rtt_microseconds", "gauge", rtt->last);
+	if (!ret)
+		ret = metric(cli, "channel_srtt_microseconds", "gauge", rtt->srtt);
+	if (!ret)
+		ret = metric(cli, "channel_rttvar_microseconds", "gauge", rtt->rttvar);
+	if (!ret)
+		ret = metric(cli, "channel_min_rtt_microseconds", "gauge", rtt->min);
+	if (!ret)
+		ret = metric(cli, "channel_max_rtt_microseconds", "gauge", rtt->max);
+	if (!ret)
+		ret = metric(cli, "channel_delivery_rate_bytes", "gauge", rtt->rate);
+	if (!ret)
+		ret = metric(cli, "channel_max_delivery_rate_bytes", "gauge",
+							rtt->max_rate);
+
+	if (!ret)
+		ret = controller_answer(cli, "# TYPE rdp2tcp_channel_frames_in_total "
+										"counter");
+	for (i=0; (i<R2TCMD_MAX) && !ret; ++i)
+		ret = controller_answer(cli, "rdp2tcp_channel_frames_in_total"
+										"{cmd=\"%s\"} %llu", metric_cmds[i],
+										commands_count[i]);
+
+	if (!ret)
+		ret = controller_answer(cli, "# TYPE rdp2tcp_channel_frames_out_total "
+										"counter");
+	for (i=0; (i<R2TCMD_MAX) && !ret; ++i)
+		ret = controller_answer(cli, "rdp2tcp_channel_frames_out_total"
+										"{cmd=\"%s\"} %llu", metric_cmds[i],
+										stats->frames_out[i]);
+
+	if (!ret)
+		ret = sockets_metric(cli, "rx_bytes_total", "counter");
+	if (!ret)
+		ret = sockets_metric(cli, "tx_bytes_total", "counter");
+	if (!ret)
+		ret = sockets_metric(cli, "ibuf_bytes", "gauge");
+	if (!ret)
+		ret = sockets_metric(cli, "obuf_bytes", "gauge");
+	if (!ret)
+		ret = sockets_metric(cli, "age_seconds", "gauge");
+
 	if (ret >= 0)
 		ret = controller_answer(cli, "\n");
 
@@ -229,11 +526,12 @@ static char *extract_port(char *data, unsigned short *out_port)
  */
 int controller_read_event(netsock_t *cli)
 {
-	char cmd, *data, *end, *lhost, *rhost;
+	char cmd, *data, *end, *lhost, *rhost, *ptr;
 	int ret;
+	long val;
 	unsigned int avail, parsed;
 	unsigned short lport, rport;
-	const char valid_commands[] = "ltrxs-";
+	const char valid_commands[] = "ltrxswndmc-";
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(cli) && (cli->type == NETSOCK_CTRLCLI));
@@ -253,6 +551,9 @@ int controller_read_event(netsock_t *cli)
 
 		end = memchr(data, '\n', avail-parsed);
 		if (!end) {
+			// the input buffer of a controller is bounded
+			if (avail - parsed > CONTROLLER_LINE_MAX)
+				goto badproto;
 			ret = 1;
 			break;
 		}
@@ -273,6 +574,23 @@ int controller_read_event(netsock_t *cli)
 		if (cmd == 'l') { // list sockets
 			ret = dump_sockets(cli);
 
+		} else if (cmd == 'd') { // list (or flush) cached hostnames
+			if (!strcmp(data, "d flush"))
+				netcache_flush();
+			else if (data[1])
+				goto badproto;
+			ret = dump_dns_cache(cli);
+
+		} else if (cmd == 'm') { // memory pools counters
+			if (data[1])
+				goto badproto;
+			ret = dump_mem_pools(cli);
+
+		} else if (cmd == 'c') { // channel and sockets counters
+			if (data[1])
+				goto badproto;
+			ret = dump_metrics(cli);
+
 		} else {
 			// commands with argc >= 2
 
@@ -298,6 +616,22 @@ int controller_read_event(netsock_t *cli)
 				if (cmd == 'x') { // exec & forward stdin/stdout
 					ret = tunnel_add(cli, lhost, lport, AF_UNSPEC, data, 0);
 
+				} else if (cmd == 'w') { // set tunnel channel share
+					ptr = NULL;
+					val = strtol(data, &ptr, 10);
+					if (!ptr || *ptr || (val <= 0) || (val > 0xff))
+						goto badproto;
+					ret = tunnel_set_option(cli, lhost, lport,
+												TUNOPT_WEIGHT, (unsigned char) val);
+
+				} else if (cmd == 'n') { // disable tunnel writes coalescing
+					ptr = NULL;
+					val = strtol(data, &ptr, 10);
+					if (!ptr || *ptr || (val < 0) || (val > 1))
+						goto badproto;
+					ret = tunnel_set_option(cli, lhost, lport,
+												TUNOPT_NODELAY, (unsigned char) val);
+
 				} else {
 					// commands with argc == 4
 
@@ -0,0 +1,508 @@
+/**
+ * @file events.c
+ * network events loop (epoll, io_uring or select backend)
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+#include "resolver.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <time.h>
+#else
+#include <sys/select.h>
+#include <sys/time.h>
+#endif
+
+extern struct list_head all_sockets;
+
+#ifdef USE_EPOLL
+
+/** maximum number of events returned by a single epoll_wait */
+#define EVENTS_MAX 256
+
+static int epfd = -1;
+static int chan_out_watched = 0;
+static struct epoll_event ready[EVENTS_MAX];
+
+/* epoll user data of the rdesktop pipes */
+static const int chan_tags[2] = { RDP_FD_IN, RDP_FD_OUT };
+/* epoll user data of the resolver notifications */
+static const int resolver_tag = -1;
+#ifdef USE_SHARDS
+/* epoll user data of the worker threads notifications */
+static const int shards_tag = -2;
+#endif
+
+static unsigned int to_epoll(unsigned int evts)
+{
+	return ((evts & NETEVT_READ) ? EPOLLIN : 0)
+			| ((evts & NETEVT_WRITE) ? EPOLLOUT : 0);
+}
+
+/**
+ * initialize the events loop
+ * @return 0 on success
+ */
+int events_init(void)
+{
+	struct epoll_event ev;
+
+	trace_evt("");
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return error("failed to create epoll instance (%s)", strerror(errno));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = (void *)&chan_tags[0];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, RDP_FD_IN, &ev))
+		return error("failed to watch rdesktop pipe (%s)", strerror(errno));
+
+	ev.events   = 0;
+	ev.data.ptr = (void *)&chan_tags[1];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, RDP_FD_OUT, &ev))
+		return error("failed to watch rdesktop pipe (%s)", strerror(errno));
+
+	if (resolver_fd() != -1) {
+		ev.events   = EPOLLIN;
+		ev.data.ptr = (void *)&resolver_tag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolver_fd(), &ev))
+			return error("failed to watch resolver (%s)", strerror(errno));
+	}
+
+#ifdef USE_SHARDS
+	if (shards_fd() != -1) {
+		ev.events   = EPOLLIN;
+		ev.data.ptr = (void *)&shards_tag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, shards_fd(), &ev))
+			return error("failed to watch worker threads (%s)", strerror(errno));
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * destroy the events loop
+ */
+void events_kill(void)
+{
+	trace_evt("");
+
+	if (epfd != -1) {
+		close(epfd);
+		epfd = -1;
+	}
+}
+
+/**
+ * register a socket in the events loop
+ * @param[in] ns socket (no event is watched until event_update)
+ * @return 0 on success
+ */
+int event_add(netsock_t *ns)
+{
+	struct epoll_event ev;
+
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i", ns->fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = 0;
+	ev.data.ptr = ns;
+	ns->events  = 0;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ns->fd, &ev))
+		return error("failed to watch socket (%s)", strerror(errno));
+
+	return 0;
+}
+
+/**
+ * change the events watched on a socket
+ * @param[in] ns registered socket
+ * @param[in] evts watched events (NETEVT_xxx)
+ * @note tunnels read by a worker thread (or by io_uring) are only
+ *       registered while events are watched, so that hang-ups are reported
+ *       to the worker (or to the receive request)
+ */
+void event_update(netsock_t *ns, unsigned int evts)
+{
+	struct epoll_event ev;
+	int op;
+
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i, evts=%u", ns->fd, evts);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = to_epoll(evts);
+	ev.data.ptr = ns;
+
+	op = EPOLL_CTL_MOD;
+#ifdef USE_SHARDS
+	if (ns->shard) {
+		if (!evts)
+			op = EPOLL_CTL_DEL;
+		else if (!ns->events)
+			op = EPOLL_CTL_ADD;
+	}
+#endif
+#ifdef USE_URING
+	if (ns->uring) {
+		if (!evts)
+			op = EPOLL_CTL_DEL;
+		else if (!ns->events)
+			op = EPOLL_CTL_ADD;
+	}
+#endif
+
+	if (!epoll_ctl(epfd, op, ns->fd, &ev))
+		ns->events = (unsigned char) evts;
+	else
+		error("failed to update socket events (%s)", strerror(errno));
+}
+
+/**
+ * unregister a socket from the events loop
+ * @param[in] ns registered socket
+ */
+void event_del(netsock_t *ns)
+{
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i", ns->fd);
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, ns->fd, NULL);
+	ns->events = 0;
+}
+
+/**
+ * wait for epoll events with a microsecond timeout
+ * @param[in] timeout timeout in microseconds or -1
+ * @return epoll_wait result
+ */
+static int wait_ready(long timeout)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 35))
+	static int no_pwait2 = 0;
+	struct timespec ts;
+	int ret;
+
+	if (!no_pwait2) {
+		if (timeout >= 0) {
+			ts.tv_sec  = timeout / 1000000;
+			ts.tv_nsec = (timeout % 1000000) * 1000;
+		}
+		ret = epoll_pwait2(epfd, ready, EVENTS_MAX,
+								(timeout >= 0 ? &ts : NULL), NULL);
+		if ((ret != -1) || (errno != ENOSYS))
+			return ret;
+		no_pwait2 = 1; // kernel older than 5.11
+	}
+#endif
+	// round up to not spin while a coalescing delay expires
+	return epoll_wait(epfd, ready, EVENTS_MAX,
+					(timeout >= 0 ? (int)((timeout + 999) / 1000) : -1));
+}
+
+/**
+ * wait for epoll events
+ * @param[in] chan_write 1 if the rdesktop pipe must be watched for writing
+ * @param[in] timeout timeout in microseconds or -1
+ * @return number of ready descriptors or -1 on error
+ */
+static int epoll_ready(int chan_write, long timeout)
+{
+	struct epoll_event ev;
+	int ret;
+
+	if (chan_write != chan_out_watched) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events   = (chan_write ? EPOLLOUT : 0);
+		ev.data.ptr = (void *)&chan_tags[1];
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, RDP_FD_OUT, &ev))
+			return error("failed to watch rdesktop pipe (%s)", strerror(errno));
+		chan_out_watched = chan_write;
+	}
+
+	do {
+		ret = wait_ready(timeout);
+	} while ((ret == -1) && (errno == EINTR));
+
+	if (ret == -1)
+		return error("epoll_wait error (%s)", strerror(errno));
+
+	return ret;
+}
+
+/**
+ * wait for network events
+ * @param[in] chan_write 1 if the rdesktop pipe must be watched for writing
+ * @param[in] timeout timeout in microseconds or -1
+ * @param[out] chan_evts rdesktop pipe events (NETEVT_xxx),
+ *             NETEVT_RESOLVED if hostname resolutions are completed and
+ *             NETEVT_SHARDS if worker threads received tunnel data
+ * @return number of ready sockets or -1 on error
+ * @note with the io_uring engine, the rdesktop pipe is written before
+ *       the wait and NETEVT_WRITE is only reported on pipe errors
+ */
+int events_wait(int chan_write, long timeout, unsigned int *chan_evts)
+{
+	int i, n, ret;
+
+	assert(chan_evts);
+
+#ifdef USE_URING
+	if (uring_fd() != -1)
+		ret = uring_wait(epfd, chan_write, timeout, ready, EVENTS_MAX);
+	else
+#endif
+	ret = epoll_ready(chan_write, timeout);
+	if (ret == -1)
+		return -1;
+
+	*chan_evts = 0;
+
+	// move rdesktop pipes events out of the sockets events
+	for (i=0, n=0; i<ret; ++i) {
+		if (ready[i].data.ptr == (void *)&chan_tags[0]) {
+			*chan_evts |= NETEVT_READ;
+		} else if (ready[i].data.ptr == (void *)&chan_tags[1]) {
+			*chan_evts |= NETEVT_WRITE;
+		} else if (ready[i].data.ptr == (void *)&resolver_tag) {
+			*chan_evts |= NETEVT_RESOLVED;
+#ifdef USE_SHARDS
+		} else if (ready[i].data.ptr == (void *)&shards_tag) {
+			*chan_evts |= NETEVT_SHARDS;
+#endif
+		} else {
+			if (n != i)
+				ready[n] = ready[i];
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * retrieve a ready socket
+ * @param[in] i index of ready socket (lower than events_wait result)
+ * @param[out] evts socket events (NETEVT_xxx)
+ * @return the ready socket
+ */
+netsock_t *event_get(int i, unsigned int *evts)
+{
+	unsigned int e;
+
+	assert((i >= 0) && (i < EVENTS_MAX) && evts);
+
+	e = ready[i].events;
+	*evts = 0;
+	// errors and hang-ups are reported to the read handler (or the
+	// write handler while connecting) which then get the error code
+	if (e & (EPOLLIN|EPOLLERR|EPOLLHUP))
+		*evts |= NETEVT_READ;
+	if (e & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+		*evts |= NETEVT_WRITE;
+
+	return (netsock_t *) ready[i].data.ptr;
+}
+
+#else // select backend
+
+static netsock_t **ready = NULL;
+static unsigned char *ready_evts = NULL;
+static unsigned int ready_max = 0;
+
+int events_init(void)
+{
+	trace_evt("");
+	return 0;
+}
+
+void events_kill(void)
+{
+	trace_evt("");
+
+	if (ready) {
+		free(ready);
+		free(ready_evts);
+		ready = NULL;
+		ready_evts = NULL;
+		ready_max = 0;
+	}
+}
+
+int event_add(netsock_t *ns)
+{
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i", ns->fd);
+
+	if (ns->fd >= FD_SETSIZE)
+		return error("socket %i exceeds FD_SETSIZE", ns->fd);
+
+	ns->events = 0;
+	return 0;
+}
+
+void event_update(netsock_t *ns, unsigned int evts)
+{
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i, evts=%u", ns->fd, evts);
+
+	ns->events = (unsigned char) evts;
+}
+
+void event_del(netsock_t *ns)
+{
+	assert(ns && (ns->fd != -1));
+	trace_evt("fd=%i", ns->fd);
+
+	ns->events = 0;
+}
+
+static int grow_ready(unsigned int count)
+{
+	netsock_t **r;
+	unsigned char *e;
+
+	if (count <= ready_max)
+		return 0;
+
+	count = (count + 63) & ~63;
+	r = realloc(ready, count * sizeof(*ready));
+	if (!r)
+		return error("failed to allocate events memory");
+	ready = r;
+
+	e = realloc(ready_evts, count * sizeof(*ready_evts));
+	if (!e)
+		return error("failed to allocate events memory");
+	ready_evts = e;
+
+	ready_max = count;
+	return 0;
+}
+
+int events_wait(int chan_write, long timeout, unsigned int *chan_evts)
+{
+	int ret, fd, max_fd;
+	unsigned int count, n;
+	netsock_t *ns;
+	fd_set rfd, wfd;
+	struct timeval tv, *ptv;
+
+	assert(chan_evts);
+
+	FD_ZERO(&rfd);
+	FD_ZERO(&wfd);
+	FD_SET(RDP_FD_IN, &rfd);
+	max_fd = RDP_FD_IN;
+
+	if (chan_write) {
+		FD_SET(RDP_FD_OUT, &wfd);
+		max_fd = RDP_FD_OUT;
+	}
+
+	fd = resolver_fd();
+	if (fd != -1) {
+		FD_SET(fd, &rfd);
+		if (fd > max_fd)
+			max_fd = fd;
+	}
+
+	count = 0;
+	list_for_each(ns, &all_sockets) {
+
+		if (!ns->events)
+			continue;
+
+		fd = ns->fd;
+		if (ns->events & NETEVT_READ)
+			FD_SET(fd, &rfd);
+		if (ns->events & NETEVT_WRITE)
+			FD_SET(fd, &wfd);
+		if (fd > max_fd)
+			max_fd = fd;
+		++count;
+	}
+
+	if (grow_ready(count))
+		return -1;
+
+	ptv = NULL;
+	if (timeout >= 0) {
+		tv.tv_sec  = timeout / 1000000;
+		tv.tv_usec = timeout % 1000000;
+		ptv = &tv;
+	}
+
+	*chan_evts = 0;
+
+	ret = select(max_fd+1, &rfd, &wfd, NULL, ptv);
+	if (ret == -1) {
+		if (errno == EINTR)
+			return 0;
+		return error("select error (%s)", strerror(errno));
+	}
+
+	if (ret == 0)
+		return 0;
+
+	if (FD_ISSET(RDP_FD_IN, &rfd))
+		*chan_evts |= NETEVT_READ;
+	if (FD_ISSET(RDP_FD_OUT, &wfd))
+		*chan_evts |= NETEVT_WRITE;
+	if ((resolver_fd() != -1) && FD_ISSET(resolver_fd(), &rfd))
+		*chan_evts |= NETEVT_RESOLVED;
+
+	n = 0;
+	list_for_each(ns, &all_sockets) {
+
+		if (!ns->events)
+			continue;
+
+		fd = ns->fd;
+		ready_evts[n] = (FD_ISSET(fd, &rfd) ? NETEVT_READ : 0)
+							| (FD_ISSET(fd, &wfd) ? NETEVT_WRITE : 0);
+		if (ready_evts[n]) {
+			ready[n] = ns;
+			if (++n >= count)
+				break;
+		}
+	}
+
+	return (int) n;
+}
+
+netsock_t *event_get(int i, unsigned int *evts)
+{
+	assert((i >= 0) && ((unsigned int)i < ready_max) && evts);
+
+	*evts = ready_evts[i];
+	return ready[i];
+}
+
+#endif
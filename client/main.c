@@ -9,6 +9,8 @@
  * @li commands.c
  * @li socks5.c
  * @li controller.c
+ * @section sec_evt events loop
+ * @li events.c
  */
 /*
  * This file is part of rdp2tcp
@@ -29,14 +31,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "r2tcli.h"
+#include "resolver.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
-#include <sys/select.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -52,9 +53,18 @@ void bye(void)
 {
 	netsock_t *ns, *bak;
 
+	netsocks_close_cancelled();
 	list_for_each_safe(ns, bak, &all_sockets)
 		netsock_close(ns);
 
+	events_kill();
+	resolver_kill();
+#ifdef USE_SHARDS
+	shards_kill();
+#endif
+#ifdef USE_URING
+	uring_kill();
+#endif
 	channel_kill();
 	exit(0);
 }
@@ -69,6 +79,10 @@ static void handle_cleanup(int sig)
 static void setup(int argc, char **argv)
 {
 	const char *host;
+#ifdef USE_SHARDS
+	const char *threads;
+	int count;
+#endif
 	int port;
 
 	print_init();
@@ -91,18 +105,111 @@ static void setup(int argc, char **argv)
 		host = "127.0.0.1";
 	}
 
+	if (resolver_init())
+		exit(0);
+
+#ifdef USE_SHARDS
+	// tunnels are read by the main loop unless worker threads are requested
+	threads = getenv("RDP2TCP_THREADS");
+	if (threads) {
+		count = atoi(threads);
+		if (count < 0) {
+			error("invalid number of worker threads %i", count);
+			exit(0);
+		}
+		if (shards_init((unsigned int) count))
+			exit(0);
+	}
+#endif
+
+#ifdef USE_URING
+	// epoll remains the events loop if io_uring is not available
+	if (getenv("RDP2TCP_URING") && uring_init())
+		warn("falling back to epoll events loop");
+#endif
+
+	if (events_init())
+		exit(0);
+
 	if (controller_start(host, port))
 		exit(0);
 
 	channel_init();
 }
 
+/**
+ * dispatch network events of a socket
+ * @param[in] ns ready socket
+ * @param[in] evts ready events (NETEVT_xxx)
+ */
+static void netsock_event(netsock_t *ns, unsigned int evts)
+{
+	int ret;
+
+	assert(valid_netsock(ns));
+
+	if (ns->state == NETSTATE_CANCELLED)
+		return;
+
+	if (ns->conn) {
+		netsock_connect_event(ns);
+		return;
+	}
+
+	if (netsock_is_server(ns)) {
+		// server socket
+		if (evts & NETEVT_READ) {
+			if (ns->type == NETSOCK_TUNSRV)
+				tunnel_accept_event(ns);
+			else if (ns->type == NETSOCK_S5SRV)
+				socks5_accept_event(ns);
+			else
+				controller_accept_event(ns);
+		}
+		return;
+	}
+
+	// client socket
+	ret = 0;
+
+#ifdef USE_SHARDS
+	// the worker reads the tunnel, hang-ups are reported to the writer
+	if (ns->shard)
+		evts &= ~NETEVT_READ;
+#endif
+#ifdef USE_URING
+	// the tunnel is read by an io_uring request
+	if (ns->uring)
+		evts &= ~NETEVT_READ;
+#endif
+
+	if (evts & NETEVT_WRITE)
+		ret = tunnel_write_event(ns);
+
+	if ((ret >= 0) && (evts & NETEVT_READ)
+			&& (ns->state != NETSTATE_CANCELLED)) {
+
+		if (ns->type == NETSOCK_S5CLI)
+			ret = socks5_read_event(ns);
+		else if (ns->type == NETSOCK_CTRLCLI)
+			ret = controller_read_event(ns);
+		else
+			ret = channel_forward_recv(ns);
+	}
+
+	if (ret < 0)
+		netsock_close(ns);
+	else
+		netsock_update_watch(ns);
+}
+
 int main(int argc, char **argv)
 {
-	int ret, fd, max_fd, last_state, state;
-	netsock_t *ns, *bak;
-	fd_set rfd, wfd, *pwfd;
-	struct timeval tv, *ptv;
+	int i, n, last_state, state;
+	unsigned int evts, chan_evts;
+	long timeout, delay;
+	time_t now, trim_at;
+	netsock_t *ns;
 
 	setup(argc, argv);
 
@@ -111,16 +218,10 @@ int main(int argc, char **argv)
 	signal(SIGPIPE, handle_cleanup);
 
 	last_state = 0;
+	trim_at = time(NULL) + NETSOCK_TRIM_DELAY;
 
 	while (!killme) {
 
-		FD_ZERO(&rfd);
-		FD_SET(RDP_FD_IN, &rfd);
-		max_fd = RDP_FD_IN;
-
-		FD_ZERO(&wfd);
-		pwfd = NULL;
-		ptv = NULL;
 		state = channel_is_connected();
 		if (state != last_state) {
 
@@ -132,106 +233,51 @@ int main(int argc, char **argv)
 			last_state = state;
 		}
 
+		// wait for channel ping timeout only if channel is connected
+		timeout = -1;
 		if (state) {
-			// channel is connected
-			if (channel_want_write()) {
-				FD_SET(RDP_FD_OUT, &wfd);
-				max_fd = RDP_FD_OUT;
-				pwfd = &wfd;
-			}
-			tv.tv_sec  = 1;
-			tv.tv_usec = 0;
-			ptv = &tv;
+			channel_probe();
+			timeout = channel_write_delay();
+			if ((timeout < 0) || (timeout > 1000000))
+				timeout = 1000000;
 		}
-
-		list_for_each(ns, &all_sockets) {
-
-			assert(valid_netsock(ns));
-
-			if (ns->state != NETSTATE_CANCELLED) {
-				fd = ns->fd;
-
-				if (netsock_want_read(ns)) {
-					FD_SET(fd, &rfd);
-					if (fd > max_fd) max_fd = fd;
-				}
-
-				if (netsock_want_write(ns)) {
-					FD_SET(fd, &wfd);
-					pwfd = &wfd;
-					if (fd > max_fd) max_fd = fd;
-				}
-			}
+		now = time(NULL);
+		if (now >= trim_at) {
+			netsocks_trim();
+			trim_at = now + NETSOCK_TRIM_DELAY;
 		}
-
-		//debug(1, "channel connected: %i", channel_is_connected());
-
-		ret = select(max_fd+1, &rfd, pwfd, NULL, ptv);
-		if (ret == -1) {
-			error("select error (%s)", strerror(errno));
+		netsocks_check_budget();
+		netsocks_connect_timers();
+		delay = netsocks_connect_timeout();
+		if ((delay >= 0) && ((timeout < 0) || (delay < timeout)))
+			timeout = delay;
+		print_flush();
+		n = events_wait(state && channel_want_write(), timeout, &chan_evts);
+		if (n < 0)
 			break;
-		}
-		
-		if (ret == 0) {
-			// channel ping timeout
-			//info(0, "channel timeout");
-			continue;
-		}
 
-		if (FD_ISSET(RDP_FD_OUT, &wfd))
+		if (chan_evts & NETEVT_WRITE)
 			channel_write_event();
 
-		if (FD_ISSET(RDP_FD_IN, &rfd)) {
+		if (chan_evts & NETEVT_READ) {
 			if (channel_read_event() < 0)
 				break;
 		}
 
-		list_for_each_safe(ns, bak, &all_sockets) {
-
-			assert(valid_netsock(ns));
-
-			if (ns->state == NETSTATE_CANCELLED) {
-				debug(0, "closing cancelled connection");
-				netsock_close(ns);
-				continue;
-			}
-
-			if (ns->type == NETSOCK_RTUNSRV)
-				continue;
-
-			fd = ns->fd;
-			if (netsock_is_server(ns)) {
-				// server socket
-				if (FD_ISSET(fd, &rfd)) {
-					if (ns->type == NETSOCK_TUNSRV)
-						tunnel_accept_event(ns);
-					else if (ns->type == NETSOCK_S5SRV)
-						socks5_accept_event(ns);
-					else
-						controller_accept_event(ns);
-				}
-
-			} else {
-				// client socket
-				ret = 0;
-
-				if (FD_ISSET(fd, &wfd))
-					ret = tunnel_write_event(ns);
-
-				if ((ret >= 0) && FD_ISSET(fd, &rfd)) {
-
-					if (ns->type == NETSOCK_S5CLI)
-						ret = socks5_read_event(ns);
-					else if (ns->type == NETSOCK_CTRLCLI)
-						ret = controller_read_event(ns);
-					else
-						ret = channel_forward_recv(ns);
-				}
-
-				if (ret < 0)
-					netsock_close(ns);
-			}
+		if (chan_evts & NETEVT_RESOLVED)
+			netsocks_resolved();
+
+#ifdef USE_SHARDS
+		if (chan_evts & NETEVT_SHARDS)
+			shards_recv();
+#endif
+
+		for (i=0; i<n; ++i) {
+			ns = event_get(i, &evts);
+			netsock_event(ns, evts);
 		}
+
+		netsocks_close_cancelled();
 	}
 
 	bye();
@@ -22,11 +22,13 @@
  */
 #include "r2tcli.h"
 #include "nethelper.h"
+#include "resolver.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 /**
@@ -34,6 +36,54 @@
  */
 LIST_HEAD_INIT(all_sockets);
 
+/**
+ * cancelled network sockets waiting to be closed by the main loop
+ */
+LIST_HEAD_INIT(cancelled_sockets);
+/* number of client sockets with connection attempts in progress */
+static unsigned int connecting = 0;
+
+/* 1 while the I/O buffers exceed the memory budget */
+static int throttled = 0;
+/* number of times the memory budget has been exceeded */
+static unsigned int throttled_count = 0;
+
+/* free client sockets structures (without extra space) */
+static mempool_t netsock_pool = MEMPOOL_INITIALIZER("netsock",
+												sizeof(netsock_t), NETSOCK_POOL_SIZE);
+
+/**
+ * check if main loop must wait for network-read event
+ * @param[in] ns netsock socket
+ * @note tunnels are not read while the server receive window is exhausted,
+ *       while a window of input data is waiting for the channel or while
+ *       the memory budget is exceeded
+ */
+int netsock_want_read(netsock_t *ns)
+{
+	assert(valid_netsock(ns));
+
+	if (ns->conn) // the attempts are watched for reading
+		return 1;
+
+	if (ns->state < NETSTATE_CONNECTED)
+		return 0;
+
+	switch (ns->type) {
+
+		case NETSOCK_TUNCLI:
+		case NETSOCK_RTUNCLI:
+		case NETSOCK_S5CLI:
+			if (throttled)
+				return 0;
+			if (ns->state == NETSTATE_CONNECTED)
+				return (!ns->u.tuncli.win.tx || (ns->u.tuncli.win.credit > 0))
+					&& (iobuf_datalen(&ns->u.tuncli.ibuf) < RDP2TCP_WINDOW_SIZE);
+	}
+
+	return 1;
+}
+
 /**
  * check if main loop must wait for network-write event
  * @param[in] ns netsock socket
@@ -61,6 +111,75 @@ int netsock_want_write(netsock_t *ns)
 	return 0;
 }
 
+#if defined(USE_SHARDS) || defined(USE_URING)
+/**
+ * check if a socket forwards data from a connected tunnel to the channel
+ * @param[in] ns netsock socket
+ * @note such tunnels may be read by a worker thread or by io_uring
+ */
+static int netsock_forwarding(netsock_t *ns)
+{
+	return !ns->conn && (ns->state == NETSTATE_CONNECTED)
+			&& (ns->tid != R2TID_NONE)
+			&& ((ns->type == NETSOCK_TUNCLI) || (ns->type == NETSOCK_RTUNCLI)
+				|| (ns->type == NETSOCK_S5CLI));
+}
+#endif
+
+/**
+ * update the network events watched by the main loop
+ * @param[in] ns netsock socket
+ * @note the events loop is only notified when watched events change,
+ *       the read-event of tunnels read by a worker is watched by the worker
+ *       and the read-event of sockets read by io_uring is a request
+ */
+void netsock_update_watch(netsock_t *ns)
+{
+	unsigned int evts;
+
+	assert(valid_netsock(ns));
+
+	if ((ns->fd == -1) || (ns->type == NETSOCK_RTUNSRV))
+		return;
+
+	evts = 0;
+	if (ns->state != NETSTATE_CANCELLED) {
+		if (netsock_want_read(ns))
+			evts |= NETEVT_READ;
+		if (netsock_want_write(ns))
+			evts |= NETEVT_WRITE;
+	}
+
+#ifdef USE_SHARDS
+	if ((shards_fd() != -1) && !ns->shard && netsock_forwarding(ns))
+		shard_add(ns);
+	if (ns->shard) {
+		shard_watch(ns, evts & NETEVT_READ);
+		evts &= ~NETEVT_READ;
+	}
+#endif
+#ifdef USE_URING
+	if ((uring_fd() != -1) && !ns->uring
+#ifdef USE_SHARDS
+			&& !ns->shard
+#endif
+			&& ((netsock_is_server(ns) && ns->lhost)
+				|| netsock_forwarding(ns))) {
+		// io_uring accepts or receives, epoll only watches writes
+		// (accepted clients are typed later, servers have a listening host)
+		event_del(ns);
+		ns->uring = 1;
+	}
+	if (ns->uring) {
+		uring_watch(ns, evts & NETEVT_READ);
+		evts &= ~NETEVT_READ;
+	}
+#endif
+
+	if (evts != ns->events)
+		event_update(ns, evts);
+}
+
 /**
  * cancel a network socket / delayed netsock_close
  * @param[in] ns netsock socket
@@ -69,6 +188,29 @@ void netsock_cancel(netsock_t *ns)
 {
 	assert(valid_netsock(ns) && (ns->state != NETSTATE_CANCELLED));
 	ns->state = NETSTATE_CANCELLED;
+	tunnel_set_id(ns, R2TID_NONE);
+
+	if (ns->req) {
+		// the socket must not be connected once the hostname is resolved
+		resolver_cancel(ns->req);
+		ns->req = NULL;
+	}
+
+	list_del(&ns->list);
+	list_add_tail(&ns->list, &cancelled_sockets);
+}
+
+/**
+ * close all cancelled network sockets
+ */
+void netsocks_close_cancelled(void)
+{
+	netsock_t *ns, *bak;
+
+	list_for_each_safe(ns, bak, &cancelled_sockets) {
+		debug(0, "closing cancelled connection");
+		netsock_close(ns);
+	}
 }
 
 /**
@@ -80,9 +222,29 @@ void netsock_close(netsock_t *ns)
 	assert(ns && (((ns->type == NETSOCK_UNDEF) || valid_netsock(ns))));
 
 	list_del(&ns->list);
-
-	if (ns->type != NETSOCK_RTUNSRV)
+	tunnel_set_id(ns, R2TID_NONE);
+
+	if (ns->req)
+		resolver_cancel(ns->req);
+
+	if (ns->conn) {
+		// the socket descriptor belongs to the connection attempts
+		event_del(ns);
+		net_connect_free(ns->conn);
+		--connecting;
+
+	} else if ((ns->type != NETSOCK_RTUNSRV) && (ns->fd != -1)) {
+		event_del(ns);
+#ifdef USE_URING
+		// pending requests are cancelled, their completions are dropped
+		if (ns->uring)
+			uring_release(ns);
+#endif
+#ifdef USE_SHARDS
+		if (!ns->shard)
+#endif
 		close(ns->fd);
+	}
 
 	switch (ns->type) {
 
@@ -91,15 +253,49 @@ void netsock_close(netsock_t *ns)
 			break;
 
 		case NETSOCK_TUNCLI:
-			iobuf_kill(&ns->u.tuncli.obuf);
+		case NETSOCK_RTUNCLI:
+			channel_detach_tunnel(ns);
+			iobuf_kill2(&ns->u.tuncli.ibuf, &ns->u.tuncli.obuf);
 			break;
 
 		case NETSOCK_S5CLI:
+			channel_detach_tunnel(ns);
 			iobuf_kill2(&ns->u.sockscli.ibuf, &ns->u.sockscli.obuf);
 			break;
 	}
 
-	free(ns);
+#ifdef USE_SHARDS
+	if (ns->shard) {
+		// the worker closes the descriptor, data it received are dropped
+		ns->type = NETSOCK_UNDEF;
+		shard_release(ns);
+		return;
+	}
+#endif
+	netsock_free(ns);
+}
+
+/**
+ * release the memory of a netsock_t structure
+ * @param[in] ns socket allocated by netsock_alloc
+ */
+void netsock_free(netsock_t *ns)
+{
+	assert(ns);
+
+	if (ns->pooled)
+		mempool_put(&netsock_pool, ns);
+	else
+		free(ns);
+}
+
+/**
+ * get the counters of the sockets structures pool
+ * @param[out] stats pool counters
+ */
+void netsock_pool_stat(mempool_stats_t *stats)
+{
+	mempool_stat(&netsock_pool, stats);
 }
 
 /**
@@ -109,6 +305,7 @@ void netsock_close(netsock_t *ns)
  * @param[in] addr associated socket address
  * @param[in] extra_size extra padding allocated for structure
  * @return allocated structure
+ * @note structures without extra padding are allocated from a pool
  */
 netsock_t *netsock_alloc(
 					netsock_t *cli,
@@ -118,14 +315,32 @@ netsock_t *netsock_alloc(
 {
 	netsock_t *ns;
 
-	ns = calloc(1, sizeof(*ns)+extra_size);
+	if (!extra_size) {
+		ns = mempool_get(&netsock_pool);
+		if (ns) {
+			memset(ns, 0, sizeof(*ns));
+			ns->pooled = 1;
+		}
+	} else {
+		ns = calloc(1, sizeof(*ns)+extra_size);
+	}
+
 	if (ns) {
 		ns->type = NETSOCK_UNDEF;
 		ns->type = NETSTATE_INIT;
-		ns->tid  = 0xff;
+		ns->tid  = R2TID_NONE;
+		ns->weight = 1;
 		ns->fd = fd;
+		ns->since = time(NULL);
 		if (addr)
 			memcpy(&ns->addr, addr, sizeof(*addr));
+		if ((fd != -1) && event_add(ns)) {
+			if (cli)
+				controller_answer(cli, "failed to watch socket");
+			close(fd);
+			netsock_free(ns);
+			return NULL;
+		}
 		list_add_tail(&ns->list, &all_sockets);
 	} else {
 		error("failed to allocated socket structure");
@@ -144,6 +359,7 @@ netsock_t *netsock_alloc(
  * @param[in] port listening port
  * @param[in] extra_size extra padding allocated for structure
  * @return allocated structure
+ * @note structures without extra padding are allocated from a pool
  */
 netsock_t *netsock_bind(
 		netsock_t *cli,
@@ -153,6 +369,7 @@ netsock_t *netsock_bind(
 {
 	netsock_t *srv;
 	int ret, err, fd;
+	unsigned int host_len;
 	netaddr_t addr;
 
 	assert((!cli || valid_netsock(cli)) && host && *host && port);
@@ -165,9 +382,15 @@ netsock_t *netsock_bind(
 		return NULL;
 	}
 
-	srv = netsock_alloc(NULL, fd, &addr, extra_size);
-	if (srv)
+	// listening hostname is kept after the extra padding
+	host_len = strlen(host) + 1;
+	srv = netsock_alloc(NULL, fd, &addr, extra_size + host_len);
+	if (srv) {
+		srv->lhost = (char *)(srv + 1) + extra_size;
+		memcpy((char *)srv->lhost, host, host_len);
 		srv->state = NETSTATE_CONNECTED;
+		netsock_update_watch(srv);
+	}
 
 	return srv;
 }
@@ -185,6 +408,12 @@ netsock_t *netsock_accept(netsock_t *srv)
 
 	assert(valid_netsock(srv));
 
+#ifdef USE_URING
+	// connections of io_uring listeners are already accepted
+	if (srv->uring)
+		ret = uring_accept(srv, &fd, &addr);
+	else
+#endif
 	ret = net_accept(&srv->fd, &fd, &addr);
 	if (ret) {
 		error("failed to accept connection (%s)", strerror(ret));
@@ -192,8 +421,10 @@ netsock_t *netsock_accept(netsock_t *srv)
 	}
 
 	cli = netsock_alloc(NULL, fd, &addr, 0);
-	if (cli)
+	if (cli) {
 		cli->state = NETSTATE_CONNECTED;
+		netsock_update_watch(cli);
+	}
 
 	return cli;
 }
@@ -203,27 +434,244 @@ netsock_t *netsock_accept(netsock_t *srv)
  * @param[in] host client address 
  * @param[in] port client port
  * @return allocated structure
+ * @note the socket is connected by netsocks_resolved once the hostname
+ *       is resolved, data written meanwhile are queued
  */
 netsock_t *netsock_connect(const char *host, unsigned short port)
 {
 	netsock_t *cli;
-	int ret, err, fd;
-	netaddr_t addr;
 
 	assert(host && *host && port);
 
-	ret = net_client(AF_UNSPEC, host, port, &fd, &addr, &err);
+	cli = netsock_alloc(NULL, -1, NULL, 0);
+	if (cli) {
+		cli->state = NETSTATE_RESOLVING;
+		cli->req = resolver_query(AF_UNSPEC, host, port, cli);
+		if (!cli->req) {
+			error("failed to connect to %s:%hu", host, port);
+			list_del(&cli->list);
+			netsock_free(cli);
+			cli = NULL;
+		}
+	}
+
+	return cli;
+}
+
+/**
+ * connect the client sockets whose hostname resolution is completed
+ * @note tunnels which failed to connect are closed
+ */
+void netsocks_resolved(void)
+{
+	netreq_t *req;
+	netsock_t *ns;
+	int ret, err;
+
+	while ((req = resolver_next())) {
+
+		ns = (netsock_t *) req->ctx;
+		assert(valid_netsock(ns));
+		if (ns->state == NETSTATE_CANCELLED) {
+			// the socket is closed by netsocks_close_cancelled
+			if (ns->req == req)
+				ns->req = NULL;
+			resolver_free(req);
+			continue;
+		}
+		assert((ns->req == req) && (ns->state == NETSTATE_RESOLVING));
+		ns->req = NULL;
+
+		ret = req->ret;
+		err = req->err;
+		if (!ret)
+			ret = net_connect(req->res, req->port, &ns->conn, &err);
+
+		if (ret < 0) {
+			error("failed to connect to %s:%hu (%s)",
+					req->host, req->port, net_error(ret, err));
+			resolver_free(req);
+			tunnel_close(ns, 1);
+			continue;
+		}
+		resolver_free(req);
+
+		// the attempts are watched until one of them is connected
+		++connecting;
+		ns->fd = ns->conn->watch;
+		memcpy(&ns->addr, &ns->conn->addrs[0], sizeof(ns->addr));
+		ns->state = NETSTATE_CONNECTING;
+		if (event_add(ns)) {
+			tunnel_close(ns, 1);
+			continue;
+		}
+		netsock_update_watch(ns);
+	}
+}
+
+/**
+ * handle the completion (or the delay) of the connection attempts
+ * @param[in] ns client socket being connected
+ * @note the tunnel is closed if every attempt failed
+ */
+void netsock_connect_event(netsock_t *ns)
+{
+	int ret, err, fd;
+	char host[NETADDRSTR_MAXSIZE];
+
+	assert(valid_netsock(ns) && ns->conn
+			&& (ns->state == NETSTATE_CONNECTING));
+
+	ret = net_connect_poll(ns->conn, &fd, &ns->addr, &err);
+	if (ret > 0)
+		return;
+
+	event_del(ns);
+	net_connect_free(ns->conn);
+	ns->conn = NULL;
+	ns->fd   = -1;
+	--connecting;
+
+	netaddr_print(&ns->addr, host);
 	if (ret < 0) {
-		error("failed to connect to %s:%hu (%s)",
-				host, port, net_error(ret, err));
-		return NULL;
+		error("failed to connect to %s (%s)", host, net_error(ret, err));
+		tunnel_close(ns, 1);
+		return;
 	}
 
-	cli = netsock_alloc(NULL, fd, &addr, 0);
-	if (cli)
-		cli->state = (ret ? NETSTATE_CONNECTING : NETSTATE_CONNECTED);
+	ns->fd = fd;
+	if (event_add(ns)) {
+		close(fd);
+		ns->fd = -1;
+		tunnel_close(ns, 1);
+		return;
+	}
 
-	return cli;
+	info(1, "tunnel 0x%02x connected to %s", ns->tid, host);
+	ns->state = NETSTATE_CONNECTED;
+	netsock_update_watch(ns);
+}
+
+/**
+ * return the delay before the next connection attempt of a client socket
+ * @return the delay in microseconds, -1 if no attempt is delayed
+ */
+long netsocks_connect_timeout(void)
+{
+	netsock_t *ns;
+	long delay, min;
+
+	min = -1;
+	if (!connecting)
+		return min;
+
+	list_for_each(ns, &all_sockets) {
+		if (ns->conn) {
+			delay = net_connect_timeout(ns->conn);
+			if ((delay >= 0) && ((min < 0) || (delay < min)))
+				min = delay;
+		}
+	}
+
+	return (min < 0 ? min : min * 1000);
+}
+
+/**
+ * start the connection attempts whose delay has expired
+ */
+void netsocks_connect_timers(void)
+{
+	netsock_t *ns, *bak;
+
+	if (!connecting)
+		return;
+
+	list_for_each_safe(ns, bak, &all_sockets) {
+		if (ns->conn && !net_connect_timeout(ns->conn))
+			netsock_connect_event(ns);
+	}
+}
+
+/**
+ * release the storage of the idle sockets I/O buffers
+ * @note called every NETSOCK_TRIM_DELAY seconds, buffers are released
+ *       if they are empty and the pools shrink to the buffers needed
+ *       during the last period
+ */
+void netsocks_trim(void)
+{
+	netsock_t *ns;
+	unsigned long freed;
+
+	list_for_each(ns, &all_sockets) {
+		if (ns->state == NETSTATE_CANCELLED)
+			continue;
+		switch (ns->type) {
+
+			case NETSOCK_CTRLCLI:
+				iobuf_trim(&ns->u.ctrlcli.ibuf);
+				iobuf_trim(&ns->u.ctrlcli.obuf);
+				break;
+
+			case NETSOCK_TUNCLI:
+			case NETSOCK_RTUNCLI:
+			case NETSOCK_S5CLI:
+				iobuf_trim(&ns->u.tuncli.ibuf);
+				iobuf_trim(&ns->u.tuncli.obuf);
+				break;
+		}
+	}
+	channel_trim();
+
+	freed = iobuf_pools_trim();
+	freed += (unsigned long) mempool_trim(&netsock_pool) * sizeof(netsock_t);
+	if (freed)
+		debug(0, "%lu bytes of cached memory freed", freed);
+}
+
+/**
+ * stop (or resume) reading the sockets when the I/O buffers exceed (or
+ * fall back below 3/4 of) the memory budget
+ */
+void netsocks_check_budget(void)
+{
+	netsock_t *ns;
+	unsigned long used;
+	int over;
+
+	if (!RDP2TCP_MEM_BUDGET)
+		return;
+
+	used = iobuf_memory();
+	over = (used > (throttled ? RDP2TCP_MEM_BUDGET / 4 * 3 : RDP2TCP_MEM_BUDGET));
+	if (over == throttled)
+		return;
+
+	throttled = over;
+	if (over) {
+		// reported once, the "m" command counts the next times
+		if (!throttled_count++)
+			warn("memory budget exceeded (%lu KB), tunnels are not read "
+					"until buffers are released", used / 1024);
+		debug(0, "memory budget exceeded (%lu KB)", used / 1024);
+	} else {
+		debug(0, "memory back under budget (%lu KB)", used / 1024);
+	}
+
+	list_for_each(ns, &all_sockets)
+		netsock_update_watch(ns);
+}
+
+/**
+ * check if the sockets are not read because of the memory budget
+ * @param[out] count number of times the budget has been exceeded
+ * @return 1 if the memory budget is exceeded
+ */
+int netsocks_throttled(unsigned int *count)
+{
+	if (count)
+		*count = throttled_count;
+	return throttled;
 }
 
 /**
@@ -258,6 +706,7 @@ int netsock_read(
 		if (out_size)
 			*out_size = r;
 		print_xfer("tcp", 'r', r);
+		ns->rx += r;
 	}
 
 	return ret;
@@ -278,6 +727,12 @@ int netsock_write(netsock_t *ns, const void *buf, unsigned int len)
 
 	assert(valid_netsock(ns) && (buf || !len));
 
+	if ((ns->state == NETSTATE_RESOLVING) || ns->conn) {
+		if (len && !iobuf_append(&ns->u.tuncli.obuf, buf, len))
+			return error("failed to queue data");
+		return 1;
+	}
+
 	ret = net_write(&ns->fd, &ns->u.tuncli.obuf, buf, len, &w);
 	if (ret < 0) {
 		netaddr_print(&ns->addr, host);
@@ -286,8 +741,14 @@ int netsock_write(netsock_t *ns, const void *buf, unsigned int len)
 		else
 			error("failed to send data to %s (%s)", host, strerror(errno));
 
-	} else if (w > 0) {
-		print_xfer("tcp", 'w', w);
+	} else {
+		if (w > 0) {
+			print_xfer("tcp", 'w', w);
+			ns->tx += w;
+			if (ns->type != NETSOCK_CTRLCLI)
+				channel_ack_data(ns, w);
+		}
+		netsock_update_watch(ns);
 	}
 
 	return ret;
@@ -28,6 +28,23 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#endif
+
+#if defined(__linux__) && !defined(NO_SPLICE)
+#define USE_SPLICE
+#endif
+
+#if defined(USE_EPOLL) && !defined(NO_SHARDS)
+#define USE_SHARDS
+#endif
+
+#if defined(USE_EPOLL) && !defined(NO_URING)
+#define USE_URING
+#endif
 
 // netsock.c
 #define NETSOCK_CTRLSRV 0
@@ -42,10 +59,44 @@
 
 #define NETSTATE_INIT           0
 #define NETSTATE_CANCELLED      1
-#define NETSTATE_CONNECTING     2
-#define NETSTATE_CONNECTED      3
-#define NETSTATE_AUTHENTICATING 4
-#define NETSTATE_AUTHENTICATED  5
+#define NETSTATE_RESOLVING      2
+#define NETSTATE_CONNECTING     3
+#define NETSTATE_CONNECTED      4
+#define NETSTATE_AUTHENTICATING 5
+#define NETSTATE_AUTHENTICATED  6
+
+#ifndef NETSOCK_POOL_SIZE
+/** maximum number of free sockets structures kept for reuse */
+#define NETSOCK_POOL_SIZE 1024
+#endif
+
+#ifndef NETSOCK_TRIM_DELAY
+/** delay between releases of idle buffers (seconds) */
+#define NETSOCK_TRIM_DELAY 10
+#endif
+
+#ifndef RDP2TCP_MEM_BUDGET
+/** size of I/O buffers above which tunnels are not read (0 disables) */
+#define RDP2TCP_MEM_BUDGET (64UL*1024*1024)
+#endif
+
+/** tunnel flow control state */
+typedef struct _tunwin {
+	int credit;           /**< data accepted by the server (may be negative) */
+	unsigned int unacked; /**< data written to socket not yet acknowledged */
+	unsigned char tx;     /**< 1 if the server limits data sent to it */
+	unsigned char rx;     /**< 1 if window updates are sent to the server */
+} tunwin_t;
+
+/** tunnel channel scheduling state */
+typedef struct _tunsched {
+	struct _netsock *next; /**< next tunnel waiting for the channel */
+	unsigned int queued;   /**< input data already queued on the channel */
+	unsigned int deficit;  /**< data left to send in current round */
+	unsigned char active;  /**< 1 if tunnel is waiting for the channel */
+	unsigned char zskip;   /**< messages left to send uncompressed */
+	unsigned char zbackoff;/**< uncompressed messages after a poor ratio */
+} tunsched_t;
 
 /** network socket (tunnel, client or server) */
 typedef struct _netsock {
@@ -53,9 +104,28 @@ typedef struct _netsock {
 	int fd;                    /**< socket descriptor */
 	unsigned char type;        /**< socket type */
 	unsigned char state;       /**< tunnel state */
-	unsigned char tid;         /**< tunnel identifier */
+	unsigned char events;      /**< watched network events (NETEVT_xxx) */
+	unsigned char weight;      /**< channel share of tunnel (or of accepted ones) */
+	unsigned char nodelay;     /**< 1 if tunnel data are never coalesced */
+	unsigned short tid;        /**< tunnel identifier */
 	unsigned int min_io_size;  /**< minimal input buffer size */
 	netaddr_t addr;            /**< socket address */
+	struct _netreq *req;       /**< pending hostname resolution */
+	struct _netconn *conn;     /**< pending connection attempts */
+#ifdef USE_SHARDS
+	struct _shard *shard;      /**< worker thread reading the tunnel (or NULL) */
+	struct _netsock *released; /**< next socket released to the worker */
+	unsigned char armed;       /**< 1 if the worker may read the tunnel */
+#endif
+#ifdef USE_URING
+	struct _uringreq *ureq;    /**< io_uring receive or accept request */
+	unsigned char uring;       /**< 1 if read by the io_uring engine */
+#endif
+	const char *lhost;         /**< listening hostname (servers) */
+	unsigned char pooled;      /**< 1 if allocated from the sockets pool */
+	time_t since;              /**< creation time */
+	unsigned long long rx;     /**< bytes received from the socket */
+	unsigned long long tx;     /**< bytes sent to the socket */
 	union {
 		struct {
 			unsigned char  raf;   /**< remote address family */
@@ -64,6 +134,9 @@ typedef struct _netsock {
 		} tunsrv;
 		struct {
 			iobuf_t obuf;             /**< output buffer */
+			iobuf_t ibuf;             /**< input buffer */
+			tunwin_t win;             /**< flow control */
+			tunsched_t sched;         /**< channel scheduling */
 			netaddr_t raddr;          /**< remote address */
 			unsigned char is_process; /**< 1 if tunnel is a process */
 		} tuncli;
@@ -74,6 +147,8 @@ typedef struct _netsock {
 		struct {
 			iobuf_t obuf; /**< output buffer */
 			iobuf_t ibuf; /**< input buffer */
+			tunwin_t win; /**< flow control */
+			tunsched_t sched; /**< channel scheduling */
 		} sockscli;
 		struct {
 			unsigned short lport;     /**< local port */
@@ -87,46 +162,108 @@ typedef struct _netsock {
 
 #define valid_netsock(ns) \
 				((ns) && (ns)->list.next && (ns)->list.prev \
-				 && (((ns)->fd != -1) || ((ns)->type == NETSOCK_RTUNSRV)) \
+				 && (((ns)->fd != -1) || ((ns)->type == NETSOCK_RTUNSRV) \
+					 || ((ns)->type == NETSOCK_RTUNCLI)) \
 				 && ((ns)->type <= NETSOCK_RTUNCLI) \
 				 && (((ns)->addr.ip4.sin_family == AF_INET) \
 					 || ((ns)->addr.ip4.sin_family == AF_INET6) \
-					 || ((ns)->type == NETSOCK_RTUNSRV)))
+					 || ((ns)->fd == -1)))
 
 #define netsock_is_server(ns) ((ns)->type <= NETSOCK_S5SRV)
 
-/**
- * check if main loop must wait for network-read event
- * @param[in] ns netsock socket
- */
-#define netsock_want_read(ns) ((ns)->state >= NETSTATE_CONNECTED)
-
 netsock_t *netsock_alloc(netsock_t *, int, netaddr_t *, unsigned int);
 netsock_t *netsock_bind(netsock_t *, const char*,unsigned short,unsigned int);
 netsock_t *netsock_accept(netsock_t *);
 netsock_t *netsock_connect(const char *, unsigned short);
 int netsock_read(netsock_t *, iobuf_t *, unsigned int, unsigned int *);
 int  netsock_write(netsock_t *, const void *, unsigned int);
+int  netsock_want_read(netsock_t *);
 int  netsock_want_write(netsock_t *);
+void netsock_update_watch(netsock_t *);
 void netsock_cancel(netsock_t *);
 void netsock_close(netsock_t *);
+void netsock_free(netsock_t *);
+void netsock_pool_stat(mempool_stats_t *);
+void netsocks_close_cancelled(void);
+void netsocks_resolved(void);
+void netsock_connect_event(netsock_t *);
+long netsocks_connect_timeout(void);
+void netsocks_connect_timers(void);
+void netsocks_trim(void);
+void netsocks_check_budget(void);
+int netsocks_throttled(unsigned int *);
+
+// events.c
+#define NETEVT_READ  0x01
+#define NETEVT_WRITE 0x02
+#define NETEVT_RESOLVED 0x04
+#define NETEVT_SHARDS   0x08
+
+int  events_init(void);
+void events_kill(void);
+int  event_add(netsock_t *);
+void event_update(netsock_t *, unsigned int);
+void event_del(netsock_t *);
+int  events_wait(int, long, unsigned int *);
+netsock_t *event_get(int, unsigned int *);
 
 // channel.c
 #define RDP_FD_IN  0
 #define RDP_FD_OUT 1
 
+/** virtual channel counters */
+typedef struct _chanstats {
+	unsigned long long writes; /**< writes to the rdesktop pipe */
+	unsigned long long frames; /**< messages queued */
+	unsigned long long bytes;  /**< bytes written */
+	unsigned long long reads;  /**< reads (or splices) from the rdesktop pipe */
+	unsigned long long rbytes; /**< bytes read */
+	unsigned long long frames_out[R2TCMD_MAX]; /**< messages queued per command */
+	unsigned int ibuf;     /**< input buffer data (updated by channel_stats) */
+	unsigned int obuf;     /**< output buffer data (updated by channel_stats) */
+	unsigned int pending;  /**< queued data not written yet (channel_stats) */
+	unsigned int queued;   /**< queued messages (updated by channel_stats) */
+	unsigned int waiting;  /**< tunnels waiting (updated by channel_stats) */
+} chanstats_t;
+
+/** virtual channel measurements (timestamped pings) */
+typedef struct _chanrtt {
+	unsigned long long samples;  /**< echoed probes */
+	unsigned int last;           /**< last round-trip time (microseconds) */
+	unsigned int srtt;           /**< smoothed round-trip time (microseconds) */
+	unsigned int rttvar;         /**< round-trip time variation (microseconds) */
+	unsigned int min;            /**< minimal round-trip time (microseconds) */
+	unsigned int max;            /**< maximal round-trip time (microseconds) */
+	unsigned long long rate;     /**< smoothed delivery rate (bytes/s) */
+	unsigned long long max_rate; /**< maximal delivery rate (bytes/s) */
+} chanrtt_t;
+
 int  channel_init(void);
 void channel_kill(void);
+void channel_trim(void);
 int  channel_is_connected(void);
 int  channel_read_event(void);
 int  channel_want_write(void);
+long channel_write_delay(void);
+const chanstats_t *channel_stats(void);
+const chanrtt_t *channel_rtt(void);
 void channel_write_event(void);
+unsigned int channel_write_iov(struct iovec *, unsigned int);
+void channel_write_done(ssize_t);
 int  channel_ping(void);
-void channel_pong(void);
-unsigned char channel_request_tunnel(unsigned char, const char *, unsigned short, int);
+void channel_pong(unsigned char);
+void channel_probe(void);
+void channel_echo(const r2tmsg_ping_t *);
+unsigned short channel_request_tunnel(unsigned char, const char *, unsigned short, int);
+unsigned short channel_max_tid(void);
 int channel_forward_recv(netsock_t *);
-int channel_forward_iobuf(iobuf_t *, unsigned char);
-void channel_close_tunnel(unsigned char);
+int channel_forward_iobuf(iobuf_t *, unsigned short);
+int channel_forward_buf(netsock_t *, iobuf_t *);
+int channel_forward_data(netsock_t *, const void *, unsigned int);
+void channel_detach_tunnel(netsock_t *);
+void channel_close_tunnel(unsigned short);
+void channel_open_window(netsock_t *);
+void channel_ack_data(netsock_t *, unsigned int);
 
 // controller.c
 int  controller_start(const char *, unsigned short);
@@ -138,16 +275,20 @@ int  controller_answer(netsock_t *, const char *, ...);
 int tunnel_add(netsock_t *, char *, unsigned short, int, char *, unsigned short);
 int tunnel_add_reverse(netsock_t *, char *, unsigned short, int, char *, unsigned short);
 int tunnel_del(netsock_t *, char *, unsigned short);
+#define TUNOPT_WEIGHT  0
+#define TUNOPT_NODELAY 1
+int tunnel_set_option(netsock_t *, char *, unsigned short, int, unsigned char);
 void tunnel_accept_event(netsock_t *);
 void tunnel_connect_event(netsock_t *, int, const void *, unsigned short);
-void tunnel_revconnect_event(netsock_t *, unsigned char, int,
+void tunnel_revconnect_event(netsock_t *, unsigned short, int,
 										const void *, unsigned short);
 void tunnel_bind_event(netsock_t *, int, const void *, unsigned short);
 int  tunnel_write_event(netsock_t *);
 int  tunnel_write(netsock_t *, const void *, unsigned int);
 void tunnel_close(netsock_t *, int);
-unsigned char tunnel_generate_id(void);
-netsock_t *tunnel_lookup(unsigned char);
+unsigned short tunnel_generate_id(void);
+void tunnel_set_id(netsock_t *, unsigned short);
+netsock_t *tunnel_lookup(unsigned short);
 void tunnels_kill_clients(void);
 void tunnels_restart(void);
 
@@ -157,6 +298,29 @@ void socks5_connect_event(netsock_t *, int, const void *, unsigned short);
 void socks5_accept_event(netsock_t *);
 int  socks5_read_event(netsock_t *);
 
+// shards.c
+#ifdef USE_SHARDS
+int  shards_init(unsigned int);
+void shards_kill(void);
+int  shards_fd(void);
+int  shard_add(netsock_t *);
+void shard_watch(netsock_t *, int);
+void shard_release(netsock_t *);
+void shards_recv(void);
+#endif
+
+// uring.c
+#ifdef USE_URING
+struct epoll_event;
+int  uring_init(void);
+void uring_kill(void);
+int  uring_fd(void);
+void uring_watch(netsock_t *, int);
+void uring_release(netsock_t *);
+int  uring_accept(netsock_t *, int *, netaddr_t *);
+int  uring_wait(int, int, long, struct epoll_event *, int);
+#endif
+
 // main.c
 void bye(void);
 
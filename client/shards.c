@@ -0,0 +1,537 @@
+/**
+ * @file shards.c
+ * tunnel sockets read by worker threads
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#ifdef USE_SHARDS
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/** maximal number of worker threads */
+#define SHARDS_MAX 64
+/** number of items queued by a worker for the main loop (power of 2) */
+#define SHARD_RING_SIZE 256
+/** maximum number of events returned by a single epoll_wait */
+#define SHARD_EVENTS_MAX 64
+/** maximal size of data read from a tunnel per event */
+#define SHARD_READ_MAX (NETBUF_MAX_SIZE*4)
+
+/** result of the item acknowledging a released socket */
+#define SHARD_RELEASED 1
+
+/** tunnel data received by a worker thread */
+typedef struct _sharditem {
+	netsock_t *ns; /**< tunnel socket */
+	iobuf_t buf;   /**< received data */
+	int ret;       /**< 0, net_read error or SHARD_RELEASED */
+} sharditem_t;
+
+/**
+ * worker thread reading a shard of the tunnel sockets
+ * @note received data are carried to the main loop by a single-producer
+ *       single-consumer ring, the main loop keeps writing the channel
+ */
+typedef struct _shard {
+	pthread_t thread;     /**< worker thread */
+	int epfd;             /**< tunnel sockets watched by the worker */
+	int wakefd;           /**< eventfd waking the worker */
+	unsigned int count;   /**< number of tunnels in the shard */
+	netsock_t *released;  /**< sockets released by the main loop */
+	int stalled;          /**< 1 while the worker waits for ring space */
+	int stop;             /**< 1 once the worker must exit */
+	/** next ring item written by the worker */
+	unsigned int tail __attribute__((aligned(64)));
+	/** next ring item read by the main loop */
+	unsigned int head __attribute__((aligned(64)));
+	sharditem_t ring[SHARD_RING_SIZE]; /**< received data queue */
+} shard_t;
+
+static shard_t *shards = NULL;
+static unsigned int shards_count = 0;
+/* main loop notification (written by the workers) */
+static int notify_fd = -1;
+
+static void eventfd_set(int fd)
+{
+	uint64_t one = 1;
+	ssize_t r;
+
+	r = write(fd, &one, sizeof(one));
+	(void)r;
+}
+
+static void eventfd_clear(int fd)
+{
+	uint64_t count;
+	ssize_t r;
+
+	r = read(fd, &count, sizeof(count));
+	(void)r;
+}
+
+/* queue an item for the main loop, wait while the ring is full (worker) */
+static int shard_push(shard_t *sh, sharditem_t *item)
+{
+	unsigned int tail;
+	struct pollfd pfd;
+
+	tail = sh->tail;
+	while (tail - __atomic_load_n(&sh->head, __ATOMIC_ACQUIRE)
+				== SHARD_RING_SIZE) {
+
+		__atomic_store_n(&sh->stalled, 1, __ATOMIC_SEQ_CST);
+		if (tail - __atomic_load_n(&sh->head, __ATOMIC_SEQ_CST)
+				< SHARD_RING_SIZE)
+			break;
+
+		eventfd_set(notify_fd);
+		pfd.fd     = sh->wakefd;
+		pfd.events = POLLIN;
+		if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+			return -1;
+		eventfd_clear(sh->wakefd);
+
+		if (__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE))
+			return -1;
+	}
+
+	sh->ring[tail % SHARD_RING_SIZE] = *item;
+	__atomic_store_n(&sh->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* read a tunnel socket and queue the received data (worker) */
+static int shard_read(shard_t *sh, netsock_t *ns)
+{
+	sharditem_t item;
+	unsigned int r, min_size, total;
+	int ret;
+
+	item.ns = ns;
+	iobuf_init(&item.buf, 'r', "shard");
+	min_size = NETBUF_MAX_SIZE;
+	total = 0;
+
+	do {
+		ret = net_read(&ns->fd, &item.buf, 0, &min_size, &r);
+		total += r;
+	} while (!ret && (total < SHARD_READ_MAX));
+
+	// nothing read is still queued: only the main loop re-arms the socket
+	// (shard_watch), so that it is never read past the window or budget
+	item.ret = (ret < 0 ? ret : 0);
+	if (shard_push(sh, &item)) {
+		iobuf_kill(&item.buf);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* close the sockets released by the main loop (worker) */
+static int shard_close_released(shard_t *sh)
+{
+	netsock_t *ns, *next;
+	sharditem_t item;
+	int count;
+
+	ns = __atomic_exchange_n(&sh->released, NULL, __ATOMIC_ACQUIRE);
+	for (count=0; ns; ns=next, ++count) {
+
+		next = ns->released;
+		close(ns->fd);
+
+		// the main loop frees the socket once its data are delivered
+		item.ns  = ns;
+		item.ret = SHARD_RELEASED;
+		iobuf_init(&item.buf, 'r', "shard");
+		if (shard_push(sh, &item)) {
+			// exiting, the main loop does not deliver anymore
+			for (; ns; ns=next) {
+				next = ns->released;
+				if (ns != item.ns)
+					close(ns->fd);
+				netsock_free(ns);
+			}
+			return -1;
+		}
+	}
+
+	return count;
+}
+
+static void *shard_thread(void *arg)
+{
+	shard_t *sh;
+	struct epoll_event evts[SHARD_EVENTS_MAX];
+	int i, n, ret, queued;
+
+	sh = (shard_t *) arg;
+
+	while (!__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE)) {
+
+		queued = shard_close_released(sh);
+		if (queued < 0)
+			break;
+		if (queued > 0)
+			eventfd_set(notify_fd);
+
+		n = epoll_wait(sh->epfd, evts, SHARD_EVENTS_MAX, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		queued = 0;
+		for (i=0; i<n; ++i) {
+			if (!evts[i].data.ptr) {
+				eventfd_clear(sh->wakefd);
+				continue;
+			}
+			ret = shard_read(sh, (netsock_t *) evts[i].data.ptr);
+			if (ret < 0)
+				return NULL;
+			queued += ret;
+		}
+
+		// a single notification for all the tunnels read
+		if (queued > 0)
+			eventfd_set(notify_fd);
+	}
+
+	return NULL;
+}
+
+/* deliver an item received from a worker (main loop) */
+static void shard_deliver(sharditem_t *item)
+{
+	netsock_t *ns;
+	char host[NETADDRSTR_MAXSIZE];
+
+	ns = item->ns;
+	if (item->ret == SHARD_RELEASED) {
+		netsock_free(ns);
+		return;
+	}
+
+	if ((ns->type == NETSOCK_UNDEF) || (ns->state != NETSTATE_CONNECTED)) {
+		// closed or cancelled tunnel
+		iobuf_kill(&item->buf);
+		return;
+	}
+
+	ns->armed = 0;
+	if (iobuf_datalen(&item->buf) > 0) {
+		if (channel_forward_buf(ns, &item->buf)) {
+			tunnel_close(ns, 1);
+			return;
+		}
+	} else {
+		iobuf_kill(&item->buf);
+	}
+
+	if (item->ret < 0) {
+		netaddr_print(&ns->addr, host);
+		if (item->ret == NETERR_CLOSED)
+			info(0, "connection %s closed", host);
+		else
+			error("failed to recv data from %s (%s)", host,
+					strerror(-item->ret));
+		tunnel_close(ns, 1);
+		return;
+	}
+
+	netsock_update_watch(ns);
+}
+
+/* start a worker thread */
+static int shard_spawn(shard_t *sh)
+{
+	struct epoll_event ev;
+	sigset_t all, old;
+	int ret;
+
+	sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sh->epfd == -1)
+		return error("failed to create epoll instance (%s)", strerror(errno));
+
+	sh->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (sh->wakefd == -1) {
+		error("failed to create worker eventfd (%s)", strerror(errno));
+		goto fail;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->wakefd, &ev)) {
+		error("failed to watch worker eventfd (%s)", strerror(errno));
+		goto fail;
+	}
+
+	// signals are handled by the main loop only
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&sh->thread, NULL, shard_thread, sh);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!ret)
+		return 0;
+	error("failed to start worker thread (%s)", strerror(ret));
+
+fail:
+	if (sh->wakefd != -1)
+		close(sh->wakefd);
+	close(sh->epfd);
+	return -1;
+}
+
+/**
+ * start the worker threads reading the tunnels
+ * @param[in] count number of worker threads (0 to read them in the main loop)
+ * @return 0 on success
+ */
+int shards_init(unsigned int count)
+{
+	void *mem;
+
+	trace_evt("count=%u", count);
+
+	if (!count)
+		return 0;
+	if (count > SHARDS_MAX)
+		count = SHARDS_MAX;
+
+	notify_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (notify_fd == -1)
+		return error("failed to create worker eventfd (%s)", strerror(errno));
+
+	if (posix_memalign(&mem, 64, count * sizeof(shard_t))) {
+		shards_kill();
+		return error("failed to allocate workers memory");
+	}
+	shards = (shard_t *) mem;
+	memset(shards, 0, count * sizeof(shard_t));
+
+	for (shards_count=0; shards_count<count; ++shards_count) {
+		shards[shards_count].wakefd = -1;
+		if (shard_spawn(&shards[shards_count])) {
+			shards_kill();
+			return -1;
+		}
+	}
+
+	info(0, "tunnels read by %u worker threads", count);
+	return 0;
+}
+
+/**
+ * stop the worker threads
+ * @note the tunnels must be closed before, the sockets still owned by
+ *       the workers are closed
+ */
+void shards_kill(void)
+{
+	shard_t *sh;
+	sharditem_t *item;
+	netsock_t *ns, *next;
+	unsigned int i;
+
+	trace_evt("");
+
+	for (i=0; i<shards_count; ++i) {
+		sh = &shards[i];
+		__atomic_store_n(&sh->stop, 1, __ATOMIC_RELEASE);
+		eventfd_set(sh->wakefd);
+		pthread_join(sh->thread, NULL);
+
+		for (; sh->head!=sh->tail; ++sh->head) {
+			item = &sh->ring[sh->head % SHARD_RING_SIZE];
+			if (item->ret == SHARD_RELEASED)
+				netsock_free(item->ns);
+			else
+				iobuf_kill(&item->buf);
+		}
+
+		for (ns=sh->released; ns; ns=next) {
+			next = ns->released;
+			close(ns->fd);
+			netsock_free(ns);
+		}
+
+		close(sh->wakefd);
+		close(sh->epfd);
+	}
+
+	if (shards) {
+		free(shards);
+		shards = NULL;
+	}
+	shards_count = 0;
+
+	if (notify_fd != -1) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+}
+
+/**
+ * get the descriptor notifying the main loop of received tunnel data
+ * @return -1 if the tunnels are read by the main loop
+ */
+int shards_fd(void)
+{
+	return notify_fd;
+}
+
+/**
+ * move the reads of a connected tunnel to the least loaded worker
+ * @param[in] ns tunnel socket
+ * @return 0 on success
+ * @note the main loop only watches the socket while data are written
+ */
+int shard_add(netsock_t *ns)
+{
+	shard_t *sh;
+	struct epoll_event ev;
+	unsigned int i;
+
+	assert(valid_netsock(ns) && !ns->shard && shards_count);
+	trace_evt("fd=%i", ns->fd);
+
+	sh = &shards[0];
+	for (i=1; i<shards_count; ++i) {
+		if (shards[i].count < sh->count)
+			sh = &shards[i];
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = EPOLLONESHOT;
+	ev.data.ptr = ns;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, ns->fd, &ev))
+		return error("failed to watch tunnel socket (%s)", strerror(errno));
+
+	event_del(ns);
+	ns->shard = sh;
+	ns->armed = 0;
+	++sh->count;
+
+	return 0;
+}
+
+/**
+ * allow or forbid the worker to read a tunnel
+ * @param[in] ns tunnel socket read by a worker
+ * @param[in] read 1 if the tunnel may be read
+ * @note the socket is watched with EPOLLONESHOT, the worker reads it once
+ *       and the main loop watches it again when the data are delivered
+ */
+void shard_watch(netsock_t *ns, int read)
+{
+	struct epoll_event ev;
+
+	assert(valid_netsock(ns) && ns->shard);
+
+	if (!read == !ns->armed)
+		return;
+	trace_evt("fd=%i, read=%i", ns->fd, read);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events   = (read ? EPOLLIN : 0) | EPOLLONESHOT;
+	ev.data.ptr = ns;
+	if (!epoll_ctl(ns->shard->epfd, EPOLL_CTL_MOD, ns->fd, &ev))
+		ns->armed = (unsigned char) read;
+	else
+		error("failed to update tunnel socket events (%s)", strerror(errno));
+}
+
+/**
+ * release a closed tunnel socket to its worker
+ * @param[in] ns tunnel socket
+ * @note the worker closes the descriptor and the socket is freed once
+ *       the data received before are delivered
+ */
+void shard_release(netsock_t *ns)
+{
+	shard_t *sh;
+
+	assert(ns && ns->shard);
+	trace_evt("fd=%i", ns->fd);
+
+	sh = ns->shard;
+	epoll_ctl(sh->epfd, EPOLL_CTL_DEL, ns->fd, NULL);
+	--sh->count;
+
+	ns->released = __atomic_load_n(&sh->released, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&sh->released, &ns->released, ns,
+					0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	eventfd_set(sh->wakefd);
+}
+
+/**
+ * deliver the tunnel data received by the workers to the channel
+ * @note at most a ring of items is delivered per worker so that busy
+ *       workers do not starve the main loop
+ */
+void shards_recv(void)
+{
+	shard_t *sh;
+	unsigned int i, head, end;
+
+	trace_evt("");
+
+	eventfd_clear(notify_fd);
+
+	for (i=0; i<shards_count; ++i) {
+		sh = &shards[i];
+
+		head = sh->head;
+		end = __atomic_load_n(&sh->tail, __ATOMIC_ACQUIRE);
+		while (head != end) {
+			shard_deliver(&sh->ring[head % SHARD_RING_SIZE]);
+			++head;
+			__atomic_store_n(&sh->head, head, __ATOMIC_RELEASE);
+		}
+
+		// ordered with the worker which sets stalled then checks head
+		__atomic_store_n(&sh->head, head, __ATOMIC_SEQ_CST);
+		if (__atomic_exchange_n(&sh->stalled, 0, __ATOMIC_SEQ_CST))
+			eventfd_set(sh->wakefd);
+
+		// come back for the data queued meanwhile
+		if (__atomic_load_n(&sh->tail, __ATOMIC_ACQUIRE) != head)
+			eventfd_set(notify_fd);
+	}
+}
+
+#endif
@@ -107,7 +107,8 @@ static int socks5_setup(netsock_t *cli)
 {
 	unsigned int len, methods_count, port_off;
 	unsigned short port;
-	unsigned char tunaf, tid, *buf, out[2];
+	unsigned char tunaf, *buf, out[2];
+	unsigned short tid;
 	iobuf_t *ibuf;
 	char *host, ip[INET6_ADDRSTRLEN+1];
 
@@ -233,10 +234,11 @@ static int socks5_setup(netsock_t *cli)
 	if (host && (host != ip))
 		free(host);
 
-	if (tid == 0xff)
+	if (tid == R2TID_NONE)
 		return -1;
 
-	cli->tid   = tid;
+	tunnel_set_id(cli, tid);
+	channel_open_window(cli);
 	cli->state = NETSTATE_CONNECTING;
 
 	return 0;
@@ -276,7 +278,9 @@ void socks5_accept_event(netsock_t *srv)
 		info(0, "accepted socks5 client %s", netaddr_print(&cli->addr, host));
 		if (channel_is_connected()) {
 			cli->type  = NETSOCK_S5CLI;
-			cli->tid   = 0xff;
+			cli->tid   = R2TID_NONE;
+			cli->weight = srv->weight;
+			cli->nodelay = srv->nodelay;
 			cli->state = NETSTATE_AUTHENTICATING;
 			iobuf_init2(&cli->u.sockscli.ibuf, &cli->u.sockscli.obuf, "socks5");
 		} else {
@@ -22,51 +22,64 @@
  */
 #include "r2tcli.h"
 #include "nethelper.h"
+#include "tidmap.h"
 
 #include <string.h>
 #include <errno.h>
 
 extern struct list_head all_sockets;
 
+/** tunnel sockets indexed by tunnel ID */
+static tidmap_t tids;
+
 /**
  * lookup socket by tunnel ID
  * @param[in] tid tunnel ID
  * @return NULL if socket was not found
  */
-netsock_t *tunnel_lookup(unsigned char tid)
+netsock_t *tunnel_lookup(unsigned short tid)
 {
-	netsock_t *ns;
-
-	assert(tid != 0xff);
 	trace_tun("id=0x%02x", tid);
 
-	list_for_each(ns, &all_sockets) {
-		if (ns->tid == tid)
-			return ns;
-	}
-
-	return NULL;
+	return (netsock_t *) tidmap_get(&tids, tid);
 }
 
-static unsigned char last_tid = 0xff;
-
 /**
  * generate a unused tunnel ID
- * @return 0xff on error (all tunnel ID are used)
+ * @return R2TID_NONE on error (all tunnel ID are used)
+ * @note only 8-bit identifiers are generated until the server supports
+ *       v2 frames
  */
-unsigned char tunnel_generate_id(void)
+unsigned short tunnel_generate_id(void)
 {
-	unsigned char tid;
+	unsigned short tid, max;
 
-	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
-			last_tid = tid;
-			return tid;
-		}
+	max = channel_max_tid();
+	tid = tidmap_next_free(&tids, max);
+	if (tid == max) {
+		error("failed to find available tunnel id");
+		return R2TID_NONE;
 	}
 
-	error("failed to find available tunnel id");
-	return 0xff;
+	return tid;
+}
+
+/**
+ * associate a tunnel ID to a socket
+ * @param[in] ns tunnel socket
+ * @param[in] tid unused tunnel ID or R2TID_NONE to release the socket tunnel ID
+ */
+void tunnel_set_id(netsock_t *ns, unsigned short tid)
+{
+	assert(ns);
+	trace_tun("id=0x%02x --> 0x%02x", ns->tid, tid);
+
+	if ((ns->tid != R2TID_NONE) && (tidmap_get(&tids, ns->tid) == ns))
+		tidmap_del(&tids, ns->tid);
+
+	ns->tid = tid;
+	if (tid != R2TID_NONE)
+		tidmap_set(&tids, tid, ns);
 }
 
 static unsigned char sysaf_to_rdpaf(int af)
@@ -145,6 +158,7 @@ int tunnel_add_reverse(
 			unsigned short rport)
 {
 	size_t lhost_len, rhost_len;
+	unsigned short tid;
 	netsock_t *ns;
 	char str[NETADDRSTR_MAXSIZE*2 + 64];
 
@@ -166,11 +180,12 @@ int tunnel_add_reverse(
 
 	if (channel_is_connected()) {
 		// request tunnel binding right now if channel is connected
-		ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
-		if (ns->tid == 0xff) {
+		tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+		if (tid == R2TID_NONE) {
 			netsock_close(ns);
 			return controller_answer(cli, "error: failed to request port binding");
 		}
+		tunnel_set_id(ns, tid);
 	}
 
 	snprintf(str, sizeof(str)-1, "tunnel [%s]:%hu <-- [%s]:%hu is being registred",
@@ -180,24 +195,20 @@ int tunnel_add_reverse(
 }
 
 /**
- * try to remove tunnel removal
- * @param[in] cli socket of client who requested tunnel removal
+ * lookup a tunnel server by local address
  * @param[in] lhost tunnel local hostname
  * @param[in] lport tunnel local TCP port
- * @return 0 or 1 if the controller is still connected
+ * @return NULL if tunnel is not found
+ * @note hostnames are not resolved but compared with the ones used to
+ *       register the tunnels, numeric addresses are compared as addresses
  */
-int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
+static netsock_t *tunnel_lookup_server(const char *lhost, unsigned short lport)
 {
 	netsock_t *ns;
-	int ret, err;
 	netaddr_t addr;
+	int numeric, ret;
 
-	assert(valid_netsock(cli) && lhost && *lhost && lport);
-	trace_tun("host=%s:%i", lhost, lport);
-
-	ret = net_resolve(AF_UNSPEC, lhost, lport, &addr, &err);
-	if (ret)
-		return controller_answer(cli, "error: %s", net_error(ret, err));
+	numeric = !net_parse(AF_UNSPEC, lhost, lport, &addr);
 
 	list_for_each(ns, &all_sockets) {
 
@@ -207,7 +218,11 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
 
 			case NETSOCK_TUNSRV:
 			case NETSOCK_S5SRV:
-				ret = netaddr_cmp(&ns->addr, &addr);
+				if (numeric)
+					ret = netaddr_cmp(&ns->addr, &addr);
+				else
+					ret = ((htons(lport) != ns->addr.ip4.sin_port)
+							|| strcmp(lhost, ns->lhost));
 				break;
 
 			case NETSOCK_RTUNSRV:
@@ -216,14 +231,76 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
 				break;
 		}
 
-		if (!ret) {
-			tunnel_close(ns, 1);
-			info(0, "tunnel [%s]:%hu removed", lhost, lport);
-			return controller_answer(cli, "tunnel [%s]:%hu removed",lhost,lport);
-		}
+		if (!ret)
+			return ns;
 	}
 
-	return controller_answer(cli,"error: tunnel [%s]:%hu not found",lhost,lport);
+	return NULL;
+}
+
+/**
+ * try to remove tunnel removal
+ * @param[in] cli socket of client who requested tunnel removal
+ * @param[in] lhost tunnel local hostname
+ * @param[in] lport tunnel local TCP port
+ * @return 0 or 1 if the controller is still connected
+ */
+int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
+{
+	netsock_t *ns;
+
+	assert(valid_netsock(cli) && lhost && *lhost && lport);
+	trace_tun("host=%s:%i", lhost, lport);
+
+	ns = tunnel_lookup_server(lhost, lport);
+	if (!ns)
+		return controller_answer(cli,"error: tunnel [%s]:%hu not found",lhost,lport);
+
+	tunnel_close(ns, 1);
+	info(0, "tunnel [%s]:%hu removed", lhost, lport);
+	return controller_answer(cli, "tunnel [%s]:%hu removed",lhost,lport);
+}
+
+/**
+ * set a channel option of the connections accepted by a tunnel
+ * @param[in] cli socket of client who requested the change
+ * @param[in] lhost tunnel local hostname
+ * @param[in] lport tunnel local TCP port
+ * @param[in] opt TUNOPT_WEIGHT (scheduling weight, 1 is the default) or
+ *            TUNOPT_NODELAY (1 to bypass channel writes coalescing)
+ * @param[in] val option value
+ * @return 0 or 1 if the controller is still connected
+ * @note established connections keep their options
+ */
+int tunnel_set_option(
+			netsock_t *cli,
+			char *lhost,
+			unsigned short lport,
+			int opt,
+			unsigned char val)
+{
+	netsock_t *ns;
+	const char *name;
+
+	assert(valid_netsock(cli) && lhost && *lhost && lport
+			&& (((opt == TUNOPT_WEIGHT) && val)
+				|| ((opt == TUNOPT_NODELAY) && (val <= 1))));
+	trace_tun("host=%s:%i, opt=%i, val=%u", lhost, lport, opt, val);
+
+	ns = tunnel_lookup_server(lhost, lport);
+	if (!ns)
+		return controller_answer(cli,"error: tunnel [%s]:%hu not found",lhost,lport);
+
+	if (opt == TUNOPT_WEIGHT) {
+		ns->weight = val;
+		name = "weight";
+	} else {
+		ns->nodelay = val;
+		name = "nodelay";
+	}
+	info(0, "tunnel [%s]:%hu %s set to %u", lhost, lport, name, val);
+	return controller_answer(cli, "tunnel [%s]:%hu %s set to %u",
+										lhost, lport, name, val);
 }
 
 /**
@@ -233,7 +310,7 @@ int tunnel_del(netsock_t *cli, char *lhost, unsigned short lport)
  */
 void tunnel_close(netsock_t *ns, int notify_server)
 {
-	unsigned char tid;
+	unsigned short tid;
 	//char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_netsock(ns));
@@ -241,13 +318,8 @@ void tunnel_close(netsock_t *ns, int notify_server)
 	tid = ns->tid;
 	trace_tun("tid=0x%02x, notify=%i", tid, notify_server);
 
-	if (tid != 0xff) {
-		if (notify_server)
-			channel_close_tunnel(tid);
-
-		if (tid == last_tid)
-			--last_tid;
-	}
+	if ((tid != R2TID_NONE) && notify_server)
+		channel_close_tunnel(tid);
 
 	netsock_cancel(ns);
 }
@@ -258,7 +330,7 @@ void tunnel_close(netsock_t *ns, int notify_server)
  */
 void tunnel_accept_event(netsock_t *srv)
 {
-	unsigned char tid;
+	unsigned short tid;
 	netsock_t *cli;
 	char host1[NETADDRSTR_MAXSIZE], host2[NETADDRSTR_MAXSIZE];
 
@@ -268,7 +340,9 @@ void tunnel_accept_event(netsock_t *srv)
 	cli = netsock_accept(srv);
 	if (cli) {
 		cli->type = NETSOCK_TUNCLI;
-		iobuf_init(&cli->u.tuncli.obuf, 'w', "tun");
+		cli->weight = srv->weight;
+		cli->nodelay = srv->nodelay;
+		iobuf_init2(&cli->u.tuncli.ibuf, &cli->u.tuncli.obuf, "tun");
 
 		info(0, "accepted local tunnel client %s on %s",
 				netaddr_print(&cli->addr, host1),
@@ -279,11 +353,13 @@ void tunnel_accept_event(netsock_t *srv)
 													srv->u.tunsrv.rhost,
 													srv->u.tunsrv.rport, 0);
 
-			if (tid != 0xff) {
+			if (tid != R2TID_NONE) {
 				info(0, "reserved tunnel 0x%02x for %s",
 						tid, netaddr_print(&cli->addr, host1));
-				cli->tid = tid;
+				tunnel_set_id(cli, tid);
+				channel_open_window(cli);
 				cli->state = NETSTATE_CONNECTING;
+				netsock_update_watch(cli);
 			} else {
 				netsock_close(cli);
 			}
@@ -318,6 +394,7 @@ void tunnel_connect_event(
 		af == AF_INET ? "ipv4" : (af == AF_UNSPEC ? "proc" : "ipv6"), port);
 
 	ns->state = NETSTATE_CONNECTED;
+	netsock_update_watch(ns);
 
 	if (af != AF_UNSPEC) {
 		// tcp forwarding
@@ -366,7 +443,7 @@ void tunnel_bind_event(
  */
 void tunnel_revconnect_event(
 				netsock_t *srv,
-				unsigned char new_id,
+				unsigned short new_id,
 				int af,
 				const void *addr,
 				unsigned short port)
@@ -379,9 +456,13 @@ void tunnel_revconnect_event(
 	cli = netsock_connect(srv->u.rtunsrv.lhost, srv->u.rtunsrv.lport);
 	if (cli) {
 		cli->type = NETSOCK_RTUNCLI;
-		cli->tid = new_id;
+		cli->weight = srv->weight;
+		cli->nodelay = srv->nodelay;
+		tunnel_set_id(cli, new_id);
+		channel_open_window(cli);
 		netaddr_set(af, addr, port, &cli->u.tuncli.raddr);
-		iobuf_init(&cli->u.tuncli.obuf, 'w', "rtuncli");
+		iobuf_init2(&cli->u.tuncli.ibuf, &cli->u.tuncli.obuf, "rtuncli");
+		netsock_update_watch(cli);
 	} else {
 		channel_close_tunnel(new_id);
 	}
@@ -428,7 +509,7 @@ void tunnels_kill_clients(void)
 	list_for_each_safe(ns, bak, &all_sockets) {
 
 		if (ns->type == NETSOCK_RTUNSRV) {
-			ns->tid   = 0xff;
+			tunnel_set_id(ns, R2TID_NONE);
 			ns->u.rtunsrv.bound = 0;
 			memset(&ns->addr, 0, sizeof(ns->addr));
 
@@ -448,6 +529,7 @@ void tunnels_restart(void)
 	netsock_t *ns, *bak;
 	const char *rhost;
 	unsigned short rport;
+	unsigned short tid;
 
 	list_for_each_safe(ns, bak, &all_sockets) {
 
@@ -456,8 +538,9 @@ void tunnels_restart(void)
 			rhost = &ns->u.rtunsrv.lhost[ns->u.rtunsrv.lhost_len];
 			rport = ns->u.rtunsrv.rport;
 
-			ns->tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
-			if (ns->tid != 0xff) {
+			tid = channel_request_tunnel(TUNAF_ANY, rhost, rport, 1);
+			if (tid != R2TID_NONE) {
+				tunnel_set_id(ns, tid);
 				info(0, "restarted %s:%hu <-- %s:%hu",
 						ns->u.rtunsrv.lhost, ns->u.rtunsrv.lport, rhost, rport);
 			} else {
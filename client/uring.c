@@ -0,0 +1,803 @@
+/**
+ * @file uring.c
+ * io_uring engine accepting connections, reading tunnels and writing
+ * the rdesktop pipe
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "r2tcli.h"
+
+#ifdef USE_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+/** number of submission queue entries */
+#define URING_ENTRIES 256
+/** number of buffers provided for tunnel reads (power of 2) */
+#ifndef URING_BUFS
+#define URING_BUFS 256
+#endif
+/** size of buffers provided for tunnel reads */
+#define URING_BUF_SIZE NETBUF_MAX_SIZE
+/** provided buffers group identifier */
+#define URING_BGID 0
+/** number of buffers written by a single writev to the rdesktop pipe */
+#define URING_WRITE_IOV 64
+/** maximal number of linked writes to the rdesktop pipe */
+#define URING_WRITE_LINKS 4
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
+
+/* user data of the requests which are not bound to a socket */
+#define TAG_CANCEL 0
+#define TAG_EPOLL  1
+#define TAG_PIPE   2
+#define TAG_WRITE  3
+
+#define UREQ_RECV   0
+#define UREQ_ACCEPT 1
+
+/**
+ * multishot request receiving tunnel data or accepting connections
+ * @note the request outlives its socket until the final completion
+ */
+typedef struct _uringreq {
+	struct list_head list;  /**< requests double-linked list */
+	netsock_t *ns;          /**< socket (NULL once released) */
+	int *fds;               /**< accepted connections not yet handled */
+	unsigned int nfds;      /**< number of accepted connections */
+	unsigned int maxfds;    /**< size of the accepted connections array */
+	unsigned char op;       /**< UREQ_RECV or UREQ_ACCEPT */
+	unsigned char armed;    /**< 1 until the final completion */
+	unsigned char cancel;   /**< 1 once cancellation is requested */
+} uringreq_t;
+
+/** io_uring instance */
+static struct {
+	int fd;                        /**< io_uring descriptor (-1 if disabled) */
+	void *sq_ring;                 /**< submission ring mapping */
+	void *cq_ring;                 /**< completion ring mapping */
+	size_t sq_size;                /**< size of the submission ring mapping */
+	size_t cq_size;                /**< size of the completion ring mapping */
+	struct io_uring_sqe *sqes;     /**< submission queue entries */
+	size_t sqes_size;              /**< size of the entries mapping */
+	unsigned int *sq_head;         /**< first entry not consumed by kernel */
+	unsigned int *sq_ktail;        /**< last entry published to kernel */
+	unsigned int *sq_array;        /**< submission ring indexes */
+	unsigned int sq_mask;          /**< submission ring mask */
+	unsigned int sq_entries;       /**< number of submission entries */
+	unsigned int sq_tail;          /**< next entry filled */
+	unsigned int *cq_head;         /**< first completion not consumed */
+	unsigned int *cq_tail;         /**< last completion posted by kernel */
+	unsigned int cq_mask;          /**< completion ring mask */
+	struct io_uring_cqe *cqes;     /**< completion queue entries */
+	struct io_uring_buf_ring *br;  /**< provided buffers ring */
+	unsigned char *bufs;           /**< provided buffers memory */
+	unsigned short br_tail;        /**< provided buffers ring tail */
+	unsigned int writes;           /**< linked writes not completed */
+	ssize_t written;               /**< data written by the linked writes */
+	int werr;                      /**< first error of the linked writes */
+	unsigned int accepted;         /**< accepted connections not handled */
+	unsigned char ep_polled;       /**< 1 if epoll descriptor is polled */
+	unsigned char ep_ready;        /**< 1 if epoll descriptor is readable */
+	unsigned char pipe_polled;     /**< 1 if rdesktop pipe is polled */
+	unsigned char pipe_blocked;    /**< 1 if rdesktop pipe is full */
+} ring = { .fd = -1 };
+
+/** receive and accept requests */
+static LIST_HEAD_INIT(requests);
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int submit, unsigned int wait,
+								unsigned int flags, void *arg, size_t argsz)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+								arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned int op, void *arg,
+								unsigned int count)
+{
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+/* multishot receive requires Linux 6.0 */
+static int kernel_supported(void)
+{
+	struct utsname u;
+	unsigned int major, minor;
+
+	if (uname(&u) || (sscanf(u.release, "%u.%u", &major, &minor) != 2))
+		return 0;
+
+	return major >= 6;
+}
+
+/**
+ * submit the queued requests and wait for completions
+ * @param[in] wait minimal number of completions
+ * @param[in] timeout timeout in microseconds or -1
+ * @return 0 on success (or timeout)
+ */
+static int uring_enter(unsigned int wait, long timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int submit, flags;
+	int ret;
+
+	// publish the filled entries
+	__atomic_store_n(ring.sq_ktail, ring.sq_tail, __ATOMIC_RELEASE);
+	submit = ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (!submit && !wait)
+		return 0;
+
+	flags = 0;
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags = IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+		if (timeout >= 0) {
+			ts.tv_sec  = timeout / 1000000;
+			ts.tv_nsec = (timeout % 1000000) * 1000;
+			arg.ts = (uintptr_t) &ts;
+		}
+	}
+
+	ret = sys_io_uring_enter(ring.fd, submit, wait, flags, &arg, sizeof(arg));
+	if ((ret == -1) && (errno != ETIME) && (errno != EINTR)
+			&& (errno != EBUSY) && (errno != EAGAIN))
+		return error("io_uring_enter error (%s)", strerror(errno));
+
+	return 0;
+}
+
+/**
+ * get a free submission queue entry
+ * @param[in] count number of entries needed by the caller
+ * @return cleared entry or NULL if the queue is full
+ * @note the queue is submitted if less than count entries are free
+ */
+static struct io_uring_sqe *uring_sqe(unsigned int count)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (ring.sq_tail - head + count > ring.sq_entries) {
+		uring_enter(0, -1);
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (ring.sq_tail - head + count > ring.sq_entries) {
+			error("io_uring submission queue is full");
+			return NULL;
+		}
+	}
+
+	sqe = &ring.sqes[ring.sq_tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[ring.sq_tail & ring.sq_mask] = ring.sq_tail & ring.sq_mask;
+	++ring.sq_tail;
+
+	return sqe;
+}
+
+/* give a buffer back to the kernel */
+static void uring_recycle(unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring.br->bufs[ring.br_tail & (URING_BUFS - 1)];
+	buf->addr = (uintptr_t) (ring.bufs + (size_t) bid * URING_BUF_SIZE);
+	buf->len  = URING_BUF_SIZE;
+	buf->bid  = bid;
+	++ring.br_tail;
+	__atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+/* poll a descriptor once */
+static int uring_poll(int fd, unsigned int events, unsigned long long tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(1);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = tag;
+
+	return 0;
+}
+
+/* start a multishot receive or accept request */
+static void uring_arm(uringreq_t *req)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(req->ns && !req->armed);
+
+	sqe = uring_sqe(1);
+	if (!sqe)
+		return;
+
+	sqe->fd = req->ns->fd;
+	if (req->op == UREQ_RECV) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags  = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	} else {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK;
+	}
+	sqe->user_data = (uintptr_t) req;
+
+	req->armed  = 1;
+	req->cancel = 0;
+}
+
+/* request the cancellation of a multishot request */
+static void uring_cancel(uringreq_t *req)
+{
+	struct io_uring_sqe *sqe;
+
+	assert(req->armed && !req->cancel);
+
+	sqe = uring_sqe(1);
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) req;
+	sqe->user_data = TAG_CANCEL;
+
+	req->cancel = 1;
+}
+
+/**
+ * initialize the io_uring engine
+ * @return 0 on success
+ * @note the engine is optional, the epoll loop is used if it fails
+ */
+int uring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	if (!kernel_supported())
+		return error("io_uring multishot receive requires Linux 6.0");
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring.fd == -1)
+		return error("failed to create io_uring instance (%s)",
+						strerror(errno));
+
+	if (!(p.features & IORING_FEAT_EXT_ARG)
+			|| !(p.features & IORING_FEAT_NODROP)) {
+		uring_kill();
+		return error("io_uring features are not supported");
+	}
+
+	ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && (ring.cq_size > ring.sq_size))
+		ring.sq_size = ring.cq_size;
+
+	ring.sq_ring = mmap(NULL, ring.sq_size, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED) {
+		ring.sq_ring = NULL;
+		uring_kill();
+		return error("failed to map io_uring (%s)", strerror(errno));
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ring = ring.sq_ring;
+	} else {
+		ring.cq_ring = mmap(NULL, ring.cq_size, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED) {
+			ring.cq_ring = NULL;
+			uring_kill();
+			return error("failed to map io_uring (%s)", strerror(errno));
+		}
+	}
+
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+					MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = NULL;
+		uring_kill();
+		return error("failed to map io_uring (%s)", strerror(errno));
+	}
+
+	ring.sq_head    = (unsigned int *)((char *)ring.sq_ring + p.sq_off.head);
+	ring.sq_ktail   = (unsigned int *)((char *)ring.sq_ring + p.sq_off.tail);
+	ring.sq_array   = (unsigned int *)((char *)ring.sq_ring + p.sq_off.array);
+	ring.sq_mask    = *(unsigned int *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_entries = p.sq_entries;
+	ring.sq_tail    = *ring.sq_ktail;
+	ring.cq_head    = (unsigned int *)((char *)ring.cq_ring + p.cq_off.head);
+	ring.cq_tail    = (unsigned int *)((char *)ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask    = *(unsigned int *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes       = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+
+	// buffers picked by the kernel for the tunnels receive requests
+	ring.br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+					PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ring.br == MAP_FAILED) {
+		ring.br = NULL;
+		uring_kill();
+		return error("failed to allocate io_uring buffers");
+	}
+	ring.bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+	if (!ring.bufs) {
+		uring_kill();
+		return error("failed to allocate io_uring buffers");
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uintptr_t) ring.br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid         = URING_BGID;
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		error("failed to register io_uring buffers (%s)", strerror(errno));
+		uring_kill();
+		return -1;
+	}
+
+	ring.br_tail = 0;
+	for (i=0; i<URING_BUFS; ++i)
+		uring_recycle((unsigned short) i);
+
+	info(0, "network events handled by io_uring");
+	return 0;
+}
+
+/**
+ * destroy the io_uring engine
+ * @note pending requests are cancelled by the kernel
+ */
+void uring_kill(void)
+{
+	uringreq_t *req, *bak;
+	unsigned int i;
+
+	list_for_each_safe(req, bak, &requests) {
+		if (req->ns) {
+			req->ns->ureq = NULL;
+			req->ns->uring = 0;
+		}
+		for (i=0; i<req->nfds; ++i)
+			close(req->fds[i]);
+		list_del(&req->list);
+		free(req->fds);
+		free(req);
+	}
+
+	if (ring.fd != -1) {
+		close(ring.fd);
+		ring.fd = -1;
+	}
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_ring && (ring.cq_ring != ring.sq_ring))
+		munmap(ring.cq_ring, ring.cq_size);
+	if (ring.sq_ring)
+		munmap(ring.sq_ring, ring.sq_size);
+	if (ring.br)
+		munmap(ring.br, URING_BUFS * sizeof(struct io_uring_buf));
+	free(ring.bufs);
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+/**
+ * return the io_uring descriptor
+ * @return -1 if the engine is disabled
+ */
+int uring_fd(void)
+{
+	return ring.fd;
+}
+
+/**
+ * start or stop reading a socket
+ * @param[in] ns tunnel or server socket read by io_uring
+ * @param[in] read 1 if data (or connections) must be received
+ * @note a cancelled request is restarted once its final completion
+ *       is handled, data received meanwhile are still forwarded
+ */
+void uring_watch(netsock_t *ns, int read)
+{
+	uringreq_t *req;
+
+	assert(valid_netsock(ns) && ns->uring && (ring.fd != -1));
+
+	req = ns->ureq;
+	if (!req) {
+		if (!read)
+			return;
+		req = calloc(1, sizeof(*req));
+		if (!req) {
+			error("failed to allocate io_uring request");
+			return;
+		}
+		req->ns = ns;
+		req->op = (netsock_is_server(ns) ? UREQ_ACCEPT : UREQ_RECV);
+		list_add_tail(&req->list, &requests);
+		ns->ureq = req;
+	}
+
+	if (read && !req->armed)
+		uring_arm(req);
+	else if (!read && req->armed && !req->cancel)
+		uring_cancel(req);
+}
+
+/**
+ * detach a closed socket from its request
+ * @param[in] ns socket read by io_uring
+ * @note the request is submitted at once since the socket descriptor
+ *       may be reused as soon as it is closed
+ */
+void uring_release(netsock_t *ns)
+{
+	uringreq_t *req;
+	unsigned int i;
+
+	assert(ns && ns->uring);
+
+	req = ns->ureq;
+	if (!req)
+		return;
+	ns->ureq = NULL;
+	req->ns  = NULL;
+
+	for (i=0; i<req->nfds; ++i)
+		close(req->fds[i]);
+	ring.accepted -= req->nfds;
+	req->nfds = 0;
+
+	if (!req->armed) {
+		list_del(&req->list);
+		free(req->fds);
+		free(req);
+		return;
+	}
+
+	if (!req->cancel)
+		uring_cancel(req);
+	uring_enter(0, -1);
+}
+
+/**
+ * get a connection accepted by io_uring
+ * @param[in] srv server socket read by io_uring
+ * @param[out] fd client socket
+ * @param[out] addr client address
+ * @return 0 on success or errno value
+ */
+int uring_accept(netsock_t *srv, int *fd, netaddr_t *addr)
+{
+	uringreq_t *req;
+	socklen_t addrlen;
+
+	assert(valid_netsock(srv) && srv->uring && fd && addr);
+
+	req = srv->ureq;
+	if (!req || !req->nfds)
+		return EAGAIN;
+
+	*fd = req->fds[0];
+	--req->nfds;
+	--ring.accepted;
+	memmove(req->fds, req->fds + 1, req->nfds * sizeof(*req->fds));
+
+	addrlen = sizeof(*addr);
+	if (getpeername(*fd, (struct sockaddr *)addr, &addrlen)) {
+		close(*fd);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* handle a completion of a receive request */
+static void recv_done(uringreq_t *req, const struct io_uring_cqe *cqe)
+{
+	netsock_t *ns;
+	unsigned short bid;
+	char host[NETADDRSTR_MAXSIZE];
+
+	ns = req->ns;
+	if ((cqe->res > 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+		bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (ns && (ns->state == NETSTATE_CONNECTED)) {
+			if (channel_forward_data(ns, ring.bufs + (size_t) bid * URING_BUF_SIZE,
+										(unsigned int) cqe->res))
+				tunnel_close(ns, 1);
+			else
+				netsock_update_watch(ns);
+		}
+		uring_recycle(bid);
+		return;
+	}
+
+	if (!ns || (ns->state != NETSTATE_CONNECTED))
+		return;
+
+	// buffers exhaustion and cancellation only stop the request
+	if ((cqe->res == -ENOBUFS) || (cqe->res == -ECANCELED))
+		return;
+
+	netaddr_print(&ns->addr, host);
+	if (!cqe->res)
+		info(0, "connection %s closed", host);
+	else
+		error("failed to recv data from %s (%s)", host, strerror(-cqe->res));
+	tunnel_close(ns, 1);
+}
+
+/* handle a completion of an accept request */
+static void accept_done(uringreq_t *req, const struct io_uring_cqe *cqe)
+{
+	int *fds;
+
+	if (cqe->res < 0) {
+		if (req->ns && (cqe->res != -ECANCELED))
+			error("failed to accept connection (%s)", strerror(-cqe->res));
+		return;
+	}
+
+	if (!req->ns) {
+		close(cqe->res);
+		return;
+	}
+
+	if (req->nfds == req->maxfds) {
+		fds = realloc(req->fds, (req->maxfds + 16) * sizeof(*fds));
+		if (!fds) {
+			error("failed to allocate io_uring connections");
+			close(cqe->res);
+			return;
+		}
+		req->fds = fds;
+		req->maxfds += 16;
+	}
+
+	req->fds[req->nfds++] = cqe->res;
+	++ring.accepted;
+}
+
+/* handle a completion of a linked write to the rdesktop pipe */
+static void write_done(const struct io_uring_cqe *cqe)
+{
+	ssize_t w;
+
+	if (cqe->res >= 0)
+		ring.written += cqe->res;
+	else if ((cqe->res != -ECANCELED) && !ring.werr)
+		ring.werr = cqe->res;
+
+	if (--ring.writes)
+		return;
+
+	// data written before a failure (or a short write) are released
+	w = (ring.written > 0 ? ring.written : (ssize_t) ring.werr);
+	if ((w == -EAGAIN) || (w == -EWOULDBLOCK))
+		ring.pipe_blocked = 1;
+	channel_write_done(w);
+}
+
+/* handle the posted completions */
+static void uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	uringreq_t *req;
+	unsigned int head;
+
+	head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+
+		cqe = &ring.cqes[head & ring.cq_mask];
+
+		switch (cqe->user_data) {
+
+			case TAG_CANCEL:
+				break;
+
+			case TAG_EPOLL:
+				ring.ep_polled = 0;
+				ring.ep_ready  = 1;
+				break;
+
+			case TAG_PIPE:
+				ring.pipe_polled  = 0;
+				ring.pipe_blocked = 0;
+				break;
+
+			case TAG_WRITE:
+				write_done(cqe);
+				break;
+
+			default:
+				req = (uringreq_t *)(uintptr_t) cqe->user_data;
+				if (req->op == UREQ_RECV)
+					recv_done(req, cqe);
+				else
+					accept_done(req, cqe);
+
+				if (!(cqe->flags & IORING_CQE_F_MORE)) {
+					req->armed = 0;
+					if (!req->ns) {
+						list_del(&req->list);
+						free(req->fds);
+						free(req);
+					} else {
+						// restart the request if the socket is still read
+						req->cancel = 0;
+						netsock_update_watch(req->ns);
+					}
+				}
+				break;
+		}
+
+		++head;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/* queue linked writes of the channel messages */
+static int uring_writev(const struct iovec *iov, unsigned int n)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i, links;
+
+	links = (n + URING_WRITE_IOV - 1) / URING_WRITE_IOV;
+	ring.written = 0;
+	ring.werr    = 0;
+
+	for (i=0; i<n; i+=URING_WRITE_IOV) {
+		// the whole chain must be submitted at once
+		sqe = uring_sqe(links);
+		if (!sqe)
+			return -1;
+		--links;
+
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd     = RDP_FD_OUT;
+		sqe->off    = (unsigned long long) -1;
+		sqe->addr   = (uintptr_t) &iov[i];
+		sqe->len    = (n - i < URING_WRITE_IOV ? n - i : URING_WRITE_IOV);
+		// io_uring would wait for the pipe despite O_NONBLOCK
+		sqe->rw_flags = RWF_NOWAIT;
+		// a short write cancels the next writes
+		if (links)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = TAG_WRITE;
+		++ring.writes;
+	}
+
+	return 0;
+}
+
+/**
+ * wait for network events with io_uring
+ * @param[in] epfd epoll descriptor of the events loop
+ * @param[in] chan_write 1 if data must be written to the rdesktop pipe
+ * @param[in] timeout timeout in microseconds or -1
+ * @param[out] ready ready sockets
+ * @param[in] max maximal number of ready sockets
+ * @return number of ready sockets or -1 on error
+ * @note the channel messages are written by linked writes submitted
+ *       with the wait, received tunnel data are forwarded before the
+ *       wait returns, servers are reported once per accepted connection
+ *       and the epoll descriptor is polled for the other sockets
+ */
+int uring_wait(int epfd, int chan_write, long timeout,
+					struct epoll_event *ready, int max)
+{
+	struct iovec iov[URING_WRITE_IOV * URING_WRITE_LINKS];
+	uringreq_t *req;
+	unsigned int i, n;
+	int ret, count;
+
+	assert((ring.fd != -1) && ready && (max > 0));
+
+	if (chan_write && !ring.pipe_blocked) {
+		n = channel_write_iov(iov, URING_WRITE_IOV * URING_WRITE_LINKS);
+		if (!n)
+			ring.pipe_blocked = 1;
+		else if (uring_writev(iov, n))
+			return -1;
+	}
+
+	if (chan_write && ring.pipe_blocked && !ring.pipe_polled) {
+		if (uring_poll(RDP_FD_OUT, POLLOUT, TAG_PIPE))
+			return -1;
+		ring.pipe_polled = 1;
+	}
+
+	if (!ring.ep_polled) {
+		if (uring_poll(epfd, POLLIN, TAG_EPOLL))
+			return -1;
+		ring.ep_polled = 1;
+	}
+
+	// connections accepted meanwhile are reported at once
+	ring.ep_ready = 0;
+	if (uring_enter(ring.accepted ? 0 : 1, timeout))
+		return -1;
+	uring_reap();
+
+	// the messages buffers must stay valid until they are written
+	while (ring.writes) {
+		if (uring_enter(1, -1))
+			return -1;
+		uring_reap();
+	}
+
+	count = 0;
+	list_for_each(req, &requests) {
+		if (!req->ns || (req->op != UREQ_ACCEPT))
+			continue;
+		for (i=0; (i<req->nfds) && (count<max); ++i) {
+			memset(&ready[count], 0, sizeof(ready[count]));
+			ready[count].events   = EPOLLIN;
+			ready[count].data.ptr = req->ns;
+			++count;
+		}
+	}
+
+	if (ring.ep_ready && (count < max)) {
+		ret = epoll_wait(epfd, ready + count, max - count, 0);
+		if ((ret == -1) && (errno != EINTR))
+			return error("epoll_wait error (%s)", strerror(errno));
+		if (ret > 0)
+			count += ret;
+	}
+
+	return count;
+}
+
+#endif
@@ -35,6 +35,7 @@
 #define ssize_t int
 #define inline __inline
 #define snprintf _snprintf
+#define vsnprintf _vsnprintf
 #define typeof(x) void *
 #endif
 
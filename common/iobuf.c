@@ -30,6 +30,94 @@
 #include <stdio.h>
 #endif
 
+#ifdef IOBUF_STATS
+unsigned long long iobuf_moved = 0;
+#endif
+
+#define IOBUF_POOL(i) MEMPOOL_INITIALIZER("iobuf", IOBUF_MIN_SIZE << (i), \
+						IOBUF_POOL_SIZE / (IOBUF_MIN_SIZE << (i)))
+
+#ifdef __GNUC__
+#define memory_add(n) __atomic_add_fetch(&memory, (n), __ATOMIC_RELAXED)
+#define memory_sub(n) __atomic_sub_fetch(&memory, (n), __ATOMIC_RELAXED)
+#else
+// buffers of the MSVC built server are allocated by a single thread
+#define memory_add(n) (memory += (n))
+#define memory_sub(n) (memory -= (n))
+#endif
+
+/** size of the data buffers in use */
+static unsigned long memory = 0;
+
+/** free data buffers of each size class */
+static mempool_t pools[IOBUF_POOLS] = {
+	IOBUF_POOL(0), IOBUF_POOL(1), IOBUF_POOL(2),
+	IOBUF_POOL(3), IOBUF_POOL(4), IOBUF_POOL(5)
+};
+
+/**
+ * allocate a data buffer
+ * @param[in,out] total minimal size, rounded to the size class
+ * @return NULL if memory cannot be allocated
+ * @note buffers larger than IOBUF_POOL_MAX are not pooled
+ */
+static char *data_alloc(unsigned int *total)
+{
+	unsigned int i;
+	char *data;
+
+	for (i=0; (i<IOBUF_POOLS) && (*total>pools[i].size); ++i)
+		;
+
+	if (i < IOBUF_POOLS) {
+		*total = pools[i].size;
+		data = mempool_get(&pools[i]);
+	} else {
+		data = malloc(*total);
+	}
+
+	if (data)
+		memory_add(*total);
+
+	return data;
+}
+
+/**
+ * release a data buffer
+ * @param[in] data buffer allocated with data_alloc
+ * @param[in] total buffer size
+ */
+static void data_free(char *data, unsigned int total)
+{
+	unsigned int i;
+
+	memory_sub(total);
+
+	for (i=0; i<IOBUF_POOLS; ++i) {
+		if (total == pools[i].size) {
+			mempool_put(&pools[i], data);
+			return;
+		}
+	}
+
+	assert(total > IOBUF_POOL_MAX);
+	free(data);
+}
+
+/**
+ * return the data buffer of an I/O buffer to its pool
+ * @param[in] buf I/O buffer
+ */
+static void iobuf_release(iobuf_t *buf)
+{
+	if (buf->data) {
+		data_free(buf->data, buf->total);
+		buf->data  = NULL;
+		buf->total = 0;
+	}
+	buf->off = 0;
+}
+
 /**
  * @brief initialize I/O buffer
  * @param[out] buf buffer to initialize
@@ -45,6 +133,7 @@ void __iobuf_init(iobuf_t *buf
 	buf->data  = NULL;
 	buf->size  = 0;
 	buf->total = 0;
+	buf->off   = 0;
 #ifdef DEBUG
 	buf->name  = name;
 	buf->type  = type;
@@ -87,7 +176,7 @@ void iobuf_kill(iobuf_t *buf)
 	trace_iobuf("[%c] %s", buf->type, buf->name);
 
 	if (buf->data)
-		free(buf->data);
+		data_free(buf->data, buf->total);
 }
 
 /**
@@ -118,10 +207,12 @@ void iobuf_consume(iobuf_t *buf, unsigned int consumed)
 	trace_iobuf("[%c] %s, consumed=%u, remaining=%u",
 					buf->type, buf->name, consumed, size);
 
-	if (size)
-		memmove(buf->data, buf->data + consumed, size);
-
+	// data are moved later by iobuf_reserve, only if needed
 	buf->size = size;
+	if (size)
+		buf->off += consumed;
+	else
+		iobuf_release(buf);
 }
 
 /**
@@ -131,15 +222,23 @@ void iobuf_consume(iobuf_t *buf, unsigned int consumed)
  * @param[out] reserved will hold the size of allocated data
  * @return pointer where data have been allocated
  * @note if size is 0 reserved must be non-NULL
+ * @note used data are moved to the head of the buffer only when the
+ *       space following them is too small. the buffer is compacted in
+ *       place if consumed space is larger than used data, otherwise it
+ *       grows geometrically. thus each byte is moved an amortized
+ *       constant number of times.
+ * @note a buffer growing within the pooled size classes is moved to a
+ *       buffer of the next class, larger buffers are reallocated
  */
 void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 {
-	unsigned int avail;
-	void *bak, *data;
+	unsigned int avail, used, total;
+	char *data;
 
 	assert(valid_iobuf(buf) && (size || reserved));
 
-	avail = buf->total - buf->size;
+	used  = buf->size;
+	avail = buf->total - buf->off - used;
 
 	if (!size)
 		size = IOBUF_MIN_SIZE;
@@ -148,18 +247,47 @@ void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 					buf->type, buf->name, size, avail);
 
 	if (size > avail) {
-		bak = buf->data;
-		data = realloc(bak, buf->size + size);
-		if (!data)
-			return NULL;
-		buf->data = data;
-		buf->total = buf->size + size;
+
+		if ((buf->off >= used) && (buf->total - used >= size)) {
+			// source and destination do not overlap
+			memcpy(buf->data, buf->data + buf->off, used);
+			buf->off = 0;
+#ifdef IOBUF_STATS
+			iobuf_moved += used;
+#endif
+
+		} else {
+			total = buf->total * 2;
+			if (total < used + size)
+				total = used + size;
+
+			if (!buf->off && (buf->total > IOBUF_POOL_MAX)) {
+				data = realloc(buf->data, total);
+				if (!data)
+					return NULL;
+				memory_add(total - buf->total);
+			} else {
+				data = data_alloc(&total);
+				if (!data)
+					return NULL;
+				if (buf->data) {
+					memcpy(data, buf->data + buf->off, used);
+					data_free(buf->data, buf->total);
+				}
+				buf->off = 0;
+			}
+#ifdef IOBUF_STATS
+			iobuf_moved += used;
+#endif
+			buf->data  = data;
+			buf->total = total;
+		}
 	}
 
 	if (reserved)
 		*reserved = size;
 
-	return buf->data + buf->size;
+	return buf->data + buf->off + used;
 }
 
 /**
@@ -171,7 +299,7 @@ void *iobuf_reserve(iobuf_t *buf, unsigned int size, unsigned int *reserved)
 void iobuf_commit(iobuf_t *buf, unsigned int commited)
 {
 	assert(valid_iobuf(buf) && (commited > 0)
-				&& (commited <= (buf->total - buf->size)));
+				&& (commited <= (buf->total - buf->off - buf->size)));
 	trace_iobuf("[%c] %s, commited=%u, total=%u, size=%u",
 			buf->type, buf->name, commited, buf->total, buf->size);
 
@@ -202,6 +330,97 @@ void *iobuf_append(iobuf_t *buf, const void *data, unsigned int size)
 	return ptr;
 }
 
+/**
+ * move the data of an I/O buffer to the end of another one
+ * @param[in] dst I/O buffer to hold data
+ * @param[in] src I/O buffer to empty (destroyed on success)
+ * @return pointer where data have been moved or NULL if memory
+ *         cannot be allocated
+ * @note the memory of src is taken over if dst is empty
+ */
+void *iobuf_xfer(iobuf_t *dst, iobuf_t *src)
+{
+	void *ptr;
+
+	assert(valid_iobuf(dst) && valid_iobuf(src) && src->size);
+	trace_iobuf("[%c] %s, size=%u", dst->type, dst->name, src->size);
+
+	if (!dst->size) {
+		if (dst->data)
+			data_free(dst->data, dst->total);
+		dst->data  = src->data;
+		dst->total = src->total;
+		dst->off   = src->off;
+		dst->size  = src->size;
+		return dst->data + dst->off;
+	}
+
+	ptr = iobuf_append(dst, src->data + src->off, src->size);
+	if (ptr)
+		iobuf_kill(src);
+
+	return ptr;
+}
+
+/**
+ * release the data buffer of an empty I/O buffer
+ * @param[in] buf I/O buffer
+ * @note the buffer of idle sockets is returned to its pool
+ */
+void iobuf_trim(iobuf_t *buf)
+{
+	assert_iobuf(buf);
+
+	if (!buf->size)
+		iobuf_release(buf);
+}
+
+/**
+ * free the pooled data buffers not needed since the last call
+ * @return size of freed buffers
+ */
+unsigned long iobuf_pools_trim(void)
+{
+	unsigned int i;
+	unsigned long freed;
+
+	for (i=0, freed=0; i<IOBUF_POOLS; ++i)
+		freed += (unsigned long) mempool_trim(&pools[i]) * pools[i].size;
+
+	return freed;
+}
+
+/**
+ * get the size of the data buffers in use
+ * @return size in bytes (cached buffers are not counted)
+ */
+unsigned long iobuf_memory(void)
+{
+#ifdef __GNUC__
+	return __atomic_load_n(&memory, __ATOMIC_RELAXED);
+#else
+	return memory;
+#endif
+}
+
+/**
+ * get the counters of the data buffers pools
+ * @param[out] stats counters of each size class
+ * @param[in] max maximum number of size classes
+ * @return number of size classes
+ */
+unsigned int iobuf_pools_stat(mempool_stats_t *stats, unsigned int max)
+{
+	unsigned int i;
+
+	assert(stats || !max);
+
+	for (i=0; (i<IOBUF_POOLS) && (i<max); ++i)
+		mempool_stat(&pools[i], &stats[i]);
+
+	return i;
+}
+
 #ifdef DEBUG
 void iobuf_dump(iobuf_t *buf)
 {
@@ -20,16 +20,34 @@
 #define __MPROXY_IOBUF_H__
 
 #include "debug.h"
+#include "mempool.h"
 #include <sys/types.h>
 
 #ifndef IOBUF_MIN_SIZE
 #define IOBUF_MIN_SIZE 2048
 #endif
 
-/** I/O buffer */
+/** number of buffer size classes (IOBUF_MIN_SIZE to 32*IOBUF_MIN_SIZE) */
+#define IOBUF_POOLS 6
+/** largest buffer allocated from the pools */
+#define IOBUF_POOL_MAX (IOBUF_MIN_SIZE << (IOBUF_POOLS - 1))
+
+#ifndef IOBUF_POOL_SIZE
+/** maximum size of the free buffers cached by a size class */
+#define IOBUF_POOL_SIZE (1024*1024)
+#endif
+
+/**
+ * I/O buffer
+ * @note data are stored at offset off of the data buffer, consumed data
+ *       are skipped and the buffer is compacted only when space is needed
+ * @note the data buffer is borrowed from the pool of its size class and
+ *       returned to it once all data are consumed
+ */
 typedef struct iobuf {
 	unsigned int size;  /**< used size */
 	unsigned int total; /**< allocated size */
+	unsigned int off;   /**< offset of the first used byte */
 	char *data;         /**< data buffer */
 #ifdef DEBUG
 	const char *name;
@@ -39,7 +57,8 @@ typedef struct iobuf {
 
 #ifdef DEBUG
 #define valid_iobuf(x) \
-	((x) && (((x)->size <= (x)->total) && ((x)->data || !((x)->total))) \
+	((x) && (((x)->off + (x)->size <= (x)->total) \
+		&& ((x)->data || !((x)->total))) \
 	 && (x)->name && (((x)->type == 'r') || (x)->type == 'w'))
 void iobuf_dump(iobuf_t *);
 void __iobuf_init(iobuf_t *, char, const char *);
@@ -49,7 +68,8 @@ void __iobuf_init2(iobuf_t *, iobuf_t *, const char *);
 
 #else
 #define valid_iobuf(x) \
-	((x) && (((x)->size <= (x)->total) && ((x)->data || !((x)->total))))
+	((x) && (((x)->off + (x)->size <= (x)->total) \
+		&& ((x)->data || !((x)->total))))
 void __iobuf_init(iobuf_t *);
 void __iobuf_init2(iobuf_t *, iobuf_t *);
 #define iobuf_init(buf, type, name) __iobuf_init(buf)
@@ -72,12 +92,12 @@ static inline unsigned int iobuf_datalen(iobuf_t *buf)
 
 static inline void *iobuf_dataptr(iobuf_t *buf)
 {
-	return buf->size ? buf->data : 0;
+	return buf->size ? buf->data + buf->off : 0;
 }
 
 static inline void *iobuf_allocptr(iobuf_t *buf)
 {
-	return ((char *)buf->data) + buf->size;
+	return ((char *)buf->data) + buf->off + buf->size;
 }
 
 void iobuf_consume(iobuf_t *, unsigned int);
@@ -85,7 +105,17 @@ void iobuf_consume(iobuf_t *, unsigned int);
 void *iobuf_reserve(iobuf_t *, unsigned int, unsigned int *);
 void iobuf_commit(iobuf_t *, unsigned int);
 void *iobuf_append(iobuf_t *, const void *, unsigned int);
-//void iobuf_xfer(iobuf_t *, iobuf_t *);
+void *iobuf_xfer(iobuf_t *, iobuf_t *);
+
+void iobuf_trim(iobuf_t *);
+unsigned long iobuf_pools_trim(void);
+unsigned long iobuf_memory(void);
+unsigned int iobuf_pools_stat(mempool_stats_t *, unsigned int);
+
+#ifdef IOBUF_STATS
+/** bytes moved by buffers compaction and reallocation */
+extern unsigned long long iobuf_moved;
+#endif
 
 #endif
 // vim: ts=3 sw=3
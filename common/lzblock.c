@@ -0,0 +1,295 @@
+/**
+ * @file lzblock.c
+ * LZ4 block format compression
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lzblock.h"
+
+#include <string.h>
+
+/** log2 of the match finder hash table size */
+#define HASH_LOG    12
+/** minimal match length */
+#define MIN_MATCH   4
+/** the last bytes of a block are always literals */
+#define LAST_LITERALS 5
+/** the last match starts before this number of bytes from the end */
+#define MF_LIMIT    12
+/** maximal match offset */
+#define MAX_DISTANCE 0xffff
+
+static inline unsigned int read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * count the bytes of a match
+ * @param[in] ip current position
+ * @param[in] ref match position
+ * @param[in] limit end of the bytes which may be matched
+ */
+static inline unsigned int count_match(
+						const unsigned char *ip,
+						const unsigned char *ref,
+						const unsigned char *limit)
+{
+	const unsigned char *start;
+#if defined(__GNUC__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	unsigned long long a, b;
+
+	start = ip;
+	while (ip + sizeof(a) <= limit) {
+		memcpy(&a, ip, sizeof(a));
+		memcpy(&b, ref, sizeof(b));
+		if (a != b) {
+			// index of the first different byte
+			return (unsigned int)(ip - start) + (__builtin_ctzll(a ^ b) >> 3);
+		}
+		ip  += sizeof(a);
+		ref += sizeof(b);
+	}
+#else
+	start = ip;
+#endif
+	while ((ip < limit) && (*ip == *ref)) {
+		++ip;
+		++ref;
+	}
+
+	return (unsigned int)(ip - start);
+}
+
+static inline unsigned int hash32(unsigned int v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+ * encode a length field (token nibble already set to 15)
+ * @return updated output pointer
+ */
+static inline unsigned char *put_length(unsigned char *op, unsigned int n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = (unsigned char) n;
+	return op;
+}
+
+/**
+ * compress a buffer to the LZ4 block format
+ * @param[in] src data to compress
+ * @param[in] len size of data
+ * @param[out] dst compressed data
+ * @param[in] max size of destination buffer
+ * @return size of compressed data or 0 if it does not fit in max bytes
+ * @note the compression gives up as soon as max bytes are exceeded, a
+ *       small max makes incompressible data fail early
+ */
+unsigned int lzblock_compress(
+						const void *src,
+						unsigned int len,
+						void *dst,
+						unsigned int max)
+{
+	unsigned int table[1 << HASH_LOG];
+	const unsigned char *base, *ip, *anchor, *ref, *iend, *mflimit, *mlimit;
+	unsigned char *op, *oend, *token;
+	unsigned int h, seq, lit, ml, off;
+
+	base = anchor = ip = (const unsigned char *) src;
+	iend = base + len;
+	op = (unsigned char *) dst;
+	oend = op + max;
+
+	if (len > MF_LIMIT) {
+		mflimit = iend - MF_LIMIT;
+		mlimit  = iend - LAST_LITERALS;
+		memset(table, 0, sizeof(table));
+		++ip;
+
+		while (ip < mflimit) {
+
+			seq = read32(ip);
+			h = hash32(seq);
+			ref = base + table[h];
+			table[h] = (unsigned int)(ip - base);
+
+			if ((ip - ref > MAX_DISTANCE) || (read32(ref) != seq)) {
+				// skip faster in data without matches
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+				--ip;
+				--ref;
+			}
+
+			ml = MIN_MATCH + count_match(ip + MIN_MATCH, ref + MIN_MATCH, mlimit);
+
+			lit = (unsigned int)(ip - anchor);
+			if ((unsigned int)(oend - op) < 1 + lit + lit/255 + 1 + 2 + ml/255 + 1)
+				return 0;
+
+			token = op++;
+			if (lit >= 15) {
+				*token = 15 << 4;
+				op = put_length(op, lit - 15);
+			} else {
+				*token = (unsigned char)(lit << 4);
+			}
+			memcpy(op, anchor, lit);
+			op += lit;
+
+			off = (unsigned int)(ip - ref);
+			*op++ = (unsigned char) off;
+			*op++ = (unsigned char)(off >> 8);
+
+			if (ml - MIN_MATCH >= 15) {
+				*token |= 15;
+				op = put_length(op, ml - MIN_MATCH - 15);
+			} else {
+				*token |= (unsigned char)(ml - MIN_MATCH);
+			}
+
+			ip += ml;
+			anchor = ip;
+			if (ip < mflimit)
+				table[hash32(read32(ip - 2))] = (unsigned int)(ip - 2 - base);
+		}
+	}
+
+	// last literals
+	lit = (unsigned int)(iend - anchor);
+	if ((unsigned int)(oend - op) < 1 + lit + lit/255 + 1)
+		return 0;
+
+	token = op++;
+	if (lit >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, lit - 15);
+	} else {
+		*token = (unsigned char)(lit << 4);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return (unsigned int)(op - (unsigned char *)dst);
+}
+
+/**
+ * decode a length field extension
+ * @return -1 if the input is truncated
+ */
+static inline int get_length(
+					const unsigned char **pip,
+					const unsigned char *iend,
+					unsigned int *n)
+{
+	const unsigned char *ip;
+	unsigned char b;
+
+	ip = *pip;
+	do {
+		if (ip >= iend)
+			return -1;
+		b = *ip++;
+		*n += b;
+	} while (b == 255);
+	*pip = ip;
+
+	return 0;
+}
+
+/**
+ * decompress a LZ4 block
+ * @param[in] src compressed data
+ * @param[in] len size of compressed data
+ * @param[out] dst uncompressed data
+ * @param[in] max size of destination buffer
+ * @return size of uncompressed data or -1 if the block is invalid
+ * @note the input is untrusted, no read or write is done out of bounds
+ */
+int lzblock_decompress(
+				const void *src,
+				unsigned int len,
+				void *dst,
+				unsigned int max)
+{
+	const unsigned char *ip, *iend, *ref;
+	unsigned char *op, *oend, *obase;
+	unsigned int token, lit, ml, off;
+
+	ip = (const unsigned char *) src;
+	iend = ip + len;
+	obase = op = (unsigned char *) dst;
+	oend = op + max;
+
+	while (ip < iend) {
+
+		token = *ip++;
+
+		lit = token >> 4;
+		if ((lit == 15) && get_length(&ip, iend, &lit))
+			return -1;
+		if ((lit > (unsigned int)(iend - ip)) || (lit > (unsigned int)(oend - op)))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		// the last sequence only has literals
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || (off > (unsigned int)(op - obase)))
+			return -1;
+
+		ml = token & 15;
+		if ((ml == 15) && get_length(&ip, iend, &ml))
+			return -1;
+		ml += MIN_MATCH;
+		if (ml > (unsigned int)(oend - op))
+			return -1;
+
+		ref = op - off;
+		if (off >= ml) {
+			memcpy(op, ref, ml);
+			op += ml;
+		} else {
+			// overlapping match repeats the last off bytes
+			while (ml--)
+				*op++ = *ref++;
+		}
+	}
+
+	return (int)(op - obase);
+}
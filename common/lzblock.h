@@ -0,0 +1,33 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LZBLOCK_H__
+#define __LZBLOCK_H__
+
+#include "compiler.h"
+
+/**
+ * worst case size of compressed data
+ * @param[in] len size of uncompressed data
+ */
+#define lzblock_bound(len) ((len) + (len)/255 + 16)
+
+unsigned int lzblock_compress(const void *, unsigned int, void *, unsigned int);
+int lzblock_decompress(const void *, unsigned int, void *, unsigned int);
+
+#endif
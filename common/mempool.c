@@ -0,0 +1,165 @@
+/**
+ * @file mempool.c
+ * @brief fixed size objects allocator
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "debug.h"
+#include "mempool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifndef _WIN32
+#define pool_lock(p)   pthread_mutex_lock(&(p)->lock)
+#define pool_unlock(p) pthread_mutex_unlock(&(p)->lock)
+#else
+// critical sections cannot be initialized statically
+#define pool_lock(p) do { \
+		while (InterlockedExchange((LONG volatile *)&(p)->lock, 1)) \
+			Sleep(0); \
+	} while (0)
+#define pool_unlock(p) InterlockedExchange((LONG volatile *)&(p)->lock, 0)
+#endif
+
+/**
+ * allocate an object
+ * @param[in] pool memory pool
+ * @return NULL if memory cannot be allocated
+ * @note the object memory is not initialized
+ */
+void *mempool_get(mempool_t *pool)
+{
+	void *obj;
+
+	assert(pool && (pool->size >= sizeof(void *)));
+
+	pool_lock(pool);
+	obj = pool->free;
+	if (obj) {
+		pool->free = *(void **)obj;
+		if (--pool->nfree < pool->low)
+			pool->low = pool->nfree;
+		++pool->hits;
+	} else {
+		++pool->misses;
+	}
+	if (++pool->used > pool->peak)
+		pool->peak = pool->used;
+	pool_unlock(pool);
+
+	if (!obj) {
+		obj = malloc(pool->size);
+		if (!obj) {
+			pool_lock(pool);
+			--pool->used;
+			pool_unlock(pool);
+		}
+	}
+
+	return obj;
+}
+
+/**
+ * release an object
+ * @param[in] pool memory pool the object has been allocated from
+ * @param[in] obj object to release
+ * @note the object is freed if the pool already caches max_free objects
+ */
+void mempool_put(mempool_t *pool, void *obj)
+{
+	assert(pool && obj && pool->used);
+
+	pool_lock(pool);
+	--pool->used;
+	if (pool->nfree < pool->max_free) {
+		*(void **)obj = pool->free;
+		pool->free = obj;
+		++pool->nfree;
+		obj = NULL;
+	}
+	pool_unlock(pool);
+
+	if (obj)
+		free(obj);
+}
+
+/**
+ * free the cached objects which have not been needed since the last trim
+ * @param[in] pool memory pool
+ * @return number of freed objects
+ * @note the pool keeps as many objects as were taken from its cache at
+ *       once during the last period, thus a pool not used between two
+ *       trims is emptied
+ */
+unsigned int mempool_trim(mempool_t *pool)
+{
+	void *obj, *next, **last;
+	unsigned int count, i;
+
+	assert(pool);
+
+	pool_lock(pool);
+	count = pool->low;
+	obj   = NULL;
+	if (count) {
+		// unneeded objects are detached from the head of the list
+		obj  = pool->free;
+		last = &pool->free;
+		for (i=0; i<count; ++i)
+			last = (void **)*last;
+		pool->free = *last;
+		*last = NULL;
+		pool->nfree -= count;
+	}
+	pool->low = pool->nfree;
+	pool_unlock(pool);
+
+	for (; obj; obj=next) {
+		next = *(void **)obj;
+		free(obj);
+	}
+
+	return count;
+}
+
+/**
+ * get the counters of a pool
+ * @param[in] pool memory pool
+ * @param[out] stats pool counters
+ */
+void mempool_stat(mempool_t *pool, mempool_stats_t *stats)
+{
+	assert(pool && stats);
+
+	pool_lock(pool);
+	stats->name   = pool->name;
+	stats->size   = pool->size;
+	stats->used   = pool->used;
+	stats->cached = pool->nfree;
+	stats->peak   = pool->peak;
+	stats->hits   = pool->hits;
+	stats->misses = pool->misses;
+	pool_unlock(pool);
+}
+
+// vim: ts=3 sw=3
@@ -0,0 +1,76 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __MEMPOOL_H__
+#define __MEMPOOL_H__
+
+#include "compiler.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/**
+ * free-list allocator of fixed size objects
+ * @note released objects are kept for reuse (up to max_free objects)
+ *       instead of being returned to malloc, the pool may be shared by
+ *       several threads
+ */
+typedef struct _mempool {
+	const char *name;          /**< pool name */
+	unsigned int size;         /**< size of objects */
+	unsigned int max_free;     /**< maximum number of cached objects */
+	void *free;                /**< cached objects list */
+	unsigned int nfree;        /**< number of cached objects */
+	unsigned int low;          /**< lowest nfree since the last trim */
+	unsigned int used;         /**< number of allocated objects */
+	unsigned int peak;         /**< maximum number of allocated objects */
+	unsigned long long hits;   /**< allocations served by the cache */
+	unsigned long long misses; /**< allocations served by malloc */
+#ifndef _WIN32
+	pthread_mutex_t lock;
+#else
+	volatile long lock;
+#endif
+} mempool_t;
+
+#ifndef _WIN32
+#define MEMPOOL_INITIALIZER(name, size, max_free) \
+	{ name, size, max_free, NULL, 0, 0, 0, 0, 0, 0, \
+	  PTHREAD_MUTEX_INITIALIZER }
+#else
+#define MEMPOOL_INITIALIZER(name, size, max_free) \
+	{ name, size, max_free, NULL, 0, 0, 0, 0, 0, 0, 0 }
+#endif
+
+/** memory pool counters */
+typedef struct _mempool_stats {
+	const char *name;          /**< pool name */
+	unsigned int size;         /**< size of objects */
+	unsigned int used;         /**< number of allocated objects */
+	unsigned int cached;       /**< number of cached objects */
+	unsigned int peak;         /**< maximum number of allocated objects */
+	unsigned long long hits;   /**< allocations served by the cache */
+	unsigned long long misses; /**< allocations served by malloc */
+} mempool_stats_t;
+
+void *mempool_get(mempool_t *);
+void mempool_put(mempool_t *, void *);
+unsigned int mempool_trim(mempool_t *);
+void mempool_stat(mempool_t *, mempool_stats_t *);
+
+#endif
@@ -34,6 +34,8 @@
 extern int debug_level;
 extern const cmdhandler_t cmd_handlers[];
 
+unsigned long long commands_count[R2TCMD_MAX];
+
 /**
  * parse rdp2tcp commands and call specific handlers
  * @param[in] ibuf input buffer
@@ -42,14 +44,18 @@ extern const cmdhandler_t cmd_handlers[];
 int commands_parse(iobuf_t *ibuf)
 {
 	unsigned char cmd, *data;
-	unsigned int off, msg_len, avail;
+	unsigned int off, msg_len, min_len, avail;
+	int n, ret;
+	r2thdr_t hdr;
 	static const unsigned char r2t_min_size[R2TCMD_MAX] = {
 		3, // R2TCMD_CONN
 		2, // R2TCMD_CLOSE
 		2, // R2TCMD_DATA
 		1, // R2TCMD_PING
 		3, // R2TCMD_BIND
-		2  // R2TCMD_RCONN
+		2, // R2TCMD_RCONN
+		6, // R2TCMD_WINDOW
+		7  // R2TCMD_ZDATA
 	};
 
 	assert(valid_iobuf(ibuf) && (iobuf_datalen(ibuf)>0));
@@ -59,44 +65,106 @@ int commands_parse(iobuf_t *ibuf)
 #endif
 
 	off   = 0;
+	ret   = -1;
 	data  = iobuf_dataptr(ibuf);
 	avail = iobuf_datalen(ibuf);
 	debug(1, "commands_parse(avail=%u)", avail);
 
 	// for each command
-	while (off + 5 < avail) {
+	while (off < avail) {
+
+		if (data[off] & R2TFRAME_COMPACT) {
+			// compact DATA frame
+			n = varint_get(data+off+1, avail-off-1, &msg_len);
+			if (!n)
+				break;
+			if ((n < 0) || !msg_len || (msg_len > RDP2TCP_MAX_MSGLEN)) {
+				error("invalid compact msg size");
+				goto end;
+			}
+			if (off+1+n+msg_len > avail)
+				break;
+
+			// the 2 last header bytes are replaced by the v1 layout
+			hdr.id = data[off] & ~R2TFRAME_COMPACT;
+			hdr.v2 = 0;
+			off += n - 1;
+			data[off]   = R2TCMD_DATA;
+			data[off+1] = (unsigned char) hdr.id;
+			msg_len += 2;
+			++commands_count[R2TCMD_DATA];
+
+			// the header is rewritten, the frame is consumed even on error
+			off += msg_len;
+			if (cmd_handlers[R2TCMD_DATA]((const r2tmsg_t*)(data+off-msg_len),
+													msg_len, &hdr))
+				goto end;
+			continue;
+		}
+
+		if (off + 5 >= avail)
+			break;
 
 		msg_len = ntohl(*(unsigned int*)(data+off));
-		if (!msg_len || (msg_len > RDP2TCP_MAX_MSGLEN))
-			return error("invalid channel msg size 0x%08x", msg_len);
+		if (!msg_len || (msg_len > RDP2TCP_MAX_MSGLEN)) {
+			error("invalid channel msg size 0x%08x", msg_len);
+			goto end;
+		}
 
 		if (off+msg_len+4 > avail)
 			break;
 
-		off += 4;
-
-		cmd = data[off];
-		if (cmd >= R2TCMD_MAX)
-			return error("invalid command id 0x%02x", cmd);
+		cmd = data[off+4];
+		hdr.v2 = ((cmd & R2TCMD_V2) != 0);
+		cmd &= ~R2TCMD_V2;
+		if (cmd >= R2TCMD_MAX) {
+			error("invalid command id 0x%02x", cmd);
+			goto end;
+		}
+
+		// v2 frames always have a 3 bytes header
+		min_len = r2t_min_size[cmd];
+		if (hdr.v2)
+			min_len = (min_len < 2 ? 3 : min_len + 1);
+		if (msg_len < min_len) {
+			error("command 0x%02x too short 0x%08x < 0x%08x",
+					cmd, msg_len, min_len);
+			goto end;
+		}
+
+		if (!cmd_handlers[cmd]) {
+			error("command 0x%02x not supported", cmd);
+			goto end;
+		}
 
-		if (msg_len < (unsigned int)r2t_min_size[cmd])
-			return error("command 0x%02x too short 0x%08x < 0x%08x", 
-					cmd, msg_len, (unsigned int)r2t_min_size[cmd]);
-
-		if (!cmd_handlers[cmd])
-			return error("command 0x%02x not supported", cmd);
-
-		// call specific command handler
-		if (cmd_handlers[cmd]((const r2tmsg_t*)(data+off), msg_len))
-			return -1;
+		off += 4;
 
+		if (hdr.v2) {
+			// the handler gets the message in v1 layout
+			hdr.id = (data[off+1] << 8) | data[off+2];
+			++off;
+			--msg_len;
+		} else {
+			hdr.id = (msg_len > 1 ? data[off+1] : 0);
+			if (hdr.id == R2TID_MAX_V1)
+				hdr.id = R2TID_NONE;
+		}
+
+		// call specific command handler, the message is consumed on error
+		++commands_count[cmd];
 		off += msg_len;
+		if (cmd_handlers[cmd]((const r2tmsg_t*)(data+off-msg_len),
+								msg_len, &hdr))
+			goto end;
 	}
+	ret = 0;
 
+end:
+	// handled messages are never parsed twice
 	if (off > 0)
 		iobuf_consume(ibuf, off);
 
-	return 0;
+	return ret;
 }
 
 // R2TERR_xxx error strings
@@ -21,8 +21,93 @@
 
 #include "rdp2tcp.h"
 
-typedef int (*cmdhandler_t)(const r2tmsg_t *, unsigned int);
+/** decoded message header */
+typedef struct _r2thdr {
+	unsigned short id; /**< tunnel identifier */
+	unsigned char v2;  /**< 1 for a v2 frame */
+} r2thdr_t;
+
+/**
+ * command handler
+ * @param[in] msg message (v1 layout, the header must be read from hdr)
+ * @param[in] len size of message (v1 layout)
+ * @param[in] hdr decoded message header
+ */
+typedef int (*cmdhandler_t)(const r2tmsg_t *, unsigned int, const r2thdr_t *);
+
+/** messages parsed per command (R2TCMD_xxx) */
+extern unsigned long long commands_count[R2TCMD_MAX];
 
 int commands_parse(iobuf_t *);
 
+/**
+ * encode a varint (7 bits per byte, least significant bits first)
+ * @param[out] buf output buffer (4 bytes)
+ * @param[in] val value lower than 2^28
+ * @return size of encoded value
+ */
+static inline unsigned int varint_put(unsigned char *buf, unsigned int val)
+{
+	unsigned int n;
+
+	n = 0;
+	while (val >= 0x80) {
+		buf[n++] = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	buf[n++] = (unsigned char) val;
+
+	return n;
+}
+
+/**
+ * decode a varint
+ * @param[in] buf input buffer
+ * @param[in] avail size of input buffer
+ * @param[out] val decoded value
+ * @return size of encoded value, 0 if truncated or -1 if invalid
+ */
+static inline int varint_get(
+					const unsigned char *buf,
+					unsigned int avail,
+					unsigned int *val)
+{
+	unsigned int i, v;
+
+	// small payloads have a 1 byte size
+	if (avail && !(buf[0] & 0x80)) {
+		*val = buf[0];
+		return 1;
+	}
+
+	v = 0;
+	for (i=0; i<4; ++i) {
+		if (i >= avail)
+			return 0;
+		v |= (unsigned int)(buf[i] & 0x7f) << (7*i);
+		if (!(buf[i] & 0x80)) {
+			*val = v;
+			return (int)i+1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * write the header of a compact DATA frame
+ * @param[out] buf header buffer (R2TFRAME_COMPACT_HDRLEN bytes)
+ * @param[in] tid tunnel ID lower than R2TID_MAX_COMPACT
+ * @param[in] len size of payload
+ * @return size of header
+ */
+static inline unsigned int compact_header(
+						unsigned char *buf,
+						unsigned short tid,
+						unsigned int len)
+{
+	buf[0] = (unsigned char)(R2TFRAME_COMPACT | tid);
+	return 1 + varint_put(buf+1, len);
+}
+
 #endif
@@ -24,24 +24,41 @@
 #include "debug.h"
 
 #include <stdio.h>
-#ifndef _WIN32
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef _WIN32
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#endif
+
+#if defined(_WIN32) || defined(__linux__)
+/* attempts are started every NETCONN_DELAY ms and watched together,
+ * other systems only try the next address when connect fails at once */
+#define NETCONN_PARALLEL 1
+#else
+#define NETCONN_PARALLEL 0
 #endif
 
 #ifndef _WIN32
 #define nethelper_error errno
 #define nethelper_badsock -1
+#define nethelper_badwatch -1
 #define close_sock(x) close(x)
 #define net_fd(s) (*(s))
 
 #else
 #define nethelper_error WSAGetLastError()
 #define nethelper_badsock INVALID_SOCKET
+#define nethelper_badwatch WSA_INVALID_EVENT
 #define close_sock(x) closesocket(x)
 #ifndef ENOMEM
 #define ENOMEM ERROR_NOT_ENOUGH_MEMORY
@@ -123,10 +140,53 @@ const char *net_error(int ret, int err)
 	return (const char *) buffer;
 }
 
-static int netres(
+/**
+ * resolve a hostname
+ * @param[in] pref_af preferred address family (AF_UNSPEC for any)
+ * @param[in] host hostname
+ * @param[in] port TCP port (0 to leave the port of the results unset)
+ * @param[in] flags getaddrinfo flags (AI_xxx)
+ * @param[out] out_res resolution results (released with freeaddrinfo)
+ * @param[out] err getaddrinfo error
+ * @return NETERR_RESOLVE on error, 0 on success
+ * @note this function may block, it is called by the resolver threads
+ */
+int net_lookup(
+		int pref_af,
+		const char *host,
+		unsigned short port,
+		int flags,
+		struct addrinfo **out_res,
+		int *err)
+{
+	int ret;
+	struct addrinfo hints;
+	char service[8];
+
+	assert(((pref_af==AF_UNSPEC) || (pref_af==AF_INET) || (pref_af==AF_INET6))
+			&& host && *host && out_res && err);
+	*err = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = pref_af;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = flags;
+	if (port)
+		snprintf(service, sizeof(service)-1, "%hu", port);
+
+	*out_res = NULL;
+	ret = getaddrinfo(host, (port ? service : NULL), &hints, out_res);
+	if (ret) {
+		*err = ret;
+		return NETERR_RESOLVE;
+	}
+
+	return 0;
+}
+
+static int netres_addrs(
 					int mode,
-					int pref_af,
-					const char *host,
+					const struct addrinfo *res,
 					unsigned short port,
 					sock_t *out_sock,
 					netaddr_t *addr,
@@ -139,28 +199,15 @@ static int netres(
 	WSAEVENT evt;
 #endif
 	int ret, n;
-	struct addrinfo hints, *res, *ptr;
-	char service[8];
+	const struct addrinfo *ptr;
+	netaddr_t sa;
 
-	assert(((pref_af==AF_UNSPEC) || (pref_af==AF_INET) || (pref_af==AF_INET6))
-			&& host && *host && port && addr && err && (out_sock || !mode));
+	assert(res && err && (out_sock || !mode));
 	*err = 0;
 
 	if (addr)
 		memset(addr, 0, sizeof(*addr));
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = pref_af;
-	hints.ai_socktype = SOCK_STREAM;
-	snprintf(service, sizeof(service)-1, "%hu", port);
-
-	res = NULL;
-	ret = getaddrinfo(host, service, &hints, &res);
-	if (ret) {
-		*err = ret;
-		return NETERR_RESOLVE;
-	}
-
 	ret = NETERR_NOADDR;
 	fd  = nethelper_badsock;
 #ifdef _WIN32
@@ -170,8 +217,20 @@ static int netres(
 	// for each hostname resolution result
 	for (ptr=res; ptr; ptr=ptr->ai_next) {
 
+		if (ptr->ai_addrlen > sizeof(sa))
+			continue;
+
+		// results may be shared by several ports (cached resolutions)
+		memcpy(&sa, ptr->ai_addr, ptr->ai_addrlen);
+		if (port) {
+			if (ptr->ai_family == AF_INET6)
+				sa.ip6.sin6_port = htons(port);
+			else
+				sa.ip4.sin_port = htons(port);
+		}
+
 		if (addr)
-			memcpy(addr, ptr->ai_addr, ptr->ai_addrlen);
+			memcpy(addr, &sa, ptr->ai_addrlen);
 
 		if (!mode) { // resolve-only
 			ret = 0;
@@ -202,9 +261,10 @@ static int netres(
 			n = 1;
 			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,(const void*)&n, sizeof(n));
 
-			if (!bind(fd, ptr->ai_addr, ptr->ai_addrlen)) {
+			if (!bind(fd, (struct sockaddr *)&sa, ptr->ai_addrlen)) {
 
-				if (!listen(fd, 5)) {
+				// bursts of connections (SOCKS5 browsing) are not dropped
+				if (!listen(fd, SOMAXCONN)) {
 #ifdef _WIN32
 					if (WSAEventSelect(fd, evt, FD_ACCEPT)) {
 						*err = nethelper_error;
@@ -230,7 +290,7 @@ static int netres(
 				break;
 			}
 #endif
-			if (!connect(fd, ptr->ai_addr, ptr->ai_addrlen)) {
+			if (!connect(fd, (struct sockaddr *)&sa, ptr->ai_addrlen)) {
 #ifdef _WIN32
 				if (WSAEventSelect(fd, evt, FD_READ|FD_CLOSE)) {
 					*err = nethelper_error;
@@ -251,13 +311,13 @@ static int netres(
 
 #ifdef _WIN32
 		WSACloseEvent(evt);
+		evt = WSA_INVALID_EVENT;
 #endif
 		close_sock(fd);
+		fd = nethelper_badsock;
 		*err = nethelper_error;
 	}
 
-	freeaddrinfo(res);
-
 	if ((ret >= 0) && mode) {
 #ifndef _WIN32
 		*out_sock = fd;
@@ -276,6 +336,29 @@ static int netres(
 	return ret;
 }
 
+static int netres(
+					int mode,
+					int pref_af,
+					const char *host,
+					unsigned short port,
+					sock_t *out_sock,
+					netaddr_t *addr,
+					int *err)
+{
+	int ret;
+	struct addrinfo *res;
+
+	ret = net_lookup(pref_af, host, port, 0, &res, err);
+	if (!ret) {
+		ret = netres_addrs(mode, res, 0, out_sock, addr, err);
+		freeaddrinfo(res);
+	} else if (addr) {
+		memset(addr, 0, sizeof(*addr));
+	}
+
+	return ret;
+}
+
 /**
  * resolve a hostname
  * @return -1 on error, 0 on success
@@ -322,6 +405,593 @@ int net_client(
 	return netres(2, pref_af, host, port, out_sock, addr, err);
 }
 
+/**
+ * bind a socket server to resolved addresses
+ * @param[in] res hostname resolution results (net_lookup)
+ * @param[in] port TCP port (0 to keep the port of the results)
+ * @return -1 on error, 0 on success
+ */
+int net_server_addrs(
+		const struct addrinfo *res,
+		unsigned short port,
+		sock_t *out_sock,
+		netaddr_t *addr,
+		int *err)
+{
+	return netres_addrs(1, res, port, out_sock, addr, err);
+}
+
+/**
+ * connect a socket client to resolved addresses
+ * @param[in] res hostname resolution results (net_lookup)
+ * @param[in] port TCP port (0 to keep the port of the results)
+ * @return -1 on error, 0 on success, 1 if connection is pending
+ */
+int net_client_addrs(
+		const struct addrinfo *res,
+		unsigned short port,
+		sock_t *out_sock,
+		netaddr_t *addr,
+		int *err)
+{
+	return netres_addrs(2, res, port, out_sock, addr, err);
+}
+
+/* monotonic clock in milliseconds (wraps) */
+static unsigned int net_msec(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#else
+	return (unsigned int) GetTickCount();
+#endif
+}
+
+/* append a resolved address to the connection attempts */
+static void netconn_append(
+					netconn_t *nc,
+					const struct addrinfo *ai,
+					unsigned short port)
+{
+	netaddr_t *addr;
+
+	if ((nc->count >= NETCONN_MAX) || (ai->ai_addrlen > sizeof(*addr)))
+		return;
+
+	addr = &nc->addrs[nc->count++];
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	if (ai->ai_family == AF_INET6)
+		addr->ip6.sin6_port = htons(port);
+	else
+		addr->ip4.sin_port = htons(port);
+}
+
+/* start the connection attempt to the next address
+ * return 1 if an attempt is started, 0 if every address failed */
+static int netconn_attempt(netconn_t *nc)
+{
+#ifndef _WIN32
+	int fd;
+#if NETCONN_PARALLEL
+	struct epoll_event ev;
+#endif
+#else
+	SOCKET fd;
+#endif
+	unsigned int i;
+	netaddr_t *addr;
+	socklen_t addr_len;
+
+	while (nc->next < nc->count) {
+
+		i = nc->next++;
+		addr = &nc->addrs[i];
+		addr_len = (netaddr_af(addr) == AF_INET6 ? sizeof(addr->ip6)
+															: sizeof(addr->ip4));
+
+		fd = socket(netaddr_af(addr), SOCK_STREAM, IPPROTO_TCP);
+		if (fd == nethelper_badsock) {
+			nc->err = nethelper_error;
+			continue;
+		}
+
+#ifndef _WIN32
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+#if NETCONN_PARALLEL
+		memset(&ev, 0, sizeof(ev));
+		ev.events   = EPOLLOUT;
+		ev.data.u32 = i;
+		if (epoll_ctl(nc->watch, EPOLL_CTL_ADD, fd, &ev)) {
+			nc->err = nethelper_error;
+			close_sock(fd);
+			continue;
+		}
+#else
+		nc->watch = fd;
+#endif
+#else
+		if (WSAEventSelect(fd, nc->watch, FD_CONNECT|FD_CLOSE)) {
+			nc->err = nethelper_error;
+			close_sock(fd);
+			continue;
+		}
+#endif
+
+		if (!connect(fd, (struct sockaddr *)addr, addr_len)) {
+			nc->won = i + 1;
+#ifdef _WIN32
+			SetEvent(nc->watch);
+#endif
+		} else if (!net_pending()) {
+			nc->err = nethelper_error;
+			close_sock(fd);
+#if !NETCONN_PARALLEL
+			nc->watch = -1;
+#endif
+			continue;
+		}
+
+		nc->fds[i] = fd;
+		++nc->pending;
+		nc->next_at = net_msec() + NETCONN_DELAY;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* check an attempt, return 0 if connected, 1 if pending, -1 on failure */
+static int netconn_check(netconn_t *nc, unsigned int i)
+{
+	int err;
+#ifndef _WIN32
+	socklen_t len;
+	struct pollfd pfd;
+
+	pfd.fd      = nc->fds[i];
+	pfd.events  = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 1;
+
+	len = sizeof(err);
+	if (getsockopt(nc->fds[i], SOL_SOCKET, SO_ERROR, (void *)&err, &len))
+		err = errno;
+#else
+	WSANETWORKEVENTS events;
+
+	if (WSAEnumNetworkEvents(nc->fds[i], NULL, &events)) {
+		err = WSAGetLastError();
+	} else {
+		if (!(events.lNetworkEvents & FD_CONNECT))
+			return 1;
+		err = events.iErrorCode[FD_CONNECT_BIT];
+	}
+#endif
+
+	if (!err)
+		return 0;
+
+	nc->err = err;
+	close_sock(nc->fds[i]);
+	nc->fds[i] = nethelper_badsock;
+	--nc->pending;
+	return -1;
+}
+
+/**
+ * start connecting a socket client to resolved addresses
+ * @param[in] res hostname resolution results (net_lookup)
+ * @param[in] port TCP port
+ * @param[out] out_nc connection attempts, watched until net_connect_poll
+ *             completes, then released with net_connect_free
+ * @param[out] err error of the last failed attempt
+ * @return -1 on error, 1 if connection is pending
+ * @note IPv6 and IPv4 addresses are tried alternately, starting with the
+ * family of the first result. An attempt is started every NETCONN_DELAY
+ * ms, or as soon as the previous ones failed (RFC 8305).
+ */
+int net_connect(
+		const struct addrinfo *res,
+		unsigned short port,
+		netconn_t **out_nc,
+		int *err)
+{
+	netconn_t *nc;
+	const struct addrinfo *p1, *p2;
+	unsigned int i;
+	int af;
+
+	assert(res && port && out_nc && err);
+	*err = 0;
+
+	nc = calloc(1, sizeof(*nc));
+	if (!nc) {
+		*err = ENOMEM;
+		return NETERR_SOCKET;
+	}
+	for (i=0; i<NETCONN_MAX; ++i)
+		nc->fds[i] = nethelper_badsock;
+
+	// interleave the address families
+	af = res->ai_family;
+	p1 = p2 = res;
+	while (p1 || p2) {
+		while (p1 && (p1->ai_family != af))
+			p1 = p1->ai_next;
+		if (p1) {
+			netconn_append(nc, p1, port);
+			p1 = p1->ai_next;
+		}
+		while (p2 && ((p2->ai_family == af) || ((p2->ai_family != AF_INET)
+						&& (p2->ai_family != AF_INET6))))
+			p2 = p2->ai_next;
+		if (p2) {
+			netconn_append(nc, p2, port);
+			p2 = p2->ai_next;
+		}
+	}
+
+	if (!nc->count) {
+		free(nc);
+		return NETERR_NOADDR;
+	}
+
+#if NETCONN_PARALLEL
+#ifndef _WIN32
+	nc->watch = epoll_create1(EPOLL_CLOEXEC);
+#else
+	nc->watch = WSACreateEvent();
+#endif
+	if (nc->watch == nethelper_badwatch) {
+		*err = nethelper_error;
+		free(nc);
+		return NETERR_SOCKET;
+	}
+#else
+	nc->watch = -1;
+#endif
+
+	if (!netconn_attempt(nc)) {
+		*err = nc->err;
+		net_connect_free(nc);
+		return NETERR_CONNECT;
+	}
+
+	*out_nc = nc;
+	return 1;
+}
+
+/**
+ * handle the completion of connection attempts (or their delay)
+ * @param[in] nc connection attempts (net_connect)
+ * @param[out] out_sock connected socket
+ * @param[out] addr address of the connected socket
+ * @param[out] err error of the last failed attempt
+ * @return -1 if every attempt failed, 0 on success, 1 if still pending
+ * @note the other attempts are left to net_connect_free
+ */
+int net_connect_poll(
+		netconn_t *nc,
+		sock_t *out_sock,
+		netaddr_t *addr,
+		int *err)
+{
+	unsigned int i;
+	int ret, failed;
+#ifndef _WIN32
+	int fd;
+#else
+	SOCKET fd;
+#endif
+
+	assert(nc && out_sock && err);
+	*err = 0;
+
+#ifdef _WIN32
+	// attempts completed after this point signal the event again
+	ResetEvent(nc->watch);
+#endif
+
+	failed = 0;
+	for (i=0; i<nc->next; ++i) {
+
+		if (nc->fds[i] == nethelper_badsock)
+			continue;
+
+		ret = (nc->won == i + 1 ? 0 : netconn_check(nc, i));
+		if (ret < 0) {
+			failed = 1;
+			continue;
+		}
+		if (ret > 0)
+			continue;
+
+		fd = nc->fds[i];
+		nc->fds[i] = nethelper_badsock;
+		--nc->pending;
+#ifndef _WIN32
+#if NETCONN_PARALLEL
+		epoll_ctl(nc->watch, EPOLL_CTL_DEL, fd, NULL);
+#else
+		nc->watch = -1;
+#endif
+		*out_sock = fd;
+#else
+		// the event of the attempts is now owned by the socket
+		if (WSAEventSelect(fd, nc->watch, FD_READ|FD_CLOSE)) {
+			*err = nethelper_error;
+			closesocket(fd);
+			return NETERR_SOCKET;
+		}
+		out_sock->fd  = fd;
+		out_sock->evt = nc->watch;
+		nc->watch = WSA_INVALID_EVENT;
+#endif
+		if (addr)
+			memcpy(addr, &nc->addrs[i], sizeof(*addr));
+		return 0;
+	}
+
+#if NETCONN_PARALLEL
+	if (failed || !nc->pending || (net_connect_timeout(nc) == 0))
+		netconn_attempt(nc);
+#endif
+
+	if (nc->pending)
+		return 1;
+
+	*err = nc->err;
+	return NETERR_CONNECT;
+}
+
+/**
+ * return the delay before the next connection attempt
+ * @param[in] nc connection attempts (net_connect)
+ * @return the delay in milliseconds, -1 if no attempt is left
+ */
+long net_connect_timeout(const netconn_t *nc)
+{
+	int delay;
+
+	assert(nc);
+
+	if (!NETCONN_PARALLEL || (nc->next >= nc->count))
+		return -1;
+
+	delay = (int)(nc->next_at - net_msec());
+	return (delay > 0 ? delay : 0);
+}
+
+/**
+ * release connection attempts
+ * @param[in] nc connection attempts (net_connect)
+ */
+void net_connect_free(netconn_t *nc)
+{
+	unsigned int i;
+
+	assert(nc);
+
+	for (i=0; i<nc->next; ++i) {
+		if (nc->fds[i] != nethelper_badsock)
+			close_sock(nc->fds[i]);
+	}
+#ifndef _WIN32
+#if NETCONN_PARALLEL
+	if (nc->watch != -1)
+		close(nc->watch);
+#endif
+#else
+	if (nc->watch != WSA_INVALID_EVENT)
+		WSACloseEvent(nc->watch);
+#endif
+	free(nc);
+}
+
+/**
+ * parse a numeric address without hostname resolution
+ * @return -1 if host is not a numeric address, 0 on success
+ */
+int net_parse(
+		int pref_af,
+		const char *host,
+		unsigned short port,
+		netaddr_t *addr)
+{
+	int ret, err;
+	struct addrinfo *res;
+
+	ret = net_lookup(pref_af, host, port, AI_NUMERICHOST, &res, &err);
+	if (!ret) {
+		ret = netres_addrs(0, res, 0, NULL, addr, &err);
+		freeaddrinfo(res);
+	}
+
+	return ret;
+}
+
+/* hostname resolutions cache (used by the events loop thread only) */
+static netcache_t *cache = NULL;
+static netcache_stats_t cache_stats;
+
+/* remove an entry from the cache, release it if no request uses it */
+static void netcache_unlink(netcache_t **prev)
+{
+	netcache_t *nc;
+
+	nc = *prev;
+	*prev = nc->next;
+	nc->next   = NULL;
+	nc->cached = 0;
+	--cache_stats.entries;
+
+	if (!nc->refs)
+		netcache_release(nc);
+}
+
+/**
+ * lookup a hostname resolution in the cache
+ * @param[in] af preferred address family
+ * @param[in] host hostname
+ * @return NULL if the hostname is not cached
+ * @note the returned entry may still be resolved (pending), it is released
+ * with netcache_release
+ */
+netcache_t *netcache_get(int af, const char *host)
+{
+	netcache_t *nc, **prev;
+	time_t now;
+
+	assert(host && *host);
+
+	now = time(NULL);
+	prev = &cache;
+	while ((nc = *prev)) {
+		if (!nc->pending && (nc->expire <= now)) {
+			netcache_unlink(prev);
+			continue;
+		}
+		if ((nc->af == af) && !strcmp(nc->host, host)) {
+			++cache_stats.hits;
+			++nc->refs;
+			return nc;
+		}
+		prev = &nc->next;
+	}
+
+	++cache_stats.misses;
+	return NULL;
+}
+
+/**
+ * add a pending hostname resolution to the cache
+ * @param[in] af preferred address family
+ * @param[in] host hostname
+ * @return NULL on allocation error
+ * @note the entry is completed with netcache_set and released with
+ * netcache_release
+ */
+netcache_t *netcache_add(int af, const char *host)
+{
+	netcache_t *nc, **prev, **oldest;
+	unsigned int host_len;
+
+	assert(host && *host);
+
+	host_len = strlen(host);
+	nc = calloc(1, sizeof(*nc) + host_len);
+	if (!nc)
+		return NULL;
+	nc->af      = af;
+	nc->refs    = 1;
+	nc->pending = 1;
+	nc->cached  = 1;
+	memcpy(nc->host, host, host_len + 1);
+
+	if (cache_stats.entries >= NETCACHE_MAX) {
+		// evict the resolution which expires first
+		oldest = NULL;
+		for (prev=&cache; *prev; prev=&(*prev)->next) {
+			if (!(*prev)->pending
+					&& (!oldest || ((*prev)->expire < (*oldest)->expire)))
+				oldest = prev;
+		}
+		if (oldest)
+			netcache_unlink(oldest);
+	}
+
+	nc->next = cache;
+	cache = nc;
+	++cache_stats.entries;
+
+	return nc;
+}
+
+/**
+ * store the result of a hostname resolution
+ * @param[in] nc pending cache entry
+ * @param[in] ret 0 on success or NETERR_RESOLVE
+ * @param[in] err getaddrinfo error
+ * @param[in] res resolution results, owned by the cache entry
+ * @note failed resolutions are cached for NETCACHE_NEG_TTL seconds
+ */
+void netcache_set(netcache_t *nc, int ret, int err, struct addrinfo *res)
+{
+	assert(nc && nc->pending);
+
+	nc->res     = res;
+	nc->ret     = ret;
+	nc->err     = err;
+	nc->pending = 0;
+	nc->expire  = time(NULL) + (ret ? NETCACHE_NEG_TTL : NETCACHE_TTL);
+}
+
+/**
+ * release a reference on a cache entry
+ * @param[in] nc cache entry
+ */
+void netcache_release(netcache_t *nc)
+{
+	netcache_t **prev;
+
+	assert(nc);
+
+	if (nc->refs > 0)
+		--nc->refs;
+	if (nc->refs)
+		return;
+
+	if (nc->cached) {
+		if (!nc->pending)
+			return;
+		// nobody will complete the resolution
+		for (prev=&cache; *prev; prev=&(*prev)->next) {
+			if (*prev == nc) {
+				netcache_unlink(prev);
+				break;
+			}
+		}
+		return;
+	}
+
+	if (nc->res)
+		freeaddrinfo(nc->res);
+	free(nc);
+}
+
+/**
+ * remove the completed resolutions from the cache
+ * @note pending resolutions are kept for the requests waiting for them
+ */
+void netcache_flush(void)
+{
+	netcache_t **prev;
+
+	prev = &cache;
+	while (*prev) {
+		if ((*prev)->pending)
+			prev = &(*prev)->next;
+		else
+			netcache_unlink(prev);
+	}
+}
+
+/**
+ * return the cached hostname resolutions
+ * @param[out] stats cache counters (may be NULL)
+ * @return the first cache entry (NULL if the cache is empty)
+ */
+const netcache_t *netcache_entries(netcache_stats_t *stats)
+{
+	if (stats)
+		memcpy(stats, &cache_stats, sizeof(*stats));
+	return cache;
+}
+
 /**
  * accept a client connection
  * @param[in] srv the server socket
@@ -373,6 +1043,8 @@ int net_accept(sock_t *srv, sock_t *cli, netaddr_t *addr)
  * @param[in,out] min_size minimal I/O chunk size
  * @param[out] out_size hold transfer size on success
  * @return -1 on error, 0 on success and 1 if the operation would block
+ * @note min_size doubles while reads fill the buffer and is halved when
+ *       less than a quarter of it is read
  */
 int net_read(
 			sock_t *s,
@@ -408,11 +1080,17 @@ int net_read(
 		iobuf_commit(ibuf, prefix_size + (unsigned int) ret);
 		*out_size = (unsigned int) ret;
 
-		if (ret == (avail - prefix_size)) {
-			 // increase I/O chunks size (perfs..)
-			curr_min_size <<= 1;
-			if (curr_min_size > NETBUF_MAX_SIZE)
-				curr_min_size = NETBUF_MAX_SIZE;
+		if (min_size) {
+			if (ret == (avail - prefix_size)) {
+				 // increase I/O chunks size (perfs..)
+				curr_min_size <<= 1;
+				if (curr_min_size > NETBUF_MAX_SIZE)
+					curr_min_size = NETBUF_MAX_SIZE;
+			} else if (((unsigned int) ret < curr_min_size / 4)
+					&& (curr_min_size > IOBUF_MIN_SIZE)) {
+				// decrease it once the stream slows down
+				curr_min_size >>= 1;
+			}
 			*min_size = curr_min_size;
 		}
 		return 0;
@@ -459,11 +1137,14 @@ int net_write(
 #else
 			ret = send(net_fd(s), data, size, 0);
 #endif
-			if (ret < 0)
-				return net_pending() ? 1 : -(int)nethelper_error;
+			if (ret < 0) {
+				if (!net_pending())
+					return -(int)nethelper_error;
+				ret = 0; // socket is full, buffer everything
 
-			if (!ret)
+			} else if (!ret) {
 				return NETERR_CLOSED;
+			}
 
 			data = ((const char *)data) + ret;
 			size -= ret;
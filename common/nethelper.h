@@ -22,6 +22,8 @@
 #include "compiler.h"
 #include "iobuf.h"
 
+#include <time.h>
+
 #define NETERR_RESOLVE -1
 #define NETERR_NOADDR  -2
 #define NETERR_SOCKET  -3
@@ -85,9 +87,88 @@ const char *netaddr_print(const netaddr_t *, char *);
 
 const char *net_error(int, int);
 
+int net_lookup(int, const char *, unsigned short, int, struct addrinfo **, int *);
 int net_resolve(int, const char *, unsigned short, netaddr_t *, int *);
+int net_parse(int, const char *, unsigned short, netaddr_t *);
 int net_server(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
 int net_client(int, const char *, unsigned short, sock_t *, netaddr_t *,int*);
+int net_server_addrs(const struct addrinfo *, unsigned short, sock_t *,
+							netaddr_t *, int *);
+int net_client_addrs(const struct addrinfo *, unsigned short, sock_t *,
+							netaddr_t *, int *);
+/** maximal number of addresses tried by a connection */
+#ifndef NETCONN_MAX
+#define NETCONN_MAX 8
+#endif
+/** delay before the next connection attempt in milliseconds (RFC 8305) */
+#ifndef NETCONN_DELAY
+#define NETCONN_DELAY 250
+#endif
+
+/** connection attempts to the addresses of a hostname (Happy Eyeballs) */
+typedef struct _netconn {
+#ifndef _WIN32
+	int watch;                 /**< descriptor ready when an attempt completes */
+	int fds[NETCONN_MAX];      /**< attempts sockets (-1 if none) */
+#else
+	WSAEVENT watch;            /**< event signaled when an attempt completes */
+	SOCKET fds[NETCONN_MAX];   /**< attempts sockets (INVALID_SOCKET if none) */
+#endif
+	netaddr_t addrs[NETCONN_MAX]; /**< addresses, IPv6 and IPv4 interleaved */
+	unsigned int next_at;      /**< date of the next attempt (ms) */
+	int err;                   /**< error of the last failed attempt */
+	unsigned char count;       /**< number of addresses */
+	unsigned char next;        /**< index of the next address to try */
+	unsigned char pending;     /**< number of attempts in progress */
+	unsigned char won;         /**< 1 + index of an attempt connected at once */
+} netconn_t;
+
+int  net_connect(const struct addrinfo *, unsigned short, netconn_t **, int *);
+int  net_connect_poll(netconn_t *, sock_t *, netaddr_t *, int *);
+long net_connect_timeout(const netconn_t *);
+void net_connect_free(netconn_t *);
+
+/** maximal number of cached hostname resolutions */
+#ifndef NETCACHE_MAX
+#define NETCACHE_MAX 256
+#endif
+/** lifetime of successful resolutions (seconds) */
+#ifndef NETCACHE_TTL
+#define NETCACHE_TTL 60
+#endif
+/** lifetime of failed resolutions (seconds) */
+#ifndef NETCACHE_NEG_TTL
+#define NETCACHE_NEG_TTL 5
+#endif
+
+/** cached hostname resolution */
+typedef struct _netcache {
+	struct _netcache *next; /**< next cache entry */
+	struct addrinfo *res;   /**< resolution results (NULL on failure) */
+	int ret;                /**< 0 on success or NETERR_RESOLVE */
+	int err;                /**< getaddrinfo error */
+	int af;                 /**< preferred address family */
+	unsigned int refs;      /**< number of requests using the results */
+	unsigned char pending;  /**< 1 while the hostname is resolved */
+	unsigned char cached;   /**< 0 once removed from the cache */
+	time_t expire;          /**< expiration date */
+	char host[1];           /**< hostname */
+} netcache_t;
+
+/** hostname resolutions cache counters */
+typedef struct _netcache_stats {
+	unsigned int hits;    /**< lookups answered by the cache */
+	unsigned int misses;  /**< lookups resolved by a resolver thread */
+	unsigned int entries; /**< number of cache entries */
+} netcache_stats_t;
+
+netcache_t *netcache_get(int, const char *);
+netcache_t *netcache_add(int, const char *);
+void netcache_set(netcache_t *, int, int, struct addrinfo *);
+void netcache_release(netcache_t *);
+void netcache_flush(void);
+const netcache_t *netcache_entries(netcache_stats_t *);
+
 int net_accept(sock_t *, sock_t *, netaddr_t *);
 int net_read(sock_t*, iobuf_t*, unsigned int, unsigned int*, unsigned int*);
 int net_write(sock_t *, iobuf_t *, const void *, unsigned int, unsigned int *);
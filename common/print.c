@@ -25,7 +25,9 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "debug.h"
 #include "print.h"
 
@@ -35,29 +37,184 @@
 #define PRINT_DBG  3
 #define PRINT_MAX  4
 
+#ifndef PRINT_RING_SIZE
+/** size of the messages ring (power of 2) */
+#define PRINT_RING_SIZE (64*1024)
+#endif
+#ifndef PRINT_RATE_MAX
+/** maximal number of messages per second and per category */
+#define PRINT_RATE_MAX 100
+#endif
+/** maximal size of a formatted message */
+#define PRINT_LINE_MAX 1024
+/** number of I/O streams with transfer counters */
+#define PRINT_XFER_MAX 8
+
 int info_level = 3;
+int debug_level = -1;
 static FILE *print_fps[PRINT_MAX];
 
+/** formatted messages waiting for print_flush */
+static struct {
+	char data[PRINT_RING_SIZE];
+	unsigned int head; /**< write position (only moved by producer) */
+	unsigned int tail; /**< read position (only moved by print_flush) */
+} ring;
+
+/** per-category rate limiting */
+static struct {
+	time_t ts;                     /**< current second */
+	unsigned int count[PRINT_MAX]; /**< messages printed in current second */
+	unsigned int dropped[PRINT_MAX]; /**< messages suppressed */
+} rate;
+
+/** transfer counters of an I/O stream */
+typedef struct _xferstats {
+	const char *name;
+	unsigned long long ops[2];   /**< number of reads/writes */
+	unsigned long long bytes[2]; /**< size of reads/writes */
+} xferstats_t;
+
+static xferstats_t xfers[PRINT_XFER_MAX];
+static time_t xfers_ts = 0;
+
 /* common code {{{  */
+/**
+ * write the ring data to the output stream
+ * @note there is a single consumer, the producer only moves the head
+ */
+static void ring_flush(void)
+{
+	unsigned int head, off, len;
+	FILE *fp;
+
+	fp = print_fps[PRINT_INFO];
+	head = ring.head;
+	while (ring.tail != head) {
+		off = ring.tail & (PRINT_RING_SIZE - 1);
+		len = head - ring.tail;
+		if (len > PRINT_RING_SIZE - off)
+			len = PRINT_RING_SIZE - off;
+		if (fp && (fwrite(ring.data + off, 1, len, fp) != len))
+			break;
+		ring.tail += len;
+	}
+	ring.tail = head;
+	if (fp)
+		fflush(fp);
+}
+
+/**
+ * append data to the ring
+ * @note the ring is flushed synchronously if it is full
+ */
+static void ring_put(const char *data, unsigned int len)
+{
+	unsigned int off, n;
+
+	if (PRINT_RING_SIZE - (ring.head - ring.tail) < len)
+		ring_flush();
+
+	while (len > 0) {
+		off = ring.head & (PRINT_RING_SIZE - 1);
+		n = PRINT_RING_SIZE - off;
+		if (n > len)
+			n = len;
+		memcpy(ring.data + off, data, n);
+		ring.head += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * format a message line into the ring
+ * @param[in] prefix message prefix (or NULL)
+ * @param[in] fmt format string
+ * @param[in] va format arguments
+ * @note long messages are truncated
+ */
+static void ring_vprintf(const char *prefix, const char *fmt, va_list va)
+{
+	char line[PRINT_LINE_MAX];
+	int len, plen, max;
+
+	plen = 0;
+	if (prefix) {
+		plen = (int) strlen(prefix);
+		memcpy(line, prefix, plen);
+	}
+
+	max = (int)sizeof(line) - plen - 2;
+	len = vsnprintf(line + plen, max + 1, fmt, va);
+	if ((len < 0) || (len > max))
+		len = max;
+	len += plen;
+	line[len++] = '\n';
+
+	ring_put(line, (unsigned int) len);
+}
+
+static void ring_printf(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	ring_vprintf(NULL, fmt, va);
+	va_end(va);
+}
+
+/**
+ * check whether a message category exceeds its rate
+ * @param[in] fid message category (PRINT_xxx)
+ * @return 1 if the message must be dropped
+ */
+static int rate_exceeded(unsigned int fid)
+{
+	time_t now;
+
+	time(&now);
+	if (now != rate.ts) {
+		rate.ts = now;
+		memset(rate.count, 0, sizeof(rate.count));
+	}
+
+	if (rate.count[fid] >= PRINT_RATE_MAX) {
+		++rate.dropped[fid];
+		return 1;
+	}
+	++rate.count[fid];
+	return 0;
+}
+
+/**
+ * format a message into the ring
+ * @param[in] fid message category (PRINT_xxx)
+ * @param[in] prefix message prefix (or NULL)
+ * @param[in] fmt format string
+ * @param[in] va format arguments
+ * @note information messages are written by print_flush, other
+ *       messages (and all messages in debug mode) are written immediately
+ */
 static void do_print(
 					unsigned int fid,
 					const char *prefix,
 					const char *fmt,
 					va_list va)
 {
-	FILE *fp;
-
 	assert(print_fps[fid] && fmt);
 
-	fp = print_fps[fid];
-	if (prefix)
-		fputs(prefix, fp);
-	vfprintf(fp, fmt, va);
-	fputc('\n', fp);
+	// debug messages are never dropped
+	if ((fid != PRINT_DBG) && rate_exceeded(fid))
+		return;
+
+	ring_vprintf(prefix, fmt, va);
+
+	if ((fid != PRINT_INFO) || (debug_level >= 0))
+		ring_flush();
 }
 /* }}} */
 /* debug {{{ */
-int debug_level = -1;
 int tracing_flags = 0;
 
 void __debug(int level, const char *fmt, ...)
@@ -80,6 +237,7 @@ void __trace(
 {
 	va_list va;
 
+	ring_flush();
 	fprintf(stderr, " %s(", func);
 	va_start(va, fmt);
 	vfprintf(stderr, fmt, va);
@@ -105,6 +263,46 @@ void print_init(void)
 	print_fps[0] = stderr;
 	print_fps[1] = stderr;
 	print_fps[2] = stderr;
+
+	atexit(print_flush);
+}
+
+/**
+ * write the buffered messages and the transfer counters
+ * @note must be called from an idle point of the events loop, the
+ *       transfer counters are printed at most once per second
+ */
+void print_flush(void)
+{
+	static const char *names[PRINT_MAX] = { "info", "warn", "error", "debug" };
+	unsigned int i;
+	xferstats_t *x;
+	time_t now;
+
+	for (i=0; i<PRINT_MAX; ++i) {
+		if (rate.dropped[i]) {
+			ring_printf("%u %s messages suppressed", rate.dropped[i], names[i]);
+			rate.dropped[i] = 0;
+		}
+	}
+
+	time(&now);
+	if ((now != xfers_ts) && (info_level >= 1)) {
+		xfers_ts = now;
+		for (i=0; (i<PRINT_XFER_MAX) && xfers[i].name; ++i) {
+			x = &xfers[i];
+			if (!x->ops[0] && !x->ops[1])
+				continue;
+			ring_printf("%-6s %lu bytes > %lu writes, %lu bytes < %lu reads", x->name,
+							(unsigned long) x->bytes[1], (unsigned long) x->ops[1],
+							(unsigned long) x->bytes[0], (unsigned long) x->ops[0]);
+			memset(x->ops, 0, sizeof(x->ops));
+			memset(x->bytes, 0, sizeof(x->bytes));
+		}
+	}
+
+	if (ring.head != ring.tail)
+		ring_flush();
 }
 
 /**
@@ -165,11 +363,33 @@ int error(const char *fmt, ...)
 /* }}} */
 
 /**
- * print I/O transfer length
+ * account an I/O transfer
+ * @param[in] name I/O stream name
+ * @param[in] rw 'r' or 'w'
+ * @param[in] size transfer length
+ * @note the counters are printed by print_flush (info level 1)
  */
 void print_xfer(const char *name, char rw, unsigned int size)
 {
-	info(1, (rw=='r'?"%-6s          < %-8u":"%-6s %8u >"), name, size);
+	xferstats_t *x;
+	unsigned int i;
+
+	for (i=0; i<PRINT_XFER_MAX-1; ++i) {
+		x = &xfers[i];
+		if (!x->name) {
+			x->name = name;
+			break;
+		}
+		if ((x->name == name) || !strcmp(x->name, name))
+			break;
+	}
+	x = &xfers[i];
+	if (!x->name)
+		x->name = "other";
+
+	i = (rw == 'w');
+	++x->ops[i];
+	x->bytes[i] += size;
 }
 
 #ifdef DEBUG
@@ -29,6 +29,7 @@ int warn(const char *, ...);
 int error(const char *, ...);
 
 void print_xfer(const char *, char, unsigned int);
+void print_flush(void);
 
 #ifdef DEBUG
 void fprint_hex(void *, unsigned int, FILE *);
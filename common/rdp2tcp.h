@@ -31,6 +31,10 @@
  */
 #define RDP2TCP_CHAN_NAME "rdp2tcp"
 #define RDP2TCP_PING_DELAY 5 // secs
+#ifndef RDP2TCP_PROBE_DELAY
+/** delay between timestamped pings measuring the channel (milliseconds) */
+#define RDP2TCP_PROBE_DELAY 1000
+#endif
 
 // rdp2tcp commands
 #define R2TCMD_CONN  0x00
@@ -39,7 +43,48 @@
 #define R2TCMD_PING  0x03
 #define R2TCMD_BIND  0x04
 #define R2TCMD_RCONN 0x05
-#define R2TCMD_MAX   0x06
+#define R2TCMD_WINDOW 0x06
+#define R2TCMD_ZDATA 0x07
+#define R2TCMD_MAX   0x08
+
+/** command flag of v2 frames (16-bit tunnel identifier in network order)
+ * @note message structures describe v1 frames, they are used on v2 frames
+ *       shifted by 1 byte: cmd and id fields then hold the identifier */
+#define R2TCMD_V2    0x80
+
+/** first byte of compact DATA frames, ORed with the tunnel identifier
+ * @note compact frames have no size header: the first byte is followed by
+ *       the payload size (varint) and the payload. The size header of
+ *       other frames always starts with a zero byte. */
+#define R2TFRAME_COMPACT  0x80
+/** identifiers of compact frames are lower than this */
+#define R2TID_MAX_COMPACT 0x80
+/** maximal size of a compact frame header */
+#define R2TFRAME_COMPACT_HDRLEN 5
+
+// capabilities advertised in R2TCMD_PING payload
+#define R2TCAP_WINDOW 0x01 /**< per-tunnel flow control (R2TCMD_WINDOW) */
+#define R2TCAP_ZDATA  0x02 /**< LZ4 compressed tunnel data (R2TCMD_ZDATA) */
+#define R2TCAP_TID16  0x04 /**< 16-bit tunnel identifiers (v2 frames) */
+#define R2TCAP_COMPACT 0x08 /**< compact DATA frames (R2TFRAME_COMPACT) */
+#define R2TCAP_PROBE  0x10 /**< timestamped pings (r2tmsg_ping_t) */
+
+// flags of timestamped pings
+#define R2TPING_PROBE 0x01 /**< the ping must be echoed */
+#define R2TPING_ECHO  0x02 /**< echo of a probe */
+
+// tunnel identifiers
+#define R2TID_MAX_V1 0xff   /**< identifiers of v1 frames are lower than this */
+#define R2TID_MAX_V2 0xffff /**< identifiers of v2 frames are lower than this */
+#define R2TID_NONE   0xffff /**< invalid tunnel identifier */
+
+#ifndef RDP2TCP_WINDOW_SIZE
+/**
+ * per-tunnel receive window, maximal amount of tunnel data received
+ * from the virtual channel and not yet written to the tunnel
+ */
+#define RDP2TCP_WINDOW_SIZE (256*1024)
+#endif
 
 // address family on wire
 #define TUNAF_ANY  0x00
@@ -96,4 +141,50 @@ PACK(struct _r2tmsg_rconnreq {
 });
 typedef struct _r2tmsg_rconnreq r2tmsg_rconnreq_t;
 
+/** R2TCMD_RCONN message of v2 frames (server --> client) */
+PACK(struct _r2tmsg_rconnreq2 {
+	unsigned char cmd;      /**< first byte of local tunnel identifier */
+	unsigned char id;       /**< last byte of local tunnel identifier */
+	unsigned short rid;     /**< remote tunnel identifier (network order) */
+	unsigned char af;       /**< address family */
+	unsigned short port;    /**< TCP port */
+	unsigned char addr[16]; /**< tunnel address */
+});
+typedef struct _r2tmsg_rconnreq2 r2tmsg_rconnreq2_t;
+
+/** R2TCMD_WINDOW message (client <--> server)
+ * @note the first message of a tunnel sets the initial window size,
+ *       peers only limit tunnel data once this message is received */
+PACK(struct _r2tmsg_window {
+	unsigned char cmd; /**< R2TCMD_WINDOW */
+	unsigned char id;  /**< tunnel identifier */
+	unsigned int inc;  /**< receive window increment (network order) */
+});
+typedef struct _r2tmsg_window r2tmsg_window_t;
+
+/** timestamped R2TCMD_PING message (client <--> server)
+ * @note only sent to a peer which advertised R2TCAP_PROBE. A probe is
+ *       answered at once with an echo holding the same sequence number
+ *       and timestamp, which are opaque to the peer. */
+PACK(struct _r2tmsg_ping {
+	unsigned char cmd;   /**< R2TCMD_PING */
+	unsigned char id;    /**< unused (0) */
+	unsigned char caps;  /**< capabilities of the sender */
+	unsigned char flags; /**< R2TPING_xxx */
+	unsigned int seq;    /**< probe sequence number (network order) */
+	unsigned char ts[8]; /**< probe timestamp */
+});
+typedef struct _r2tmsg_ping r2tmsg_ping_t;
+
+/** R2TCMD_ZDATA message (client <--> server)
+ * @note only sent to a peer which advertised R2TCAP_ZDATA, the data
+ *       are a single LZ4 block */
+PACK(struct _r2tmsg_zdata {
+	unsigned char cmd;    /**< R2TCMD_ZDATA */
+	unsigned char id;     /**< tunnel identifier */
+	unsigned int len;     /**< uncompressed size (network order) */
+	unsigned char data[0]; /**< compressed data */
+});
+typedef struct _r2tmsg_zdata r2tmsg_zdata_t;
+
 #endif
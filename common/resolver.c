@@ -0,0 +1,541 @@
+/**
+ * @file resolver.c
+ * asynchronous hostname resolution
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "resolver.h"
+#include "debug.h"
+#include "print.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+/* completion notification (both ends are the same eventfd on Linux) */
+static int notify_fd[2] = { -1, -1 };
+
+#define resolver_lock()   pthread_mutex_lock(&lock)
+#define resolver_unlock() pthread_mutex_unlock(&lock)
+#define resolver_wait()   pthread_cond_wait(&wakeup, &lock)
+#define resolver_wake()   pthread_cond_signal(&wakeup)
+
+#else
+static CRITICAL_SECTION lock;
+/* semaphore released for each queued request */
+static HANDLE wakeup = NULL;
+/* manual-reset event set while completed requests are waiting */
+static HANDLE notify_evt = NULL;
+
+#define resolver_lock()   EnterCriticalSection(&lock)
+#define resolver_unlock() LeaveCriticalSection(&lock)
+#define resolver_wait() do { \
+		LeaveCriticalSection(&lock); \
+		WaitForSingleObject(wakeup, INFINITE); \
+		EnterCriticalSection(&lock); \
+	} while (0)
+#define resolver_wake()   ReleaseSemaphore(wakeup, 1, NULL)
+#endif
+
+/* requests waiting for a resolver thread */
+static netreq_t *queued = NULL, **queued_tail = &queued;
+static unsigned int queued_count = 0;
+/* requests waiting for the main loop */
+static netreq_t *done = NULL, **done_tail = &done;
+/* requests waiting for a pending cache entry (main loop only) */
+static netreq_t *waiting = NULL, **waiting_tail = &waiting;
+
+static unsigned int threads = 0;
+static unsigned int idle = 0;
+static int initialized = 0;
+static int stopping = 0;
+
+static void notify_set(void)
+{
+#ifndef _WIN32
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+	ssize_t r;
+
+	r = write(notify_fd[1], &one, sizeof(one));
+	(void)r;
+#else
+	SetEvent(notify_evt);
+#endif
+}
+
+static void notify_clear(void)
+{
+#ifndef _WIN32
+	char buf[64];
+
+	while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+		;
+#else
+	ResetEvent(notify_evt);
+#endif
+}
+
+/* append a request to a queue */
+static void enqueue(netreq_t ***tail, netreq_t *req)
+{
+	req->next = NULL;
+	**tail = req;
+	*tail = &req->next;
+}
+
+/* remove the first request of a queue */
+static netreq_t *dequeue(netreq_t **head, netreq_t ***tail)
+{
+	netreq_t *req;
+
+	req = *head;
+	if (req) {
+		*head = req->next;
+		if (!*head)
+			*tail = head;
+	}
+	return req;
+}
+
+/* move a resolved request to the completion queue (locked) */
+static void complete(netreq_t *req)
+{
+	if (stopping) {
+		// the cache is left to the main loop
+		if (req->res && (!req->cache || req->lead))
+			freeaddrinfo(req->res);
+		free(req);
+		return;
+	}
+	// cancelled cache leaders are still needed to complete the cache entry
+	if (!req->ctx && !req->lead) {
+		resolver_free(req);
+		return;
+	}
+
+	req->state = NETREQ_DONE;
+	enqueue(&done_tail, req);
+	if (done == req)
+		notify_set();
+}
+
+/* resolver thread body (locked) */
+static void resolver_loop(void)
+{
+	netreq_t *req;
+
+	for (;;) {
+
+		while (!queued && !stopping) {
+			++idle;
+			resolver_wait();
+			--idle;
+		}
+		if (stopping)
+			break;
+
+		req = dequeue(&queued, &queued_tail);
+		--queued_count;
+		req->state = NETREQ_RUNNING;
+
+		resolver_unlock();
+		req->ret = net_lookup(req->pref_af, req->host, 0, 0,
+									&req->res, &req->err);
+		resolver_lock();
+
+		complete(req);
+	}
+
+	--threads;
+}
+
+#ifndef _WIN32
+static void *resolver_thread(void *arg)
+{
+	resolver_lock();
+	resolver_loop();
+	resolver_unlock();
+	return NULL;
+}
+
+/* start a detached resolver thread (locked) */
+static int resolver_spawn(void)
+{
+	pthread_t th;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// signals are handled by the main loop only
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&th, &attr, resolver_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret)
+		return error("failed to start resolver thread (%s)", strerror(ret));
+
+	++threads;
+	return 0;
+}
+
+#else
+static DWORD WINAPI resolver_thread(LPVOID arg)
+{
+	resolver_lock();
+	resolver_loop();
+	resolver_unlock();
+	return 0;
+}
+
+/* start a detached resolver thread (locked) */
+static int resolver_spawn(void)
+{
+	HANDLE th;
+
+	th = CreateThread(NULL, 0, resolver_thread, NULL, 0, NULL);
+	if (!th)
+		return error("failed to start resolver thread (%u)",
+						(unsigned int) GetLastError());
+
+	CloseHandle(th);
+	++threads;
+	return 0;
+}
+#endif
+
+/**
+ * initialize the resolver
+ * @return 0 on success
+ * @note resolver threads are started on demand
+ */
+int resolver_init(void)
+{
+	trace_res("");
+
+	if (initialized)
+		return 0;
+
+#ifndef _WIN32
+#ifdef __linux__
+	notify_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (notify_fd[0] == -1)
+		return error("failed to create resolver eventfd (%s)", strerror(errno));
+	notify_fd[1] = notify_fd[0];
+#else
+	if (pipe(notify_fd))
+		return error("failed to create resolver pipe (%s)", strerror(errno));
+	fcntl(notify_fd[0], F_SETFL, fcntl(notify_fd[0], F_GETFL)|O_NONBLOCK);
+	fcntl(notify_fd[1], F_SETFL, fcntl(notify_fd[1], F_GETFL)|O_NONBLOCK);
+	fcntl(notify_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(notify_fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+#else
+	InitializeCriticalSection(&lock);
+	wakeup = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+	notify_evt = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!wakeup || !notify_evt)
+		return error("failed to create resolver events (%u)",
+						(unsigned int) GetLastError());
+#endif
+
+	initialized = 1;
+	return 0;
+}
+
+/**
+ * stop the resolver and release the pending requests
+ * @note threads blocked by a hostname resolution are not waited for
+ */
+void resolver_kill(void)
+{
+	netreq_t *req;
+
+	trace_res("");
+
+	if (!initialized)
+		return;
+
+	resolver_lock();
+	stopping = 1;
+	while ((req = dequeue(&queued, &queued_tail)))
+		resolver_free(req);
+	queued_count = 0;
+	while ((req = dequeue(&done, &done_tail)))
+		resolver_free(req);
+	while ((req = dequeue(&waiting, &waiting_tail)))
+		resolver_free(req);
+#ifndef _WIN32
+	pthread_cond_broadcast(&wakeup);
+#else
+	ReleaseSemaphore(wakeup, RESOLVER_THREADS, NULL);
+#endif
+	resolver_unlock();
+}
+
+#ifndef _WIN32
+/**
+ * return the descriptor readable when requests are completed
+ * @return -1 if the resolver is not initialized
+ */
+int resolver_fd(void)
+{
+	return notify_fd[0];
+}
+#else
+/**
+ * return the event signaled when requests are completed
+ */
+HANDLE resolver_event(void)
+{
+	return notify_evt;
+}
+#endif
+
+/* use the results of a completed cache entry */
+static void use_cache(netreq_t *req)
+{
+	req->res = req->cache->res;
+	req->ret = req->cache->ret;
+	req->err = req->cache->err;
+}
+
+/* store the results of a cache leader and complete the waiting requests */
+static void fill_cache(netreq_t *leader)
+{
+	netcache_t *nc;
+	netreq_t *req, **prev;
+
+	nc = leader->cache;
+	netcache_set(nc, leader->ret, leader->err, leader->res);
+	leader->lead = 0;
+
+	resolver_lock();
+	complete(leader);
+	prev = &waiting;
+	while ((req = *prev)) {
+		if (req->cache == nc) {
+			*prev = req->next;
+			if (waiting_tail == &req->next)
+				waiting_tail = prev;
+			use_cache(req);
+			complete(req);
+		} else {
+			prev = &req->next;
+		}
+	}
+	resolver_unlock();
+}
+
+/**
+ * start the resolution of a hostname
+ * @param[in] pref_af preferred address family (AF_UNSPEC for any)
+ * @param[in] host hostname or numeric address
+ * @param[in] port TCP port
+ * @param[in] ctx request owner returned with the completed request
+ * @return NULL on error
+ * @note numeric addresses and cached hostnames are completed without a
+ * resolver thread, concurrent requests for a hostname share its resolution
+ */
+netreq_t *resolver_query(
+					int pref_af,
+					const char *host,
+					unsigned short port,
+					void *ctx)
+{
+	netreq_t *req;
+	unsigned int host_len;
+
+	assert(host && *host && port && ctx);
+	trace_res("host=%s, port=%hu", host, port);
+
+	if (!initialized) {
+		error("resolver is not initialized");
+		return NULL;
+	}
+
+	host_len = strlen(host);
+	req = calloc(1, sizeof(*req) + host_len);
+	if (!req) {
+		error("failed to allocate resolver request");
+		return NULL;
+	}
+	req->ctx     = ctx;
+	req->pref_af = pref_af;
+	req->port    = port;
+	memcpy(req->host, host, host_len + 1);
+
+	if (!net_lookup(pref_af, host, port, AI_NUMERICHOST, &req->res, &req->err)) {
+		resolver_lock();
+		complete(req);
+		resolver_unlock();
+		return req;
+	}
+	req->err = 0;
+
+	req->cache = netcache_get(pref_af, host);
+	if (req->cache) {
+		if (!req->cache->pending) {
+			trace_res("%s cached", host);
+			use_cache(req);
+			resolver_lock();
+			complete(req);
+			resolver_unlock();
+		} else {
+			trace_res("%s is being resolved", host);
+			req->state = NETREQ_WAITING;
+			enqueue(&waiting_tail, req);
+		}
+		return req;
+	}
+
+	// the hostname is resolved without cache if the entry can't be allocated
+	req->cache = netcache_add(pref_af, host);
+	req->lead  = (req->cache != NULL);
+
+	resolver_lock();
+	req->state = NETREQ_QUEUED;
+	enqueue(&queued_tail, req);
+	++queued_count;
+
+	if ((queued_count > idle) && (threads < RESOLVER_THREADS)
+			&& resolver_spawn() && !threads) {
+		dequeue(&queued, &queued_tail);
+		--queued_count;
+		resolver_unlock();
+		resolver_free(req);
+		return NULL;
+	}
+	resolver_wake();
+	resolver_unlock();
+
+	return req;
+}
+
+/**
+ * cancel a resolution request
+ * @param[in] req request not returned yet by resolver_next
+ * @note a running resolution is released once completed, cache leaders are
+ * resolved anyway for the requests waiting for them
+ */
+void resolver_cancel(netreq_t *req)
+{
+	netreq_t **prev;
+
+	assert(req && req->ctx);
+	trace_res("host=%s, state=%u", req->host, req->state);
+
+	if (req->state == NETREQ_WAITING) {
+		for (prev=&waiting; *prev; prev=&(*prev)->next) {
+			if (*prev == req) {
+				*prev = req->next;
+				if (waiting_tail == &req->next)
+					waiting_tail = prev;
+				resolver_free(req);
+				break;
+			}
+		}
+		return;
+	}
+
+	resolver_lock();
+
+	req->ctx = NULL;
+	if ((req->state == NETREQ_QUEUED) && !req->lead) {
+		for (prev=&queued; *prev; prev=&(*prev)->next) {
+			if (*prev == req) {
+				*prev = req->next;
+				if (queued_tail == &req->next)
+					queued_tail = prev;
+				--queued_count;
+				resolver_free(req);
+				break;
+			}
+		}
+	}
+
+	resolver_unlock();
+}
+
+/**
+ * retrieve a completed request
+ * @return NULL if no request is completed
+ * @note returned requests are released with resolver_free
+ */
+netreq_t *resolver_next(void)
+{
+	netreq_t *req;
+
+	if (!initialized)
+		return NULL;
+
+	resolver_lock();
+
+	while ((req = dequeue(&done, &done_tail))) {
+		if (req->lead) {
+			resolver_unlock();
+			fill_cache(req);
+			resolver_lock();
+			continue;
+		}
+		if (req->ctx)
+			break;
+		resolver_free(req);
+	}
+	if (!done)
+		notify_clear();
+
+	resolver_unlock();
+
+	return req;
+}
+
+/**
+ * release a request and its resolution results
+ * @param[in] req completed request
+ */
+void resolver_free(netreq_t *req)
+{
+	assert(req);
+
+	if (req->res && (!req->cache || req->lead))
+		freeaddrinfo(req->res);
+	if (req->cache)
+		netcache_release(req->cache);
+	free(req);
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "compiler.h"
+#include "nethelper.h"
+
+/** maximal number of resolver threads */
+#ifndef RESOLVER_THREADS
+#define RESOLVER_THREADS 4
+#endif
+
+#define NETREQ_QUEUED  0
+#define NETREQ_RUNNING 1
+#define NETREQ_DONE    2
+#define NETREQ_WAITING 3
+
+/** hostname resolution request */
+typedef struct _netreq {
+	struct _netreq *next;  /**< next request of the queue */
+	void *ctx;             /**< request owner (NULL once cancelled) */
+	struct addrinfo *res;  /**< resolution results */
+	netcache_t *cache;     /**< cache entry holding the results */
+	int ret;               /**< 0 on success or NETERR_RESOLVE */
+	int err;               /**< getaddrinfo error */
+	int pref_af;           /**< preferred address family */
+	unsigned short port;   /**< TCP port */
+	unsigned char state;   /**< request state (NETREQ_xxx) */
+	unsigned char lead;    /**< 1 if the request resolves the cache entry */
+	char host[1];          /**< hostname */
+} netreq_t;
+
+int  resolver_init(void);
+void resolver_kill(void);
+#ifndef _WIN32
+int  resolver_fd(void);
+#else
+HANDLE resolver_event(void);
+#endif
+netreq_t *resolver_query(int, const char *, unsigned short, void *);
+void resolver_cancel(netreq_t *);
+netreq_t *resolver_next(void);
+void resolver_free(netreq_t *);
+
+#endif
@@ -0,0 +1,117 @@
+/**
+ * @file tidmap.c
+ * tunnel identifiers table
+ */
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "debug.h"
+#include "tidmap.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+/**
+ * find the first zero bit of a word
+ * @param[in] w word (must not be 0xffffffff)
+ */
+static inline unsigned int ffz(unsigned int w)
+{
+#ifdef __GNUC__
+	return (unsigned int) __builtin_ctz(~w);
+#else
+	unsigned int i;
+	for (i=0; w & 1; ++i)
+		w >>= 1;
+	return i;
+#endif
+}
+
+/**
+ * register a tunnel identifier
+ * @param[in] map tunnels table
+ * @param[in] id unused tunnel identifier
+ * @param[in] tun tunnel associated with identifier
+ */
+void tidmap_set(tidmap_t *map, unsigned short id, void *tun)
+{
+	assert(map && (id != 0xffff) && tun && !map->tunnels[id]);
+
+	map->tunnels[id] = tun;
+	map->used[id >> 5] |= 1U << (id & 31);
+}
+
+/**
+ * release a tunnel identifier
+ * @param[in] map tunnels table
+ * @param[in] id tunnel identifier
+ */
+void tidmap_del(tidmap_t *map, unsigned short id)
+{
+	assert(map && (id != 0xffff));
+
+	map->tunnels[id] = NULL;
+	map->used[id >> 5] &= ~(1U << (id & 31));
+}
+
+/**
+ * find the first unused identifier within [from, to[
+ * @return -1 if all identifiers are used
+ */
+static int find_free(const tidmap_t *map, unsigned int from, unsigned int to)
+{
+	unsigned int id, w;
+
+	for (id=from; id<to; id=(id & ~31U)+32) {
+		// ignore identifiers lower than id within the current word
+		w = map->used[id >> 5] | ((1U << (id & 31)) - 1);
+		if (w != 0xffffffff) {
+			id = (id & ~31U) + ffz(w);
+			return (id < to ? (int)id : -1);
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * generate an unused tunnel identifier
+ * @param[in] map tunnels table
+ * @param[in] max generated identifiers are lower than max
+ * @return max if all identifiers are used
+ * @note identifiers are generated in a round-robin way so that recently
+ *       released identifiers are not reused immediately
+ */
+unsigned short tidmap_next_free(tidmap_t *map, unsigned short max)
+{
+	unsigned int start;
+	int id;
+
+	assert(map);
+
+	start = (map->next >= max ? 0 : map->next);
+	id = find_free(map, start, max);
+	if ((id < 0) && start)
+		id = find_free(map, 0, start);
+
+	if (id < 0)
+		return max;
+
+	map->next = (unsigned int) id + 1;
+	return (unsigned short) id;
+}
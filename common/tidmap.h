@@ -0,0 +1,50 @@
+/*
+ * This file is part of rdp2tcp
+ *
+ * Copyright (C) 2010-2011, Nicolas Collignon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TIDMAP_H__
+#define __TIDMAP_H__
+
+#include "compiler.h"
+#include "debug.h"
+
+/** number of tunnel identifiers (0xffff is reserved) */
+#define TIDMAP_SIZE 0x10000
+
+/** tunnel identifiers table */
+typedef struct _tidmap {
+	void *tunnels[TIDMAP_SIZE];         /**< tunnels indexed by identifier */
+	unsigned int used[TIDMAP_SIZE/32]; /**< bitmap of used identifiers */
+	unsigned int next;                 /**< next identifier to try */
+} tidmap_t;
+
+/**
+ * lookup a tunnel by identifier
+ * @param[in] map tunnels table
+ * @param[in] id tunnel identifier
+ * @return NULL if identifier is not used
+ */
+static inline void *tidmap_get(const tidmap_t *map, unsigned short id)
+{
+	return map->tunnels[id];
+}
+
+void tidmap_set(tidmap_t *, unsigned short, void *);
+void tidmap_del(tidmap_t *, unsigned short);
+unsigned short tidmap_next_free(tidmap_t *, unsigned short);
+
+#endif
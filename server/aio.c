@@ -63,6 +63,8 @@ int __aio_init_forward(aio_t *rio, aio_t *wio
 	wio->io.hEvent = evt2;
 	rio->min_io_size = 1024;
 	wio->min_io_size = 0;
+	rio->io_count = wio->io_count = 0;
+	rio->io_bytes = wio->io_bytes = 0;
 
 	return 0;
 }
@@ -89,6 +91,7 @@ void aio_kill_forward(aio_t *rio, aio_t *wio)
  * @param[in] callback function called data are received
  * @param[in] ctx context passed as argument to callback function
  * @return -1 on error
+ * @note no I/O is started once callback returns 1
  */
 int aio_read(
 		aio_t *rio,
@@ -100,6 +103,7 @@ int aio_read(
 	iobuf_t *ibuf;
 	char *data;
 	DWORD len, r;
+	int ret;
 	unsigned int avail, min_io_size;
 
 	assert(valid_aio(rio) && name && *name && callback);
@@ -132,9 +136,10 @@ int aio_read(
 
 		print_xfer(name, 'r', (unsigned int) len);
 		iobuf_commit(ibuf, len);
-		if (callback(ibuf, ctx) < 0) {
+		ret = callback(ibuf, ctx);
+		if (ret) { // error or reading suspended
 			ResetEvent(rio->io.hEvent);
-			return -1;
+			return (ret < 0 ? -1 : 0);
 		}
 	}
 
@@ -161,9 +166,10 @@ int aio_read(
 
 		print_xfer(name, 'r', r);
 		iobuf_commit(ibuf, (unsigned int)r);
-		if (callback(ibuf, ctx) < 0) {
+		ret = callback(ibuf, ctx);
+		if (ret) { // error or reading suspended
 			ResetEvent(rio->io.hEvent);
-			return -1;
+			return (ret < 0 ? -1 : 0);
 		}
 
 	} else {
@@ -216,6 +222,7 @@ int aio_write(aio_t *wio, HANDLE fd, const char *name)
 		}
 		iobuf_consume(obuf, (unsigned int)len);
 		print_xfer(name, 'w', len);
+		wio->io_bytes += len;
 	}
 
 	len = (DWORD) iobuf_datalen(obuf);
@@ -229,6 +236,7 @@ int aio_write(aio_t *wio, HANDLE fd, const char *name)
 #endif
 
 	w = 0;
+	++wio->io_count;
 	if (WriteFile(fd, iobuf_dataptr(obuf), len, &w, &wio->io)) {
 
 		if (w == 0) {
@@ -238,6 +246,7 @@ int aio_write(aio_t *wio, HANDLE fd, const char *name)
 
 		iobuf_consume(obuf, w);
 		print_xfer(name, 'w', w);
+		wio->io_bytes += w;
 
 	} else {
 
@@ -24,6 +24,7 @@
 #include "r2twin.h"
 #include "rdp2tcp.h"
 #include "msgparser.h"
+#include "lzblock.h"
 #include "wtsapi32.h"
 
 #ifndef CHANNEL_CHUNK_LENGTH
@@ -31,6 +32,16 @@
 #define CHANNEL_CHUNK_LENGTH 1600
 #endif
 
+/** tunnel data smaller than this are never compressed */
+#define CHANNEL_ZIP_MIN 256
+/** maximal number of messages sent uncompressed after a poor ratio */
+#define CHANNEL_ZIP_BACKOFF 64
+
+#ifndef CHANNEL_COALESCE_SIZE
+/** tunnel data held on an idle channel are written once this size is reached */
+#define CHANNEL_COALESCE_SIZE 4096
+#endif
+
 #ifdef DEBUG
 extern int debug_level;
 #endif
@@ -95,6 +106,11 @@ int channel_init(const char *name)
 void channel_kill(void)
 {
 	trace_chan("");
+	if (vc.wio.io_count > 0)
+		info(0, "channel writes=%lu frames/write=%.2f bytes/write=%.0f",
+				(unsigned long)vc.wio.io_count,
+				(double)vc.frames / vc.wio.io_count,
+				(double)vc.wio.io_bytes / vc.wio.io_count);
 	CancelIo(vc.chan);
 	aio_kill_forward(&vc.rio, &vc.wio);
 	CloseHandle(vc.chan);
@@ -126,6 +142,15 @@ int channel_write_pending(void)
 	return vc.wio.pending;
 }
 
+/**
+ * check whether tunnel data are held for coalescing
+ * @note held data are written as soon as no other event is ready
+ */
+int channel_write_corked(void)
+{
+	return vc.corked;
+}
+
 /**
  * process TS virtual channel write-event
  * @return 0 on success
@@ -134,6 +159,7 @@ int channel_write_event(void)
 {
 	int ret;
 
+	vc.corked = 0;
 	ret = aio_write(&vc.wio, vc.chan, "chan");
 	trace_chan("pending=%i, outavail=%u, connected=%i, ret=%i",
 			vc.wio.pending, iobuf_datalen(&vc.wio.buf), vc.connected, ret);
@@ -147,6 +173,83 @@ int channel_write_event(void)
 	return 0;
 }
 
+/**
+ * start the write of a message appended to the channel output buffer
+ * @param[in] used size of data buffered before the message
+ * @param[in] cork 1 if the message may be coalesced with the next ones
+ * @return 0 on success
+ * @note small tunnel data are held until the events loop is idle, so that
+ *       the data of the tunnels ready at the same time share a single write
+ */
+static int write_msg(unsigned int used, int cork)
+{
+	++vc.frames;
+
+	if (cork && (iobuf_datalen(&vc.wio.buf) < CHANNEL_COALESCE_SIZE)) {
+		if (!used)
+			vc.corked = 1;
+		return 0;
+	}
+
+	if ((used > 0) && !vc.corked)
+		return 0;
+
+	return channel_write_event();
+}
+
+/**
+ * check whether the messages of a tunnel are sent in v2 frames
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @return 1 for v2 frames (16-bit tunnel ID)
+ */
+int channel_is_v2(unsigned short tun_id)
+{
+	return ((vc.caps & R2TCAP_TID16) || (tun_id >= R2TID_MAX_V1));
+}
+
+/**
+ * get the tunnel ID allocation limit
+ * @return R2TID_MAX_V2 if the client supports 16-bit IDs
+ */
+unsigned short channel_max_tid(void)
+{
+	return (vc.caps & R2TCAP_TID16 ? R2TID_MAX_V2 : R2TID_MAX_V1);
+}
+
+/**
+ * write a message header
+ * @param[out] ptr header buffer (7 bytes)
+ * @param[in] cmd rdp2tcp command (R2TCMD_xxx)
+ * @param[in] tun_id rdp2tcp tunnel ID
+ * @param[in] data_len size of message payload
+ * @return size of header
+ * @note DATA messages of tunnels with a small ID have a compact header if
+ *       the client supports it
+ */
+static unsigned int write_header(
+					unsigned char *ptr,
+					unsigned char cmd,
+					unsigned short tun_id,
+					unsigned int data_len)
+{
+	if ((cmd == R2TCMD_DATA) && (vc.caps & R2TCAP_COMPACT)
+			&& (tun_id < R2TID_MAX_COMPACT))
+		return compact_header(ptr, tun_id, data_len);
+
+	if (channel_is_v2(tun_id)) {
+		*((unsigned int *)ptr) = htonl(data_len+3);
+		ptr[4] = cmd | R2TCMD_V2;
+		ptr[5] = (unsigned char)(tun_id >> 8);
+		ptr[6] = (unsigned char) tun_id;
+		return 7;
+	}
+
+	*((unsigned int *)ptr) = htonl(data_len+2);
+	ptr[4] = cmd;
+	ptr[5] = (unsigned char) tun_id;
+	return 6;
+}
+
 /**
  * send a message through TS virtual channel
  * @param[in] cmd rdp2tcp command (R2TCMD_xxx)
@@ -157,36 +260,91 @@ int channel_write_event(void)
  */
 int channel_write(
 	unsigned char cmd,
-	unsigned char tun_id,
+	unsigned short tun_id,
 	const void *data,
 	unsigned int data_len)
 {
 	unsigned char *ptr;
-	unsigned int used;
+	unsigned int used, hlen;
 
 	trace_chan("cmd=%02x id=%02x len=%u", cmd, tun_id, data_len);
 	used = iobuf_datalen(&vc.wio.buf);
 
-	ptr = iobuf_reserve(&vc.wio.buf, data_len+6, NULL);
+	ptr = iobuf_reserve(&vc.wio.buf, data_len+7, NULL);
 	if (!ptr)
-		return error("failed to append %u bytes to channel buffer", data_len+6);
-	*((unsigned int *)ptr) = htonl(data_len+2);
+		return error("failed to append %u bytes to channel buffer", data_len+7);
 
-	ptr[4] = cmd;
-	ptr[5] = tun_id;
-	memcpy(ptr+6, data, data_len);
-	iobuf_commit(&vc.wio.buf, data_len+6);
+	hlen = write_header(ptr, cmd, tun_id, data_len);
+	memcpy(ptr+hlen, data, data_len);
+	iobuf_commit(&vc.wio.buf, data_len+hlen);
 
-	if (used > 0)
-		return 0;
+	return write_msg(used, (cmd == R2TCMD_DATA));
+}
 
-	return channel_write_event();
+/**
+ * record the capabilities advertised by the client
+ * @param[in] caps client capabilities (R2TCAP_xxx)
+ */
+void channel_set_caps(unsigned char caps)
+{
+	if (vc.caps != caps) {
+		debug(0, "client capabilities 0x%02x", caps);
+		vc.caps = caps;
+	}
+}
+
+/**
+ * send compressed tunnel data through TS virtual channel
+ * @param[in] tun tunnel
+ * @param[in] data data to compress
+ * @param[in] len size of data
+ * @return 0 on success, 1 if data do not compress well or -1 on error
+ * @note after a poor ratio the next messages of the tunnel are sent
+ *       uncompressed, the number of skipped messages doubles as long as
+ *       the tunnel data do not compress
+ */
+static int write_zdata(tunnel_t *tun, const void *data, unsigned int len)
+{
+	unsigned char *ptr;
+	unsigned int used, max, zlen, hlen;
+
+	if (tun->zskip > 0) {
+		--tun->zskip;
+		return 1;
+	}
+
+	// compression must save at least 1/8 of the data
+	max = len - len/8;
+	used = iobuf_datalen(&vc.wio.buf);
+
+	ptr = iobuf_reserve(&vc.wio.buf, max+11, NULL);
+	if (!ptr)
+		return error("failed to append %u bytes to channel buffer", max+11);
+
+	hlen = (channel_is_v2(tun->id) ? 7 : 6);
+	zlen = lzblock_compress(data, len, ptr+hlen+4, max);
+	if (!zlen) {
+		tun->zbackoff = (tun->zbackoff ? tun->zbackoff * 2 : 1);
+		if (tun->zbackoff > CHANNEL_ZIP_BACKOFF)
+			tun->zbackoff = CHANNEL_ZIP_BACKOFF;
+		tun->zskip = tun->zbackoff;
+		return 1;
+	}
+	tun->zbackoff = 0;
+
+	trace_chan("id=%02x len=%u zlen=%u", tun->id, len, zlen);
+	write_header(ptr, R2TCMD_ZDATA, tun->id, zlen+4);
+	*((unsigned int *)(ptr+hlen)) = htonl(len);
+	iobuf_commit(&vc.wio.buf, hlen+4+zlen);
+
+	return write_msg(used, 1);
 }
 
 /**
  * forward tunnel input buffer to virtual channel
  * @param[in] tun tunnel
  * @return -1 on error
+ * @note data are compressed if the client supports it
  */
 int channel_forward(tunnel_t *tun)
 {
@@ -199,11 +357,54 @@ int channel_forward(tunnel_t *tun)
 	ret = 0;
 
 	if (len > 0) {
-		ret = channel_write(R2TCMD_DATA, tun->id, iobuf_dataptr(ibuf), len);
-		if (ret >= 0)
+		ret = 1;
+		if ((vc.caps & R2TCAP_ZDATA) && (len >= CHANNEL_ZIP_MIN)
+				&& (len <= RDP2TCP_MAX_MSGLEN - 6))
+			ret = write_zdata(tun, iobuf_dataptr(ibuf), len);
+		if (ret > 0)
+			ret = channel_write(R2TCMD_DATA, tun->id, iobuf_dataptr(ibuf), len);
+		if (ret >= 0) {
 			iobuf_consume(ibuf, len);
+			tun->tx_credit -= (int) len;
+		}
 	}
 
 	return ret;
 }
 
+/**
+ * advertise the tunnel receive window to the client
+ * @param[in] tun tunnel
+ * @return -1 on error
+ */
+int channel_open_window(tunnel_t *tun)
+{
+	unsigned int inc;
+
+	trace_chan("id=0x%02x, size=%u", tun->id, RDP2TCP_WINDOW_SIZE);
+
+	tun->rx_fc = 1;
+	inc = htonl(RDP2TCP_WINDOW_SIZE);
+	return channel_write(R2TCMD_WINDOW, tun->id, &inc, 4);
+}
+
+/**
+ * acknowledge client data written to the tunnel
+ * @param[in] tun tunnel
+ * @param[in] len size of data written
+ * @return -1 on error
+ * @note window updates are sent once half of the window is available
+ */
+int channel_ack_data(tunnel_t *tun, unsigned int len)
+{
+	unsigned int inc;
+
+	tun->rx_unacked += len;
+	if (!tun->rx_fc || (tun->rx_unacked < RDP2TCP_WINDOW_SIZE / 2))
+		return 0;
+
+	inc = htonl(tun->rx_unacked);
+	tun->rx_unacked = 0;
+	return channel_write(R2TCMD_WINDOW, tun->id, &inc, 4);
+}
+
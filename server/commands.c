@@ -23,8 +23,11 @@
 #include "rdp2tcp.h"
 #include "r2twin.h"
 #include "msgparser.h"
+#include "lzblock.h"
 
-static int protoerror(unsigned char tid, unsigned char err, const char *errstr)
+#include <string.h>
+
+static int protoerror(unsigned short tid, unsigned char err, const char *errstr)
 {
 	channel_write(R2TCMD_CONN, tid, &err, 1);
 	return error("protocol error (%s)", errstr);
@@ -33,52 +36,62 @@ static int protoerror(unsigned char tid, unsigned char err, const char *errstr)
 static int start_tcp_tunnel(
 					const r2tmsg_connreq_t *msg,
 					unsigned int len,
+					unsigned short tid,
 					int bind_tunnel)
 {
 	static const int r2taf_to_sysaf[3] = { AF_UNSPEC, AF_INET, AF_INET6 };
 
+	if (tid == R2TID_NONE)
+		return error("invalid tunnel id 0x%02x", tid);
+
 	if (len < 7)
-		return protoerror(msg->id, R2TERR_BADMSG, "command too small");
+		return protoerror(tid, R2TERR_BADMSG, "command too small");
 
-	if (tunnel_lookup(msg->id))
-		return error("tunnel 0x%02x is already used", msg->id);
+	if (tunnel_lookup(tid))
+		return error("tunnel 0x%02x is already used", tid);
 
 	if (msg->af > TUNAF_IPV6)
-		return protoerror(msg->id, R2TERR_BADMSG, "invalid address family");
+		return protoerror(tid, R2TERR_BADMSG, "invalid address family");
 
 	if (msg->hostname[len-6])
-		return protoerror(msg->id, R2TERR_BADMSG, "invalid hostname");
+		return protoerror(tid, R2TERR_BADMSG, "invalid hostname");
 
-	tunnel_create(msg->id, r2taf_to_sysaf[msg->af],
+	tunnel_create(tid, r2taf_to_sysaf[msg->af],
 						msg->hostname, ntohs(msg->port), bind_tunnel);
 
 	return 0;
 }
 	
-static int cmd_conn(const r2tmsg_connreq_t *msg, unsigned int len)
+static int cmd_conn(
+				const r2tmsg_connreq_t *msg,
+				unsigned int len,
+				const r2thdr_t *hdr)
 {
 	trace_chan("len=%u, tid=0x%02x, af=0x%02x, port=0x%04x",
-		len, msg->id, msg->af, msg->port);
+		len, hdr->id, msg->af, msg->port);
 
-	return start_tcp_tunnel(msg, len, 0);
+	return start_tcp_tunnel(msg, len, hdr->id, 0);
 }
 
-static int cmd_bind(const r2tmsg_connreq_t *msg, unsigned int len)
+static int cmd_bind(
+				const r2tmsg_connreq_t *msg,
+				unsigned int len,
+				const r2thdr_t *hdr)
 {
 	trace_chan("len=%u, tid=0x%02x, af=0x%02x, port=0x%04x",
-		len, msg->id, msg->af, msg->port);
+		len, hdr->id, msg->af, msg->port);
 
-	return start_tcp_tunnel(msg, len, 1);
+	return start_tcp_tunnel(msg, len, hdr->id, 1);
 }
 
-static int cmd_close(const r2tmsg_t *msg, unsigned int len)
+static int cmd_close(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
 	tunnel_t *tun;
 	
-	trace_chan("len=%u, tid=0x%02x", len, msg->id);
-	tun = tunnel_lookup(msg->id);
+	trace_chan("len=%u, tid=0x%02x", len, hdr->id);
+	tun = tunnel_lookup(hdr->id);
 	if (!tun) {
-		error("invalid tunnel id 0x%02x", msg->id);
+		error("invalid tunnel id 0x%02x", hdr->id);
 		return 0;
 	}
 
@@ -86,26 +99,96 @@ static int cmd_close(const r2tmsg_t *msg, unsigned int len)
 	return 0;
 }
 
-static int cmd_data(const r2tmsg_t *msg, unsigned int len)
+static int cmd_data(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
 {
 	tunnel_t *tun;
 	
-	trace_chan("len=%u, id=0x%02x", len, msg->id);
-	tun = tunnel_lookup(msg->id);
+	trace_chan("len=%u, id=0x%02x", len, hdr->id);
+	tun = tunnel_lookup(hdr->id);
 	if (!tun) {
-		error("invalid tunnel id 0x%02x", msg->id);
+		error("invalid tunnel id 0x%02x", hdr->id);
 		return 0;
 	}
 
 	return tunnel_write(tun, ((const char *)msg)+2, len-2);
 }
 
+static int cmd_zdata(
+				const r2tmsg_zdata_t *msg,
+				unsigned int len,
+				const r2thdr_t *hdr)
+{
+	static char data[RDP2TCP_MAX_MSGLEN];
+	tunnel_t *tun;
+	unsigned int size;
+
+	trace_chan("len=%u, id=0x%02x", len, hdr->id);
+	tun = tunnel_lookup(hdr->id);
+	if (!tun) {
+		error("invalid tunnel id 0x%02x", hdr->id);
+		return 0;
+	}
+
+	size = ntohl(msg->len);
+	if (!size || (size > sizeof(data))
+			|| (lzblock_decompress(msg->data, len-6, data, size) != (int)size)) {
+		error("invalid compressed data for tunnel 0x%02x", hdr->id);
+		tunnel_close(tun);
+		return 0;
+	}
+
+	return tunnel_write(tun, data, size);
+}
+
+static int cmd_ping(const r2tmsg_t *msg, unsigned int len, const r2thdr_t *hdr)
+{
+	const r2tmsg_ping_t *ping;
+	r2tmsg_ping_t echo;
+
+	channel_set_caps(len > 2 ? ((const unsigned char *)msg)[2] : 0);
+
+	// timestamped probes are echoed at once
+	ping = (const r2tmsg_ping_t *) msg;
+	if ((len >= sizeof(*ping)) && (ping->flags & R2TPING_PROBE)) {
+		echo.caps  = SERVER_CAPS;
+		echo.flags = R2TPING_ECHO;
+		echo.seq   = ping->seq;
+		memcpy(echo.ts, ping->ts, sizeof(echo.ts));
+		return channel_write(R2TCMD_PING, 0, &echo.caps, sizeof(echo) - 2);
+	}
+
+	return 0;
+}
+
+static int cmd_window(
+				const r2tmsg_window_t *msg,
+				unsigned int len,
+				const r2thdr_t *hdr)
+{
+	tunnel_t *tun;
+
+	trace_chan("len=%u, id=0x%02x", len, hdr->id);
+	tun = tunnel_lookup(hdr->id);
+	if (!tun) // tunnel may have been closed meanwhile
+		return 0;
+
+	if (!tun->rx_fc && (channel_open_window(tun) < 0))
+		return -1;
+
+	if (tunnel_window(tun, ntohl(msg->inc)) < 0)
+		tunnel_close(tun);
+
+	return 0;
+}
+
 const cmdhandler_t cmd_handlers[R2TCMD_MAX] = {
 	(cmdhandler_t) cmd_conn,  /* R2TCMD_CONN */
 	(cmdhandler_t) cmd_close, /* R2TCMD_CLOSE */
 	(cmdhandler_t) cmd_data,  /* R2TCMD_DATA */
-	NULL,
+	(cmdhandler_t) cmd_ping,  /* R2TCMD_PING */
 	(cmdhandler_t) cmd_bind,  /* R2TCMD_BIND */
-	NULL
+	NULL,
+	(cmdhandler_t) cmd_window,/* R2TCMD_WINDOW */
+	(cmdhandler_t) cmd_zdata  /* R2TCMD_ZDATA */
 };
 
@@ -22,12 +22,19 @@
  */
 #include "r2twin.h"
 #include "rdp2tcp.h"
+#include "resolver.h"
 
 extern struct list_head all_tunnels;
 
+/** maximal number of events handled while channel data are coalesced */
+#define EVENTS_CORK_MAX 16
+
 static unsigned int events_count = 0;
 static HANDLE all_events[0x102] = {0, };
-static unsigned char evtid_to_tunid[0x102] = {0, };
+static unsigned short evtid_to_tunid[0x102] = {0, };
+
+/** index of the resolver completion event */
+#define EVENTS_RESOLVER 2
 
 /** initialize the TS events loop
  * @param[in] wevt TS virtual channel write-event
@@ -37,14 +44,15 @@ void events_init(HANDLE wevt, HANDLE revt)
 	trace_evt("wevt=%x, revt=%x", wevt, revt);
 	all_events[0] = wevt;
 	all_events[1] = revt;
-	events_count = 2;
+	all_events[EVENTS_RESOLVER] = resolver_event();
+	events_count = EVENTS_RESOLVER + 1;
 }
 
 /** register a network tunnel event
  * @param[in] evt TS virtual channel socket event
  * @param[in] id rdp2tcp tunnel ID
  * @return 0 on success */
-int event_add_tunnel(HANDLE evt, unsigned char id)
+int event_add_tunnel(HANDLE evt, unsigned short id)
 {
 	unsigned int i;
 
@@ -69,7 +77,7 @@ int event_add_tunnel(HANDLE evt, unsigned char id)
  * @param[in] we child process write event
  * @param[in] id rdp2tcp tunnel ID
  * @return 0 on success */
-int event_add_process(HANDLE proc, HANDLE re, HANDLE we, unsigned char id)
+int event_add_process(HANDLE proc, HANDLE re, HANDLE we, unsigned short id)
 {
 	unsigned int i;
 
@@ -95,13 +103,13 @@ int event_add_process(HANDLE proc, HANDLE re, HANDLE we, unsigned char id)
 
 /** remove events associated with a rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID */
-void event_del_tunnel(unsigned char id)
+void event_del_tunnel(unsigned short id)
 {
 	unsigned int i, j;
 
 	trace_evt("id=0x%02x", id);
 
-	for (i=2, j=0; i<events_count; ++i) {
+	for (i=EVENTS_RESOLVER+1, j=0; i<events_count; ++i) {
 		if (evtid_to_tunid[i] == id)
 			++j;
 		else if (j)
@@ -125,14 +133,37 @@ void event_del_tunnel(unsigned char id)
  * @return the last event type (EVT_xxx) or -1 on error */
 int event_wait(tunnel_t **out_tun, HANDLE *out_h)
 {
-	DWORD ret, off;
+	static unsigned int corked_waits = 0;
+	DWORD ret, off, timeout;
+	long delay;
+	int timer;
 	tunnel_t *tun;
 
 	off = (channel_write_pending() ? 0 : 1);
 
+	// coalesced channel data are written once no event is ready
+	timeout = RDP2TCP_PING_DELAY*1000;
+	if (channel_write_corked()) {
+		if (++corked_waits > EVENTS_CORK_MAX) {
+			corked_waits = 0;
+			return EVT_CHAN_FLUSH;
+		}
+		timeout = 0;
+	} else {
+		corked_waits = 0;
+	}
+
+	// the next connection attempt of a tunnel may be due before the ping
+	timer = 0;
+	delay = tunnels_connect_timeout();
+	if ((delay >= 0) && ((DWORD)delay < timeout)) {
+		timeout = (DWORD) delay;
+		timer = 1;
+	}
+
 	trace_evt("WaitForMultipleObjects: events_count=%i, offset=%i, events: %x", events_count, off, all_events[off]);
 	ret = WaitForMultipleObjects(events_count-off, &all_events[off], FALSE,
-											RDP2TCP_PING_DELAY*1000);
+											timeout);
 
 	if (ret == WAIT_FAILED) {
 		assert(GetLastError() != ERROR_INVALID_HANDLE);
@@ -140,7 +171,9 @@ int event_wait(tunnel_t **out_tun, HANDLE *out_h)
 	}
 
 	if (ret == WAIT_TIMEOUT) {
-		return EVT_PING;
+		if (timer)
+			return EVT_CONNECT;
+		return (timeout ? EVT_PING : EVT_CHAN_FLUSH);
 	}
 
 	ret -= WAIT_OBJECT_0;
@@ -154,6 +187,10 @@ int event_wait(tunnel_t **out_tun, HANDLE *out_h)
 		return EVT_CHAN_READ;
 	}
 
+	if (off+ret == EVENTS_RESOLVER) {
+		return EVT_RESOLVED;
+	}
+
 	tun = tunnel_lookup(evtid_to_tunid[off+ret]);
 	if (!tun) {
 		return error("invalid tunnel event 0x%02x", evtid_to_tunid[off+ret]);
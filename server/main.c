@@ -32,6 +32,7 @@
 #include "print.h"
 #include "rdp2tcp.h"
 #include "r2twin.h"
+#include "resolver.h"
 
 #include <stdio.h>
 #include <time.h>
@@ -40,6 +41,7 @@ void bye(void)
 {
 	channel_kill();
 	tunnels_kill();
+	resolver_kill();
 	net_exit();
 	exit(0);
 }
@@ -61,6 +63,8 @@ static void setup(void)
 {
 	print_init();
 	net_init();
+	if (resolver_init())
+		exit(0);
 	SetConsoleCtrlHandler(on_signal, TRUE);
 }
 
@@ -74,11 +78,12 @@ static time_t last_ping = 0;
 
 static int ping(time_t *now)
 {
+	static const unsigned char caps = SERVER_CAPS;
 
 	time(now);
 	if (!last_ping || (last_ping + RDP2TCP_PING_DELAY - 1 < *now)) {
 		last_ping = *now;
-		return channel_write(R2TCMD_PING, 0, NULL, 0);
+		return channel_write(R2TCMD_PING, 0, &caps, 1);
 	}
 
 	return 0;
@@ -108,6 +113,8 @@ int main(int argc, char **argv)
 		// I/O loop
 		while (ret >= 0) {
 
+			print_flush();
+			tunnels_connect_timers();
 			switch (event_wait(&tun, &h)) {
 
 				case EVT_CHAN_WRITE: // virtual channel outgoing data
@@ -124,11 +131,25 @@ int main(int argc, char **argv)
 						ping(&now);
 					break;
 
+				case EVT_CHAN_FLUSH: // coalesced outgoing data
+					debug(0, "EVT_CHAN_FLUSH");
+					ret = channel_write_event();
+					break;
+
 				case EVT_TUNNEL: // tcp tunnel incoming/outgoing data
 					debug(0, "EVT_TUNNEL");
 					ret = tunnel_event(tun, h);
 					break;
 
+				case EVT_RESOLVED: // hostname resolutions completed
+					debug(0, "EVT_RESOLVED");
+					tunnels_resolved();
+					break;
+
+				case EVT_CONNECT: // delayed connection attempts
+					debug(0, "EVT_CONNECT");
+					break;
+
 				case EVT_PING: // ping delay
 					if (channel_is_connected()) {
 						debug(0, "EVT_PING");
@@ -32,13 +32,26 @@ typedef struct _aio {
 	unsigned int min_io_size; /**< minimal I/O buffer size */
 	int pending;   /**< 1 if an I/O is pending */
 	OVERLAPPED io; /**< async event */
+	unsigned long long io_count; /**< number of writes started */
+	unsigned long long io_bytes; /**< number of bytes written */
 } aio_t;
 
+#ifndef NO_COMPRESSION
+/** capabilities advertised to the client */
+#define SERVER_CAPS (R2TCAP_WINDOW|R2TCAP_ZDATA|R2TCAP_TID16|R2TCAP_COMPACT \
+						|R2TCAP_PROBE)
+#else
+#define SERVER_CAPS (R2TCAP_WINDOW|R2TCAP_TID16|R2TCAP_COMPACT|R2TCAP_PROBE)
+#endif
+
 /** TS virtual channel */
 typedef struct _vchannel {
 	HANDLE ts;       /**< RDP channel handle */
 	HANDLE chan;     /**< RDP channel I/O handle */
 	int connected:1; /**< 1 if channel is conneced */
+	unsigned char caps; /**< capabilities of the client (R2TCAP_xxx) */
+	unsigned char corked; /**< 1 if tunnel data are held for coalescing */
+	unsigned long long frames; /**< number of messages sent */
 	aio_t rio;       /**< input aio_t */
 	aio_t wio;       /**< output aio_t */
 } vchannel_t;
@@ -49,13 +62,22 @@ typedef struct _tunnel {
 	sock_t sock;             /**< tunnel socket */
 	unsigned char connected; /**< 1 if tunnel is connected */
 	unsigned char server;    /**< 1 for reverse-connect tunnel */
-	unsigned char id;        /**< tunnel identifier */
+	unsigned short id;       /**< tunnel identifier */
 	HANDLE proc;     /**< child process HANDLE */
 	HANDLE rfd;      /**< child process stdout/stderr HANDLE */
 	HANDLE wfd;      /**< child process stdin HANDLE */
 	aio_t rio;       /**< input aio_t */
 	aio_t wio;       /**< output aio_t */
 	netaddr_t addr;  /**< network address */
+	int tx_credit;            /**< data accepted by the client (may be negative) */
+	unsigned int rx_unacked;  /**< data written to tunnel not yet acknowledged */
+	unsigned char tx_fc;      /**< 1 if the client limits data sent to it */
+	unsigned char rx_fc;      /**< 1 if window updates are sent to the client */
+	unsigned char zskip;      /**< messages left to send uncompressed */
+	unsigned char zbackoff;   /**< uncompressed messages after a poor ratio */
+	unsigned char bind;       /**< 1 if socket is bound once resolved */
+	struct _netreq *req;      /**< pending hostname resolution */
+	struct _netconn *conn;    /**< pending connection attempts */
 } tunnel_t;
 
 /* aio.c ***/
@@ -70,6 +92,7 @@ int __aio_init_forward(aio_t *, aio_t *);
 
 void aio_kill_forward(aio_t *, aio_t *);
 
+/** aio_read callback, returns 1 to suspend reading or -1 on error */
 typedef int (*aio_readcb_t)(iobuf_t *, void *);
 int aio_read(aio_t *, HANDLE, const char *, aio_readcb_t, void *);
 int aio_write(aio_t *, HANDLE, const char *);
@@ -79,11 +102,14 @@ int aio_write(aio_t *, HANDLE, const char *);
 #define EVT_CHAN_READ  1
 #define EVT_TUNNEL     2
 #define EVT_PING       3
+#define EVT_CHAN_FLUSH 4
+#define EVT_RESOLVED   5
+#define EVT_CONNECT    6
 
 void events_init(HANDLE, HANDLE);
-int event_add_tunnel(HANDLE, unsigned char);
-void event_del_tunnel(unsigned char);
-int event_add_process(HANDLE, HANDLE, HANDLE, unsigned char);
+int event_add_tunnel(HANDLE, unsigned short);
+void event_del_tunnel(unsigned short);
+int event_add_process(HANDLE, HANDLE, HANDLE, unsigned short);
 int event_wait(tunnel_t **, HANDLE *);
 
 /* channel.c ***/
@@ -93,15 +119,25 @@ int channel_is_connected(void);
 int channel_read_event(void);
 int channel_write_event(void);
 int channel_write_pending(void);
-int channel_write(unsigned char, unsigned char, const void *, unsigned int);
+int channel_write_corked(void);
+int channel_write(unsigned char, unsigned short, const void *, unsigned int);
+int channel_is_v2(unsigned short);
+unsigned short channel_max_tid(void);
 int channel_forward(tunnel_t *);
+int channel_open_window(tunnel_t *);
+int channel_ack_data(tunnel_t *, unsigned int);
+void channel_set_caps(unsigned char);
 
 /* tunnel.c ***/
 #define valid_tunnel(tun) ((tun) && (tun)->list.next && (tun)->list.prev)
-void tunnel_create(unsigned char, int, const char *, unsigned short, int);
-tunnel_t *tunnel_lookup(unsigned char);
+void tunnel_create(unsigned short, int, const char *, unsigned short, int);
+void tunnels_resolved(void);
+long tunnels_connect_timeout(void);
+void tunnels_connect_timers(void);
+tunnel_t *tunnel_lookup(unsigned short);
 int tunnel_event(tunnel_t *, HANDLE);
 int tunnel_write(tunnel_t *tun, const void *, unsigned int);
+int tunnel_window(tunnel_t *, unsigned int);
 void tunnel_close(tunnel_t *);
 void tunnels_kill(void);
 
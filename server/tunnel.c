@@ -23,28 +23,39 @@
 #include "rdp2tcp.h"
 #include "r2twin.h"
 #include "print.h"
+#include "tidmap.h"
+#include "resolver.h"
 
 #include <stdio.h>
 
 extern const char *r2t_errors[R2TERR_MAX];
 
+/** check whether the client receive window of a tunnel is exhausted */
+#define tunnel_tx_blocked(tun) ((tun)->tx_fc && ((tun)->tx_credit <= 0))
+
 /** global tunnels double-linked list */
 LIST_HEAD_INIT(all_tunnels);
+/* number of tunnels with connection attempts in progress */
+static unsigned int connecting = 0;
+
+/** tunnels indexed by tunnel ID */
+static tidmap_t tids;
 
 /** lookup rdp2tcp tunnel
  * @param[in] id rdp2tcp tunnel ID
  * @return NULL if tunnel is not found */
-tunnel_t *tunnel_lookup(unsigned char id)
+tunnel_t *tunnel_lookup(unsigned short id)
 {
-	tunnel_t *tun;
-
 	//trace_tun("id=0x%02x", id);
-	list_for_each(tun, &all_tunnels) {
-		if (tun->id == id)
-			return tun;
-	}
+	return (tunnel_t *) tidmap_get(&tids, id);
+}
 
-	return NULL;
+/** register an established rdp2tcp tunnel
+ * @param[in] tun tunnel with an unused tunnel ID */
+static void tunnel_link(tunnel_t *tun)
+{
+	list_add_tail(&tun->list, &all_tunnels);
+	tidmap_set(&tids, tun->id, tun);
 }
 
 static unsigned char wsa_to_r2t_error(int err)
@@ -61,23 +72,17 @@ static unsigned char wsa_to_r2t_error(int err)
 
 /**
  * generate a unused tunnel ID
- * @return 0xff on error (all tunnel ID are used)
+ * @return R2TID_NONE on error (all tunnel ID are used)
 	// in most cases tunnel IDs are generated by the client
 	// this is the single case where it is generated by the server
  */
-static unsigned char tunnel_generate_id(void)
+static unsigned short tunnel_generate_id(void)
 {
-	unsigned char tid;
-	static unsigned char last_tid = 0xff;
-
-	for (tid=last_tid+1; tid!=last_tid; ++tid) {
-		if (!tunnel_lookup(tid)) {
-			last_tid = tid;
-			return tid;
-		}
-	}
+	unsigned short tid, max;
 
-	return 0xff;
+	max = channel_max_tid();
+	tid = tidmap_next_free(&tids, max);
+	return (tid != max ? tid : R2TID_NONE);
 }
 
 static unsigned int netaddr_to_connans(
@@ -116,8 +121,10 @@ static int tunnel_socksend_event(tunnel_t *tun)
 	if (ret < 0)
 		return error("%s", net_error(NETERR_SEND, ret));
 
-	if (w > 0)
+	if (w > 0) {
 		print_xfer("tcp", 'w', w);
+		return channel_ack_data(tun, w);
+	}
 
 	return 0;
 }
@@ -164,46 +171,38 @@ static int tunnel_connect_event(tunnel_t *tun, int err)
 }
 
 
-static int host_connect(
-					tunnel_t *tun,
-					int pref_af,
-					const char *host,
-					unsigned short port)
+static int host_connect(tunnel_t *tun, const netreq_t *req)
 {
 	int ret, err;
 	unsigned char msg;
 
-	ret = net_client(pref_af, host, port, &tun->sock, &tun->addr, &err);
-	debug(0, "net_client(%s, %hu) -> %i / %i", host, port, ret, err);
+	ret = req->ret;
+	err = req->err;
+	if (!ret)
+		ret = net_connect(req->res, req->port, &tun->conn, &err);
+	debug(0, "net_connect(%s, %hu) -> %i / %i", req->host, req->port, ret, err);
 
-	if (ret >= 0) {
-		info(0, "connect%s to %s:%hu", (ret > 0 ? "ing" : "ed"),
-			host, port);
+	if (ret > 0) {
+		info(0, "connecting to %s:%hu", req->host, req->port);
 
+		// the attempts are watched until one of them is connected
+		tun->sock.fd  = INVALID_SOCKET;
+		tun->sock.evt = tun->conn->watch;
 		if (!event_add_tunnel(tun->sock.evt, tun->id)) {
-			iobuf_init2(&tun->rio.buf, &tun->wio.buf, "tcp");
-			if (!ret) {
-				ret = tunnel_connect_event(tun, 0);
-			} else {
-				//WSAEventSelect(tun->sock.fd, tun->sock.evt, FD_CONNECT|FD_CLOSE);
-			}
-			return ret;
+			++connecting;
+			return 0;
 		}
+		net_connect_free(tun->conn);
+		tun->conn = NULL;
 	}
 
 	msg = wsa_to_r2t_error(err);
 	channel_write(R2TCMD_CONN, tun->id, &msg, 1);
-	if (ret >= 0)
-		net_close(&tun->sock);
 
 	return -1;
 }
 
-static int host_bind(
-		tunnel_t *tun,
-		int pref_af,
-		const char *host,
-		unsigned short port)
+static int host_bind(tunnel_t *tun, const netreq_t *req)
 {
 	int ret, err;
 	unsigned int ans_len;
@@ -212,10 +211,14 @@ static int host_bind(
 	memset(&ans, 0, sizeof(ans));
 	ans_len = 1;
 
-	ret = net_server(pref_af, host, port, &tun->sock, &tun->addr, &err);
-	debug(0, "bind %s:%hu ... %i/%i", host, port, ret, err);
+	ret = req->ret;
+	err = req->err;
+	if (!ret)
+		ret = net_server_addrs(req->res, req->port, &tun->sock,
+										&tun->addr, &err);
+	debug(0, "bind %s:%hu ... %i/%i", req->host, req->port, ret, err);
 	if (!ret) {
-		info(0, "listening on %s:%hu", host, port);
+		info(0, "listening on %s:%hu", req->host, req->port);
 		ans_len = netaddr_to_connans(&tun->addr, &ans);
 		ans.err = 0;
 		if (event_add_tunnel(tun->sock.evt, tun->id)) {
@@ -226,7 +229,8 @@ static int host_bind(
 
 	} else {
 		ans.err = wsa_to_r2t_error(err);
-		error("failed to bind %s:%hu (%i %s)", host, port, err, r2t_errors[ans.err]);
+		error("failed to bind %s:%hu (%i %s)", req->host, req->port,
+				err, r2t_errors[ans.err]);
 	}
 
 	if (channel_write(R2TCMD_BIND, tun->id, &ans.err, ans_len) >= 0) {
@@ -246,7 +250,7 @@ static int host_bind(
 }
 
 
-static tunnel_t *tunnel_alloc(unsigned char id)
+static tunnel_t *tunnel_alloc(unsigned short id)
 {
 	tunnel_t *tun;
 
@@ -269,7 +273,7 @@ static tunnel_t *tunnel_alloc(unsigned char id)
  * @param[in] bind_socket 1 for reverse connect tunnel
  */
 void tunnel_create(
-			unsigned char id,
+			unsigned short id,
 			int pref_af,
 			const char *host,
 			unsigned short port,
@@ -277,6 +281,7 @@ void tunnel_create(
 {
 	tunnel_t *tun;
 	int ret;
+	unsigned char err;
 
 	assert(host && *host);
 	trace_tun("id=0x%02x, pref_af=%i, host=%s, port=%hu", id, pref_af, host, port);
@@ -286,18 +291,26 @@ void tunnel_create(
 		return;
 
 	if (port > 0) {
-		// tcp tunnel
+		// tcp tunnel, connected or bound by tunnels_resolved
+		tun->bind = (unsigned char) bind_socket;
 		if (!bind_socket)
-			ret = host_connect(tun, pref_af, host, port);
-		else
-			ret = host_bind(tun, pref_af, host, port);
+			iobuf_init2(&tun->rio.buf, &tun->wio.buf, "tcp");
+		tun->req = resolver_query(pref_af, host, port, tun);
+		ret = 0;
+		if (!tun->req) {
+			err = R2TERR_GENERIC;
+			channel_write((bind_socket ? R2TCMD_BIND : R2TCMD_CONN), id, &err, 1);
+			if (!bind_socket)
+				iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+			ret = -1;
+		}
 	} else {
 		// process stdin/out tunnel
 		ret = process_start(tun, host);
 	}
 
 	if (ret >= 0) {
-		list_add_tail(&tun->list, &all_tunnels);
+		tunnel_link(tun);
 		debug(0, "tunnel 0x%02x created", id);
 
 	} else {
@@ -306,6 +319,40 @@ void tunnel_create(
 	}
 }
 
+/**
+ * connect or bind the tunnels whose hostname resolution is completed
+ * @note the client is notified of the result by host_connect/host_bind
+ */
+void tunnels_resolved(void)
+{
+	netreq_t *req;
+	tunnel_t *tun;
+	int ret;
+
+	while ((req = resolver_next())) {
+
+		tun = (tunnel_t *) req->ctx;
+		assert(valid_tunnel(tun) && (tun->req == req));
+		tun->req = NULL;
+
+		if (!tun->bind)
+			ret = host_connect(tun, req);
+		else
+			ret = host_bind(tun, req);
+		resolver_free(req);
+
+		if (ret < 0) {
+			debug(0, "failed to create tunnel 0x%02x", tun->id);
+			list_del(&tun->list);
+			tidmap_del(&tids, tun->id);
+			event_del_tunnel(tun->id);
+			if (!tun->bind)
+				iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+			free(tun);
+		}
+	}
+}
+
 /** close rdp2tcp tunnel
  * @param[in] tun established tunnel */
 void tunnel_close(tunnel_t *tun)
@@ -314,10 +361,23 @@ void tunnel_close(tunnel_t *tun)
 	trace_tun("id=0x%02x", tun->id);
 
 	list_del(&tun->list);
+	tidmap_del(&tids, tun->id);
 
 	event_del_tunnel(tun->id);
 
-	if (!tun->proc) {
+	if (tun->req) {
+		// hostname is still being resolved
+		resolver_cancel(tun->req);
+		if (!tun->bind)
+			iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+
+	} else if (tun->conn) {
+		// no connection attempt has succeeded yet
+		net_connect_free(tun->conn);
+		--connecting;
+		iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
+
+	} else if (!tun->proc) {
 		if (!tun->server)
 			iobuf_kill2(&tun->rio.buf, &tun->wio.buf);
 		net_close(&tun->sock);
@@ -358,7 +418,12 @@ static int tunnel_sockrecv_event(tunnel_t *tun)
 static int on_read_completed(iobuf_t *ibuf, tunnel_t *tun)
 {
 	assert(valid_iobuf(ibuf) && valid_tunnel(tun));
-	return channel_forward(tun);
+
+	if (channel_forward(tun) < 0)
+		return -1;
+
+	// suspend reading until the client window is opened
+	return tunnel_tx_blocked(tun);
 }
 
 static int tunnel_fdread_event(tunnel_t *tun)
@@ -370,8 +435,16 @@ static int tunnel_fdread_event(tunnel_t *tun)
 
 static int tunnel_fdwrite_event(tunnel_t *tun)
 {
+	unsigned int used;
+
 	assert(valid_tunnel(tun));
-	return aio_write(&tun->wio, tun->wfd, "tun");
+
+	used = iobuf_datalen(&tun->wio.buf);
+	if (aio_write(&tun->wio, tun->wfd, "tun") < 0)
+		return -1;
+
+	used -= iobuf_datalen(&tun->wio.buf);
+	return (used > 0 ? channel_ack_data(tun, used) : 0);
 }
 
 static int tunnel_accept_event(tunnel_t *tun)
@@ -379,10 +452,11 @@ static int tunnel_accept_event(tunnel_t *tun)
 	tunnel_t *cli;
 	sock_t cli_sock;
 	int ret;
-	unsigned char tid;
+	unsigned short tid;
 	unsigned int msg_len;
 	netaddr_t addr;
 	r2tmsg_rconnreq_t msg;
+	r2tmsg_rconnreq2_t msg2;
 	char host[NETADDRSTR_MAXSIZE];
 
 	assert(valid_tunnel(tun));
@@ -393,7 +467,7 @@ static int tunnel_accept_event(tunnel_t *tun)
 		return wsaerror("accept");
 
 	tid = tunnel_generate_id();
-	if (tid == 0xff) {
+	if (tid == R2TID_NONE) {
 		error("failed to generate tunnel identifier");
 		net_close(&cli_sock);
 		return 0;
@@ -419,12 +493,22 @@ static int tunnel_accept_event(tunnel_t *tun)
 	cli->connected = 1;
 	cli->id        = tid;
 	iobuf_init2(&cli->rio.buf, &cli->wio.buf, "tcp");
-	list_add_tail(&cli->list, &all_tunnels);
+	tunnel_link(cli);
 
 	msg_len = netaddr_to_connans(&addr, (r2tmsg_connans_t *)&msg);
-	msg.rid = tid;
+	if (!channel_is_v2(tun->id)) {
+		msg.rid = (unsigned char) tid;
+		ret = channel_write(R2TCMD_RCONN, tun->id, &msg.rid, msg_len);
+	} else {
+		// v2 frames carry a 16-bit identifier of the accepted tunnel
+		msg2.rid  = htons(tid);
+		msg2.af   = msg.af;
+		msg2.port = msg.port;
+		memcpy(msg2.addr, msg.addr, sizeof(msg2.addr));
+		ret = channel_write(R2TCMD_RCONN, tun->id, &msg2.rid, msg_len+1);
+	}
 
-	if (channel_write(R2TCMD_RCONN, tun->id, &msg.rid, msg_len) < 0)
+	if (ret < 0)
 		tunnel_close(tun);
 
 	return 0;
@@ -440,6 +524,78 @@ static int tunnel_close_event(tunnel_t *tun)
 	return 0;
 }
 
+/* handle the completion (or the delay) of the connection attempts */
+static int tunnel_attempts_event(tunnel_t *tun)
+{
+	int ret, err;
+
+	ret = net_connect_poll(tun->conn, &tun->sock, &tun->addr, &err);
+	trace_tun("id=0x%02x --> ret=%i, err=%i", tun->id, ret, err);
+	if (ret > 0)
+		return 0;
+
+	if (ret < 0) {
+		// the attempts are released by tunnel_close
+		tunnel_connect_event(tun, err);
+		return -1;
+	}
+
+	// the socket keeps the event of the attempts
+	net_connect_free(tun->conn);
+	tun->conn = NULL;
+	--connecting;
+
+	ret = tunnel_connect_event(tun, 0);
+	if (!ret) {
+		ret = tunnel_socksend_event(tun);
+		if (ret >= 0)
+			ret = tunnel_sockrecv_event(tun);
+	}
+
+	return ret;
+}
+
+/**
+ * return the delay before the next tunnel connection attempt
+ * @return the delay in milliseconds, -1 if no attempt is delayed
+ */
+long tunnels_connect_timeout(void)
+{
+	tunnel_t *tun;
+	long delay, min;
+
+	min = -1;
+	if (!connecting)
+		return min;
+
+	list_for_each(tun, &all_tunnels) {
+		if (tun->conn) {
+			delay = net_connect_timeout(tun->conn);
+			if ((delay >= 0) && ((min < 0) || (delay < min)))
+				min = delay;
+		}
+	}
+
+	return min;
+}
+
+/**
+ * start the tunnel connection attempts whose delay has expired
+ */
+void tunnels_connect_timers(void)
+{
+	tunnel_t *tun, *bak;
+
+	if (!connecting)
+		return;
+
+	list_for_each_safe(tun, bak, &all_tunnels) {
+		if (tun->conn && !net_connect_timeout(tun->conn)
+				&& (tunnel_attempts_event(tun) < 0))
+			tunnel_close(tun);
+	}
+}
+
 /** handle tunnel event
  * @param[in] tun tunnel associated with event
  * @param[in] h event handle
@@ -466,6 +622,9 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
 			ret = tunnel_fdwrite_event(tun);
 		}
 
+	} else if (tun->conn) { // socket tunnel being connected
+		ret = tunnel_attempts_event(tun);
+
 	} else { // socket tunnel
 
 		ret = 0;
@@ -499,7 +658,9 @@ int tunnel_event(tunnel_t *tun, HANDLE h)
 				ret = tunnel_socksend_event(tun);
 			}
 
-			if ((ret >= 0) && (evt & FD_READ)) {
+			// FD_READ is not re-enabled until the client window is opened
+			if ((ret >= 0) && (evt & FD_READ)
+					&& (!tunnel_tx_blocked(tun) || (evt & FD_CLOSE))) {
 				debug(0, "FD_READ");
 				ret = tunnel_sockrecv_event(tun);
 			}
@@ -558,6 +719,35 @@ int tunnel_write(tunnel_t *tun, const void *data, unsigned int len)
 	return tunnel_socksend_event(tun);
 }
 
+/** handle rdp2tcp tunnel window update
+ * @param[in] tun tunnel
+ * @param[in] inc client receive window increment
+ * @return 0 on success
+ * @note the tunnel is read again if the client window was exhausted */
+int tunnel_window(tunnel_t *tun, unsigned int inc)
+{
+	int blocked;
+
+	assert(valid_tunnel(tun));
+	trace_tun("id=0x%02x, credit=%i, inc=%u", tun->id, tun->tx_credit, inc);
+
+	blocked = tunnel_tx_blocked(tun);
+
+	tun->tx_fc = 1;
+	if ((long long)tun->tx_credit + inc > 0x7fffffff)
+		tun->tx_credit = 0x7fffffff;
+	else
+		tun->tx_credit += (int) inc;
+
+	if (!blocked || tunnel_tx_blocked(tun) || !tun->connected || tun->server)
+		return 0;
+
+	if (tun->proc)
+		return (tun->rio.pending ? 0 : tunnel_fdread_event(tun));
+
+	return tunnel_sockrecv_event(tun);
+}
+
 /** destroy all tunnels */
 void tunnels_kill(void)
 {
@@ -80,10 +80,30 @@ class rdp2tcp:
 		self.sock.sendall(('- %s %i\n' % src).encode('utf-8'))
 		return self.__read_answer().decode('utf-8')
 
+	def set_weight(self, src, weight):
+		self.sock.sendall(('w %s %i %i\n' % (src[0], src[1], weight)).encode('utf-8'))
+		return self.__read_answer().decode('utf-8')
+
+	def set_nodelay(self, src, nodelay):
+		self.sock.sendall(('n %s %i %i\n' % (src[0], src[1], nodelay)).encode('utf-8'))
+		return self.__read_answer().decode('utf-8')
+
 	def info(self):
 		self.sock.sendall(b'l\n')
 		return self.__read_answer(b'\n\n').decode('utf-8')
 
+	def dns_cache(self, flush=False):
+		self.sock.sendall(b'd flush\n' if flush else b'd\n')
+		return self.__read_answer(b'\n\n').decode('utf-8')
+
+	def mem_pools(self):
+		self.sock.sendall(b'm\n')
+		return self.__read_answer(b'\n\n').decode('utf-8')
+
+	def metrics(self):
+		self.sock.sendall(b'c\n')
+		return self.__read_answer(b'\n\n').decode('utf-8')
+
 
 if __name__ == '__main__':
 	from sys import argv, exit, stdin, stdout
@@ -99,6 +119,11 @@ commands:
    add process <lhost> <lport> <command>
    add socks5  <lhost> <lport>
    del <lhost> <lport>
+   weight <lhost> <lport> <weight>
+   nodelay <lhost> <lport> <0|1>
+   dns [flush]
+   mem
+   metrics
    sh [args]""" % argv[0])
 		exit(0)
 
@@ -137,7 +162,8 @@ commands:
 		i += 2
 
 	cmd = argv[i]
-	if cmd not in ('info', 'add', 'del', 'sh', 'telnet'):
+	if cmd not in ('info', 'add', 'del', 'weight', 'nodelay', 'dns', 'mem',
+					'metrics', 'sh', 'telnet'):
 		usage()
 
 	try:
@@ -179,9 +205,42 @@ commands:
 		except R2TException as e:
 			print('error: %s' % str(e))
 
+	elif cmd == 'weight':
+		if argc != 3:
+			usage()
+
+		try:
+			print(r2t.set_weight((argv[i+1], int(argv[i+2])), int(argv[i+3])))
+		except R2TException as e:
+			print('error: %s' % str(e))
+
+	elif cmd == 'nodelay':
+		if argc != 3:
+			usage()
+
+		try:
+			print(r2t.set_nodelay((argv[i+1], int(argv[i+2])), int(argv[i+3])))
+		except R2TException as e:
+			print('error: %s' % str(e))
+
 	elif cmd == 'info':
 		print(r2t.info())
 
+	elif cmd == 'dns':
+		if (argc > 1) or ((argc == 1) and (argv[i+1] != 'flush')):
+			usage()
+		print(r2t.dns_cache(argc == 1))
+
+	elif cmd == 'mem':
+		if argc:
+			usage()
+		print(r2t.mem_pools())
+
+	elif cmd == 'metrics':
+		if argc:
+			usage()
+		print(r2t.metrics())
+
 	elif cmd == 'sh':
 		proc = 'cmd.exe'
 		if argc >= 1: